@@ -0,0 +1,81 @@
+// Compares bytes on the wire and host-side parse cost of the JSON relay protocol
+// against the binary protocol (see core/RelayBinaryProtocol.js).
+//
+// Usage: node benchmarks/relay-protocol-benchmark.js [iterations]
+
+const RelayBinaryProtocol = require('../core/RelayBinaryProtocol');
+
+const ITERATIONS = parseInt(process.argv[2], 10) || 200000;
+
+// Representative messages, shaped exactly as the firmware / server produce them
+const messages = [
+    {
+        name: 'state (keyframe)',
+        message: {
+            type: 'state',
+            device_id: 'AA:BB:CC:DD:EE:FF',
+            mac: 'AA:BB:CC:DD:EE:FF',
+            ip: '192.168.1.123',
+            seq: 4812,
+            relay_mask: 5,
+            input_mask: 130,
+            inputs: [false, true, false, false, false, false, false, true],
+            relays: [1, 0, 1, 0, 0, 0, 0, 0]
+        }
+    },
+    {
+        name: 'state_delta',
+        message: { type: 'state_delta', seq: 4813, relays: 5, inputs: 131 }
+    },
+    {
+        name: 'relay_control_ack',
+        message: { type: 'relay_control_ack', relay: 3, state: true, success: true, latency_us: 412 }
+    },
+    {
+        name: 'input_changed',
+        message: { type: 'input_changed', inputIndex: 6, state: true, timestamp_us: 86400123456, latency_us: 230 }
+    },
+    {
+        name: 'relay_control',
+        message: { type: 'relay_control', relay: 3, state: true }
+    }
+];
+
+function timeNsPerOp(fn) {
+    // Warm up so both paths are measured after JIT optimisation
+    for (let i = 0; i < 10000; i++) fn();
+
+    const start = process.hrtime.bigint();
+    for (let i = 0; i < ITERATIONS; i++) fn();
+    const elapsed = process.hrtime.bigint() - start;
+    return Number(elapsed) / ITERATIONS;
+}
+
+let sink = 0;
+const rows = [];
+
+for (const { name, message } of messages) {
+    const jsonFrame = Buffer.from(JSON.stringify(message));
+    const binFrame = RelayBinaryProtocol.encode(message);
+
+    // The relay server receives a Buffer from ws and parses it
+    const jsonParse = timeNsPerOp(() => { sink += JSON.parse(jsonFrame).type.length; });
+    const binParse = timeNsPerOp(() => { sink += RelayBinaryProtocol.decode(binFrame).type.length; });
+    const jsonEncode = timeNsPerOp(() => { sink += Buffer.from(JSON.stringify(message)).length; });
+    const binEncode = timeNsPerOp(() => { sink += RelayBinaryProtocol.encode(message).length; });
+
+    rows.push({
+        message: name,
+        'json bytes': jsonFrame.length,
+        'bin bytes': binFrame.length,
+        'size ratio': `${(jsonFrame.length / binFrame.length).toFixed(1)}x`,
+        'json parse ns': jsonParse.toFixed(0),
+        'bin parse ns': binParse.toFixed(0),
+        'json encode ns': jsonEncode.toFixed(0),
+        'bin encode ns': binEncode.toFixed(0)
+    });
+}
+
+console.log(`Relay protocol benchmark (${ITERATIONS} iterations per measurement, node ${process.version})`);
+console.table(rows);
+if (sink === 0) console.log('');
@@ -1,5 +1,6 @@
 const WebSocket = require('ws');
 const EventEmitter = require('events');
+const RelayLatencyTracker = require('./RelayLatencyTracker');
 
 class ESP32ElevatorController extends EventEmitter {
     constructor(config) {
@@ -7,12 +8,14 @@ class ESP32ElevatorController extends EventEmitter {
         this.config = {
             ip: config.ip,
             port: config.port || 81,
+            token: config.token || '', // The device's lan_token
             relayId: config.relayId,
             channels: config.channels || {},
             inputPins: config.inputPins || [],
             reconnectInterval: 5000,
             heartbeatInterval: 30000,
-            commandTimeout: 10000
+            commandTimeout: 10000,
+            commandRetransmitInterval: 1000 // Same commandId again; the device deduplicates
         };
         
         this.ws = null;
@@ -22,6 +25,11 @@ class ESP32ElevatorController extends EventEmitter {
         this.commandId = 0;
         this.relayStates = new Map();
         this.inputStates = new Map();
+        this.stateSeq = null; // Last state_delta sequence number seen
+        this.latency = new RelayLatencyTracker(); // Stage timings from traced relay_control acks
+        this.pendingTraces = new Map(); // trace -> { resolve, reject }
+        this.deviceLatency = null; // Last latency_stats answer (device-side histograms)
+        this.pendingConnect = null; // { resolve, reject } until the device accepts the token
         
         // Initialize channel states
         for (let i = 0; i < 8; i++) {
@@ -68,13 +76,12 @@ class ESP32ElevatorController extends EventEmitter {
             console.log(`Connecting to ESP32 relay at ${wsUrl}`);
             
             this.ws = new WebSocket(wsUrl);
+            this.pendingConnect = { resolve, reject };
 
+            // The LAN server answers nothing but auth until the token is accepted; it
+            // then sends register and a full state
             this.ws.on('open', () => {
-                console.log(`Connected to ESP32 relay ${this.config.relayId}`);
-                this.connected = true;
-                this.lastHeartbeat = Date.now();
-                this.emit('connected');
-                resolve();
+                this.ws.send(JSON.stringify({ type: 'auth', token: this.config.token }));
             });
 
             this.ws.on('message', (data) => {
@@ -130,15 +137,32 @@ class ESP32ElevatorController extends EventEmitter {
             console.log(`Received message from relay ${this.config.relayId}:`, message);
             
             switch (message.type) {
+                case 'register':
+                    this.handleRegister(message);
+                    break;
+                case 'error_report':
+                    this.handleErrorReport(message);
+                    break;
                 case 'full_state':
+                case 'state':
                     this.handleStateUpdate(message);
                     break;
+                case 'state_delta':
+                    this.handleStateDelta(message);
+                    break;
                 case 'input_changed':
                     this.handleInputChange(message);
                     break;
                 case 'command_response':
                     this.handleCommandResponse(message);
                     break;
+                case 'relay_control_ack':
+                    this.handleRelayControlAck(message);
+                    break;
+                case 'latency_stats':
+                    this.deviceLatency = { window_s: message.window_s, stages: message.stages, receivedAt: Date.now() };
+                    this.emit('latencyStats', this.deviceLatency);
+                    break;
                 case 'heartbeat':
                     this.lastHeartbeat = Date.now();
                     break;
@@ -150,21 +174,68 @@ class ESP32ElevatorController extends EventEmitter {
         }
     }
 
+    handleRegister(message) {
+        console.log(`Connected to ESP32 relay ${this.config.relayId}`);
+        // Command ids continue above the last one the device executed for this link
+        if (Number.isInteger(message.last_command_id) && message.last_command_id > this.commandId) {
+            this.commandId = message.last_command_id;
+        }
+        this.connected = true;
+        this.lastHeartbeat = Date.now();
+        this.emit('connected');
+        if (this.pendingConnect) {
+            this.pendingConnect.resolve();
+            this.pendingConnect = null;
+        }
+    }
+
+    handleErrorReport(message) {
+        console.error(`Relay ${this.config.relayId} reported ${message.error_type}: ${message.message}`);
+        if (message.error_type === 'UNAUTHORIZED' && this.pendingConnect) {
+            this.pendingConnect.reject(new Error(`Relay ${this.config.relayId} rejected the LAN token`));
+            this.pendingConnect = null;
+        }
+    }
+
     handleStateUpdate(message) {
         // Update relay states
         if (message.relays && Array.isArray(message.relays)) {
             for (let i = 0; i < Math.min(message.relays.length, 8); i++) {
-                this.relayStates.set(i, message.relays[i] === 1);
+                this.relayStates.set(i, message.relays[i] === 1 || message.relays[i] === true);
             }
         }
         
         // Update input states
         if (message.inputs && Array.isArray(message.inputs)) {
             for (let i = 0; i < Math.min(message.inputs.length, 8); i++) {
-                this.inputStates.set(i, message.inputs[i] === 1);
+                this.inputStates.set(i, message.inputs[i] === 1 || message.inputs[i] === true);
             }
         }
         
+        // Keyframes re-base the delta sequence
+        if (Number.isInteger(message.seq)) {
+            this.stateSeq = message.seq;
+        }
+        
+        this.emit('stateUpdated', {
+            relayStates: Object.fromEntries(this.relayStates),
+            inputStates: Object.fromEntries(this.inputStates)
+        });
+    }
+
+    handleStateDelta(message) {
+        // Request a full state keyframe if a delta went missing
+        if (Number.isInteger(this.stateSeq) && message.seq !== this.stateSeq + 1 && this.ws) {
+            console.log(`State gap on relay ${this.config.relayId} (expected ${this.stateSeq + 1}, got ${message.seq}), requesting resync`);
+            this.ws.send(JSON.stringify({ type: 'resync' }));
+        }
+        this.stateSeq = message.seq;
+        
+        for (let i = 0; i < 8; i++) {
+            this.relayStates.set(i, ((message.relays >> i) & 1) === 1);
+            this.inputStates.set(i, ((message.inputs >> i) & 1) === 1);
+        }
+        
         this.emit('stateUpdated', {
             relayStates: Object.fromEntries(this.relayStates),
             inputStates: Object.fromEntries(this.inputStates)
@@ -178,7 +249,9 @@ class ESP32ElevatorController extends EventEmitter {
             this.emit('inputChanged', {
                 inputIndex: message.inputIndex,
                 state: message.state,
-                function: this.getFunctionForInput(message.inputIndex)
+                function: this.getFunctionForInput(message.inputIndex),
+                timestampUs: message.timestamp_us,
+                deviceLatencyUs: message.latency_us
             });
         }
     }
@@ -190,6 +263,16 @@ class ESP32ElevatorController extends EventEmitter {
         if (pendingCommand) {
             this.pendingCommands.delete(commandId);
             
+            // The device already ran higher ids (we restarted and count from 1 again):
+            // continue above its last id and send the command once more
+            if (message.error_type === 'STALE_COMMAND' && Number.isInteger(message.last_id) &&
+                message.last_id >= this.commandId && !pendingCommand.resent) {
+                this.commandId = message.last_id;
+                pendingCommand.resent = true;
+                this.transmitCommand(pendingCommand);
+                return;
+            }
+            
             if (message.success) {
                 pendingCommand.resolve(message.result);
             } else {
@@ -198,6 +281,23 @@ class ESP32ElevatorController extends EventEmitter {
         }
     }
 
+    handleRelayControlAck(message) {
+        const trace = this.latency.complete(message);
+        if (trace) {
+            this.emit('latencyTrace', trace);
+        }
+        
+        const pending = this.pendingTraces.get(message.trace);
+        if (pending) {
+            this.pendingTraces.delete(message.trace);
+            if (message.success) {
+                pending.resolve(trace);
+            } else {
+                pending.reject(new Error(message.error || 'Relay command failed'));
+            }
+        }
+    }
+
     getFunctionForInput(inputIndex) {
         for (const [channelIndex, config] of this.channelFunctions.entries()) {
             if (config.inputPin === inputIndex) {
@@ -212,22 +312,71 @@ class ESP32ElevatorController extends EventEmitter {
             throw new Error(`Relay ${this.config.relayId} is not connected`);
         }
 
-        const commandId = ++this.commandId;
-        const message = {
+        // The device executes each commandId at most once, so a lost response is
+        // recovered by retransmitting the same id until the timeout
+        return new Promise((resolve, reject) => {
+            let timeout = null;
+            const pending = {
+                command: command,
+                params: params,
+                resolve: (result) => {
+                    clearTimeout(timeout);
+                    clearInterval(pending.retransmit);
+                    resolve(result);
+                },
+                reject: (error) => {
+                    clearTimeout(timeout);
+                    clearInterval(pending.retransmit);
+                    reject(error);
+                }
+            };
+            
+            timeout = setTimeout(() => {
+                this.pendingCommands.delete(pending.commandId);
+                clearInterval(pending.retransmit);
+                reject(new Error(`Command timeout: ${command}`));
+            }, this.config.commandTimeout);
+            
+            this.transmitCommand(pending);
+        });
+    }
+
+    // Assign the next id to a pending command and send it, retransmitting every
+    // commandRetransmitInterval until its command_response arrives
+    transmitCommand(pending) {
+        clearInterval(pending.retransmit);
+        pending.commandId = ++this.commandId;
+        this.pendingCommands.set(pending.commandId, pending);
+        
+        const payload = JSON.stringify({
             type: 'command',
-            commandId: commandId,
-            command: command,
-            params: params
-        };
+            commandId: pending.commandId,
+            command: pending.command,
+            params: pending.params
+        });
+        this.ws.send(payload);
+        pending.retransmit = setInterval(() => {
+            if (this.connected && this.ws) {
+                this.ws.send(payload);
+            }
+        }, this.config.commandRetransmitInterval);
+    }
+
+    // Switch one channel with a traced relay_control; resolves with the stage timings
+    // ({ trace, relay, success, stages: { parse, queue, i2c, ack, device, network, total } })
+    async controlRelay(channelIndex, state) {
+        if (!this.connected) {
+            throw new Error(`Relay ${this.config.relayId} is not connected`);
+        }
         
+        const trace = this.latency.begin(channelIndex);
         return new Promise((resolve, reject) => {
-            // Set command timeout
             const timeout = setTimeout(() => {
-                this.pendingCommands.delete(commandId);
-                reject(new Error(`Command timeout: ${command}`));
+                this.pendingTraces.delete(trace);
+                reject(new Error(`relay_control timeout on channel ${channelIndex}`));
             }, this.config.commandTimeout);
             
-            this.pendingCommands.set(commandId, {
+            this.pendingTraces.set(trace, {
                 resolve: (result) => {
                     clearTimeout(timeout);
                     resolve(result);
@@ -238,10 +387,26 @@ class ESP32ElevatorController extends EventEmitter {
                 }
             });
             
-            this.ws.send(JSON.stringify(message));
+            this.ws.send(JSON.stringify({ type: 'relay_control', relay: channelIndex, state: state, trace: trace }));
         });
     }
 
+    // Ask the device for its own per-stage histograms (answered with latency_stats)
+    requestLatencyStats(reset = false) {
+        if (!this.connected) {
+            throw new Error(`Relay ${this.config.relayId} is not connected`);
+        }
+        this.ws.send(JSON.stringify({ type: 'latency_stats', reset: reset }));
+    }
+
+    // p50/p99 actuation latency per stage, as measured here and as reported by the device
+    getLatencyStats() {
+        return {
+            backend: this.latency.stats(),
+            device: this.deviceLatency
+        };
+    }
+
     // Elevator control methods
     async selectFloor(floor) {
         const functionName = `floor_${floor}`;
@@ -259,6 +424,7 @@ class ESP32ElevatorController extends EventEmitter {
         console.log(`Selecting floor ${floor} on relay ${this.config.relayId} (channel ${channelIndex})`);
         return this.sendCommand('set_relay', {
             relay: functionName,
+            channel: channelIndex,
             state: true
         });
     }
@@ -278,6 +444,7 @@ class ESP32ElevatorController extends EventEmitter {
         console.log(`Opening door on relay ${this.config.relayId} (channel ${channelIndex})`);
         return this.sendCommand('set_relay', {
             relay: 'door_open',
+            channel: channelIndex,
             state: true
         });
     }
@@ -297,6 +464,7 @@ class ESP32ElevatorController extends EventEmitter {
         console.log(`Closing door on relay ${this.config.relayId} (channel ${channelIndex})`);
         return this.sendCommand('set_relay', {
             relay: 'door_close',
+            channel: channelIndex,
             state: true
         });
     }
@@ -316,6 +484,7 @@ class ESP32ElevatorController extends EventEmitter {
         console.log(`Sending hall call on relay ${this.config.relayId} (channel ${channelIndex})`);
         return this.sendCommand('set_relay', {
             relay: 'hall_call',
+            channel: channelIndex,
             state: true
         });
     }
@@ -335,6 +504,7 @@ class ESP32ElevatorController extends EventEmitter {
         console.log(`Activating emergency stop on relay ${this.config.relayId} (channel ${channelIndex})`);
         return this.sendCommand('set_relay', {
             relay: 'emergency_stop',
+            channel: channelIndex,
             state: true
         });
     }
@@ -355,6 +525,7 @@ class ESP32ElevatorController extends EventEmitter {
         console.log(`Setting ${functionName} to ${state} on relay ${this.config.relayId} (channel ${channelIndex})`);
         return this.sendCommand('set_relay', {
             relay: functionName,
+            channel: channelIndex,
             state: state
         });
     }
@@ -390,10 +561,22 @@ class ESP32ElevatorController extends EventEmitter {
             relayStates: Object.fromEntries(this.relayStates),
             inputStates: Object.fromEntries(this.inputStates),
             channelFunctions: Object.fromEntries(this.channelFunctions),
-            pendingCommands: this.pendingCommands.size
+            pendingCommands: this.pendingCommands.size,
+            latency: this.getLatencySummary()
         };
     }
 
+    // Dashboard summary: p50/p99 in microseconds for each stage seen so far
+    getLatencySummary() {
+        const summary = {};
+        for (const [stage, stats] of Object.entries(this.latency.stats().stages)) {
+            if (stats.n > 0) {
+                summary[stage] = { p50: stats.p50, p99: stats.p99 };
+            }
+        }
+        return summary;
+    }
+
     getRelayState(channelIndex) {
         return this.relayStates.get(channelIndex) || false;
     }
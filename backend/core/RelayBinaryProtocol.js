@@ -0,0 +1,452 @@
+// Host-side encoder/decoder for the compact binary relay protocol (WebSocket BIN frames).
+// Frame layouts are defined in esp32/src/relay_protocol.h and must be kept in sync.
+//
+// Decoded frames use the same shape as the JSON messages the firmware sends, so the
+// relay message handlers work unchanged whichever protocol a board negotiated.
+
+const MAGIC = 0xA5;
+const VERSION = 1;
+const HEADER_SIZE = 4;
+const PROTOCOL_NAME = 'bin1';
+
+const MessageType = {
+    RELAY_CONTROL: 0x01,
+    RESYNC: 0x02,
+    RELAY_MASK: 0x03,
+    PULSE: 0x04,
+    SEQUENCE: 0x05,
+    SEQUENCE_CANCEL: 0x06,
+    STATE: 0x10,
+    STATE_DELTA: 0x11,
+    RELAY_ACK: 0x12,
+    INPUT_CHANGED: 0x13,
+    ERROR: 0x14,
+    MASK_ACK: 0x15,
+    SEQUENCE_STATUS: 0x16,
+    RELAY_ACK_TRACE: 0x17
+};
+
+const SEQ_FLAG_ABORT_ON_DISCONNECT = 0x01;
+const SEQ_STEP_SIZE = 8;
+const SEQ_MAX_STEPS = 8;
+
+// Index = RelaySequenceStatus in relay_protocol.h
+const SEQUENCE_STATUS = ['started', 'completed', 'aborted', 'replaced', 'rejected', 'failed'];
+
+const AckFlags = {
+    STATE: 0x01,
+    SUCCESS: 0x02,
+    VERIFIED: 0x04
+};
+
+// Index = error code (RelayError in relay_protocol.h)
+const ERRORS = [
+    { type: 'NONE', message: 'OK' },
+    { type: 'INVALID_RELAY', message: 'Invalid relay index' },
+    { type: 'QUEUE_FULL', message: 'Command queue full' },
+    { type: 'I2C_ERROR', message: 'I2C communication failed' },
+    { type: 'JSON_PARSE_ERROR', message: 'Failed to parse incoming message' },
+    { type: 'UNKNOWN_MESSAGE_TYPE', message: 'Received unknown message type' },
+    { type: 'BAD_FRAME', message: 'Malformed binary frame' },
+    { type: 'INVALID_MASK', message: 'Relay set and clear masks overlap' },
+    { type: 'INVALID_SEQUENCE', message: 'Invalid relay sequence' },
+    { type: 'VERIFY_MISMATCH', message: 'Relay output read-back mismatch' },
+    { type: 'STALE_COMMAND', message: 'Stale command id' },
+    { type: 'UNKNOWN_COMMAND', message: 'Unknown command' },
+    { type: 'INVALID_COMMAND', message: 'Missing command id or invalid parameters' },
+    { type: 'INVALID_WORKFLOW', message: 'Invalid workflow table' },
+    { type: 'UNAUTHORIZED', message: 'Not authenticated, or not allowed on this link' }
+];
+
+function errorInfo(code) {
+    return ERRORS[code] || { type: 'UNKNOWN', message: `Unknown error ${code}` };
+}
+
+function errorCode(message) {
+    const index = ERRORS.findIndex(entry => entry.message === message || entry.type === message);
+    return index === -1 ? 0xFF : index;
+}
+
+function maskToArray(mask, width = 8) {
+    const values = [];
+    for (let i = 0; i < width; i++) {
+        values.push((mask >> i) & 1);
+    }
+    return values;
+}
+
+function arrayToMask(values) {
+    let mask = 0;
+    for (let i = 0; i < values.length; i++) {
+        if (values[i] === true || values[i] === 1) {
+            mask |= (1 << i);
+        }
+    }
+    return mask;
+}
+
+function frame(type, payloadSize) {
+    const buffer = Buffer.alloc(HEADER_SIZE + payloadSize);
+    buffer[0] = MAGIC;
+    buffer[1] = VERSION;
+    buffer[2] = type;
+    return buffer;
+}
+
+function isChannel(value) {
+    return Number.isInteger(Number(value)) && value !== '' && Number(value) >= 0 && Number(value) <= 0xFF;
+}
+
+function isMask(value) {
+    return value === undefined || (Number.isInteger(value) && value >= 0 && value <= 0xFF);
+}
+
+// Binary sequence steps carry masks only; relay/state steps are folded into them
+function stepMasks(step) {
+    if (step.relay !== undefined) {
+        const bit = 1 << Number(step.relay);
+        return step.state ? { set: bit, clear: 0 } : { set: 0, clear: bit };
+    }
+    return { set: step.set || 0, clear: step.clear || 0 };
+}
+
+function isStep(step) {
+    if (!step) return false;
+    if (step.relay !== undefined) return isChannel(step.relay) && Number(step.relay) < 8;
+    return isMask(step.set) && isMask(step.clear);
+}
+
+function sequenceFlags(message) {
+    return message.on_disconnect === 'abort' ? SEQ_FLAG_ABORT_ON_DISCONNECT : 0;
+}
+
+// Whether a JSON-shaped message has a binary representation
+function canEncode(message) {
+    switch (message && message.type) {
+        case 'relay_control':
+            return isChannel(message.relay);
+        case 'relay_mask':
+            return isMask(message.set) && isMask(message.clear);
+        case 'relay_pulse':
+            return isChannel(message.relay);
+        case 'relay_sequence':
+            return Array.isArray(message.steps) && message.steps.length <= SEQ_MAX_STEPS && message.steps.every(isStep);
+        case 'sequence_cancel':
+        case 'sequence_status':
+        case 'resync':
+        case 'state':
+        case 'state_delta':
+        case 'relay_control_ack':
+        case 'input_changed':
+        case 'error_report':
+        case 'relay_mask_ack':
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Encode a JSON-shaped message into a binary frame
+function encode(message) {
+    let buffer;
+    switch (message.type) {
+        case 'relay_control':
+            // A trace id asks the device for per-stage timestamps (RELAY_ACK_TRACE)
+            buffer = frame(MessageType.RELAY_CONTROL, message.trace !== undefined ? 6 : 2);
+            buffer[4] = Number(message.relay);
+            buffer[5] = message.state ? 1 : 0;
+            if (message.trace !== undefined) {
+                buffer.writeUInt32LE(message.trace >>> 0, 6);
+            }
+            return buffer;
+
+        case 'relay_mask':
+            buffer = frame(MessageType.RELAY_MASK, 2);
+            buffer[4] = message.set || 0;
+            buffer[5] = message.clear || 0;
+            return buffer;
+
+        case 'relay_pulse':
+            buffer = frame(MessageType.PULSE, 8);
+            buffer[4] = Number(message.relay);
+            buffer[5] = sequenceFlags(message);
+            buffer.writeUInt16LE((message.id || 0) & 0xFFFF, 6);
+            buffer.writeUInt32LE((message.duration_ms || 0) >>> 0, 8);
+            return buffer;
+
+        case 'relay_sequence':
+            buffer = frame(MessageType.SEQUENCE, 4 + message.steps.length * SEQ_STEP_SIZE);
+            buffer.writeUInt16LE((message.id || 0) & 0xFFFF, 4);
+            buffer[6] = sequenceFlags(message);
+            buffer[7] = message.steps.length;
+            message.steps.forEach((step, i) => {
+                const offset = 8 + i * SEQ_STEP_SIZE;
+                const masks = stepMasks(step);
+                buffer[offset] = masks.set;
+                buffer[offset + 1] = masks.clear;
+                buffer.writeUInt32LE((step.hold_ms || 0) >>> 0, offset + 4);
+            });
+            return buffer;
+
+        case 'sequence_cancel':
+            buffer = frame(MessageType.SEQUENCE_CANCEL, 2);
+            buffer.writeUInt16LE((message.id || 0) & 0xFFFF, 4);
+            return buffer;
+
+        case 'resync':
+            return frame(MessageType.RESYNC, 0);
+
+        case 'state':
+        case 'state_delta': {
+            const isKeyframe = message.type === 'state';
+            buffer = frame(isKeyframe ? MessageType.STATE : MessageType.STATE_DELTA, 6);
+            buffer.writeUInt32LE((message.seq || 0) >>> 0, 4);
+            buffer[8] = isKeyframe ? (message.relay_mask !== undefined ? message.relay_mask : arrayToMask(message.relays || [])) : message.relays;
+            buffer[9] = isKeyframe ? (message.input_mask !== undefined ? message.input_mask : arrayToMask(message.inputs || [])) : message.inputs;
+            return buffer;
+        }
+
+        case 'relay_control_ack': {
+            const traced = message.trace !== undefined && message.t_us;
+            buffer = traced ? frame(MessageType.RELAY_ACK_TRACE, 28) : frame(MessageType.RELAY_ACK, 8);
+            buffer[4] = message.relay;
+            buffer[5] = (message.state ? AckFlags.STATE : 0) |
+                        (message.success ? AckFlags.SUCCESS : 0) |
+                        (message.verified ? AckFlags.VERIFIED : 0);
+            buffer[6] = message.success ? 0 : errorCode(message.error);
+            if (!traced) {
+                buffer.writeUInt32LE((message.latency_us || 0) >>> 0, 8);
+                return buffer;
+            }
+            const t = message.t_us;
+            buffer.writeUInt32LE(message.trace >>> 0, 8);
+            buffer.writeUInt32LE(t.rx >>> 0, 12);
+            buffer.writeUInt32LE((t.parse - t.rx) >>> 0, 16);
+            buffer.writeUInt32LE((t.io - t.rx) >>> 0, 20);
+            buffer.writeUInt32LE((t.i2c - t.rx) >>> 0, 24);
+            buffer.writeUInt32LE((t.ack - t.rx) >>> 0, 28);
+            return buffer;
+        }
+
+        case 'relay_mask_ack':
+            buffer = frame(MessageType.MASK_ACK, 8);
+            buffer[4] = message.set;
+            buffer[5] = message.clear;
+            buffer[6] = message.relays;
+            buffer[7] = message.success ? 0 : errorCode(message.error);
+            buffer.writeUInt32LE((message.latency_us || 0) >>> 0, 8);
+            return buffer;
+
+        case 'sequence_status':
+            buffer = frame(MessageType.SEQUENCE_STATUS, 12);
+            buffer.writeUInt16LE((message.id || 0) & 0xFFFF, 4);
+            buffer[6] = Math.max(0, SEQUENCE_STATUS.indexOf(message.status));
+            buffer[7] = message.error ? errorCode(message.error) : 0;
+            buffer[8] = message.steps || 0;
+            buffer.writeUInt32LE((message.elapsed_us || 0) >>> 0, 12);
+            return buffer;
+
+        case 'input_changed':
+            buffer = frame(MessageType.INPUT_CHANGED, 16);
+            buffer[4] = message.inputIndex;
+            buffer[5] = message.state ? 1 : 0;
+            buffer.writeBigUInt64LE(BigInt(message.timestamp_us || 0), 8);
+            buffer.writeUInt32LE((message.latency_us || 0) >>> 0, 16);
+            return buffer;
+
+        case 'error_report':
+            buffer = frame(MessageType.ERROR, 1);
+            buffer[4] = errorCode(message.error_type);
+            return buffer;
+
+        default:
+            throw new Error(`Message type ${message.type} has no binary encoding`);
+    }
+}
+
+// Decode a binary frame into a JSON-shaped message; returns null for malformed frames
+function decode(buffer) {
+    if (!Buffer.isBuffer(buffer)) {
+        buffer = Buffer.from(buffer);
+    }
+    if (buffer.length < HEADER_SIZE || buffer[0] !== MAGIC || buffer[1] !== VERSION) {
+        return null;
+    }
+
+    const payloadSize = buffer.length - HEADER_SIZE;
+    switch (buffer[2]) {
+        case MessageType.RELAY_CONTROL: {
+            if (payloadSize < 2) return null;
+            const message = { type: 'relay_control', relay: buffer[4], state: buffer[5] !== 0 };
+            if (payloadSize >= 6) {
+                message.trace = buffer.readUInt32LE(6);
+            }
+            return message;
+        }
+
+        case MessageType.RELAY_MASK:
+            if (payloadSize < 2) return null;
+            return { type: 'relay_mask', set: buffer[4], clear: buffer[5] };
+
+        case MessageType.PULSE: {
+            if (payloadSize < 8) return null;
+            return {
+                type: 'relay_pulse',
+                relay: buffer[4],
+                id: buffer.readUInt16LE(6),
+                duration_ms: buffer.readUInt32LE(8),
+                on_disconnect: (buffer[5] & SEQ_FLAG_ABORT_ON_DISCONNECT) ? 'abort' : 'complete'
+            };
+        }
+
+        case MessageType.SEQUENCE: {
+            if (payloadSize < 4 || payloadSize < 4 + buffer[7] * SEQ_STEP_SIZE) return null;
+            const steps = [];
+            for (let i = 0; i < buffer[7]; i++) {
+                const offset = 8 + i * SEQ_STEP_SIZE;
+                steps.push({ set: buffer[offset], clear: buffer[offset + 1], hold_ms: buffer.readUInt32LE(offset + 4) });
+            }
+            return {
+                type: 'relay_sequence',
+                id: buffer.readUInt16LE(4),
+                on_disconnect: (buffer[6] & SEQ_FLAG_ABORT_ON_DISCONNECT) ? 'abort' : 'complete',
+                steps
+            };
+        }
+
+        case MessageType.SEQUENCE_CANCEL:
+            if (payloadSize < 2) return null;
+            return { type: 'sequence_cancel', id: buffer.readUInt16LE(4) };
+
+        case MessageType.RESYNC:
+            return { type: 'resync' };
+
+        case MessageType.STATE:
+            if (payloadSize < 6) return null;
+            return {
+                type: 'state',
+                seq: buffer.readUInt32LE(4),
+                relay_mask: buffer[8],
+                input_mask: buffer[9],
+                relays: maskToArray(buffer[8]),
+                inputs: maskToArray(buffer[9])
+            };
+
+        case MessageType.STATE_DELTA:
+            if (payloadSize < 6) return null;
+            return {
+                type: 'state_delta',
+                seq: buffer.readUInt32LE(4),
+                relays: buffer[8],
+                inputs: buffer[9]
+            };
+
+        case MessageType.RELAY_ACK: {
+            if (payloadSize < 8) return null;
+            const flags = buffer[5];
+            const message = {
+                type: 'relay_control_ack',
+                relay: buffer[4],
+                state: (flags & AckFlags.STATE) !== 0,
+                success: (flags & AckFlags.SUCCESS) !== 0,
+                verified: (flags & AckFlags.VERIFIED) !== 0,
+                latency_us: buffer.readUInt32LE(8)
+            };
+            if (!message.success) {
+                message.error = errorInfo(buffer[6]).message;
+            }
+            return message;
+        }
+
+        // rx is the low 32 bits of the device clock; the other stamps are rebuilt from
+        // their offsets, so differences between them are exact
+        case MessageType.RELAY_ACK_TRACE: {
+            if (payloadSize < 28) return null;
+            const flags = buffer[5];
+            const rx = buffer.readUInt32LE(12);
+            const t_us = {
+                rx,
+                parse: rx + buffer.readUInt32LE(16),
+                io: rx + buffer.readUInt32LE(20),
+                i2c: rx + buffer.readUInt32LE(24),
+                ack: rx + buffer.readUInt32LE(28)
+            };
+            const message = {
+                type: 'relay_control_ack',
+                relay: buffer[4],
+                state: (flags & AckFlags.STATE) !== 0,
+                success: (flags & AckFlags.SUCCESS) !== 0,
+                verified: (flags & AckFlags.VERIFIED) !== 0,
+                latency_us: t_us.i2c - t_us.parse,
+                trace: buffer.readUInt32LE(8),
+                t_us
+            };
+            if (!message.success) {
+                message.error = errorInfo(buffer[6]).message;
+            }
+            return message;
+        }
+
+        case MessageType.MASK_ACK: {
+            if (payloadSize < 8) return null;
+            const message = {
+                type: 'relay_mask_ack',
+                set: buffer[4],
+                clear: buffer[5],
+                relays: buffer[6],
+                success: buffer[7] === 0,
+                latency_us: buffer.readUInt32LE(8)
+            };
+            if (!message.success) {
+                message.error = errorInfo(buffer[7]).message;
+            }
+            return message;
+        }
+
+        case MessageType.SEQUENCE_STATUS: {
+            if (payloadSize < 12) return null;
+            const message = {
+                type: 'sequence_status',
+                id: buffer.readUInt16LE(4),
+                status: SEQUENCE_STATUS[buffer[6]] || 'unknown',
+                steps: buffer[8],
+                elapsed_us: buffer.readUInt32LE(12)
+            };
+            if (buffer[7] !== 0) {
+                message.error = errorInfo(buffer[7]).message;
+            }
+            return message;
+        }
+
+        case MessageType.INPUT_CHANGED:
+            if (payloadSize < 16) return null;
+            return {
+                type: 'input_changed',
+                inputIndex: buffer[4],
+                state: buffer[5] !== 0,
+                timestamp_us: Number(buffer.readBigUInt64LE(8)),
+                latency_us: buffer.readUInt32LE(16)
+            };
+
+        case MessageType.ERROR: {
+            if (payloadSize < 1) return null;
+            const info = errorInfo(buffer[4]);
+            return { type: 'error_report', error_type: info.type, message: info.message };
+        }
+
+        default:
+            return null;
+    }
+}
+
+module.exports = {
+    MAGIC,
+    VERSION,
+    PROTOCOL_NAME,
+    MessageType,
+    canEncode,
+    encode,
+    decode,
+    maskToArray,
+    arrayToMask
+};
@@ -0,0 +1,119 @@
+// Per-stage relay_control latency from traced commands.
+//
+// begin() assigns a trace id to an outgoing relay_control and remembers when it was sent;
+// complete() takes the matching relay_control_ack, whose t_us carries the device
+// timestamps (frame receipt, parse done, I2C start, I2C done, ack sent), and splits the
+// round trip into stages. The device clock is only ever used for differences, so it
+// does not need to be synchronised with ours.
+//
+// Stages (microseconds):
+//   parse    frame receipt -> parsed and queued for the I/O task
+//   queue    queued -> I/O task starts the I2C write
+//   i2c      I2C write
+//   ack      I2C done -> ack handed to the device's socket
+//   device   frame receipt -> ack (sum of the above)
+//   network  round trip minus device time (both WAN hops plus our own event loop)
+//   total    relay_control sent -> relay_control_ack received
+
+const STAGES = ['parse', 'queue', 'i2c', 'ack', 'device', 'network', 'total'];
+const DEFAULT_SAMPLES = 1024;          // Rolling window per stage
+const PENDING_TIMEOUT_MS = 30000;      // Forget traces whose ack never arrived
+
+class RelayLatencyTracker {
+    constructor(options = {}) {
+        this.maxSamples = options.maxSamples || DEFAULT_SAMPLES;
+        this.nextTrace = 1;
+        this.pending = new Map(); // trace -> { relay, sentAt (hrtime ns) }
+        this.samples = {};
+        this.next = {};
+        for (const stage of STAGES) {
+            this.samples[stage] = [];
+            this.next[stage] = 0;
+        }
+        this.completed = 0;
+        this.expired = 0;
+    }
+
+    // Returns the trace id to put in the outgoing relay_control
+    begin(relay) {
+        this.expire();
+        const trace = this.nextTrace;
+        this.nextTrace = this.nextTrace >= 0xFFFFFFFF ? 1 : this.nextTrace + 1;
+        this.pending.set(trace, { relay, sentAt: process.hrtime.bigint() });
+        return trace;
+    }
+
+    // Returns the stage breakdown for a traced ack, or null if it is not one of ours
+    complete(ack) {
+        if (!ack || !Number.isInteger(ack.trace) || !ack.t_us) {
+            return null;
+        }
+        const entry = this.pending.get(ack.trace);
+        if (!entry) {
+            return null;
+        }
+        this.pending.delete(ack.trace);
+
+        const t = ack.t_us;
+        const totalUs = Number((process.hrtime.bigint() - entry.sentAt) / 1000n);
+        const deviceUs = t.ack - t.rx;
+        const stages = {
+            parse: t.parse - t.rx,
+            queue: t.io - t.parse,
+            i2c: t.i2c - t.io,
+            ack: t.ack - t.i2c,
+            device: deviceUs,
+            network: Math.max(0, totalUs - deviceUs),
+            total: totalUs
+        };
+        for (const stage of STAGES) {
+            this.record(stage, stages[stage]);
+        }
+        this.completed++;
+        return { trace: ack.trace, relay: ack.relay, success: ack.success, stages };
+    }
+
+    // p50/p90/p99/max per stage over the rolling window
+    stats() {
+        const stages = {};
+        for (const stage of STAGES) {
+            const sorted = this.samples[stage].slice().sort((a, b) => a - b);
+            stages[stage] = {
+                n: sorted.length,
+                p50: percentile(sorted, 0.50),
+                p90: percentile(sorted, 0.90),
+                p99: percentile(sorted, 0.99),
+                max: sorted.length ? sorted[sorted.length - 1] : 0
+            };
+        }
+        return { unit: 'us', completed: this.completed, pending: this.pending.size, expired: this.expired, stages };
+    }
+
+    record(stage, value) {
+        const samples = this.samples[stage];
+        if (samples.length < this.maxSamples) {
+            samples.push(value);
+        } else {
+            samples[this.next[stage]] = value;
+        }
+        this.next[stage] = (this.next[stage] + 1) % this.maxSamples;
+    }
+
+    expire() {
+        const cutoff = process.hrtime.bigint() - BigInt(PENDING_TIMEOUT_MS) * 1000000n;
+        for (const [trace, entry] of this.pending) {
+            if (entry.sentAt >= cutoff) break; // Insertion order = send order
+            this.pending.delete(trace);
+            this.expired++;
+        }
+    }
+}
+
+function percentile(sorted, p) {
+    if (sorted.length === 0) return 0;
+    return sorted[Math.min(sorted.length - 1, Math.ceil(p * sorted.length) - 1)];
+}
+
+RelayLatencyTracker.STAGES = STAGES;
+
+module.exports = RelayLatencyTracker;
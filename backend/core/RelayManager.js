@@ -57,6 +57,7 @@ class RelayManager extends EventEmitter {
                     type: customizedConfig.relayType,
                     ip: customizedConfig.ipAddress,
                     port: customizedConfig.port || 81,
+                    lanToken: customizedConfig.lanToken,
                     description: `Relay for ${customizedConfig.relayName}`,
                     capabilities: customizedConfig.capabilities || [],
                     buildingId: buildingId,
@@ -89,6 +90,7 @@ class RelayManager extends EventEmitter {
             type, // 'elevator', 'door', 'light', etc.
             ip,
             port = 81,
+            lanToken = '', // Must match the device's lan_token config
             description = '',
             capabilities = [], // ['door_control', 'floor_selection', etc.]
             robotId = null,
@@ -108,6 +110,7 @@ class RelayManager extends EventEmitter {
             type,
             ip,
             port,
+            lanToken,
             description,
             capabilities,
             status: 'offline',
@@ -247,6 +250,7 @@ class RelayManager extends EventEmitter {
             const controller = new ESP32ElevatorController({
                 ip: relay.ip,
                 port: relay.port,
+                token: relay.lanToken,
                 relayId: relay.id,
                 channels: relay.channels,
                 inputPins: relay.inputPins
@@ -279,9 +279,47 @@ function getElevatorCoordinates(floor, elevatorManager) {
     return coords;
 }
 
+// Build an on-device ride workflow (the relay "workflow" message). The ESP32 presses the
+// call button, waits for its car-arrived input, holds the door and releases on its own,
+// so a ride costs no WAN round trips and its timeouts still release the relays if the
+// link drops partway. Relays and the input are channel indices, times in milliseconds.
+// onDisconnect 'abort' gives up a ride that has not reached the floor yet when the link
+// drops; a door already held open is always let go on its timer.
+function buildDeviceRideWorkflow(id, {
+    callRelay,
+    doorHoldRelay,
+    arrivalInput,
+    callPressMs = 500,
+    arrivalTimeoutMs = 120000,
+    doorHoldMs = 20000,
+    onDisconnect = 'complete'
+} = {}) {
+    if (![callRelay, doorHoldRelay, arrivalInput].every(Number.isInteger)) {
+        throw new Error('callRelay, doorHoldRelay and arrivalInput are required');
+    }
+    const call = 2 ** callRelay;
+    const door = 2 ** doorHoldRelay;
+    const arrived = { input: arrivalInput, active: true, goto: 'hold_door' };
+    const waiting = onDisconnect === 'abort' ? [arrived, { link: 'down', goto: 'failed' }] : [arrived];
+
+    return {
+        type: 'workflow',
+        id,
+        states: [
+            // A car already standing at the floor goes straight to hold_door
+            { name: 'call', set: call, timeout_ms: callPressMs, on_timeout: 'wait_arrival', on: waiting },
+            { name: 'wait_arrival', clear: call, timeout_ms: arrivalTimeoutMs, on_timeout: 'failed', on: waiting },
+            { name: 'hold_door', set: door, clear: call, timeout_ms: doorHoldMs, on_timeout: 'release' },
+            { name: 'release', clear: door, end: 'completed' },
+            { name: 'failed', clear: call + door, end: 'failed' }
+        ]
+    };
+}
+
 module.exports = {
     elevatorWorkflowTemplates,
     createElevatorWorkflow,
+    buildDeviceRideWorkflow,
     calculateFloorTravelTime,
     getElevatorCoordinates
 }; 
@@ -1,5 +1,7 @@
 const express = require('express');
 const http = require('http');
+const https = require('https');
+const fs = require('fs');
 const WebSocket = require('ws');
 const path = require('path');
 const WorkflowManager = require('./core/WorkflowManager');
@@ -7,6 +9,8 @@ const RobotManager = require('./core/RobotManager');
 const MapManager = require('./core/MapManager');
 const RecurringTaskScheduler = require('./core/RecurringTaskScheduler');
 const RelayManager = require('./core/RelayManager');
+const RelayBinaryProtocol = require('./core/RelayBinaryProtocol');
+const RelayLatencyTracker = require('./core/RelayLatencyTracker');
 const cors = require('cors');
 const jwt = require('jsonwebtoken');
 const robotMaps = require('./robot-maps.js');
@@ -14,6 +18,7 @@ const db = require('../db');
 const JWT_SECRET = 'your-secret-key';
 const cron = require('node-cron');
 const { determineWorkflowType } = require('./core/multifloor-workflows');
+const { buildDeviceRideWorkflow } = require('./core/elevator-workflows');
 const { SerialPort } = require('serialport');
 
 // Initialize Express app
@@ -21,8 +26,20 @@ const app = express();
 const server = http.createServer(app);
 const wss = new WebSocket.Server({ server });
 
+// wss for the relays when RELAY_TLS_CERT and RELAY_TLS_KEY name PEM files. Devices pin
+// RELAY_TLS_CA (default: the certificate itself, for a self-signed one). Session tickets
+// are on, so clients that can resume skip the certificate exchange on a reconnect.
+const RELAY_TLS_SESSION_TIMEOUT_S = 24 * 3600;
+const relayTls = process.env.RELAY_TLS_CERT && process.env.RELAY_TLS_KEY ? {
+    cert: fs.readFileSync(process.env.RELAY_TLS_CERT),
+    key: fs.readFileSync(process.env.RELAY_TLS_KEY),
+    ca: fs.readFileSync(process.env.RELAY_TLS_CA || process.env.RELAY_TLS_CERT, 'utf8')
+} : null;
+
 // Create a second server instance for elevator relays on port 80
-const relayServer = http.createServer();
+const relayServer = relayTls
+    ? https.createServer({ cert: relayTls.cert, key: relayTls.key, sessionTimeout: RELAY_TLS_SESSION_TIMEOUT_S })
+    : http.createServer();
 const relayWss = new WebSocket.Server({ 
     server: relayServer,
     path: '/elevator'
@@ -31,6 +48,8 @@ const relayWss = new WebSocket.Server({
 // Store connected relays, keyed by their MAC address
 // Each entry contains: { ws: WebSocket, ip: string }
 const connectedRelays = new Map();
+const RELAY_LOG_HISTORY = 200; // Streamed log lines kept per relay
+const RELAY_STATS_LATE_WARN_US = 20000; // I/O task wake-up lateness (p99) that marks a board as struggling
 
 // Ensure JSON and CORS middleware are set before any routes
 app.use(express.json());
@@ -971,19 +990,25 @@ wss.on('connection', async (ws, req) => {
 // New API endpoint to send commands to a specific relay
 app.post('/api/relays/:mac/command', async (req, res) => {
     const { mac } = req.params;
-    const { command, type, relay, state } = req.body;
-
-    // Simple relay command - send relay number directly to ESP32
-    const messageToSend = {
-        type: 'relay_control',
-        relay: relay,  // Use relay number directly (0-7)
-        state: state
-    };
-
     const relayData = connectedRelays.get(mac);
+    let messageToSend;
+    try {
+        messageToSend = buildRelayCommand(req.body, relayData);
+    } catch (error) {
+        return res.status(400).json({ error: error.message });
+    }
 
     if (relayData && relayData.ws.readyState === WebSocket.OPEN) {
-        relayData.ws.send(JSON.stringify(messageToSend));
+        if (messageToSend.type === 'command') {
+            try {
+                const result = await sendRelayCommandAndWait(relayData, messageToSend);
+                res.status(200).json({ success: true, result: result });
+            } catch (error) {
+                res.status(502).json({ success: false, error: error.message });
+            }
+            return;
+        }
+        sendToRelay(relayData, messageToSend);
         res.status(200).json({ message: `Command '${messageToSend.type}' sent to relay ${mac} at IP: ${relayData.ip}` });
     } else {
         res.status(404).json({ error: `Relay with MAC address ${mac} not connected or not ready.` });
@@ -998,7 +1023,13 @@ app.get('/api/relays/connected', (req, res) => {
         connectedRelaysList.push({
             mac: mac,
             ip: relayData.ip,
-            status: relayData.ws.readyState === WebSocket.OPEN ? 'connected' : 'disconnected'
+            status: relayData.ws.readyState === WebSocket.OPEN ? 'connected' : 'disconnected',
+            i2cStats: relayData.i2cStats || null,
+            link: relayData.link || null,
+            boot: relayData.boot || null,
+            heap: relayData.heap || null,
+            power: relayData.power || null,
+            stats: relayData.stats || null
         });
     }
     
@@ -1008,6 +1039,175 @@ app.get('/api/relays/connected', (req, res) => {
     });
 });
 
+// API endpoint to get relay_control latency per stage: measured here from traced acks
+// (backend) and the device's own histograms from its last latency_stats answer (device)
+app.get('/api/relays/:mac/latency', (req, res) => {
+    const target = req.params.mac.toLowerCase();
+    for (const [mac, relayData] of connectedRelays.entries()) {
+        if (mac.toLowerCase() === target) {
+            return res.json({
+                mac,
+                backend: relayData.latency ? relayData.latency.stats() : null,
+                device: relayData.deviceLatency || null
+            });
+        }
+    }
+    res.status(404).json({ error: 'Relay not connected' });
+});
+
+// Heap samples from state keyframes and heap_stats answers. The first sample after a
+// registration is the baseline; the firmware's message path does not allocate, so on a
+// long soak drift (bytes lost since the baseline) should stay at zero.
+function recordRelayHeap(relayData, heap) {
+    const sample = {
+        free: heap.free,
+        min_free: heap.min_free,
+        largest_block: heap.largest_block,
+        received_at: Date.now()
+    };
+    if (Number.isFinite(heap.used)) sample.used = heap.used;
+    if (Number.isFinite(heap.tx_overflows)) sample.tx_overflows = heap.tx_overflows;
+    if (!relayData.heapBaseline) {
+        relayData.heapBaseline = { free: heap.free, at: sample.received_at };
+    }
+    sample.drift = relayData.heapBaseline.free - heap.free;
+    relayData.heap = sample;
+}
+
+// API endpoint to get a relay's heap trend (free, low-water mark, largest block, drift)
+app.get('/api/relays/:mac/heap', (req, res) => {
+    const target = req.params.mac.toLowerCase();
+    for (const [mac, relayData] of connectedRelays.entries()) {
+        if (mac.toLowerCase() === target) {
+            return res.json({ mac, heap: relayData.heap || null, baseline: relayData.heapBaseline || null });
+        }
+    }
+    res.status(404).json({ error: 'Relay not connected' });
+});
+
+// On-device workflows by id: the state names of the table sent, and the transitions
+// reported by workflow_status (replayed after a reconnect, so a ride that ended while the
+// link was down still gets its outcome)
+const WORKFLOW_HISTORY = 32;
+
+function recordWorkflowSent(relayData, message) {
+    relayData.workflows = relayData.workflows || new Map();
+    relayData.workflows.set(message.id, {
+        id: message.id,
+        states: message.states.map((state, index) => state.name || String(index)),
+        status: 'sent',
+        state: null,
+        history: [],
+        updated_at: Date.now()
+    });
+}
+
+function recordWorkflowStatus(relayData, status) {
+    relayData.workflows = relayData.workflows || new Map();
+    let workflow = relayData.workflows.get(status.id);
+    if (!workflow) {
+        workflow = { id: status.id, states: [], status: null, state: null, history: [] };
+        relayData.workflows.set(status.id, workflow);
+    }
+    const stateName = (index) => (index === undefined ? null : workflow.states[index] || String(index));
+    workflow.status = status.status;
+    if (status.state !== undefined) {
+        workflow.state = stateName(status.state);
+    }
+    workflow.error = status.error || null;
+    workflow.updated_at = Date.now();
+    if (!status.replay) {
+        workflow.history.push({ status: status.status, state: stateName(status.state), from: stateName(status.from),
+                                cause: status.cause || null, elapsed_us: status.elapsed_us });
+        if (workflow.history.length > WORKFLOW_HISTORY) {
+            workflow.history.shift();
+        }
+    }
+    return workflow;
+}
+
+// API endpoint to get the on-device workflows of a relay and their progress
+app.get('/api/relays/:mac/workflows', (req, res) => {
+    const target = req.params.mac.toLowerCase();
+    for (const [mac, relayData] of connectedRelays.entries()) {
+        if (mac.toLowerCase() === target) {
+            return res.json({ mac, workflows: relayData.workflows ? [...relayData.workflows.values()] : [] });
+        }
+    }
+    res.status(404).json({ error: 'Relay not connected' });
+});
+
+// Input capture upload: the status message announces the runs, the chunks fill them in
+function recordCaptureStatus(relayData, status) {
+    const { type, success, ...fields } = status;
+    const previous = relayData.capture;
+    // Another status for a finished capture keeps the chunks received so far
+    const keep = previous && previous.capture === status.capture && previous.state === 'done' && status.state === 'done';
+    relayData.capture = {
+        ...fields,
+        received_at: Date.now(),
+        data: keep ? previous.data : [],
+        chunks_received: keep ? previous.chunks_received : 0
+    };
+}
+
+function recordCaptureChunk(relayData, chunk) {
+    const capture = relayData.capture;
+    if (!capture || capture.capture !== chunk.capture) {
+        return;
+    }
+    if (capture.data[chunk.chunk] === undefined) {
+        capture.chunks_received++;
+    }
+    capture.data[chunk.chunk] = chunk.runs;
+}
+
+// Decode the run words (4 bytes little endian: bits 0-7 input levels, 8-31 sample count)
+// into [{ sample, t_us, levels, inputs, samples }]; t_us is relative to the capture start
+function decodeCaptureRuns(capture) {
+    const runs = [];
+    let sample = capture.first_sample || 0;
+    for (const encoded of capture.data) {
+        const bytes = Buffer.from(encoded || '', 'base64');
+        for (let offset = 0; offset + 4 <= bytes.length; offset += 4) {
+            const word = bytes.readUInt32LE(offset);
+            const levels = word & 0xFF;
+            const length = word >>> 8;
+            runs.push({ sample, t_us: sample * capture.period_us, levels, inputs: maskToArray(levels), samples: length });
+            sample += length;
+        }
+    }
+    return runs;
+}
+
+// API endpoint to get the last input capture of a relay (complete once every chunk arrived)
+app.get('/api/relays/:mac/capture', (req, res) => {
+    const target = req.params.mac.toLowerCase();
+    for (const [mac, relayData] of connectedRelays.entries()) {
+        if (mac.toLowerCase() === target) {
+            const capture = relayData.capture;
+            if (!capture) {
+                return res.json({ mac, capture: null });
+            }
+            const { data, ...status } = capture;
+            const complete = capture.state === 'done' && capture.chunks_received === capture.chunks;
+            return res.json({ mac, capture: status, complete, runs: complete ? decodeCaptureRuns(capture) : [] });
+        }
+    }
+    res.status(404).json({ error: 'Relay not connected' });
+});
+
+// API endpoint to get the log lines a relay streamed upstream (newest last)
+app.get('/api/relays/:mac/logs', (req, res) => {
+    const target = req.params.mac.toLowerCase();
+    for (const [mac, relayData] of connectedRelays.entries()) {
+        if (mac.toLowerCase() === target) {
+            return res.json({ mac, lines: relayData.logs || [] });
+        }
+    }
+    res.status(404).json({ error: 'Relay not connected' });
+});
+
 // Handle WebSocket messages
 async function handleWebSocketMessage(ws, data) {
     switch (data.type) {
@@ -1110,7 +1310,7 @@ async function handleWebSocketMessage(ws, data) {
                         console.log(`[RELAY] Forwarded command to ${deviceId}: ${relayName} (not in DB) = ${relayState}`);
                     }
                     
-                    targetRelay.send(JSON.stringify(relayCommand));
+                    sendToRelay(connectedRelays.get(targetMac), relayCommand);
                     ws.send(JSON.stringify({ type: 'relay_command_sent', relay: relayName, state: relayState }));
                 } catch (err) {
                     console.error(`Error looking up relay configuration for ${targetMac}:`, err);
@@ -1120,7 +1320,7 @@ async function handleWebSocketMessage(ws, data) {
                     relay: relayName,
                     state: relayState
                 };
-                targetRelay.send(JSON.stringify(relayCommand));
+                sendToRelay(connectedRelays.get(targetMac), relayCommand);
                     console.log(`[RELAY] Forwarded command to ${deviceId}: ${relayName} (DB error) = ${relayState}`);
                 ws.send(JSON.stringify({ type: 'relay_command_sent', relay: relayName, state: relayState }));
                 }
@@ -1130,6 +1330,70 @@ async function handleWebSocketMessage(ws, data) {
             }
             break;
 
+        case 'set_relays': {
+            // Switch several relay functions together, e.g. { set: ['door_open'], clear: ['floor_3'] }.
+            // Sent as one relay_mask so the board changes all channels in the same I2C write.
+            const maskTarget = findConnectedRelay(data.device_id);
+            if (!maskTarget) {
+                console.error(`[RELAY] Relay ${data.device_id} not found or not connected`);
+                ws.send(JSON.stringify({ type: 'error', message: `Relay ${data.device_id} not found or not connected` }));
+                break;
+            }
+
+            try {
+                const toChannel = await loadRelayChannelResolver(maskTarget.mac);
+                const names = [...(data.set || []), ...(data.clear || [])];
+                const unknown = names.filter(name => toChannel(name) < 0);
+                if (unknown.length > 0) {
+                    ws.send(JSON.stringify({ type: 'error', message: `Unknown relay functions: ${unknown.join(', ')}` }));
+                    break;
+                }
+
+                const relayCommand = buildRelayMask(maskTarget.relayData, (data.set || []).map(toChannel),
+                                                    (data.clear || []).map(toChannel));
+                sendToRelay(maskTarget.relayData, relayCommand);
+                console.log(`[RELAY] Forwarded mask command to ${data.device_id}: set ${JSON.stringify(data.set || [])} clear ${JSON.stringify(data.clear || [])}`);
+                ws.send(JSON.stringify({ type: 'relay_command_sent', set: data.set || [], clear: data.clear || [] }));
+            } catch (err) {
+                console.error(`Error looking up relay configuration for ${maskTarget.mac}:`, err);
+                ws.send(JSON.stringify({ type: 'error', message: `Failed to resolve relay functions for ${data.device_id}` }));
+            }
+            break;
+        }
+
+        case 'pulse_relay': {
+            // Momentary button press timed on the board, e.g. { relay: 'hall_call', duration_ms: 250 }
+            const pulseTarget = findConnectedRelay(data.device_id);
+            if (!pulseTarget) {
+                console.error(`[RELAY] Relay ${data.device_id} not found or not connected`);
+                ws.send(JSON.stringify({ type: 'error', message: `Relay ${data.device_id} not found or not connected` }));
+                break;
+            }
+
+            try {
+                const toChannel = await loadRelayChannelResolver(pulseTarget.mac);
+                const channelIndex = toChannel(data.relay);
+                if (channelIndex < 0) {
+                    ws.send(JSON.stringify({ type: 'error', message: `Unknown relay function: ${data.relay}` }));
+                    break;
+                }
+
+                sendToRelay(pulseTarget.relayData, {
+                    type: 'relay_pulse',
+                    relay: channelIndex,
+                    duration_ms: data.duration_ms,
+                    id: data.id || 0,
+                    on_disconnect: data.on_disconnect
+                });
+                console.log(`[RELAY] Forwarded pulse to ${data.device_id}: ${data.relay} (channel ${channelIndex}) for ${data.duration_ms}ms`);
+                ws.send(JSON.stringify({ type: 'relay_command_sent', relay: data.relay, duration_ms: data.duration_ms }));
+            } catch (err) {
+                console.error(`Error looking up relay configuration for ${pulseTarget.mac}:`, err);
+                ws.send(JSON.stringify({ type: 'error', message: `Failed to resolve relay function for ${data.device_id}` }));
+            }
+            break;
+        }
+
         default:
             ws.send(JSON.stringify({ type: 'error', message: 'Unknown message type' }));
     }
@@ -4230,7 +4494,7 @@ server.listen(PORT, '0.0.0.0', async () => {
 
 // Start relay server on port 40000 for elevator relays
 relayServer.listen(40000, '0.0.0.0', () => {
-    console.log(`Relay server running on port 40000`);
+    console.log(`Relay server running on port 40000 (${relayTls ? 'wss' : 'ws'})`);
 });
 
 // Generate firmware configuration from relay config
@@ -4244,6 +4508,18 @@ function generateFirmwareConfig(config) {
         server_host: "skytechautomated.com",
         server_port: 40000
     };
+    if (relayTls) {
+        firmwareConfig.server_tls = true;
+        firmwareConfig.server_ca = relayTls.ca;
+    }
+    // Light sleep between rides; the first command after an idle stretch waits for a DTIM beacon
+    if (config.power_save !== undefined) {
+        firmwareConfig.power_save = Boolean(config.power_save);
+    }
+    // Runtime profile pushed every stats_interval seconds (0 or 10-3600)
+    if (config.stats_interval !== undefined) {
+        firmwareConfig.stats_interval = Number(config.stats_interval) || 0;
+    }
 
     // Add MAC address if configured
     if (config.mac_address) {
@@ -4876,6 +5152,273 @@ async function processDIInputs(macAddress, inputs) {
     }
 }
 
+// Send a message to a relay board in the wire protocol it negotiated at registration.
+// Every relay_control gets a trace id, so its ack carries the device stage timestamps.
+function sendToRelay(relayData, message) {
+    if (message.type === 'relay_control' && message.trace === undefined) {
+        relayData.latency = relayData.latency || new RelayLatencyTracker();
+        message = { ...message, trace: relayData.latency.begin(message.relay) };
+    }
+    if (message.type === 'workflow') {
+        recordWorkflowSent(relayData, message);
+    }
+    if (relayData.protocol === RelayBinaryProtocol.PROTOCOL_NAME && RelayBinaryProtocol.canEncode(message)) {
+        relayData.ws.send(RelayBinaryProtocol.encode(message), { binary: true });
+    } else {
+        relayData.ws.send(JSON.stringify(message));
+    }
+}
+
+// "command" messages get the next commandId and resolve with the device's
+// command_response. The device executes each id at most once, so the same id is
+// retransmitted until the response arrives; ids continue above the last_command_id
+// the device reported in register.
+const RELAY_COMMAND_TIMEOUT_MS = 10000;
+const RELAY_COMMAND_RETRANSMIT_MS = 1000;
+
+function sendRelayCommandAndWait(relayData, message) {
+    relayData.pendingCommands = relayData.pendingCommands || new Map();
+    return new Promise((resolve, reject) => {
+        const pending = { message, resolve, reject, resent: false };
+        pending.timeout = setTimeout(() => {
+            relayData.pendingCommands.delete(pending.commandId);
+            clearInterval(pending.retransmit);
+            reject(new Error(`Command timeout: ${message.command}`));
+        }, RELAY_COMMAND_TIMEOUT_MS);
+        transmitRelayCommand(relayData, pending);
+    });
+}
+
+function transmitRelayCommand(relayData, pending) {
+    clearInterval(pending.retransmit);
+    relayData.commandId = (relayData.commandId || 0) + 1;
+    pending.commandId = relayData.commandId;
+    relayData.pendingCommands.set(pending.commandId, pending);
+    const payload = JSON.stringify({ ...pending.message, commandId: pending.commandId });
+    relayData.ws.send(payload);
+    pending.retransmit = setInterval(() => {
+        if (relayData.ws.readyState === WebSocket.OPEN) {
+            relayData.ws.send(payload);
+        }
+    }, RELAY_COMMAND_RETRANSMIT_MS);
+}
+
+function handleRelayCommandResponse(relayData, data) {
+    const pending = relayData.pendingCommands && relayData.pendingCommands.get(data.commandId);
+    if (!pending) {
+        return; // Duplicate answer to a retransmit, or already timed out
+    }
+    relayData.pendingCommands.delete(data.commandId);
+    
+    // Our ids fell behind the device's (it saw a higher id on an earlier connection): skip ahead once
+    if (data.error_type === 'STALE_COMMAND' && Number.isInteger(data.last_id) && !pending.resent) {
+        relayData.commandId = Math.max(relayData.commandId, data.last_id);
+        pending.resent = true;
+        transmitRelayCommand(relayData, pending);
+        return;
+    }
+    
+    clearTimeout(pending.timeout);
+    clearInterval(pending.retransmit);
+    if (data.success) {
+        pending.resolve(data.result);
+    } else {
+        pending.reject(new Error(data.error || 'Command failed'));
+    }
+}
+
+// Find an open relay connection by MAC address or device_id (case-insensitive)
+function findConnectedRelay(deviceId) {
+    const target = (deviceId || '').toLowerCase();
+    for (const [mac, relayData] of connectedRelays.entries()) {
+        if (mac.toLowerCase() === target ||
+            (relayData.device_id && relayData.device_id.toLowerCase() === target)) {
+            return relayData.ws.readyState === WebSocket.OPEN ? { mac, relayData } : null;
+        }
+    }
+    return null;
+}
+
+// Returns a function mapping a relay function name (or channel index) to its channel, -1 if unknown
+async function loadRelayChannelResolver(macAddress) {
+    const relayResult = await db.query(`
+        SELECT rc.channel_config
+        FROM relay_configurations rc
+        LEFT JOIN connected_relays cr ON cr.relay_configuration_id = rc.id
+        WHERE cr.mac_address = $1
+    `, [macAddress]);
+    const channelConfig = relayResult.rows.length > 0 ? (relayResult.rows[0].channel_config || {}) : {};
+
+    return (name) => {
+        if (Number.isInteger(name)) return name >= 0 && name < 8 ? name : -1;
+        for (let i = 0; i < 8; i++) {
+            const channel = channelConfig[`channel${i}`];
+            if (channel && channel.function === name) return i;
+        }
+        return -1;
+    };
+}
+
+// Build the relay message for a /api/relays/:mac/command request body (relayData: the
+// connected relay, if any, for its bank layout)
+function buildRelayCommand(body, relayData) {
+    const { type, relay, state } = body;
+
+    switch (type) {
+        // Multi-relay command - the ESP32 applies set/clear together in a single I2C write
+        case 'relay_mask':
+            return buildRelayMask(relayData, body.set, body.clear);
+
+        // Timed commands - the ESP32 runs them on its own timer, so pulse widths do not
+        // depend on network latency. on_disconnect: 'complete' (default) or 'abort'.
+        case 'relay_pulse':
+            return { type: 'relay_pulse', relay, duration_ms: body.duration_ms, id: body.id || 0, on_disconnect: body.on_disconnect };
+        case 'relay_sequence':
+            return { type: 'relay_sequence', steps: body.steps || [], id: body.id || 0, on_disconnect: body.on_disconnect };
+        case 'sequence_cancel':
+            return { type: 'sequence_cancel', id: body.id || 0 };
+
+        // On-device workflow - a state machine table the ESP32 runs from its own inputs
+        // and timers; progress comes back as workflow_status. elevator_ride builds the
+        // call / wait for arrival / hold door / release table (callRelay, doorHoldRelay,
+        // arrivalInput, callPressMs, arrivalTimeoutMs, doorHoldMs, onDisconnect).
+        case 'workflow':
+            return { type: 'workflow', id: body.id || 0, states: body.states || [] };
+        case 'elevator_ride':
+            return buildDeviceRideWorkflow(body.id || 0, body);
+        case 'workflow_cancel':
+            return { type: 'workflow_cancel', id: body.id || 0 };
+
+        // Diagnostics - the ESP32 answers with its I2C driver counters
+        case 'i2c_stats':
+            return { type: 'i2c_stats' };
+
+        // Diagnostics - the ESP32 answers with per-stage relay_control latency percentiles
+        case 'latency_stats':
+            return { type: 'latency_stats', reset: body.reset === true };
+
+        // Correlated command (set_relay, set_mask, get_state): answered with a
+        // command_response; the commandId is assigned when it is sent
+        case 'command':
+            return { type: 'command', command: body.command, params: body.params || {} };
+
+        // Diagnostics - the ESP32 answers with heap free / low-water mark / largest block
+        case 'heap_stats':
+            return { type: 'heap_stats' };
+
+        // Diagnostics - the ESP32 answers with its runtime profile (task loop timing and CPU,
+        // stack/heap low-water marks, queue peaks, RSSI, reconnects); reset clears the
+        // timing histograms and queue peaks
+        case 'stats':
+            return { type: 'stats', reset: body.reset === true };
+
+        // High-rate input capture - action 'start' (rate_hz 1000-10000, duration_ms,
+        // mode 'ring' or 'fill', upload), 'stop', 'upload' or 'status'. The runs arrive as
+        // input_capture_chunk messages; GET /api/relays/:mac/capture decodes them.
+        case 'input_capture': {
+            const message = { type: 'input_capture', action: body.action || 'status' };
+            for (const key of ['rate_hz', 'duration_ms', 'mode', 'upload']) {
+                if (body[key] !== undefined) message[key] = body[key];
+            }
+            return message;
+        }
+
+        // Log streaming - records at or above level ('error', 'warn', 'info', 'debug') are
+        // forwarded as 'log' messages; 'off' stops the stream
+        case 'log_stream':
+            return { type: 'log_stream', level: body.level || 'off' };
+
+        // Simple relay command - send relay number directly to ESP32
+        default:
+            return {
+                type: 'relay_control',
+                relay: relay,  // Use relay number directly (0-7)
+                state: state
+            };
+    }
+}
+
+// relay_mask operands may be given as a bitmask or as an array of channel indices
+function toRelayChannels(value) {
+    if (Array.isArray(value)) {
+        return value.map(Number);
+    }
+    const mask = Number(value) || 0;
+    if (!Number.isSafeInteger(mask) || mask < 0) {
+        throw new Error(`Invalid relay mask ${value}: give channels above 52 as a channel array`);
+    }
+    const channels = [];
+    for (let bits = mask, channel = 0; bits > 0; bits = Math.floor(bits / 2), channel++) {
+        if (bits % 2) channels.push(channel);
+    }
+    return channels;
+}
+
+// relay_mask for a relay's bank layout. Channels in bank 0 go as plain set/clear masks
+// (at most 16 bits); anything past it goes in the per-bank form the firmware parses
+// ({"banks": [{"bank": 1, "set": 5}]}), since JavaScript bit operations stop at bit 31
+// and a JSON number at bit 53. Throws for a channel the relay does not have.
+function buildRelayMask(relayData, set, clear) {
+    const bankChannels = (relayData && Array.isArray(relayData.bankChannels) && relayData.bankChannels.length > 0)
+        ? relayData.bankChannels : [8];
+    const banks = bankChannels.map((channels, bank) => ({ bank, set: 0, clear: 0 }));
+    const place = (channels, field) => {
+        for (const channel of channels) {
+            let offset = 0;
+            const bank = bankChannels.findIndex(width => {
+                if (channel < offset + width) return true;
+                offset += width;
+                return false;
+            });
+            if (!Number.isInteger(channel) || channel < 0 || bank < 0) {
+                throw new Error(`Invalid relay channel ${channel}`);
+            }
+            banks[bank][field] |= 1 << (channel - offset);
+        }
+    };
+    place(toRelayChannels(set), 'set');
+    place(toRelayChannels(clear), 'clear');
+
+    const used = banks.filter(bank => bank.set || bank.clear);
+    if (used.every(bank => bank.bank === 0)) {
+        return { type: 'relay_mask', set: banks[0].set, clear: banks[0].clear };
+    }
+    return { type: 'relay_mask', banks: used };
+}
+
+// Expand a firmware bitmask (bit i = channel i) into the 1/0 array format used for DI processing
+function maskToArray(mask, width = 8) {
+    const values = [];
+    for (let i = 0; i < width; i++) {
+        values.push((mask >> i) & 1);
+    }
+    return values;
+}
+
+// Relay outputs of a state/delta/ack: per-bank bits (relay_banks) on multi-expander boards,
+// otherwise one mask
+function relayMaskToArray(relayData, mask, banks) {
+    const bankChannels = relayData && relayData.bankChannels;
+    if (Array.isArray(banks) && Array.isArray(bankChannels)) {
+        return banks.reduce((values, bits, bank) => values.concat(maskToArray(bits, bankChannels[bank] || 8)), []);
+    }
+    return maskToArray(mask, (bankChannels && bankChannels[0]) || 8);
+}
+
+// Record a relay's input levels and only run DI processing (several DB round trips) when they changed
+async function applyRelayInputs(macAddress, inputs) {
+    const relayData = connectedRelays.get(macAddress);
+    const previous = relayData ? relayData.inputs : null;
+    const changed = !previous || previous.length !== inputs.length || previous.some((value, index) => value !== inputs[index]);
+    
+    if (relayData) {
+        relayData.inputs = inputs;
+    }
+    if (changed) {
+        await processDIInputs(macAddress, inputs);
+    }
+}
+
 // Update elevator status based on DI inputs
 async function updateElevatorStatus(macAddress, functionName, isActive) {
     console.log(`[INFO] Elevator status update - ${macAddress}: ${functionName} = ${isActive}`);
@@ -4989,7 +5532,7 @@ async function sendRelayCommand(macAddress, functionName, state) {
                 state: state ? 1 : 0
             };
             
-            relayData.ws.send(JSON.stringify(message));
+            sendToRelay(relayData, message);
             console.log(`[INFO] Sent command to relay ${macAddress}:`, message);
         } else {
             console.log(`[ERROR] Relay ${macAddress} not connected`);
@@ -5008,9 +5551,13 @@ relayWss.on('connection', async (ws, req) => {
     
     // Extract MAC address from the connection URL to identify relays
     let macAddress = null;
+    let standby = false;
     try {
     const url = new URL(req.url, `http://${req.headers.host}`);
         macAddress = url.searchParams.get('id');
+        // Devices with backup_servers keep a hot-standby link open; firmware without
+        // the role query is always active
+        standby = url.searchParams.get('role') === 'standby';
         console.log(`[DEBUG] Parsed MAC address: ${macAddress}`);
     } catch (error) {
         console.error(`[DEBUG] Error parsing URL: ${error.message}`);
@@ -5021,34 +5568,113 @@ relayWss.on('connection', async (ws, req) => {
         // Extract IP address from the connection
         const relayIP = req.socket.remoteAddress || req.connection.remoteAddress || 'unknown';
         
-        console.log(`[PORT 40000] Relay connected with ID: ${macAddress} from IP: ${relayIP}`);
+        console.log(`[PORT 40000] Relay connected with ID: ${macAddress} from IP: ${relayIP}${standby ? ' (hot standby)' : ''}`);
         
-        // Store the relay connection
-        connectedRelays.set(macAddress, { ws, ip: relayIP });
-        
-        // Insert or update connected_relays table
-        try {
-            console.log('[DEBUG] [PORT 40000] Attempting to insert/update connected_relays for', macAddress, relayIP);
-            const result = await db.query(`
-                INSERT INTO connected_relays (mac_address, status, is_connected, last_seen, ip_address, port)
-                VALUES ($1, 'online', TRUE, CURRENT_TIMESTAMP, $2, 40000)
-                ON CONFLICT (mac_address) DO UPDATE
-                SET status = 'online', is_connected = TRUE, last_seen = CURRENT_TIMESTAMP, ip_address = $2, port = 40000
-                `, [macAddress, relayIP]);
-            console.log('[DEBUG] [PORT 40000] Insert/update for connected_relays completed for', macAddress, 'Result:', result.rowCount);
-        } catch (err) {
-            console.error('[DEBUG] [PORT 40000] Error inserting/updating connected_relays for', macAddress, err);
+        // Store the relay connection and mark it online. A hot standby only does this once
+        // the device switches over to it and registers it as the active link.
+        const activate = async () => {
+            standby = false;
+            connectedRelays.set(macAddress, { ws, ip: relayIP });
+            
+            // Insert or update connected_relays table
+            try {
+                console.log('[DEBUG] [PORT 40000] Attempting to insert/update connected_relays for', macAddress, relayIP);
+                const result = await db.query(`
+                    INSERT INTO connected_relays (mac_address, status, is_connected, last_seen, ip_address, port)
+                    VALUES ($1, 'online', TRUE, CURRENT_TIMESTAMP, $2, 40000)
+                    ON CONFLICT (mac_address) DO UPDATE
+                    SET status = 'online', is_connected = TRUE, last_seen = CURRENT_TIMESTAMP, ip_address = $2, port = 40000
+                    `, [macAddress, relayIP]);
+                console.log('[DEBUG] [PORT 40000] Insert/update for connected_relays completed for', macAddress, 'Result:', result.rowCount);
+            } catch (err) {
+                console.error('[DEBUG] [PORT 40000] Error inserting/updating connected_relays for', macAddress, err);
+            }
+        };
+        if (!standby) {
+            await activate();
         }
 
-        ws.on('message', async (message) => {
+        ws.on('message', async (message, isBinary) => {
             try {
-                const data = JSON.parse(message);
+                // Boards that negotiated the binary protocol send BIN frames
+                const data = isBinary ? RelayBinaryProtocol.decode(message) : JSON.parse(message);
+                if (!data) {
+                    console.error(`[PORT 40000] Malformed binary frame from relay ${macAddress} (${message.length} bytes)`);
+                    return;
+                }
                 console.log(`[PORT 40000] Received message from relay ${macAddress}:`, data);
+                // Only register reaches us from a hot standby; the device drops anything sent to it
+                if (standby && data.type !== 'register' && data.type !== 'device_register') {
+                    return;
+                }
 
                 // Handle device registration (accept both old and new formats)
                 if (data.type === 'device_register' || data.type === 'register') {
+                    // The device moved its active link elsewhere: this one is the standby now.
+                    // Its relay entry goes, the database status is left to the active link.
+                    if (data.role === 'standby') {
+                        if (!standby) {
+                            standby = true;
+                            const relayData = connectedRelays.get(macAddress);
+                            if (relayData && relayData.ws === ws) {
+                                connectedRelays.delete(macAddress);
+                            }
+                            console.log(`[PORT 40000] Relay ${macAddress} link is now the hot standby`);
+                        }
+                        return;
+                    }
+                    if (standby) {
+                        console.log(`[PORT 40000] Relay ${macAddress} switched over to its hot-standby link`);
+                        await activate();
+                    }
                     console.log(`[PORT 40000] Relay ${macAddress} registering as ${data.device_name}`);
                     
+                    // Negotiate the wire protocol; firmware that does not offer bin_version stays on JSON
+                    if (Number.isInteger(data.bin_version)) {
+                        const relayData = connectedRelays.get(macAddress);
+                        const protocol = data.bin_version === RelayBinaryProtocol.VERSION ? RelayBinaryProtocol.PROTOCOL_NAME : 'json';
+                        ws.send(JSON.stringify({ type: 'register_ack', protocol: protocol }));
+                        if (relayData) {
+                            relayData.protocol = protocol;
+                        }
+                        console.log(`[PORT 40000] Relay ${macAddress} protocol: ${protocol}`);
+                    }
+                    
+                    // Firmware with event-driven reconnects reports how long it was away
+                    if (data.reconnects > 0) {
+                        console.log(`[PORT 40000] Relay ${macAddress} reconnected (#${data.reconnects}) after ${data.last_outage_ms}ms offline`);
+                    }
+                    // Devices with backup_servers register again on every failover to their hot standby
+                    if (data.switches > 0) {
+                        console.log(`[PORT 40000] Relay ${macAddress} on upstream endpoint ${data.endpoint} after ${data.switches} switch(es)`);
+                    }
+                    
+                    // Boards with several expanders list each bank's width; relay masks then
+                    // arrive split per bank (relay_banks)
+                    if (Array.isArray(data.bank_channels)) {
+                        const relayData = connectedRelays.get(macAddress);
+                        if (relayData) {
+                            relayData.bankChannels = data.bank_channels;
+                        }
+                    }
+                    
+                    // Command ids continue above the highest the device has executed
+                    if (Number.isInteger(data.last_command_id)) {
+                        const relayData = connectedRelays.get(macAddress);
+                        if (relayData) {
+                            relayData.commandId = Math.max(relayData.commandId || 0, data.last_command_id);
+                        }
+                    }
+                    
+                    // Power-up -> first registration, measured by the device (fast boot tracking)
+                    if (Number.isFinite(data.boot_ms)) {
+                        const relayData = connectedRelays.get(macAddress);
+                        if (relayData) {
+                            relayData.boot = { ms: data.boot_ms, fast: data.fast_boot === true };
+                        }
+                        console.log(`[PORT 40000] Relay ${macAddress} registered ${data.boot_ms}ms after boot (${data.fast_boot ? 'fast boot' : 'full scan'})`);
+                    }
+                    
                     // Extract MAC address from registration message
                     const actualMac = data.mac || data.mac_address;
                     const deviceIP = data.ip;
@@ -5083,24 +5709,196 @@ relayWss.on('connection', async (ws, req) => {
                     }
                 }
                 
-                // Handle state updates
+                // Handle state updates (full state keyframe, sent on connect, on resync and as a slow heartbeat)
                 if (data.type === 'full_state' || data.type === 'state') {
                     console.log(`[PORT 40000] Relay ${macAddress} state:`, {
+                        seq: data.seq,
                         relays: data.relays,
                         inputs: data.inputs
                     });
                     
+                    const relayData = connectedRelays.get(macAddress);
+                    
                     // Update IP address if provided in state message
-                    if (data.ip) {
-                        const relayData = connectedRelays.get(macAddress);
-                        if (relayData) {
-                            relayData.ip = data.ip;
-                        }
+                    if (data.ip && relayData) {
+                        relayData.ip = data.ip;
+                    }
+                    
+                    // A keyframe re-bases the delta sequence
+                    if (relayData && Number.isInteger(data.seq)) {
+                        relayData.stateSeq = data.seq;
+                    }
+                    
+                    // Upstream link health measured by the device (ping/pong RTT, reconnects)
+                    if (relayData && data.link) {
+                        relayData.link = data.link;
+                    }
+                    
+                    // Heap trend for soak monitoring
+                    if (relayData && data.heap) {
+                        recordRelayHeap(relayData, data.heap);
+                    }
+                    
+                    // Low-power idle: state, share of time idle and what woke the board
+                    if (relayData && data.power) {
+                        relayData.power = data.power;
                     }
                     
                     // Process DI inputs if they exist
                     if (data.inputs && Array.isArray(data.inputs)) {
-                        await processDIInputs(macAddress, data.inputs);
+                        // Firmware reports inputs as booleans; DI processing expects 1/0
+                        const inputs = data.inputs.map(value => (value === true || value === 1) ? 1 : 0);
+                        await applyRelayInputs(macAddress, inputs);
+                    }
+                    if (data.relays && Array.isArray(data.relays) && relayData) {
+                        relayData.relays = data.relays.map(value => (value === true || value === 1) ? 1 : 0);
+                    }
+                }
+                
+                // Handle change-driven state deltas (relay/input bitmasks + sequence number)
+                if (data.type === 'state_delta') {
+                    const relayData = connectedRelays.get(macAddress);
+                    if (relayData) {
+                        if (Number.isInteger(relayData.stateSeq) && data.seq !== relayData.stateSeq + 1) {
+                            console.log(`[PORT 40000] Relay ${macAddress} state gap (expected seq ${relayData.stateSeq + 1}, got ${data.seq}), requesting resync`);
+                            sendToRelay(relayData, { type: 'resync' });
+                        }
+                        relayData.stateSeq = data.seq;
+                        relayData.relays = relayMaskToArray(relayData, data.relays, data.relay_banks);
+                    }
+                    await applyRelayInputs(macAddress, maskToArray(data.inputs));
+                }
+                
+                // Handle multi-relay command acks (one per relay_mask, carrying the resulting relay mask)
+                if (data.type === 'relay_mask_ack') {
+                    const relayData = connectedRelays.get(macAddress);
+                    if (data.success) {
+                        console.log(`[PORT 40000] Relay ${macAddress} mask applied: set 0x${data.set.toString(16)} clear 0x${data.clear.toString(16)} -> 0x${data.relays.toString(16)} (${data.latency_us}us)`);
+                        if (relayData) {
+                            relayData.relays = relayMaskToArray(relayData, data.relays, data.relay_banks);
+                        }
+                    } else {
+                        console.error(`[PORT 40000] Relay ${macAddress} mask command failed: ${data.error}`);
+                    }
+                }
+                
+                // Handle answers to correlated commands
+                if (data.type === 'command_response') {
+                    const relayData = connectedRelays.get(macAddress);
+                    if (relayData) {
+                        handleRelayCommandResponse(relayData, data);
+                    }
+                    if (!data.success) {
+                        console.error(`[PORT 40000] Relay ${macAddress} command ${data.commandId} failed: ${data.error}`);
+                    }
+                }
+                
+                // Handle on-device pulse/sequence progress (started, then completed/aborted/replaced/failed)
+                if (data.type === 'sequence_status') {
+                    const detail = data.error ? ` - ${data.error}` : '';
+                    console.log(`[PORT 40000] Relay ${macAddress} sequence ${data.id} ${data.status} after ${data.steps} steps (${data.elapsed_us}us)${detail}`);
+                }
+                
+                // Handle on-device workflow progress (started, steps, then completed/failed/aborted/replaced)
+                if (data.type === 'workflow_status') {
+                    const relayData = connectedRelays.get(macAddress);
+                    if (relayData) {
+                        const workflow = recordWorkflowStatus(relayData, data);
+                        const detail = data.error ? ` - ${data.error}` : '';
+                        const step = data.status === 'step' ? ` ${workflow.state} (${data.cause})` : '';
+                        console.log(`[PORT 40000] Relay ${macAddress} workflow ${data.id} ${data.status}${step} after ${data.elapsed_us}us${data.replay ? ' (replay)' : ''}${detail}`);
+                    }
+                }
+                
+                // Handle single relay acks; traced ones carry the device stage timestamps
+                if (data.type === 'relay_control_ack') {
+                    const relayData = connectedRelays.get(macAddress);
+                    const trace = relayData && relayData.latency ? relayData.latency.complete(data) : null;
+                    if (trace) {
+                        const s = trace.stages;
+                        console.log(`[PORT 40000] Relay ${macAddress} trace ${trace.trace}: total ${s.total}us = network ${s.network}us + parse ${s.parse}us + queue ${s.queue}us + i2c ${s.i2c}us + ack ${s.ack}us`);
+                    }
+                    if (!data.success) {
+                        console.error(`[PORT 40000] Relay ${macAddress} relay ${data.relay} command failed: ${data.error}`);
+                    }
+                }
+                
+                // Handle the device-side latency histograms (answer to a latency_stats request)
+                if (data.type === 'latency_stats') {
+                    const relayData = connectedRelays.get(macAddress);
+                    if (relayData) {
+                        relayData.deviceLatency = { window_s: data.window_s, stages: data.stages, received_at: Date.now() };
+                    }
+                }
+                
+                // Handle input capture progress and upload chunks
+                if (data.type === 'input_capture_status') {
+                    const relayData = connectedRelays.get(macAddress);
+                    if (!data.success) {
+                        console.error(`[PORT 40000] Relay ${macAddress} input capture: ${data.error}`);
+                    }
+                    if (relayData && data.success) {
+                        recordCaptureStatus(relayData, data);
+                    }
+                }
+                if (data.type === 'input_capture_chunk') {
+                    const relayData = connectedRelays.get(macAddress);
+                    if (relayData) {
+                        recordCaptureChunk(relayData, data);
+                    }
+                }
+                
+                // Handle heap metrics (answer to a heap_stats request)
+                if (data.type === 'heap_stats') {
+                    const relayData = connectedRelays.get(macAddress);
+                    if (relayData) {
+                        recordRelayHeap(relayData, data);
+                    }
+                }
+                
+                // Handle the runtime profile (answer to a stats request, or pushed every
+                // stats_interval seconds)
+                if (data.type === 'stats') {
+                    const relayData = connectedRelays.get(macAddress);
+                    if (relayData) {
+                        const { type, ...stats } = data;
+                        relayData.stats = { ...stats, received_at: Date.now() };
+                    }
+                    const io = data.tasks && data.tasks.io;
+                    if (io && io.late_us && io.late_us.p99 > RELAY_STATS_LATE_WARN_US) {
+                        console.warn(`[PORT 40000] Relay ${macAddress} I/O task runs late: p99 ${io.late_us.p99}us, max ${io.late_us.max}us`);
+                    }
+                }
+                
+                // Handle I2C driver counters (answer to an i2c_stats request)
+                if (data.type === 'i2c_stats') {
+                    const relayData = connectedRelays.get(macAddress);
+                    if (relayData) {
+                        const { type, ...stats } = data;
+                        relayData.i2cStats = { ...stats, received_at: Date.now() };
+                    }
+                }
+                
+                // Handle streamed device log records (enabled with a log_stream command)
+                if (data.type === 'log' && Array.isArray(data.lines)) {
+                    const relayData = connectedRelays.get(macAddress);
+                    for (const line of data.lines) {
+                        console.log(`[PORT 40000] Relay ${macAddress} log ${line.level} (${line.t}) ${line.msg}`);
+                    }
+                    if (relayData) {
+                        relayData.logs = (relayData.logs || []).concat(data.lines).slice(-RELAY_LOG_HISTORY);
+                    }
+                }
+                
+                // Handle interrupt-driven input edges (sent as soon as the device debounces them)
+                if (data.type === 'input_changed') {
+                    console.log(`[PORT 40000] Relay ${macAddress} input ${data.inputIndex} -> ${data.state} (device latency ${data.latency_us}us)`);
+                    
+                    const relayData = connectedRelays.get(macAddress);
+                    if (relayData && Number.isInteger(data.inputIndex) && data.inputIndex >= 0 && data.inputIndex < 8) {
+                        const inputs = (relayData.inputs || new Array(8).fill(0)).slice();
+                        inputs[data.inputIndex] = data.state ? 1 : 0;
+                        await applyRelayInputs(macAddress, inputs);
                     }
                 }
                 
@@ -5112,6 +5910,10 @@ relayWss.on('connection', async (ws, req) => {
         });
 
         ws.on('close', async () => {
+            if (standby) {
+                console.log(`[PORT 40000] Relay ${macAddress} hot-standby link closed`);
+                return;
+            }
             const relayData = connectedRelays.get(macAddress);
             const relayIP = relayData ? relayData.ip : 'unknown';
             console.log(`[PORT 40000] Relay disconnected: ${macAddress} from IP: ${relayIP}`);
@@ -5142,6 +5944,10 @@ relayWss.on('connection', async (ws, req) => {
         });
 
         ws.on('error', async (error) => {
+            if (standby) {
+                console.error(`[PORT 40000] Error on relay ${macAddress} hot-standby link:`, error);
+                return;
+            }
             const relayData = connectedRelays.get(macAddress);
             const relayIP = relayData ? relayData.ip : 'unknown';
             console.error(`[PORT 40000] Error with relay ${macAddress} from IP: ${relayIP}:`, error);
@@ -5180,19 +5986,25 @@ relayWss.on('connection', async (ws, req) => {
 // New API endpoint to send commands to a specific relay
 app.post('/api/relays/:mac/command', async (req, res) => {
     const { mac } = req.params;
-    const { command, type, relay, state } = req.body;
-
-    // Simple relay command - send relay number directly to ESP32
-    const messageToSend = {
-        type: 'relay_control',
-        relay: relay,  // Use relay number directly (0-7)
-        state: state
-    };
-
     const relayData = connectedRelays.get(mac);
+    let messageToSend;
+    try {
+        messageToSend = buildRelayCommand(req.body, relayData);
+    } catch (error) {
+        return res.status(400).json({ error: error.message });
+    }
 
     if (relayData && relayData.ws.readyState === WebSocket.OPEN) {
-        relayData.ws.send(JSON.stringify(messageToSend));
+        if (messageToSend.type === 'command') {
+            try {
+                const result = await sendRelayCommandAndWait(relayData, messageToSend);
+                res.status(200).json({ success: true, result: result });
+            } catch (error) {
+                res.status(502).json({ success: false, error: error.message });
+            }
+            return;
+        }
+        sendToRelay(relayData, messageToSend);
         res.status(200).json({ message: `Command '${messageToSend.type}' sent to relay ${mac} at IP: ${relayData.ip}` });
     } else {
         res.status(404).json({ error: `Relay with MAC address ${mac} not connected or not ready.` });
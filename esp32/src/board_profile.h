@@ -0,0 +1,86 @@
+// Board profiles: the hardware of each board the firmware ships for, fixed at compile time
+//
+// A profile is a constexpr descriptor - relay expanders (type and address), the input
+// pin map and polarity, the I2C and provisioning button pins - and platformio.ini picks
+// one per environment with -D RELAY_BOARD=<id>. The HAL and the relay setup read it as
+// constants: the input read compiles to a shift and a mask (or one bit test per pin,
+// unrolled, for a scattered pin map), and a board whose expanders are soldered on sets
+// them up without probing the bus.
+//
+// A profile without expanders (expanderCount 0) finds them at boot instead: I2C scan,
+// fast-boot cache and the "relay_banks" config, for expanders added on the bus.
+//
+//   RELAY_BOARD_S3_RELAY_8CH  Waveshare ESP32-S3-Relay-8CH as shipped: one TCA9554PWR at
+//                             0x20, inputs on GPIO 4-11, active low
+//   RELAY_BOARD_S3_RELAY_BUS  The same board with more TCA9554/TCA9555 on its I2C bus;
+//                             the default, and how the firmware ran before profiles
+//
+// A new board: add its id and descriptor below and an environment that selects it.
+
+#pragma once
+
+#include <stdint.h>
+#include "hal.h"
+#include "relay_protocol.h"
+
+enum ExpanderType : uint8_t {
+    EXPANDER_TCA9554,  // 8 channels (also the TCA9554A)
+    EXPANDER_TCA9555   // 16 channels
+};
+
+constexpr uint8_t expanderChannels(ExpanderType type) {
+    return type == EXPANDER_TCA9555 ? 16 : 8;
+}
+
+struct BoardExpander {
+    ExpanderType type;
+    uint8_t address;
+};
+
+struct BoardProfile {
+    const char* name;                     // Reported in register
+    int8_t i2cSda;
+    int8_t i2cScl;
+    int8_t provisionButton;               // Active low, -1 if the board has none
+    uint8_t inputPins[HAL_INPUT_COUNT];   // GPIO of input 0..7
+    bool inputsActiveLow;                 // Pulled up and active low, else pulled down
+    uint8_t expanderCount;                // 0 = find them at boot
+    BoardExpander expanders[RELAY_MAX_BANKS]; // Channel order
+};
+
+#define RELAY_BOARD_S3_RELAY_8CH 1
+#define RELAY_BOARD_S3_RELAY_BUS 2
+
+#ifndef RELAY_BOARD
+#define RELAY_BOARD RELAY_BOARD_S3_RELAY_BUS
+#endif
+
+#if RELAY_BOARD == RELAY_BOARD_S3_RELAY_8CH
+constexpr BoardProfile BOARD = {
+    "s3-relay-8ch", 42, 41, 0, {4, 5, 6, 7, 8, 9, 10, 11}, true, 1, {{EXPANDER_TCA9554, 0x20}}
+};
+#elif RELAY_BOARD == RELAY_BOARD_S3_RELAY_BUS
+constexpr BoardProfile BOARD = {
+    "s3-relay-bus", 42, 41, 0, {4, 5, 6, 7, 8, 9, 10, 11}, true, 0, {}
+};
+#else
+#error "Unknown RELAY_BOARD"
+#endif
+
+// Inputs from..7 sit on consecutive GPIOs, input 0 lowest
+constexpr bool boardInputsContiguous(const BoardProfile& board, uint8_t from = 1) {
+    return from >= HAL_INPUT_COUNT ||
+           (board.inputPins[from] == board.inputPins[from - 1] + 1 && boardInputsContiguous(board, from + 1));
+}
+
+// Some input from..7 is on GPIO 32 or above (the second input register on the ESP32)
+constexpr bool boardInputsHigh(const BoardProfile& board, uint8_t from = 0) {
+    return from < HAL_INPUT_COUNT && (board.inputPins[from] >= 32 || boardInputsHigh(board, from + 1));
+}
+
+constexpr uint16_t boardChannels(const BoardProfile& board, uint8_t from = 0) {
+    return from >= board.expanderCount ? 0 : expanderChannels(board.expanders[from].type) + boardChannels(board, from + 1);
+}
+
+static_assert(BOARD.expanderCount <= RELAY_MAX_BANKS, "board expanders must fit RelayBanks");
+static_assert(boardChannels(BOARD) <= RELAY_MAX_CHANNELS, "board channels must fit a RelayMask");
@@ -0,0 +1,96 @@
+// Recent command ids - at-most-once execution of "command" messages
+//
+// A sender numbers its commands with increasing ids (ESP32ElevatorController counts up
+// from 1) and may retransmit one with the same id when the response is lost. The
+// window remembers the outcome of the last COMMAND_WINDOW_SIZE ids:
+//  - an id above every id seen so far is new and gets executed;
+//  - an id still in the window is a retransmit: the recorded response is sent again,
+//    or nothing while the original is still executing (its response is on the way);
+//  - any other id is older than a command that already ran and is rejected as stale,
+//    so a delayed duplicate can never undo a newer command.
+// The window outlives reconnects, so a retransmit after a link drop is still caught. A
+// restarted sender learns lastId() from the stale rejection (and from register) and
+// continues above it.
+//
+// Not thread safe: network task only.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "relay_protocol.h"
+
+const uint8_t COMMAND_WINDOW_SIZE = 16;
+
+struct CommandRecord {
+    uint32_t id;          // 0 = free slot
+    bool done;            // Outcome known and response sent
+    RelayError error;
+    RelayMask relays;     // Relay outputs after the command
+    uint32_t latencyUs;   // Command receipt -> I2C write done
+};
+
+enum CommandCheck : uint8_t {
+    COMMAND_NEW,
+    COMMAND_IN_FLIGHT,  // Retransmit of a command still executing
+    COMMAND_REPLAY,     // Retransmit of a finished command
+    COMMAND_STALE
+};
+
+class CommandWindow {
+public:
+    CommandWindow() { reset(); }
+
+    void reset() {
+        memset(records_, 0, sizeof(records_));
+        lastId_ = 0;
+        duplicates_ = 0;
+        stale_ = 0;
+    }
+
+    // Classify id (> 0); record points at the stored outcome for retransmits
+    CommandCheck check(uint32_t id, const CommandRecord*& record) {
+        record = nullptr;
+        if (id > lastId_) {
+            return COMMAND_NEW;
+        }
+        const CommandRecord& slot = records_[id % COMMAND_WINDOW_SIZE];
+        if (slot.id == id) {
+            duplicates_++;
+            record = &slot;
+            return slot.done ? COMMAND_REPLAY : COMMAND_IN_FLIGHT;
+        }
+        stale_++;
+        return COMMAND_STALE;
+    }
+
+    // A COMMAND_NEW id starts executing
+    void begin(uint32_t id) {
+        CommandRecord& slot = records_[id % COMMAND_WINDOW_SIZE];
+        memset(&slot, 0, sizeof(slot));
+        slot.id = id;
+        lastId_ = id;
+    }
+
+    // Store the outcome (dropped if the id already left the window)
+    void complete(uint32_t id, RelayError error, RelayMask relays, uint32_t latencyUs) {
+        CommandRecord& slot = records_[id % COMMAND_WINDOW_SIZE];
+        if (slot.id != id) {
+            return;
+        }
+        slot.done = true;
+        slot.error = error;
+        slot.relays = relays;
+        slot.latencyUs = latencyUs;
+    }
+
+    uint32_t lastId() const { return lastId_; }
+    uint32_t duplicates() const { return duplicates_; }
+    uint32_t stale() const { return stale_; }
+
+private:
+    CommandRecord records_[COMMAND_WINDOW_SIZE]; // Indexed by id % COMMAND_WINDOW_SIZE
+    uint32_t lastId_;                            // Highest id seen
+    uint32_t duplicates_;
+    uint32_t stale_;
+};
@@ -0,0 +1,236 @@
+#include "config_store.h"
+#include <string.h>
+
+const uint32_t CONFIG_STORE_MAGIC = 0x47464352; // "RCFG"
+const uint8_t CONFIG_KEY_ERASED = 0xFF;
+
+static uint32_t align4(uint32_t value) {
+    return (value + 3) & ~(uint32_t)3;
+}
+
+// CRC-16/CCITT-FALSE
+uint16_t configCrc16(const uint8_t* data, size_t length, uint16_t crc) {
+    for (size_t i = 0; i < length; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+ConfigStore::ConfigStore(ConfigFlash& flash, const ConfigField* fields, uint8_t fieldCount)
+    : flash_(flash), fields_(fields), fieldCount_(fieldCount), size_(0), sector_(0), sequence_(0),
+      writeOffset_(0), needsCompaction_(true), loadedSchema_(0) {
+    memset(committed_, 0, sizeof(committed_));
+    memset(&stats_, 0, sizeof(stats_));
+}
+
+bool ConfigStore::load(void* image, size_t size) {
+    if (size > sizeof(committed_)) {
+        return false;
+    }
+    size_ = size;
+
+    // Newest valid sector wins
+    bool found = false;
+    SectorHeader newest;
+    for (uint8_t sector = 0; sector < HAL_CONFIG_SECTORS; sector++) {
+        SectorHeader header;
+        if (readHeader(sector, header) && (!found || header.sequence > newest.sequence)) {
+            newest = header;
+            sector_ = sector;
+            found = true;
+        }
+    }
+
+    if (!found) {
+        // Nothing on flash: the first commit writes a complete journal into sector 0
+        memcpy(committed_, image, size_);
+        sector_ = HAL_CONFIG_SECTORS - 1;
+        sequence_ = 0;
+        needsCompaction_ = true;
+        loadedSchema_ = 0;
+        return false;
+    }
+
+    memcpy(committed_, image, size_);
+    bool damaged = false;
+    writeOffset_ = replay(sector_, committed_, damaged);
+    memcpy(image, committed_, size_);
+    sequence_ = newest.sequence;
+    loadedSchema_ = newest.schema;
+    // A torn record or an older schema: rewrite the journal on the next commit
+    needsCompaction_ = damaged || newest.schema != CONFIG_STORE_SCHEMA;
+    stats_.usedBytes = writeOffset_;
+    stats_.sequence = sequence_;
+    stats_.sector = sector_;
+    return true;
+}
+
+bool ConfigStore::commit(const void* image) {
+    if (size_ == 0) {
+        return false; // load() first
+    }
+    const uint8_t* bytes = (const uint8_t*)image;
+    bool ok = true;
+    bool wrote = false;
+
+    if (needsCompaction_) {
+        ok = compact(bytes);
+        wrote = ok;
+    } else {
+        for (uint8_t i = 0; i < fieldCount_ && ok; i++) {
+            const ConfigField& f = fields_[i];
+            uint8_t length = storedLength(f, bytes);
+            if (length == storedLength(f, committed_) && memcmp(bytes + f.offset, committed_ + f.offset, length) == 0) {
+                continue;
+            }
+            wrote = true;
+            if (!appendRecord(f, bytes)) {
+                // Sector full (or a failed write): the fresh journal carries every field
+                ok = compact(bytes);
+            }
+        }
+    }
+
+    if (!ok) {
+        stats_.failures++;
+        return false;
+    }
+    if (wrote) {
+        stats_.commits++;
+        memcpy(committed_, bytes, size_);
+    }
+    stats_.usedBytes = writeOffset_;
+    stats_.sequence = sequence_;
+    stats_.sector = sector_;
+    return true;
+}
+
+bool ConfigStore::readHeader(uint8_t sector, SectorHeader& header) {
+    if (!flash_.read((uint32_t)sector * HAL_CONFIG_SECTOR_SIZE, &header, sizeof(header))) {
+        return false;
+    }
+    return header.magic == CONFIG_STORE_MAGIC &&
+           header.crc == configCrc16((const uint8_t*)&header, sizeof(header) - sizeof(header.crc));
+}
+
+// Apply every record of the sector to image; returns the offset after the last good one
+uint32_t ConfigStore::replay(uint8_t sector, uint8_t* image, bool& damaged) {
+    uint32_t base = (uint32_t)sector * HAL_CONFIG_SECTOR_SIZE;
+    uint32_t offset = sizeof(SectorHeader);
+    uint8_t value[255];
+
+    while (offset + sizeof(RecordHeader) <= HAL_CONFIG_SECTOR_SIZE) {
+        RecordHeader record;
+        if (!flash_.read(base + offset, &record, sizeof(record))) {
+            damaged = true;
+            break;
+        }
+        if (record.key == CONFIG_KEY_ERASED) {
+            break; // End of the journal
+        }
+        uint32_t next = offset + align4(sizeof(record) + record.length);
+        if (next > HAL_CONFIG_SECTOR_SIZE ||
+            !flash_.read(base + offset + sizeof(record), value, record.length) ||
+            record.crc != configCrc16(value, record.length, configCrc16(&record.key, 2))) {
+            damaged = true; // Torn write; nothing after it can be trusted
+            break;
+        }
+
+        const ConfigField* f = field(record.key);
+        if (f != nullptr) {
+            if (f->string && record.length < f->size) {
+                memcpy(image + f->offset, value, record.length);
+                memset(image + f->offset + record.length, 0, f->size - record.length);
+            } else if (!f->string && record.length == f->size) {
+                memcpy(image + f->offset, value, record.length);
+            }
+        }
+        offset = next;
+    }
+    return offset;
+}
+
+const ConfigField* ConfigStore::field(uint8_t key) const {
+    for (uint8_t i = 0; i < fieldCount_; i++) {
+        if (fields_[i].key == key) {
+            return &fields_[i];
+        }
+    }
+    return nullptr;
+}
+
+uint8_t ConfigStore::storedLength(const ConfigField& field, const uint8_t* image) const {
+    if (!field.string) {
+        return field.size;
+    }
+    const uint8_t* end = (const uint8_t*)memchr(image + field.offset, 0, field.size);
+    return end != nullptr ? (uint8_t)(end - (image + field.offset)) : field.size - 1;
+}
+
+bool ConfigStore::appendRecord(const ConfigField& field, const uint8_t* image) {
+    uint8_t length = storedLength(field, image);
+    uint32_t total = align4(sizeof(RecordHeader) + length);
+    if (writeOffset_ + total > HAL_CONFIG_SECTOR_SIZE) {
+        return false;
+    }
+
+    uint8_t buffer[sizeof(RecordHeader) + 255 + 3];
+    memset(buffer, 0xFF, total); // Padding stays erased
+    RecordHeader record = {field.key, length, 0};
+    record.crc = configCrc16(image + field.offset, length, configCrc16(&record.key, 2));
+    memcpy(buffer, &record, sizeof(record));
+    memcpy(buffer + sizeof(record), image + field.offset, length);
+
+    if (!flash_.write((uint32_t)sector_ * HAL_CONFIG_SECTOR_SIZE + writeOffset_, buffer, total)) {
+        needsCompaction_ = true; // Partially written record: never append after it
+        return false;
+    }
+    writeOffset_ += total;
+    stats_.records++;
+    stats_.bytes += total;
+    return true;
+}
+
+// Write every field into the other sector, then its header: the switch is atomic
+bool ConfigStore::compact(const uint8_t* image) {
+    uint8_t target = (sector_ + 1) % HAL_CONFIG_SECTORS;
+    if (!flash_.eraseSector(target)) {
+        return false;
+    }
+
+    uint8_t previousSector = sector_;
+    uint32_t previousOffset = writeOffset_;
+    sector_ = target;
+    writeOffset_ = sizeof(SectorHeader);
+    for (uint8_t i = 0; i < fieldCount_; i++) {
+        if (!appendRecord(fields_[i], image)) {
+            sector_ = previousSector;
+            writeOffset_ = previousOffset;
+            needsCompaction_ = true;
+            return false;
+        }
+    }
+
+    SectorHeader header;
+    header.magic = CONFIG_STORE_MAGIC;
+    header.sequence = sequence_ + 1;
+    header.schema = CONFIG_STORE_SCHEMA;
+    memset(header.reserved, 0xFF, sizeof(header.reserved));
+    header.crc = configCrc16((const uint8_t*)&header, sizeof(header) - sizeof(header.crc));
+    if (!flash_.write((uint32_t)target * HAL_CONFIG_SECTOR_SIZE, &header, sizeof(header))) {
+        sector_ = previousSector;
+        writeOffset_ = previousOffset;
+        needsCompaction_ = true;
+        return false;
+    }
+
+    sequence_ = header.sequence;
+    stats_.bytes += sizeof(header);
+    stats_.compactions++;
+    needsCompaction_ = false;
+    loadedSchema_ = CONFIG_STORE_SCHEMA;
+    return true;
+}
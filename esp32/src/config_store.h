@@ -0,0 +1,94 @@
+// Journaled key-value configuration store on raw flash
+//
+// The configuration image (a plain struct) is described by a field table. Every field
+// is stored as its own record - key, length, CRC-16, value - appended to the active
+// sector, so a commit only writes the fields that changed since the last load/commit
+// and consecutive commits spread over the whole sector instead of rewriting one spot.
+//
+// Two sectors are used as a double buffer. When the active one is full (or holds a
+// damaged record) the current values are written as a fresh journal into the other
+// sector, and only then is that sector's header - with a higher sequence number -
+// written. A power cut at any point leaves either the old or the new journal intact.
+//
+// Loading replays the sector with the newest valid header: the last record per key
+// wins, unknown keys are skipped and fields without a record keep the values already
+// in the image. Adding a field therefore needs no migration; when a key changes
+// meaning, bump the schema and convert in the caller after load() - the next commit
+// rewrites the journal in the current schema.
+//
+// Not thread safe: one task loads and commits.
+
+#pragma once
+
+#include "hal.h"
+
+const uint8_t CONFIG_STORE_SCHEMA = 1;
+const size_t CONFIG_STORE_IMAGE_MAX = 2560; // Largest supported image
+
+struct ConfigField {
+    uint8_t key;      // 1..254, never reused for a different meaning
+    uint16_t offset;  // In the image
+    uint8_t size;     // Bytes in the image
+    bool string;      // NUL terminated; only the used bytes are stored
+};
+
+struct ConfigStoreStats {
+    uint32_t commits;      // Commits that wrote something
+    uint32_t records;      // Records appended
+    uint32_t bytes;        // Bytes written, headers included
+    uint32_t compactions;  // Journal rewrites into the other sector
+    uint32_t failures;     // Commits that failed (flash error)
+    uint32_t usedBytes;    // Journal size in the active sector
+    uint32_t sequence;     // Active sector generation
+    uint8_t sector;
+};
+
+class ConfigStore {
+public:
+    ConfigStore(ConfigFlash& flash, const ConfigField* fields, uint8_t fieldCount);
+
+    // Replay the journal into image. False if there is no valid journal (image untouched).
+    bool load(void* image, size_t size);
+    uint8_t loadedSchema() const { return loadedSchema_; }
+
+    // Persist the fields of image that differ from the last load/commit
+    bool commit(const void* image);
+
+    const ConfigStoreStats& stats() const { return stats_; }
+
+private:
+    struct SectorHeader {
+        uint32_t magic;
+        uint32_t sequence;
+        uint8_t schema;
+        uint8_t reserved[5];
+        uint16_t crc;
+    };
+
+    struct RecordHeader {
+        uint8_t key;
+        uint8_t length;
+        uint16_t crc; // Over key, length and value
+    };
+
+    bool readHeader(uint8_t sector, SectorHeader& header);
+    uint32_t replay(uint8_t sector, uint8_t* image, bool& damaged);
+    const ConfigField* field(uint8_t key) const;
+    uint8_t storedLength(const ConfigField& field, const uint8_t* image) const;
+    bool appendRecord(const ConfigField& field, const uint8_t* image);
+    bool compact(const uint8_t* image);
+
+    ConfigFlash& flash_;
+    const ConfigField* fields_;
+    uint8_t fieldCount_;
+    size_t size_;
+    uint8_t committed_[CONFIG_STORE_IMAGE_MAX]; // Image as it is on flash
+    uint8_t sector_;
+    uint32_t sequence_;
+    uint32_t writeOffset_;
+    bool needsCompaction_;
+    uint8_t loadedSchema_;
+    ConfigStoreStats stats_;
+};
+
+uint16_t configCrc16(const uint8_t* data, size_t length, uint16_t crc = 0xFFFF);
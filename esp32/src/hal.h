@@ -0,0 +1,222 @@
+// Hardware abstraction layer
+//
+// The firmware logic (relay_app, the TCA9554 driver, logging, sequencing) reaches the
+// hardware and the network only through the functions below, so the same code builds
+// for two targets:
+//
+//   env:esp32dev  hal_esp32.cpp (clock, tasks, pins, I2C, console, config flash) and
+//                 main.cpp (WiFi + WebSocketsClient upstream link)
+//   env:native    host/ - Linux threads, a simulated TCA9554, simulated input pins and
+//                 a local WebSocket stand-in server (see host/host_main.cpp)
+//
+// Keep it thin: anything that is not a hardware or OS primitive belongs in the logic.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef RELAY_HOST_BUILD
+#include <atomic>
+#define HAL_IRAM_ATTR
+#define HAL_DRAM_ATTR
+#else
+#include <Arduino.h>
+#define HAL_IRAM_ATTR IRAM_ATTR
+#define HAL_DRAM_ATTR DRAM_ATTR
+#endif
+
+const int64_t HAL_NEVER = INT64_MAX;
+
+// Console, storage and buses; first call in setup
+void halBegin();
+
+// Clock
+int64_t halMicros(); // Monotonic, safe from interrupt handlers
+uint32_t halMillis();
+void halDelayMs(uint32_t ms);
+void halDelayUs(uint32_t us);
+uint32_t halRandom(); // Hardware RNG on the ESP32; for jitter, not for keys
+
+// Tasks. Each HalTask has one notification slot: halNotify() from any task or
+// halNotifyFromIsr() from an interrupt handler wakes the task blocked in halWait().
+enum HalTask : uint8_t {
+    HAL_TASK_IO,
+    HAL_TASK_NET,
+    HAL_TASK_LOG,
+    HAL_TASK_CONFIG,
+    HAL_TASK_COUNT
+};
+
+void halStartTask(HalTask task, const char* name, void (*entry)(), uint32_t stackSize, uint8_t priority, int core);
+void halNotify(HalTask task); // No-op until the task is started
+void halNotifyFromIsr(HalTask task);
+void halWait(HalTask self, uint32_t timeoutMs); // Until notified, timed out or woken by halWakeAt
+void halWakeAt(HalTask task, int64_t deadlineUs); // One-shot, replaces the previous deadline; HAL_NEVER cancels
+int halCoreId();
+uint32_t halTaskStackFree(HalTask task); // Least free stack since start, bytes; 0 if unknown or not started
+
+// Short critical section, usable from tasks and interrupt handlers
+class HalLock {
+public:
+#ifdef RELAY_HOST_BUILD
+    void lock() const {
+        while (flag_.test_and_set(std::memory_order_acquire)) {
+        }
+    }
+    void unlock() const { flag_.clear(std::memory_order_release); }
+
+private:
+    mutable std::atomic_flag flag_ = ATOMIC_FLAG_INIT;
+#else
+    void lock() const { portENTER_CRITICAL_SAFE(&mux_); }
+    void unlock() const { portEXIT_CRITICAL_SAFE(&mux_); }
+
+private:
+    mutable portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+#endif
+};
+
+// Inputs: the 8 pins of the board profile (board_profile.h). Bit i of halReadInputs() is
+// set while input i is active. onChange(i) runs in interrupt context on every level
+// change of input i.
+const uint8_t HAL_INPUT_COUNT = 8;
+void halInputsBegin(void (*onChange)(uint8_t index));
+uint8_t halReadInputs();
+
+// Periodic sampler for input capture: onSample runs in interrupt context every periodUs
+// (a hardware timer on the ESP32, on the core that starts it). One sampler; starting
+// it again replaces the previous one.
+bool halSamplerStart(uint32_t periodUs, void (*onSample)());
+void halSamplerStop();
+
+// I2C master. Status codes follow Wire::endTransmission(): 0 ok, 2 address NACK,
+// 3 data NACK, 4 other bus error, 5 timeout.
+class I2cBus {
+public:
+    virtual ~I2cBus() {}
+    virtual void begin(uint32_t clockHz, uint16_t timeoutMs) = 0;
+    virtual void setClock(uint32_t clockHz) = 0;
+    virtual uint8_t write(uint8_t address, const uint8_t* data, size_t length) = 0;
+    // Write reg, repeated start, read length bytes
+    virtual uint8_t readRegisters(uint8_t address, uint8_t reg, uint8_t* data, size_t length) = 0;
+    // Clock SCL until a stuck device releases SDA, issue a STOP and restart the bus.
+    // Returns whether SDA is released.
+    virtual bool recover() = 0;
+};
+
+I2cBus& halRelayBus();
+
+// Serial console
+void halConsoleWrite(const char* data, size_t length);
+bool halConsoleReadLine(char* line, size_t capacity); // Non-blocking; true once a whole line arrived
+const size_t HAL_CONSOLE_LINE_MAX = 2560; // Longest line kept: a config line with a pinned CA
+// True if the installer asked for the serial provisioning window at boot (BOOT button
+// held or a serial break on the ESP32); configured boards otherwise go straight online
+bool halProvisioningRequested();
+
+// Configuration flash: HAL_CONFIG_SECTORS erase sectors of HAL_CONFIG_SECTOR_SIZE bytes
+// (the "relaycfg" partition on the ESP32). NOR semantics: erased bytes read 0xFF and a
+// write can only clear bits. Erasing takes tens of milliseconds and stalls code running
+// from flash on both cores, so only the config task (config_store.h) touches it.
+const uint32_t HAL_CONFIG_SECTOR_SIZE = 4096;
+const uint8_t HAL_CONFIG_SECTORS = 2;
+
+class ConfigFlash {
+public:
+    virtual ~ConfigFlash() {}
+    virtual bool read(uint32_t address, void* data, size_t length) = 0;
+    virtual bool write(uint32_t address, const void* data, size_t length) = 0;
+    virtual bool eraseSector(uint8_t sector) = 0;
+};
+
+ConfigFlash& halConfigFlash();
+
+// Configuration blob written by firmware before the journaled store; read once to import
+void halLegacyConfigLoad(void* data, size_t size);
+
+// Upstream link (WiFi + WebSocket on the device, a TCP WebSocket client on the host),
+// with a hot standby connection to the next endpoint when backups are configured
+// (UpstreamFailover in link_health.h). Link events are delivered to appOnLink*()
+// (relay_app.h) from halNetworkLoop().
+void halNetworkBegin();   // Connect with the current config; non-blocking
+void halNetworkLoop();    // Service the link and reconnects; network task only
+void halNetworkRestart(); // Drop the link and reconnect with a changed config
+// halWait(HAL_TASK_NET) that also returns as soon as a link has received data, so a
+// frame is handled when it arrives rather than on the next poll; network task only
+void halNetworkWait(uint32_t timeoutMs);
+// Outbound frames are built in a buffer with HAL_LINK_HEADROOM reserved bytes in front
+// of the payload; the link writes the WebSocket header there and masks in place, so a
+// send needs no copy and no heap allocation. The whole buffer may be modified.
+const size_t HAL_LINK_HEADROOM = 14; // Largest WebSocket frame header
+
+// LAN server: WebSocket clients on the local network (port HAL_LAN_PORT on the device)
+// that control the relays directly, next to the upstream link. A link set is a bit mask:
+// HAL_LINK_UPSTREAM, plus halLanLink(n) for LAN client slot n.
+typedef uint8_t HalLinks;
+const HalLinks HAL_LINK_UPSTREAM = 0x01;
+const uint8_t HAL_LAN_CLIENTS = 3;
+const uint16_t HAL_LAN_PORT = 81;
+const HalLinks HAL_LINK_LAN = ((1 << HAL_LAN_CLIENTS) - 1) << 1;
+inline HalLinks halLanLink(uint8_t client) { return (HalLinks)(0x02 << client); }
+void halLanServe(bool enabled);       // Accept LAN clients while WiFi is up
+void halLinkClose(HalLinks links);    // Drop LAN clients (the upstream link reconnects on its own)
+
+// Send one frame to every link in links; frame: headroom + length payload bytes. The
+// upstream frame is masked in place, so it goes out last.
+bool halLinkSendFrame(uint8_t* frame, size_t length, bool binary, HalLinks links);
+const char* halMacAddress(); // "AA:BB:CC:DD:EE:FF"
+const char* halIpAddress();  // Dotted quad, empty while offline
+
+struct HalLinkStats {
+    uint32_t rttUs;        // Last ping/pong round trip (0 until measured)
+    uint32_t avgRttUs;     // Smoothed round trip
+    uint32_t reconnects;   // Upstream connections after the first one since boot
+    uint32_t lastOutageMs; // Link down -> up for the most recent reconnect
+    int8_t endpoint;       // Active upstream endpoint (0 = server_host, then the backups)
+    uint32_t switches;     // Moves to the hot standby link
+    bool tls;              // Active link is wss (a full handshake on every connect)
+    uint32_t connectMs;    // Longest network task stall bringing the active link up (TCP, TLS, upgrade)
+    int32_t connectHeapBytes; // Heap the active link took on while connecting (TLS session and buffers)
+    int8_t rssi;           // WiFi signal, dBm; 0 while WiFi is down
+    uint32_t wifiDrops;    // WiFi connections lost since boot
+};
+HalLinkStats halLinkStats(); // Network task only
+
+// Fixed transmit buffer for one message type: payload() is where the message goes
+template <size_t N>
+struct LinkTxBuffer {
+    static const size_t CAPACITY = N;
+    uint8_t frame[HAL_LINK_HEADROOM + N];
+    uint8_t* payload() { return frame + HAL_LINK_HEADROOM; }
+    char* text() { return (char*)frame + HAL_LINK_HEADROOM; }
+};
+
+// Power state (network task). HAL_POWER_ACTIVE: CPU clocked and the WiFi radio always
+// listening - how the firmware ran before power saving. HAL_POWER_IDLE: the chip
+// light-sleeps whenever every task is blocked and WiFi is in modem sleep, waking for
+// each DTIM beacon of the AP; an input edge wakes the chip at once, a frame from the
+// server arrives with the next DTIM beacon (the AP buffers it until then). Returns
+// false if the build cannot light-sleep; modem sleep still applies then.
+enum HalPowerState : uint8_t {
+    HAL_POWER_ACTIVE,
+    HAL_POWER_IDLE
+};
+bool halPowerSet(HalPowerState state);
+
+// Heap (8-bit capable RAM on the ESP32; the main arena on the host)
+struct HalHeapStats {
+    uint32_t freeBytes;
+    uint32_t minFreeBytes;  // Low-water mark since boot
+    uint32_t largestBlock;  // Largest single allocation possible (fragmentation); 0 if unknown
+    uint32_t usedBytes;
+};
+HalHeapStats halHeapStats();
+
+// Large buffers that live until reboot (capture). External memory is the PSRAM of
+// boards that have one; nullptr if the memory is missing or too full.
+enum HalMemory : uint8_t {
+    HAL_MEMORY_INTERNAL,
+    HAL_MEMORY_EXTERNAL
+};
+void* halAlloc(size_t size, HalMemory memory);
@@ -0,0 +1,483 @@
+// ESP32 implementation of the HAL: clock, FreeRTOS tasks, input pins, I2C, console,
+// config flash and power management. The WiFi/WebSocket link lives in main.cpp.
+
+#include "hal.h"
+#include "board_profile.h"
+#include <Wire.h>
+#include <EEPROM.h>
+#include <WiFi.h>
+#include <esp_timer.h>
+#include <esp_partition.h>
+#include <esp_heap_caps.h>
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#include <esp_vfs_eventfd.h>
+#include <sys/select.h>
+#include <unistd.h>
+#include <hal/gpio_ll.h>
+#include <soc/soc.h>
+#include <soc/gpio_reg.h>
+#include <soc/gpio_struct.h>
+
+#define EEPROM_SIZE 512 // Legacy configuration blob, imported once into the config store
+
+// Config store partition (partitions.csv)
+#define CONFIG_PARTITION_LABEL "relaycfg"
+#define CONFIG_PARTITION_SUBTYPE 0x40
+
+// Pins come from the board profile (board_profile.h). The provisioning button is the
+// BOOT button on the S3 boards: pressed just after reset - not during it, which selects
+// the ROM download mode - it asks for the provisioning window.
+
+// Input pins by index, for the edge ISR - kept in DRAM because it runs with the cache off
+static_assert(HAL_INPUT_COUNT == 8, "INPUT_PINS lists eight inputs");
+DRAM_ATTR static const int INPUT_PINS[HAL_INPUT_COUNT] = {
+    BOARD.inputPins[0], BOARD.inputPins[1], BOARD.inputPins[2], BOARD.inputPins[3],
+    BOARD.inputPins[4], BOARD.inputPins[5], BOARD.inputPins[6], BOARD.inputPins[7]
+};
+
+static TaskHandle_t taskHandles[HAL_TASK_COUNT] = {nullptr};
+static esp_timer_handle_t wakeTimers[HAL_TASK_COUNT] = {nullptr};
+static volatile int notifyFds[HAL_TASK_COUNT] = {-1, -1, -1, -1}; // eventfd of a task waiting in select()
+DRAM_ATTR static void (*inputChangeHandler)(uint8_t index) = nullptr;
+static volatile bool serialBreakSeen = false;
+
+static void onSerialError(hardwareSerial_error_t error) {
+    if (error == UART_BREAK_ERROR) {
+        serialBreakSeen = true;
+    }
+}
+
+// No settle delay: the logs are buffered, so nothing is lost before a monitor attaches
+void halBegin() {
+    Serial.begin(115200);
+    Serial.onReceiveError(onSerialError);
+    if (BOARD.provisionButton >= 0) {
+        pinMode(BOARD.provisionButton, INPUT_PULLUP);
+    }
+    EEPROM.begin(EEPROM_SIZE);
+}
+
+int64_t IRAM_ATTR halMicros() {
+    return esp_timer_get_time();
+}
+
+uint32_t halMillis() {
+    return millis();
+}
+
+void halDelayMs(uint32_t ms) {
+    delay(ms);
+}
+
+void halDelayUs(uint32_t us) {
+    delayMicroseconds(us);
+}
+
+uint32_t halRandom() {
+    return esp_random();
+}
+
+HalHeapStats halHeapStats() {
+    HalHeapStats stats;
+    stats.freeBytes = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    stats.minFreeBytes = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    stats.largestBlock = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    stats.usedBytes = heap_caps_get_total_size(MALLOC_CAP_8BIT) - stats.freeBytes;
+    return stats;
+}
+
+static void taskEntry(void* param) {
+    ((void (*)())param)();
+    vTaskDelete(nullptr);
+}
+
+void halStartTask(HalTask task, const char* name, void (*entry)(), uint32_t stackSize, uint8_t priority, int core) {
+    xTaskCreatePinnedToCore(taskEntry, name, stackSize, (void*)entry, priority, &taskHandles[task], core);
+}
+
+uint32_t halTaskStackFree(HalTask task) {
+    return taskHandles[task] != nullptr ? uxTaskGetStackHighWaterMark(taskHandles[task]) : 0; // Bytes on ESP-IDF
+}
+
+void halNotify(HalTask task) {
+    if (taskHandles[task] != nullptr) {
+        xTaskNotifyGive(taskHandles[task]);
+    }
+    int fd = notifyFds[task];
+    if (fd >= 0) {
+        uint64_t one = 1;
+        write(fd, &one, sizeof(one));
+    }
+}
+
+void IRAM_ATTR halNotifyFromIsr(HalTask task) {
+    if (taskHandles[task] == nullptr) {
+        return;
+    }
+    BaseType_t higherPriorityTaskWoken = pdFALSE;
+    vTaskNotifyGiveFromISR(taskHandles[task], &higherPriorityTaskWoken);
+    if (higherPriorityTaskWoken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+void halWait(HalTask self, uint32_t timeoutMs) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(timeoutMs));
+}
+
+// halWait() in select(): the task's notifications also go to an eventfd, so a readable
+// socket and halNotify() both end the wait (main.cpp, network task). halNotifyFromIsr()
+// only reaches the task slot; no interrupt handler notifies the network task.
+void halWaitReadable(HalTask self, const int* fds, size_t count, uint32_t timeoutMs) {
+    static bool eventfdTried = false;
+    if (!eventfdTried) {
+        eventfdTried = true;
+        esp_vfs_eventfd_config_t eventfdConfig = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+        if (esp_vfs_eventfd_register(&eventfdConfig) == ESP_OK) {
+            notifyFds[self] = eventfd(0, 0);
+        }
+    }
+    int notifyFd = notifyFds[self];
+    if (notifyFd < 0) {
+        halWait(self, timeoutMs);
+        return;
+    }
+    
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(notifyFd, &readable);
+    int maxFd = notifyFd;
+    for (size_t i = 0; i < count; i++) {
+        FD_SET(fds[i], &readable);
+        maxFd = fds[i] > maxFd ? fds[i] : maxFd;
+    }
+    // Only check the sockets if a notification is already in the task slot (given before
+    // the eventfd existed, or just as the last wait ended)
+    struct timeval timeout = {0, 0};
+    if (ulTaskNotifyTake(pdTRUE, 0) == 0) {
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_usec = (timeoutMs % 1000) * 1000;
+    }
+    if (select(maxFd + 1, &readable, nullptr, nullptr, &timeout) > 0 && FD_ISSET(notifyFd, &readable)) {
+        uint64_t value;
+        read(notifyFd, &value, sizeof(value));
+    }
+    ulTaskNotifyTake(pdTRUE, 0); // Given along with the eventfd write
+}
+
+// esp_timer callback (timer task): hand the deadline to the task
+static void onWakeTimer(void* arg) {
+    halNotify((HalTask)(uintptr_t)arg);
+}
+
+void halWakeAt(HalTask task, int64_t deadlineUs) {
+    if (wakeTimers[task] == nullptr) {
+        if (deadlineUs == HAL_NEVER) {
+            return;
+        }
+        esp_timer_create_args_t timerArgs = {};
+        timerArgs.callback = onWakeTimer;
+        timerArgs.arg = (void*)(uintptr_t)task;
+        timerArgs.dispatch_method = ESP_TIMER_TASK;
+        timerArgs.name = "hal_wake";
+        esp_timer_create(&timerArgs, &wakeTimers[task]);
+    }
+    esp_timer_stop(wakeTimers[task]);
+    if (deadlineUs != HAL_NEVER) {
+        int64_t delayUs = deadlineUs - esp_timer_get_time();
+        esp_timer_start_once(wakeTimers[task], delayUs > 0 ? (uint64_t)delayUs : 0);
+    }
+}
+
+int halCoreId() {
+    return xPortGetCoreID();
+}
+
+// The GPIO edge detector does not run in light sleep, and only level interrupts wake the
+// chip. While the board may sleep, each input is level-triggered on the opposite of its
+// current level instead, and the handler re-arms it for the next change - the same
+// CHANGE semantics, awake or asleep.
+DRAM_ATTR static volatile bool inputWakeArmed = false;
+DRAM_ATTR static portMUX_TYPE inputWakeMux = portMUX_INITIALIZER_UNLOCKED;
+
+static inline void IRAM_ATTR armInputWake(int pin) {
+    gpio_int_type_t next = gpio_ll_get_level(&GPIO, (gpio_num_t)pin) ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL;
+    gpio_ll_wakeup_enable(&GPIO, (gpio_num_t)pin, next);
+}
+
+static void IRAM_ATTR onInputInterrupt(void* arg) {
+    uint8_t index = (uint8_t)(uintptr_t)arg;
+    portENTER_CRITICAL_SAFE(&inputWakeMux);
+    if (inputWakeArmed) {
+        armInputWake(INPUT_PINS[index]);
+    }
+    portEXIT_CRITICAL_SAFE(&inputWakeMux);
+    inputChangeHandler(index);
+}
+
+void halInputsBegin(void (*onChange)(uint8_t index)) {
+    inputChangeHandler = onChange;
+    for (uint8_t i = 0; i < HAL_INPUT_COUNT; i++) {
+        pinMode(INPUT_PINS[i], BOARD.inputsActiveLow ? INPUT_PULLUP : INPUT_PULLDOWN);
+        attachInterruptArg(INPUT_PINS[i], onInputInterrupt, (void*)(uintptr_t)i, CHANGE);
+    }
+}
+
+// Bit I of the levels from the GPIO of input I, unrolled at compile time: every pin
+// number is an immediate, so the read needs no table (the sampler runs it at 10 kHz)
+template <uint8_t I>
+struct InputBits {
+    static constexpr uint8_t PIN = BOARD.inputPins[I];
+    static inline uint8_t IRAM_ATTR gather(uint32_t low, uint32_t high) {
+        return (uint8_t)((((PIN < 32 ? low : high) >> (PIN & 31)) & 1) << I) | InputBits<I - 1>::gather(low, high);
+    }
+};
+
+template <>
+struct InputBits<0> {
+    static constexpr uint8_t PIN = BOARD.inputPins[0];
+    static inline uint8_t IRAM_ATTR gather(uint32_t low, uint32_t high) {
+        return (uint8_t)(((PIN < 32 ? low : high) >> (PIN & 31)) & 1);
+    }
+};
+
+// One register read for all eight pins; a run of consecutive pins is a single shift
+uint8_t IRAM_ATTR halReadInputs() {
+    const uint8_t first = BOARD.inputPins[0];
+    uint8_t levels;
+    if (boardInputsContiguous(BOARD) && first + HAL_INPUT_COUNT <= 32) {
+        levels = (uint8_t)(REG_READ(GPIO_IN_REG) >> first);
+    } else {
+        levels = InputBits<HAL_INPUT_COUNT - 1>::gather(REG_READ(GPIO_IN_REG),
+                                                       boardInputsHigh(BOARD) ? REG_READ(GPIO_IN1_REG) : 0);
+    }
+    return BOARD.inputsActiveLow ? (uint8_t)~levels : levels;
+}
+
+// Automatic light sleep needs CONFIG_PM_ENABLE and tickless idle in the framework build;
+// without them esp_pm_configure() fails and only WiFi modem sleep saves power. The CPU
+// keeps its full clock (min = max): the idle time is spent asleep, and a task that runs
+// after a wake runs exactly as fast as before. HAL_POWER_ACTIVE holds a no-light-sleep lock.
+static esp_pm_lock_handle_t activeLock = nullptr;
+static bool lightSleepAvailable = false;
+
+bool halPowerSet(HalPowerState state) {
+    if (activeLock == nullptr) {
+        esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "active", &activeLock);
+        esp_pm_lock_acquire(activeLock);
+        esp_pm_config_esp32s3_t pmConfig = {};
+        pmConfig.max_freq_mhz = getCpuFrequencyMhz();
+        pmConfig.min_freq_mhz = pmConfig.max_freq_mhz;
+        pmConfig.light_sleep_enable = true;
+        lightSleepAvailable = esp_pm_configure(&pmConfig) == ESP_OK;
+        esp_sleep_enable_gpio_wakeup();
+    }
+    
+    bool idle = state == HAL_POWER_IDLE;
+    if (idle != inputWakeArmed) {
+        // Inputs first: once the lock is released the chip may sleep
+        portENTER_CRITICAL(&inputWakeMux);
+        inputWakeArmed = idle;
+        for (uint8_t i = 0; i < HAL_INPUT_COUNT; i++) {
+            if (idle) {
+                armInputWake(INPUT_PINS[i]);
+            } else {
+                gpio_ll_wakeup_disable(&GPIO, (gpio_num_t)INPUT_PINS[i]);
+                gpio_ll_set_intr_type(&GPIO, (gpio_num_t)INPUT_PINS[i], GPIO_INTR_ANYEDGE);
+            }
+        }
+        portEXIT_CRITICAL(&inputWakeMux);
+        if (idle) {
+            esp_pm_lock_release(activeLock);
+        } else {
+            esp_pm_lock_acquire(activeLock);
+        }
+    }
+    // Minimum modem sleep wakes the radio for every DTIM beacon, whatever the AP's period
+    WiFi.setSleep(idle ? WIFI_PS_MIN_MODEM : WIFI_PS_NONE);
+    return lightSleepAvailable;
+}
+
+// Input capture sampler: a general-purpose hardware timer ticking at 1 MHz (APB / 80)
+#define SAMPLER_TIMER 0
+static hw_timer_t* samplerTimer = nullptr;
+DRAM_ATTR static void (*samplerHandler)() = nullptr;
+
+static void IRAM_ATTR onSamplerTimer() {
+    samplerHandler();
+}
+
+bool halSamplerStart(uint32_t periodUs, void (*onSample)()) {
+    halSamplerStop();
+    samplerHandler = onSample;
+    samplerTimer = timerBegin(SAMPLER_TIMER, 80, true);
+    if (samplerTimer == nullptr) {
+        return false;
+    }
+    timerAttachInterrupt(samplerTimer, onSamplerTimer, true);
+    timerAlarmWrite(samplerTimer, periodUs, true);
+    timerAlarmEnable(samplerTimer);
+    return true;
+}
+
+void halSamplerStop() {
+    if (samplerTimer == nullptr) {
+        return;
+    }
+    timerAlarmDisable(samplerTimer);
+    timerDetachInterrupt(samplerTimer);
+    timerEnd(samplerTimer);
+    samplerTimer = nullptr;
+}
+
+void* halAlloc(size_t size, HalMemory memory) {
+    return heap_caps_malloc(size, memory == HAL_MEMORY_EXTERNAL ? MALLOC_CAP_SPIRAM : MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
+
+// Wire on the relay expander pins
+class WireI2cBus : public I2cBus {
+public:
+    WireI2cBus(TwoWire& wire, int sdaPin, int sclPin) : wire_(wire), sdaPin_(sdaPin), sclPin_(sclPin) {}
+
+    void begin(uint32_t clockHz, uint16_t timeoutMs) override {
+        clockHz_ = clockHz;
+        timeoutMs_ = timeoutMs;
+        wire_.begin(sdaPin_, sclPin_, clockHz);
+        wire_.setTimeOut(timeoutMs);
+    }
+
+    void setClock(uint32_t clockHz) override {
+        clockHz_ = clockHz;
+        wire_.setClock(clockHz);
+    }
+
+    uint8_t write(uint8_t address, const uint8_t* data, size_t length) override {
+        wire_.beginTransmission(address);
+        wire_.write(data, length);
+        return wire_.endTransmission();
+    }
+
+    uint8_t readRegisters(uint8_t address, uint8_t reg, uint8_t* data, size_t length) override {
+        wire_.beginTransmission(address);
+        wire_.write(reg);
+        uint8_t error = wire_.endTransmission(false); // Repeated start
+        if (error != 0) {
+            return error;
+        }
+        if (wire_.requestFrom((int)address, (int)length) != (int)length) {
+            return 4;
+        }
+        for (size_t i = 0; i < length; i++) {
+            data[i] = wire_.read();
+        }
+        return 0;
+    }
+
+    bool recover() override {
+        wire_.end();
+
+        // Up to nine clocks let a device that is stuck mid-byte finish it and release SDA
+        pinMode(sdaPin_, INPUT_PULLUP);
+        pinMode(sclPin_, OUTPUT_OPEN_DRAIN);
+        digitalWrite(sclPin_, HIGH);
+        delayMicroseconds(5);
+        for (int i = 0; i < 9 && digitalRead(sdaPin_) == LOW; i++) {
+            digitalWrite(sclPin_, LOW);
+            delayMicroseconds(5);
+            digitalWrite(sclPin_, HIGH);
+            delayMicroseconds(5);
+        }
+
+        // STOP condition: SDA rises while SCL is high
+        pinMode(sdaPin_, OUTPUT_OPEN_DRAIN);
+        digitalWrite(sdaPin_, LOW);
+        delayMicroseconds(5);
+        digitalWrite(sclPin_, HIGH);
+        delayMicroseconds(5);
+        digitalWrite(sdaPin_, HIGH);
+        delayMicroseconds(5);
+        pinMode(sdaPin_, INPUT_PULLUP);
+        bool released = digitalRead(sdaPin_) == HIGH;
+
+        begin(clockHz_, timeoutMs_);
+        return released;
+    }
+
+private:
+    TwoWire& wire_;
+    int sdaPin_;
+    int sclPin_;
+    uint32_t clockHz_ = 400000;
+    uint16_t timeoutMs_ = 10;
+};
+
+I2cBus& halRelayBus() {
+    static WireI2cBus bus(Wire, BOARD.i2cSda, BOARD.i2cScl);
+    return bus;
+}
+
+void halConsoleWrite(const char* data, size_t length) {
+    Serial.write((const uint8_t*)data, length);
+}
+
+bool halConsoleReadLine(char* line, size_t capacity) {
+    static char pending[HAL_CONSOLE_LINE_MAX];
+    static size_t length = 0;
+    while (Serial.available()) {
+        char c = Serial.read();
+        if (c == '\n') {
+            size_t copied = length < capacity - 1 ? length : capacity - 1;
+            memcpy(line, pending, copied);
+            line[copied] = '\0';
+            length = 0;
+            return true;
+        }
+        if (length < sizeof(pending)) {
+            pending[length++] = c;
+        }
+    }
+    return false;
+}
+
+bool halProvisioningRequested() {
+    return serialBreakSeen || (BOARD.provisionButton >= 0 && digitalRead(BOARD.provisionButton) == LOW);
+}
+
+// Raw flash behind the journaled config store: the "relaycfg" partition (partitions.csv)
+class PartitionConfigFlash : public ConfigFlash {
+public:
+    bool read(uint32_t address, void* data, size_t length) override {
+        return partition() != nullptr && esp_partition_read(partition_, address, data, length) == ESP_OK;
+    }
+
+    bool write(uint32_t address, const void* data, size_t length) override {
+        return partition() != nullptr && esp_partition_write(partition_, address, data, length) == ESP_OK;
+    }
+
+    bool eraseSector(uint8_t sector) override {
+        return partition() != nullptr &&
+               esp_partition_erase_range(partition_, (size_t)sector * HAL_CONFIG_SECTOR_SIZE, HAL_CONFIG_SECTOR_SIZE) == ESP_OK;
+    }
+
+private:
+    const esp_partition_t* partition() {
+        if (partition_ == nullptr) {
+            partition_ = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)CONFIG_PARTITION_SUBTYPE,
+                                                  CONFIG_PARTITION_LABEL);
+        }
+        return partition_;
+    }
+
+    const esp_partition_t* partition_ = nullptr;
+};
+
+static PartitionConfigFlash configFlash;
+
+ConfigFlash& halConfigFlash() {
+    return configFlash;
+}
+
+void halLegacyConfigLoad(void* data, size_t size) {
+    EEPROM.readBytes(0, data, size);
+}
@@ -0,0 +1,1239 @@
+// Fleet load generator (host build): many simulated relay boards against a real backend
+//
+//   relay_fleet --server HOST:PORT [options]
+//
+// Every board keeps its own WebSocket to /elevator?id=<MAC> and speaks the firmware's
+// upstream protocol: register (offering bin1) and a full state on connect, state_delta on
+// every change and a keyframe every 30 s, input_changed for simulated input edges, pings
+// every second with the firmware's heartbeat and reconnect backoff (link_health.h).
+// relay_control, relay_mask and "command" are answered once the simulated TCA9554 write
+// is done - one write at a time at 400 kHz, behind a 16-entry queue like the I/O task -
+// and command ids go through the firmware's CommandWindow.
+//
+// While the boards run, HTTP clients post commands to the backend's
+// POST /api/relays/:mac/command (server port 3000) and time them, and boards are dropped
+// at a set rate to measure connection churn.
+//
+// Options: --boards N            simulated boards (default 100)
+//          --http HOST:PORT      backend HTTP API (default the --server host, port 3000)
+//          --duration S          measurement window after the ramp (default 60)
+//          --ramp N              board connects started per second (default 200)
+//          --rate N              HTTP commands per second across the fleet (default 50)
+//          --http-clients N      concurrent HTTP clients (default 8)
+//          --mode command|relay  "command" set_relay waits for the board's command_response
+//                                (full round trip); "relay" is answered once forwarded
+//          --churn N             boards dropped per second (default 0)
+//          --edge-interval-ms N  mean time between input edges per board (default 10000, 0 off)
+//          --protocol json|bin1  bin1 (default) offers bin_version like the firmware
+//          --ca FILE             wss, pinning the PEM in FILE; a full handshake per connect, as
+//                                the firmware does
+//          --tls-resume          boards resume their own TLS session on reconnect instead
+//          --threads N           board threads (default: one per core)
+//          --dialers N           threads doing the blocking connects (default 4)
+//          --no-bus-timing       answer without the simulated I2C write time
+//
+// Connect and register_ack times cover the ramp as well as churn; everything else only
+// the measurement window. HTTP round trips are timed from when each request was due, so a
+// backend that falls behind shows up in the percentiles rather than in a lower send rate.
+// Exits non-zero if a command failed or boards were still down after the ramp.
+
+#include "../command_window.h"
+#include "../link_health.h"
+#include "../relay_protocol.h"
+#include "../tca9554.h"
+#include "ws_link.h"
+#include <ArduinoJson.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+const uint32_t LINK_RETRY_BASE_MS = 250; // Same policy as the device link (main.cpp)
+const uint32_t LINK_RETRY_CAP_MS = 30000;
+const uint32_t LINK_PING_INTERVAL_MS = 1000;
+const uint32_t LINK_PONG_TIMEOUT_MS = 3000;
+const uint32_t STATE_KEYFRAME_INTERVAL_MS = 30000; // relay_app.cpp STATE_KEYFRAME_INTERVAL
+const int CONNECT_TIMEOUT_MS = 2000;
+const uint8_t COMMAND_QUEUE_SIZE = 16; // relayCommandQueue
+const uint8_t BOARD_RELAYS = 8;
+// Output register write (address, register, value) at 400 kHz: the wire time SimTca9554Bus spends
+const uint32_t I2C_WRITE_US = (2 + 1) * 9 * 1000000 / TCA9554_FAST_CLOCK_HZ + 2;
+// Heap figures reported in state keyframes: a typical ESP32-S3 with the link up
+const uint32_t BOARD_HEAP_FREE = 182000;
+const uint32_t BOARD_HEAP_MIN_FREE = 151000;
+const uint32_t BOARD_HEAP_LARGEST_BLOCK = 106000;
+const int HTTP_TIMEOUT_MS = 15000; // Above the backend's 10 s command timeout
+const int64_t MAX_POLL_US = 10000;
+
+struct Options {
+    char serverHost[64] = "127.0.0.1";
+    int serverPort = 40000;
+    char httpHost[64] = "";
+    int httpPort = 3000;
+    int boards = 100;
+    int durationS = 60;
+    int ramp = 200;
+    int rate = 50;
+    int httpClients = 8;
+    bool relayMode = false;
+    double churn = 0;
+    int edgeIntervalMs = 10000;
+    bool offerBinary = true;
+    const char* caFile = nullptr;
+    bool tlsResume = false;
+    int threads = 0;
+    int dialers = 4;
+    bool busTiming = true;
+};
+
+enum BoardPhase : uint8_t {
+    BOARD_DOWN,    // Worker: waiting for the next connect attempt
+    BOARD_DIALING, // Dialer: connecting (TCP, TLS, upgrade)
+    BOARD_DIALED,  // Worker: attempt finished, socket open or not
+    BOARD_UP       // Worker: linked
+};
+
+enum WriteKind : uint8_t {
+    WRITE_RELAY,   // relay_control -> relay_control_ack
+    WRITE_MASK,    // relay_mask -> relay_mask_ack
+    WRITE_COMMAND  // command set_relay / set_mask -> command_response
+};
+
+// A command waiting for its simulated I2C write
+struct PendingWrite {
+    WriteKind kind;
+    int64_t rxUs;
+    int64_t doneUs;   // Write finished
+    uint8_t relay;    // WRITE_RELAY
+    bool state;
+    bool traced;
+    uint32_t trace;
+    uint8_t setMask;
+    uint8_t clearMask;
+    uint32_t commandId; // WRITE_COMMAND
+};
+
+struct SimBoard {
+    int index = 0;
+    char mac[18] = "";
+    char name[24] = "";
+    char ip[16] = "";
+    std::atomic<uint8_t> phase{BOARD_DOWN};
+    std::atomic<bool> ready{false};   // Registered (and acknowledged): HTTP clients may use it
+    std::atomic<int64_t> postedUs{0}; // An HTTP command for it was posted, not yet received
+    WsSocket socket;
+    std::unique_ptr<WsTlsClient> tls;
+    int64_t dialUs = 0; // Of the last attempt (dialer)
+
+    // Worker thread only
+    ReconnectBackoff backoff{LINK_RETRY_BASE_MS, LINK_RETRY_CAP_MS};
+    LinkHeartbeat heartbeat{LINK_PING_INTERVAL_MS, LINK_PONG_TIMEOUT_MS};
+    CommandWindow window; // Outlives reconnects, as on the device
+    PendingWrite writes[COMMAND_QUEUE_SIZE];
+    uint8_t writeHead = 0;
+    uint8_t writeCount = 0;
+    int64_t busFreeUs = 0;
+    int64_t nextConnectUs = 0;
+    int64_t registerSentUs = 0;
+    int64_t droppedUs = 0; // Injected drop not yet recovered from
+    int64_t downSinceUs = 0;
+    int64_t keyframeDueUs = 0;
+    int64_t edgeDueUs = 0;
+    int64_t bootRegisteredMs = 0;
+    bool everUp = false;
+    bool binary = false;
+    uint8_t relays = 0;
+    uint8_t inputs = 0;
+    uint8_t reportedRelays = 0;
+    uint8_t reportedInputs = 0;
+    uint32_t seq = 0;
+    uint32_t reconnects = 0;
+    uint32_t lastOutageMs = 0;
+    uint32_t connectMs = 0;
+};
+
+struct FleetStats {
+    std::vector<int64_t> connectUs;     // TCP + TLS + upgrade
+    std::vector<int64_t> registerAckUs; // register sent -> register_ack
+    std::vector<int64_t> recoveryUs;    // Injected drop -> registered again
+    std::vector<int64_t> commandUs;     // HTTP request due -> response
+    std::vector<int64_t> deliveryUs;    // HTTP request sent -> command at the board
+    uint64_t framesSent = 0;
+    uint64_t framesReceived = 0;
+    uint64_t bytesSent = 0;
+    uint64_t bytesReceived = 0;
+    uint32_t connects = 0;
+    uint32_t connectFailures = 0;
+    uint32_t injectedDrops = 0;
+    uint32_t serverDrops = 0;  // Closed by the backend
+    uint32_t pongTimeouts = 0;
+    uint32_t boardCommands = 0; // relay_control, relay_mask and command messages received
+    uint32_t queueFull = 0;
+    uint32_t windowConnects = 0; // Connects during the measurement window
+    uint32_t commandsOk = 0;
+    uint32_t commandsNotConnected = 0; // 404: the board was dropped meanwhile
+    uint32_t commandsFailed = 0;       // 502 (failed or no command_response in time), other status, transport
+
+    void merge(const FleetStats& other) {
+        auto append = [](std::vector<int64_t>& to, const std::vector<int64_t>& from) {
+            to.insert(to.end(), from.begin(), from.end());
+        };
+        append(connectUs, other.connectUs);
+        append(registerAckUs, other.registerAckUs);
+        append(recoveryUs, other.recoveryUs);
+        append(commandUs, other.commandUs);
+        append(deliveryUs, other.deliveryUs);
+        framesSent += other.framesSent;
+        framesReceived += other.framesReceived;
+        bytesSent += other.bytesSent;
+        bytesReceived += other.bytesReceived;
+        connects += other.connects;
+        connectFailures += other.connectFailures;
+        injectedDrops += other.injectedDrops;
+        serverDrops += other.serverDrops;
+        pongTimeouts += other.pongTimeouts;
+        boardCommands += other.boardCommands;
+        queueFull += other.queueFull;
+        windowConnects += other.windowConnects;
+        commandsOk += other.commandsOk;
+        commandsNotConnected += other.commandsNotConnected;
+        commandsFailed += other.commandsFailed;
+    }
+};
+
+// One board thread: its share of the boards, polled together
+struct Worker {
+    std::vector<SimBoard*> boards;
+    FleetStats stats;
+    uint32_t random = 0;
+    StaticJsonDocument<1024> rx;  // Backend message being handled
+    StaticJsonDocument<1024> doc; // Message being sent
+    char text[1024];
+};
+
+Options options;
+std::vector<std::unique_ptr<SimBoard>> boards;
+std::atomic<bool> measuring(false); // Count messages and commands
+std::atomic<bool> stopping(false);
+std::mutex dialMutex;
+std::condition_variable dialWake;
+std::deque<SimBoard*> dialQueue;
+int64_t fleetStartUs = 0;
+
+int64_t nowUs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32_t nextRandom(uint32_t& state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+bool counting() {
+    return measuring.load(std::memory_order_relaxed);
+}
+
+// ---- Board side: the firmware's messages ----
+
+void sendDoc(SimBoard& board, Worker& worker) {
+    size_t length = serializeJson(worker.doc, worker.text, sizeof(worker.text));
+    if (board.socket.sendText(worker.text, length) && counting()) {
+        worker.stats.framesSent++;
+        worker.stats.bytesSent += length;
+    }
+}
+
+void sendFrame(SimBoard& board, Worker& worker, const uint8_t* frame, size_t length) {
+    if (board.socket.sendBinary(frame, length) && counting()) {
+        worker.stats.framesSent++;
+        worker.stats.bytesSent += length;
+    }
+}
+
+// sendRegistration(): a single 8-channel bank, so bin1 is on offer
+void sendRegistration(SimBoard& board, Worker& worker) {
+    JsonDocument& doc = worker.doc;
+    doc.clear();
+    doc["type"] = "register";
+    doc["device_id"] = (const char*)board.mac;
+    doc["device_name"] = (const char*)board.name;
+    doc["mac"] = (const char*)board.mac;
+    doc["ip"] = (const char*)board.ip;
+    doc["report_mode"] = "delta";
+    if (options.offerBinary) {
+        doc["bin_version"] = RELAY_PROTO_VERSION;
+    }
+    doc["relays"] = BOARD_RELAYS;
+    JsonArray bankChannels = doc.createNestedArray("bank_channels");
+    bankChannels.add(BOARD_RELAYS);
+    doc["reconnects"] = board.reconnects;
+    doc["last_outage_ms"] = board.lastOutageMs;
+    doc["endpoint"] = 0;
+    doc["switches"] = 0;
+    doc["tls"] = board.socket.isTls();
+    doc["connect_ms"] = board.connectMs;
+    doc["boot_ms"] = board.bootRegisteredMs;
+    doc["fast_boot"] = false;
+    doc["last_command_id"] = board.window.lastId(); // Command ids continue above this
+    sendDoc(board, worker);
+}
+
+// Keyframe: sendFullState() / sendStateJson()
+void sendFullState(SimBoard& board, Worker& worker, int64_t now) {
+    if (board.binary) {
+        uint8_t frame[RELAY_PROTO_MAX_FRAME];
+        size_t length = encodeStateFrame(frame, sizeof(frame), RELAY_MSG_STATE, board.seq, board.relays, board.inputs);
+        sendFrame(board, worker, frame, length);
+    } else {
+        JsonDocument& doc = worker.doc;
+        doc.clear();
+        doc["type"] = "state";
+        doc["device_id"] = (const char*)board.mac;
+        doc["mac"] = (const char*)board.mac;
+        doc["ip"] = (const char*)board.ip;
+        doc["seq"] = board.seq;
+        doc["relay_mask"] = board.relays;
+        doc["input_mask"] = board.inputs;
+        JsonArray inputs = doc.createNestedArray("inputs");
+        for (int i = 0; i < 8; i++) {
+            inputs.add((bool)((board.inputs >> i) & 1));
+        }
+        JsonArray relays = doc.createNestedArray("relays");
+        for (int i = 0; i < BOARD_RELAYS; i++) {
+            relays.add((int)((board.relays >> i) & 1));
+        }
+        JsonObject link = doc.createNestedObject("link");
+        link["rtt_us"] = board.heartbeat.lastRttUs();
+        link["avg_rtt_us"] = board.heartbeat.avgRttUs();
+        link["reconnects"] = board.reconnects;
+        link["last_outage_ms"] = board.lastOutageMs;
+        link["endpoint"] = 0;
+        link["switches"] = 0;
+        link["tls"] = board.socket.isTls();
+        link["connect_ms"] = board.connectMs;
+        link["connect_heap"] = 0;
+        JsonObject heap = doc.createNestedObject("heap");
+        heap["free"] = BOARD_HEAP_FREE;
+        heap["min_free"] = BOARD_HEAP_MIN_FREE;
+        heap["largest_block"] = BOARD_HEAP_LARGEST_BLOCK;
+        sendDoc(board, worker);
+    }
+    board.reportedRelays = board.relays;
+    board.reportedInputs = board.inputs;
+    board.keyframeDueUs = now + (int64_t)STATE_KEYFRAME_INTERVAL_MS * 1000;
+}
+
+// reportStateChanges() / sendStateDelta()
+void reportStateChanges(SimBoard& board, Worker& worker) {
+    if (board.relays == board.reportedRelays && board.inputs == board.reportedInputs) {
+        return;
+    }
+    board.reportedRelays = board.relays;
+    board.reportedInputs = board.inputs;
+    uint32_t seq = ++board.seq;
+    if (board.binary) {
+        uint8_t frame[RELAY_PROTO_MAX_FRAME];
+        size_t length = encodeStateFrame(frame, sizeof(frame), RELAY_MSG_STATE_DELTA, seq, board.relays, board.inputs);
+        sendFrame(board, worker, frame, length);
+        return;
+    }
+    JsonDocument& doc = worker.doc;
+    doc.clear();
+    doc["type"] = "state_delta";
+    doc["seq"] = seq;
+    doc["relays"] = board.relays;
+    doc["inputs"] = board.inputs;
+    sendDoc(board, worker);
+}
+
+void sendInputChanged(SimBoard& board, Worker& worker, uint8_t index, int64_t timestampUs, int64_t now) {
+    bool state = (board.inputs >> index) & 1;
+    uint32_t latencyUs = (uint32_t)(now - timestampUs);
+    if (board.binary) {
+        uint8_t frame[RELAY_PROTO_MAX_FRAME];
+        size_t length = encodeInputChangedFrame(frame, sizeof(frame), index, state, timestampUs, latencyUs);
+        sendFrame(board, worker, frame, length);
+        return;
+    }
+    JsonDocument& doc = worker.doc;
+    doc.clear();
+    doc["type"] = "input_changed";
+    doc["inputIndex"] = index;
+    doc["state"] = state;
+    doc["timestamp_us"] = timestampUs;
+    doc["latency_us"] = latencyUs;
+    sendDoc(board, worker);
+}
+
+void sendRelayControlAck(SimBoard& board, Worker& worker, const PendingWrite& write, RelayError error, int64_t now) {
+    uint32_t latencyUs = (uint32_t)(write.doneUs - write.rxUs);
+    RelayTrace trace = {write.trace, write.rxUs, write.rxUs, write.doneUs - (options.busTiming ? I2C_WRITE_US : 0),
+                        write.doneUs, now};
+    if (board.binary) {
+        uint8_t frame[RELAY_PROTO_MAX_FRAME];
+        size_t length = write.traced
+                            ? encodeRelayAckTraceFrame(frame, sizeof(frame), write.relay, write.state, error, true, trace)
+                            : encodeRelayAckFrame(frame, sizeof(frame), write.relay, write.state, error, true, latencyUs);
+        sendFrame(board, worker, frame, length);
+        return;
+    }
+    JsonDocument& doc = worker.doc;
+    doc.clear();
+    doc["type"] = "relay_control_ack";
+    doc["relay"] = write.relay;
+    doc["state"] = write.state;
+    doc["success"] = error == RELAY_ERR_NONE;
+    doc["latency_us"] = latencyUs;
+    if (error != RELAY_ERR_NONE) {
+        doc["error"] = relayErrorMessage(error);
+    }
+    if (write.traced) {
+        doc["trace"] = trace.id;
+        JsonObject stamps = doc.createNestedObject("t_us");
+        stamps["rx"] = trace.rx_us;
+        stamps["parse"] = trace.parse_us;
+        stamps["io"] = trace.io_us;
+        stamps["i2c"] = trace.i2c_us;
+        stamps["ack"] = trace.ack_us;
+    }
+    sendDoc(board, worker);
+    if (error == RELAY_ERR_NONE) {
+        doc.clear();
+        doc["type"] = "relay_state_verified";
+        doc["relay"] = write.relay;
+        doc["exio_pin"] = write.relay + 1;
+        doc["expected_state"] = write.state;
+        doc["actual_state"] = write.state;
+        sendDoc(board, worker);
+    }
+}
+
+void sendRelayMaskAck(SimBoard& board, Worker& worker, const PendingWrite& write, RelayError error) {
+    uint32_t latencyUs = (uint32_t)(write.doneUs - write.rxUs);
+    if (board.binary) {
+        uint8_t frame[RELAY_PROTO_MAX_FRAME];
+        size_t length = encodeMaskAckFrame(frame, sizeof(frame), write.setMask, write.clearMask, board.relays, error, latencyUs);
+        sendFrame(board, worker, frame, length);
+        return;
+    }
+    JsonDocument& doc = worker.doc;
+    doc.clear();
+    doc["type"] = "relay_mask_ack";
+    doc["set"] = write.setMask;
+    doc["clear"] = write.clearMask;
+    doc["relays"] = board.relays;
+    doc["success"] = error == RELAY_ERR_NONE;
+    doc["latency_us"] = latencyUs;
+    if (error != RELAY_ERR_NONE) {
+        doc["error"] = relayErrorMessage(error);
+    }
+    sendDoc(board, worker);
+}
+
+void sendCommandResponse(SimBoard& board, Worker& worker, uint32_t commandId, RelayError error, uint8_t relays,
+                         uint32_t latencyUs, bool duplicate) {
+    JsonDocument& doc = worker.doc;
+    doc.clear();
+    doc["type"] = "command_response";
+    doc["commandId"] = commandId;
+    doc["success"] = error == RELAY_ERR_NONE;
+    if (error == RELAY_ERR_NONE) {
+        JsonObject result = doc.createNestedObject("result");
+        result["relays"] = relays;
+        result["inputs"] = board.inputs;
+        result["latency_us"] = latencyUs;
+    } else {
+        doc["error"] = relayErrorMessage(error);
+        doc["error_type"] = relayErrorType(error);
+    }
+    if (error == RELAY_ERR_STALE_COMMAND) {
+        doc["last_id"] = board.window.lastId();
+    }
+    if (duplicate) {
+        doc["duplicate"] = true;
+    }
+    sendDoc(board, worker);
+}
+
+// finishCommand(): remember the outcome for retransmits, then answer
+void finishCommand(SimBoard& board, Worker& worker, uint32_t commandId, RelayError error, uint32_t latencyUs) {
+    board.window.complete(commandId, error, board.relays, latencyUs);
+    sendCommandResponse(board, worker, commandId, error, board.relays, latencyUs, false);
+}
+
+// Answer a write that could not be queued or was invalid, as the firmware does
+void rejectWrite(SimBoard& board, Worker& worker, PendingWrite& write, RelayError error, int64_t now) {
+    write.doneUs = now;
+    if (write.kind == WRITE_COMMAND) {
+        finishCommand(board, worker, write.commandId, error, 0);
+    } else if (write.kind == WRITE_MASK) {
+        sendRelayMaskAck(board, worker, write, error);
+    } else {
+        sendRelayControlAck(board, worker, write, error, now);
+    }
+}
+
+// Into the I/O queue; the bus does one write at a time
+void queueWrite(SimBoard& board, Worker& worker, PendingWrite& write, int64_t now) {
+    if (counting()) {
+        worker.stats.boardCommands++;
+    }
+    if (board.writeCount == COMMAND_QUEUE_SIZE) {
+        if (counting()) {
+            worker.stats.queueFull++;
+        }
+        rejectWrite(board, worker, write, RELAY_ERR_QUEUE_FULL, now);
+        return;
+    }
+    write.doneUs = std::max(now, board.busFreeUs) + (options.busTiming ? I2C_WRITE_US : 0);
+    board.busFreeUs = write.doneUs;
+    board.writes[(board.writeHead + board.writeCount) % COMMAND_QUEUE_SIZE] = write;
+    board.writeCount++;
+}
+
+void queueRelayWrite(SimBoard& board, Worker& worker, int relay, bool state, bool traced, uint32_t trace,
+                     uint32_t commandId, int64_t now) {
+    PendingWrite write = {};
+    write.kind = commandId ? WRITE_COMMAND : WRITE_RELAY;
+    write.rxUs = now;
+    write.relay = (uint8_t)relay;
+    write.state = state;
+    write.traced = traced;
+    write.trace = trace;
+    write.commandId = commandId;
+    if (relay < 0 || relay >= BOARD_RELAYS) {
+        rejectWrite(board, worker, write, RELAY_ERR_INVALID_RELAY, now);
+        return;
+    }
+    write.setMask = state ? (uint8_t)(1 << relay) : 0;
+    write.clearMask = state ? 0 : (uint8_t)(1 << relay);
+    queueWrite(board, worker, write, now);
+}
+
+void queueMaskWrite(SimBoard& board, Worker& worker, uint8_t setMask, uint8_t clearMask, uint32_t commandId, int64_t now) {
+    PendingWrite write = {};
+    write.kind = commandId ? WRITE_COMMAND : WRITE_MASK;
+    write.rxUs = now;
+    write.setMask = setMask;
+    write.clearMask = clearMask;
+    write.commandId = commandId;
+    queueWrite(board, worker, write, now);
+}
+
+// Writes whose bus time is over: apply, acknowledge, report the change
+void completeWrites(SimBoard& board, Worker& worker, int64_t now) {
+    while (board.writeCount > 0) {
+        PendingWrite& write = board.writes[board.writeHead];
+        if (write.doneUs > now) {
+            return;
+        }
+        board.relays = (uint8_t)((board.relays | write.setMask) & ~write.clearMask);
+        if (write.kind == WRITE_COMMAND) {
+            finishCommand(board, worker, write.commandId, RELAY_ERR_NONE, (uint32_t)(write.doneUs - write.rxUs));
+        } else if (write.kind == WRITE_MASK) {
+            sendRelayMaskAck(board, worker, write, RELAY_ERR_NONE);
+        } else {
+            sendRelayControlAck(board, worker, write, RELAY_ERR_NONE, now);
+        }
+        board.writeHead = (board.writeHead + 1) % COMMAND_QUEUE_SIZE;
+        board.writeCount--;
+        reportStateChanges(board, worker);
+    }
+}
+
+// An HTTP client posted a command for this board: time its way through the backend
+void commandReceived(SimBoard& board, Worker& worker, int64_t now) {
+    int64_t posted = board.postedUs.exchange(0);
+    if (posted != 0 && counting()) {
+        worker.stats.deliveryUs.push_back(now - posted);
+    }
+}
+
+// handleCommand(): set_relay, set_mask and get_state with at-most-once ids
+void handleCommand(SimBoard& board, Worker& worker, JsonObject message, int64_t now) {
+    uint32_t commandId = message["commandId"] | (uint32_t)0;
+    const char* command = message["command"] | "";
+    if (commandId == 0) {
+        return;
+    }
+    const CommandRecord* record;
+    switch (board.window.check(commandId, record)) {
+    case COMMAND_IN_FLIGHT:
+        return;
+    case COMMAND_REPLAY:
+        sendCommandResponse(board, worker, commandId, record->error, (uint8_t)record->relays, record->latencyUs, true);
+        return;
+    case COMMAND_STALE:
+        sendCommandResponse(board, worker, commandId, RELAY_ERR_STALE_COMMAND, board.relays, 0, false);
+        return;
+    case COMMAND_NEW:
+        break;
+    }
+    board.window.begin(commandId);
+    commandReceived(board, worker, now);
+
+    JsonObject params = message["params"];
+    if (strcmp(command, "set_relay") == 0) {
+        int relay = params["channel"] | (params["relay"] | -1);
+        queueRelayWrite(board, worker, relay, params["state"] | false, false, 0, commandId, now);
+    } else if (strcmp(command, "set_mask") == 0) {
+        queueMaskWrite(board, worker, params["set"] | 0, params["clear"] | 0, commandId, now);
+    } else if (strcmp(command, "get_state") == 0) {
+        finishCommand(board, worker, commandId, RELAY_ERR_NONE, 0);
+    } else {
+        finishCommand(board, worker, commandId, RELAY_ERR_UNKNOWN_COMMAND, 0);
+    }
+}
+
+void registered(SimBoard& board, Worker& worker, int64_t now) {
+    if (board.droppedUs != 0) {
+        worker.stats.recoveryUs.push_back(now - board.droppedUs);
+        board.droppedUs = 0;
+    }
+    board.ready = true;
+}
+
+void handleText(SimBoard& board, Worker& worker, const uint8_t* payload, size_t length, int64_t now) {
+    JsonDocument& doc = worker.rx;
+    if (deserializeJson(doc, payload, length)) {
+        return;
+    }
+    const char* type = doc["type"] | "";
+    if (strcmp(type, "relay_control") == 0) {
+        commandReceived(board, worker, now);
+        int relay = doc["channel"] | (doc["relay"] | -1);
+        queueRelayWrite(board, worker, relay, doc["state"] | false, doc.containsKey("trace"), doc["trace"] | (uint32_t)0, 0, now);
+    } else if (strcmp(type, "relay_mask") == 0) {
+        commandReceived(board, worker, now);
+        queueMaskWrite(board, worker, doc["set"] | 0, doc["clear"] | 0, 0, now);
+    } else if (strcmp(type, "command") == 0) {
+        handleCommand(board, worker, doc.as<JsonObject>(), now);
+    } else if (strcmp(type, "register_ack") == 0) {
+        board.binary = strcmp(doc["protocol"] | "json", "bin1") == 0;
+        worker.stats.registerAckUs.push_back(now - board.registerSentUs);
+        registered(board, worker, now);
+    } else if (strcmp(type, "resync") == 0) {
+        sendFullState(board, worker, now);
+    }
+}
+
+void handleBinary(SimBoard& board, Worker& worker, const uint8_t* frame, size_t length, int64_t now) {
+    const uint8_t* p = frame + RELAY_PROTO_HEADER_SIZE;
+    switch (relayProtoFrameType(frame, length)) {
+    case RELAY_MSG_RELAY_CONTROL:
+        if (length >= RELAY_PROTO_HEADER_SIZE + 2) {
+            bool traced = length >= RELAY_PROTO_HEADER_SIZE + 6;
+            commandReceived(board, worker, now);
+            queueRelayWrite(board, worker, p[0], p[1] != 0, traced, traced ? relayProtoGetU32(p + 2) : 0, 0, now);
+        }
+        break;
+    case RELAY_MSG_RELAY_MASK:
+        if (length >= RELAY_PROTO_HEADER_SIZE + 2) {
+            commandReceived(board, worker, now);
+            queueMaskWrite(board, worker, p[0], p[1], 0, now);
+        }
+        break;
+    case RELAY_MSG_RESYNC:
+        sendFullState(board, worker, now);
+        break;
+    }
+}
+
+// Everything the backend sent since the last poll
+void drainBoard(SimBoard& board, Worker& worker, int64_t now) {
+    WsMessage message;
+    while (board.socket.receive(message, 0)) {
+        if (counting()) {
+            worker.stats.framesReceived++;
+            worker.stats.bytesReceived += message.payload.size();
+        }
+        if (message.opcode == WS_OP_TEXT) {
+            handleText(board, worker, message.payload.data(), message.payload.size(), now);
+        } else if (message.opcode == WS_OP_BINARY) {
+            handleBinary(board, worker, message.payload.data(), message.payload.size(), now);
+        } else {
+            board.heartbeat.pongReceived(message.payload.data(), message.payload.size(), now);
+        }
+    }
+}
+
+// ---- Board side: link handling (main.cpp) ----
+
+void linkUp(SimBoard& board, Worker& worker, int64_t now) {
+    board.backoff.reset();
+    board.heartbeat.reset(now);
+    board.connectMs = (uint32_t)(board.dialUs / 1000);
+    worker.stats.connects++;
+    worker.stats.connectUs.push_back(board.dialUs);
+    if (counting()) {
+        worker.stats.windowConnects++;
+    }
+    if (board.everUp) {
+        board.reconnects++;
+        board.lastOutageMs = (uint32_t)((now - board.downSinceUs) / 1000);
+    } else {
+        board.bootRegisteredMs = (now - fleetStartUs) / 1000;
+    }
+    board.everUp = true;
+    board.binary = false;
+    board.phase.store(BOARD_UP, std::memory_order_relaxed);
+
+    sendRegistration(board, worker);
+    board.registerSentUs = now;
+    sendFullState(board, worker, now);
+    if (!options.offerBinary) {
+        registered(board, worker, now); // No bin_version, no register_ack
+    }
+}
+
+// Dropped, failed to connect or dropped on purpose: retry after the backoff
+void linkDown(SimBoard& board, Worker& worker, int64_t now) {
+    board.socket.close();
+    board.ready = false;
+    if (board.phase.load(std::memory_order_relaxed) == BOARD_UP) {
+        board.downSinceUs = now;
+    }
+    board.writeCount = 0; // Acks for these would have nowhere to go
+    board.busFreeUs = 0;
+    board.nextConnectUs = now + (int64_t)board.backoff.nextDelayMs(nextRandom(worker.random)) * 1000;
+    board.phase.store(BOARD_DOWN, std::memory_order_relaxed);
+}
+
+// Timers and link state of one board; wakeUs is lowered to its next deadline
+void serviceBoard(SimBoard& board, Worker& worker, int64_t now, int64_t& wakeUs) {
+    switch (board.phase.load(std::memory_order_acquire)) {
+    case BOARD_DOWN:
+        if (now >= board.nextConnectUs) {
+            board.phase.store(BOARD_DIALING, std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock(dialMutex);
+            dialQueue.push_back(&board);
+            dialWake.notify_one();
+        } else {
+            wakeUs = std::min(wakeUs, board.nextConnectUs);
+        }
+        return;
+    case BOARD_DIALING:
+        return;
+    case BOARD_DIALED:
+        if (board.socket.isOpen()) {
+            linkUp(board, worker, now);
+        } else {
+            worker.stats.connectFailures++;
+            linkDown(board, worker, now);
+            return;
+        }
+        break;
+    case BOARD_UP:
+        break;
+    }
+
+    completeWrites(board, worker, now);
+    uint8_t ping[LINK_PING_PAYLOAD_SIZE];
+    if (board.socket.isOpen() && board.heartbeat.pingDue(now, ping)) {
+        board.socket.sendPing(ping, sizeof(ping));
+    }
+    if (board.socket.isOpen() && board.heartbeat.timedOut(now)) {
+        worker.stats.pongTimeouts++; // Half-open or a backend too busy to answer
+        linkDown(board, worker, now);
+        return;
+    }
+    if (!board.socket.isOpen()) {
+        worker.stats.serverDrops++;
+        linkDown(board, worker, now);
+        return;
+    }
+    if (now >= board.keyframeDueUs) {
+        sendFullState(board, worker, now);
+    }
+    if (options.edgeIntervalMs > 0 && now >= board.edgeDueUs) {
+        if (board.edgeDueUs != 0) {
+            uint8_t index = nextRandom(worker.random) % 8;
+            board.inputs ^= 1 << index;
+            sendInputChanged(board, worker, index, now, nowUs());
+            reportStateChanges(board, worker);
+        }
+        // Uniform in [0.5, 1.5] x the mean interval
+        uint32_t intervalMs = options.edgeIntervalMs / 2 + nextRandom(worker.random) % (options.edgeIntervalMs + 1);
+        board.edgeDueUs = now + (int64_t)intervalMs * 1000;
+    }
+    if (board.writeCount > 0) {
+        wakeUs = std::min(wakeUs, board.writes[board.writeHead].doneUs);
+    }
+}
+
+void runWorker(Worker& worker, int workerCount) {
+    std::vector<pollfd> fds;
+    std::vector<SimBoard*> polled;
+    int64_t churnIntervalUs = options.churn > 0 ? (int64_t)(workerCount * 1e6 / options.churn) : 0;
+    int64_t nextChurnUs = 0; // Drops start with the measurement window
+    while (!stopping) {
+        int64_t now = nowUs();
+        int64_t wakeUs = now + MAX_POLL_US;
+        fds.clear();
+        polled.clear();
+        for (SimBoard* board : worker.boards) {
+            serviceBoard(*board, worker, now, wakeUs);
+            if (board->phase.load(std::memory_order_relaxed) == BOARD_UP) {
+                fds.push_back({board->socket.fd(), POLLIN, 0});
+                polled.push_back(board);
+            }
+        }
+
+        // Drop a random linked board: the backend sees the socket close, the board redials
+        if (churnIntervalUs > 0 && counting() && nextChurnUs == 0) {
+            nextChurnUs = now + churnIntervalUs;
+        }
+        if (churnIntervalUs > 0 && counting() && now >= nextChurnUs) {
+            nextChurnUs += churnIntervalUs;
+            if (!polled.empty()) {
+                SimBoard& victim = *polled[nextRandom(worker.random) % polled.size()];
+                worker.stats.injectedDrops++;
+                victim.droppedUs = now;
+                linkDown(victim, worker, now);
+                continue;
+            }
+        }
+        if (churnIntervalUs > 0 && counting()) {
+            wakeUs = std::min(wakeUs, nextChurnUs);
+        }
+
+        int64_t waitUs = std::max<int64_t>(0, wakeUs - nowUs());
+        timespec timeout = {(time_t)(waitUs / 1000000), (long)(waitUs % 1000000) * 1000};
+        if (ppoll(fds.data(), fds.size(), &timeout, nullptr) > 0) {
+            int64_t rxUs = nowUs();
+            for (size_t i = 0; i < fds.size(); i++) {
+                if (fds[i].revents != 0) {
+                    drainBoard(*polled[i], worker, rxUs);
+                }
+            }
+        }
+    }
+}
+
+// Blocking connects (TCP, TLS, upgrade) off the board threads
+void runDialer() {
+    for (;;) {
+        SimBoard* board;
+        {
+            std::unique_lock<std::mutex> lock(dialMutex);
+            dialWake.wait(lock, [] { return stopping || !dialQueue.empty(); });
+            if (stopping) {
+                return;
+            }
+            board = dialQueue.front();
+            dialQueue.pop_front();
+        }
+        char path[48];
+        snprintf(path, sizeof(path), "/elevator?id=%s", board->mac);
+        if (board->tls && !options.tlsResume) {
+            board->tls->forgetSession();
+        }
+        int64_t start = nowUs();
+        board->socket.connect(options.serverHost, options.serverPort, path, CONNECT_TIMEOUT_MS, board->tls.get());
+        board->dialUs = nowUs() - start;
+        board->phase.store(BOARD_DIALED, std::memory_order_release);
+    }
+}
+
+// ---- Backend HTTP API ----
+
+int httpConnect() {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char port[8];
+    snprintf(port, sizeof(port), "%d", options.httpPort);
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(options.httpHost, port, &hints, &addresses) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo* a = addresses; a != nullptr && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd >= 0) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        timeval timeout = {HTTP_TIMEOUT_MS / 1000, (HTTP_TIMEOUT_MS % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    return fd;
+}
+
+// POST a JSON body over a keep-alive connection (opened on demand). Returns the status
+// code, or 0 on a transport error, which closes fd.
+int httpPost(int& fd, const char* path, const char* body) {
+    if (fd < 0 && (fd = httpConnect()) < 0) {
+        return 0;
+    }
+    char request[512];
+    int length = snprintf(request, sizeof(request),
+                          "POST %s HTTP/1.1\r\nHost: %s:%d\r\nContent-Type: application/json\r\n"
+                          "Content-Length: %zu\r\nConnection: keep-alive\r\n\r\n%s",
+                          path, options.httpHost, options.httpPort, strlen(body), body);
+    std::string response;
+    size_t headerEnd = std::string::npos;
+    size_t contentLength = 0;
+    bool keepAlive = true;
+    if (send(fd, request, length, MSG_NOSIGNAL) == length) {
+        char buffer[2048];
+        for (;;) {
+            if (headerEnd != std::string::npos && response.size() >= headerEnd + contentLength) {
+                break;
+            }
+            ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+            if (received <= 0) {
+                response.clear();
+                break;
+            }
+            response.append(buffer, received);
+            if (headerEnd == std::string::npos && (headerEnd = response.find("\r\n\r\n")) != std::string::npos) {
+                headerEnd += 4;
+                std::string headers = response.substr(0, headerEnd);
+                std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+                size_t field = headers.find("\r\ncontent-length:");
+                contentLength = field != std::string::npos ? strtoul(headers.c_str() + field + 17, nullptr, 10) : 0;
+                keepAlive = headers.find("\r\nconnection: close") == std::string::npos;
+            }
+        }
+    }
+    int status = 0;
+    if (response.empty() || sscanf(response.c_str(), "HTTP/1.%*d %d", &status) != 1) {
+        status = 0;
+        keepAlive = false;
+    }
+    if (!keepAlive) {
+        close(fd);
+        fd = -1;
+    }
+    return status;
+}
+
+// One client with one request in flight, paced to its share of --rate, cycling through
+// its share of the boards (client i takes boards i, i + clients, ...)
+void runHttpClient(int client, FleetStats& stats) {
+    int clients = options.httpClients;
+    int64_t intervalUs = (int64_t)(1e6 * clients / options.rate);
+    int64_t dueUs = nowUs() + intervalUs * client / clients;
+    size_t cursor = client;
+    uint32_t sent = 0;
+    int fd = -1;
+    while (!stopping) {
+        int64_t waitUs = dueUs - nowUs();
+        if (waitUs > 0) {
+            usleep((useconds_t)std::min<int64_t>(waitUs, 100000));
+            continue;
+        }
+        SimBoard* board = nullptr;
+        for (size_t tries = 0; tries < boards.size() && board == nullptr; tries += clients) {
+            SimBoard* candidate = boards[cursor].get();
+            cursor = cursor + clients < boards.size() ? cursor + clients : client;
+            if (candidate->ready) {
+                board = candidate;
+            }
+        }
+        if (board == nullptr) {
+            dueUs += intervalUs;
+            continue;
+        }
+
+        uint8_t relay = sent % BOARD_RELAYS;
+        bool state = (sent / BOARD_RELAYS) % 2 == 0;
+        sent++;
+        char path[64];
+        char body[160];
+        snprintf(path, sizeof(path), "/api/relays/%s/command", board->mac);
+        if (options.relayMode) {
+            snprintf(body, sizeof(body), "{\"relay\":%u,\"state\":%s}", relay, state ? "true" : "false");
+        } else {
+            snprintf(body, sizeof(body),
+                     "{\"type\":\"command\",\"command\":\"set_relay\",\"params\":{\"relay\":%u,\"state\":%s}}", relay,
+                     state ? "true" : "false");
+        }
+        board->postedUs = nowUs();
+        int status = httpPost(fd, path, body);
+        int64_t doneUs = nowUs();
+        if (counting()) {
+            if (status == 200) {
+                stats.commandsOk++;
+                stats.commandUs.push_back(doneUs - dueUs);
+            } else if (status == 404) {
+                stats.commandsNotConnected++;
+            } else {
+                stats.commandsFailed++;
+            }
+        }
+        dueUs += intervalUs;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// ---- Report ----
+
+void printLatencies(const char* label, std::vector<int64_t>& samples, const char* unit = "us") {
+    if (samples.empty()) {
+        printf("%-28s no samples\n", label);
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&](double p) { return samples[(size_t)(p * (samples.size() - 1))]; };
+    printf("%-28s n=%-6zu p50=%-6lld p90=%-6lld p99=%-6lld max=%-6lld %s\n", label, samples.size(),
+           (long long)percentile(0.50), (long long)percentile(0.90), (long long)percentile(0.99),
+           (long long)samples.back(), unit);
+}
+
+size_t readyBoards() {
+    size_t count = 0;
+    for (const auto& board : boards) {
+        count += board->ready;
+    }
+    return count;
+}
+
+// HOST:PORT; the port stays as it is when missing
+bool parseEndpoint(const char* value, char* host, size_t hostSize, int& port) {
+    const char* colon = strrchr(value, ':');
+    size_t length = colon ? (size_t)(colon - value) : strlen(value);
+    if (length == 0 || length >= hostSize) {
+        return false;
+    }
+    snprintf(host, hostSize, "%.*s", (int)length, value);
+    if (colon) {
+        port = atoi(colon + 1);
+    }
+    return port > 0;
+}
+
+bool parseOptions(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        bool ok = true;
+        if (strcmp(arg, "--server") == 0 && value) {
+            ok = parseEndpoint(value, options.serverHost, sizeof(options.serverHost), options.serverPort);
+            i++;
+        } else if (strcmp(arg, "--http") == 0 && value) {
+            ok = parseEndpoint(value, options.httpHost, sizeof(options.httpHost), options.httpPort);
+            i++;
+        } else if (strcmp(arg, "--boards") == 0 && value) {
+            options.boards = atoi(value);
+            i++;
+        } else if (strcmp(arg, "--duration") == 0 && value) {
+            options.durationS = atoi(value);
+            i++;
+        } else if (strcmp(arg, "--ramp") == 0 && value) {
+            options.ramp = atoi(value);
+            i++;
+        } else if (strcmp(arg, "--rate") == 0 && value) {
+            options.rate = atoi(value);
+            i++;
+        } else if (strcmp(arg, "--http-clients") == 0 && value) {
+            options.httpClients = atoi(value);
+            i++;
+        } else if (strcmp(arg, "--mode") == 0 && value) {
+            options.relayMode = strcmp(value, "relay") == 0;
+            ok = options.relayMode || strcmp(value, "command") == 0;
+            i++;
+        } else if (strcmp(arg, "--churn") == 0 && value) {
+            options.churn = atof(value);
+            i++;
+        } else if (strcmp(arg, "--edge-interval-ms") == 0 && value) {
+            options.edgeIntervalMs = atoi(value);
+            i++;
+        } else if (strcmp(arg, "--protocol") == 0 && value) {
+            options.offerBinary = strcmp(value, "bin1") == 0;
+            i++;
+        } else if (strcmp(arg, "--ca") == 0 && value) {
+            options.caFile = value;
+            i++;
+        } else if (strcmp(arg, "--tls-resume") == 0) {
+            options.tlsResume = true;
+        } else if (strcmp(arg, "--threads") == 0 && value) {
+            options.threads = atoi(value);
+            i++;
+        } else if (strcmp(arg, "--dialers") == 0 && value) {
+            options.dialers = atoi(value);
+            i++;
+        } else if (strcmp(arg, "--no-bus-timing") == 0) {
+            options.busTiming = false;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "usage: %s [--server HOST:PORT] [--http HOST:PORT] [--boards N] [--duration S] [--ramp N] "
+                            "[--rate N] [--http-clients N] [--mode command|relay] [--churn N] [--edge-interval-ms N] "
+                            "[--protocol json|bin1] [--ca FILE] [--tls-resume] [--threads N] [--dialers N] [--no-bus-timing]\n", argv[0]);
+            return false;
+        }
+    }
+    if (options.httpHost[0] == '\0') {
+        snprintf(options.httpHost, sizeof(options.httpHost), "%s", options.serverHost);
+    }
+    if (options.threads <= 0) {
+        options.threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    }
+    options.threads = std::min(options.threads, options.boards);
+    return options.boards > 0 && options.rate > 0 && options.httpClients > 0 && options.dialers > 0 && options.ramp > 0;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (!parseOptions(argc, argv)) {
+        return 2;
+    }
+
+    // One socket per board plus the HTTP clients
+    rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+        if (files.rlim_cur < (rlim_t)(options.boards + options.httpClients + 64)) {
+            fprintf(stderr, "warning: open file limit %llu is too low for %d boards\n",
+                    (unsigned long long)files.rlim_cur, options.boards);
+        }
+    }
+
+    std::string caPem;
+    if (options.caFile != nullptr) {
+        FILE* file = fopen(options.caFile, "r");
+        char buffer[4096];
+        size_t length;
+        while (file != nullptr && (length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            caPem.append(buffer, length);
+        }
+        if (file != nullptr) {
+            fclose(file);
+        }
+    }
+
+    fleetStartUs = nowUs();
+    for (int i = 0; i < options.boards; i++) {
+        std::unique_ptr<SimBoard> board(new SimBoard());
+        board->index = i;
+        // Locally administered, never a real board's
+        snprintf(board->mac, sizeof(board->mac), "02:FE:%02X:%02X:%02X:%02X", (i >> 24) & 0xFF, (i >> 16) & 0xFF,
+                 (i >> 8) & 0xFF, i & 0xFF);
+        snprintf(board->name, sizeof(board->name), "Fleet Board %d", i);
+        snprintf(board->ip, sizeof(board->ip), "10.254.%d.%d", (i >> 8) & 0xFF, i & 0xFF);
+        board->nextConnectUs = fleetStartUs + (int64_t)i * 1000000 / options.ramp;
+        if (options.caFile != nullptr) {
+            board->tls.reset(new WsTlsClient());
+            if (!board->tls->configure(caPem.c_str())) {
+                fprintf(stderr, "%s: no PEM certificate\n", options.caFile);
+                return 2;
+            }
+        }
+        boards.push_back(std::move(board));
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int t = 0; t < options.threads; t++) {
+        workers.emplace_back(new Worker());
+        workers.back()->random = 0x9E3779B9u * (t + 1);
+    }
+    for (int i = 0; i < options.boards; i++) {
+        workers[i % options.threads]->boards.push_back(boards[i].get());
+    }
+    std::vector<FleetStats> clientStats(options.httpClients);
+    std::vector<std::thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back(runWorker, std::ref(*worker), options.threads);
+    }
+    for (int i = 0; i < options.dialers; i++) {
+        threads.emplace_back(runDialer);
+    }
+
+    printf("Fleet: %d boards -> %s:%d (%s%s), HTTP %s:%d, %d threads, %d dialers\n", options.boards, options.serverHost,
+           options.serverPort, options.caFile ? "wss" : "ws", options.offerBinary ? ", bin1 offered" : ", json",
+           options.httpHost, options.httpPort, options.threads, options.dialers);
+    int64_t rampDeadlineUs = fleetStartUs + ((int64_t)options.boards * 1000000 / options.ramp) + 30000000;
+    while (readyBoards() < boards.size() && nowUs() < rampDeadlineUs) {
+        usleep(100000);
+    }
+    size_t rampReady = readyBoards();
+    printf("Ramp: %zu of %d boards registered after %.1f s\n", rampReady, options.boards,
+           (nowUs() - fleetStartUs) / 1e6);
+    fflush(stdout);
+
+    measuring = true;
+    int64_t windowStartUs = nowUs();
+    for (int i = 0; i < options.httpClients; i++) {
+        threads.emplace_back(runHttpClient, i, std::ref(clientStats[i]));
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(options.durationS));
+    measuring = false;
+    double windowS = (nowUs() - windowStartUs) / 1e6;
+    size_t endReady = readyBoards();
+    {
+        std::lock_guard<std::mutex> lock(dialMutex);
+        stopping = true;
+        dialWake.notify_all();
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    FleetStats total;
+    for (auto& worker : workers) {
+        total.merge(worker->stats);
+    }
+    for (FleetStats& stats : clientStats) {
+        total.merge(stats);
+    }
+
+    printf("\n=== Fleet load test (%d boards, %s, %s, %.0f s window) ===\n", options.boards,
+           options.relayMode ? "relay_control" : "command set_relay", options.busTiming ? "timed I2C" : "untimed I2C",
+           windowS);
+    printLatencies("connect (TCP+TLS+upgrade)", total.connectUs);
+    if (options.offerBinary) {
+        printLatencies("register -> register_ack", total.registerAckUs);
+    }
+    printLatencies(options.relayMode ? "HTTP command (forwarded)" : "HTTP command round trip", total.commandUs);
+    printLatencies("HTTP post -> board", total.deliveryUs);
+    printLatencies("injected drop -> registered", total.recoveryUs);
+    printf("%-28s ok=%u not_connected=%u failed=%u (%.1f/s ok)\n", "HTTP commands", total.commandsOk,
+           total.commandsNotConnected, total.commandsFailed, total.commandsOk / windowS);
+    printf("%-28s %u received, %u queue full\n", "board commands", total.boardCommands, total.queueFull);
+    printf("%-28s sent %llu (%.0f/s, %.0f KB/s), received %llu (%.0f/s, %.0f KB/s)\n", "board messages",
+           (unsigned long long)total.framesSent, total.framesSent / windowS, total.bytesSent / windowS / 1024,
+           (unsigned long long)total.framesReceived, total.framesReceived / windowS,
+           total.bytesReceived / windowS / 1024);
+    printf("%-28s drops: %u injected, %u by the backend, %u pong timeouts; %u connects in the window (%.1f/s), "
+           "%u failed connects\n", "churn", total.injectedDrops, total.serverDrops, total.pongTimeouts,
+           total.windowConnects, total.windowConnects / windowS, total.connectFailures);
+    printf("%-28s %zu after the ramp, %zu at the end\n", "boards registered", rampReady, endReady);
+
+    return total.commandsFailed == 0 && rampReady == boards.size() ? 0 : 1;
+}
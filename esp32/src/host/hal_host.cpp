@@ -0,0 +1,287 @@
+// Linux implementation of the HAL: std::thread tasks with a notification slot each,
+// a steady clock, simulated input pins, the simulated TCA9554 bus, stdout/stdin as the
+// console and in-memory config flash. The upstream link lives in host_main.cpp.
+
+#include "hal_host.h"
+#include "sim_tca9554.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <malloc.h>
+#include <random>
+#include <thread>
+#include <poll.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace {
+
+struct TaskSlot {
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool notified = false;
+    int64_t wakeAtUs = HAL_NEVER;
+};
+
+TaskSlot taskSlots[HAL_TASK_COUNT];
+const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+std::atomic<uint8_t> inputLevels(0);
+void (*inputChangeHandler)(uint8_t index) = nullptr;
+
+std::atomic<bool> consoleStdin(false);
+
+const size_t EEPROM_SIZE = 512;
+uint8_t eeprom[EEPROM_SIZE]; // Legacy configuration blob, erased
+
+// Simulated config flash with NOR semantics and a realistic sector erase time
+const uint32_t FLASH_ERASE_MS = 40;
+
+class RamConfigFlash : public ConfigFlash {
+public:
+    RamConfigFlash() { memset(data_, 0xFF, sizeof(data_)); }
+
+    bool read(uint32_t address, void* data, size_t length) override {
+        if (address + length > sizeof(data_)) {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(mutex_);
+        memcpy(data, data_ + address, length);
+        return true;
+    }
+
+    bool write(uint32_t address, const void* data, size_t length) override {
+        if (address + length > sizeof(data_)) {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(mutex_);
+        const uint8_t* bytes = (const uint8_t*)data;
+        for (size_t i = 0; i < length; i++) {
+            data_[address + i] &= bytes[i]; // Can only clear bits
+        }
+        return true;
+    }
+
+    bool eraseSector(uint8_t sector) override {
+        if (sector >= HAL_CONFIG_SECTORS) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(FLASH_ERASE_MS));
+        std::lock_guard<std::mutex> guard(mutex_);
+        memset(data_ + (size_t)sector * HAL_CONFIG_SECTOR_SIZE, 0xFF, HAL_CONFIG_SECTOR_SIZE);
+        return true;
+    }
+
+private:
+    uint8_t data_[HAL_CONFIG_SECTOR_SIZE * HAL_CONFIG_SECTORS];
+    std::mutex mutex_;
+};
+
+RamConfigFlash configFlash;
+
+} // namespace
+
+void halBegin() {
+    memset(eeprom, 0xFF, sizeof(eeprom)); // Erased flash
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+}
+
+int64_t halMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+uint32_t halMillis() {
+    return (uint32_t)(halMicros() / 1000);
+}
+
+void halDelayMs(uint32_t ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void halDelayUs(uint32_t us) {
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+uint32_t halRandom() {
+    thread_local std::mt19937 generator(std::random_device{}());
+    return generator();
+}
+
+// glibc only reports the main arena; enough to see drift in the logic's own allocations.
+// Called from the network task only.
+HalHeapStats halHeapStats() {
+    static uint32_t minFree = UINT32_MAX;
+    struct mallinfo2 info = mallinfo2();
+    HalHeapStats stats;
+    stats.freeBytes = (uint32_t)info.fordblks;
+    if (stats.freeBytes < minFree) {
+        minFree = stats.freeBytes;
+    }
+    stats.minFreeBytes = minFree;
+    stats.largestBlock = 0;
+    stats.usedBytes = (uint32_t)info.uordblks;
+    return stats;
+}
+
+// Stack size, priority and core only matter on the device
+void halStartTask(HalTask task, const char* name, void (*entry)(), uint32_t stackSize, uint8_t priority, int core) {
+    std::thread(entry).detach();
+}
+
+// std::thread stacks are not tracked
+uint32_t halTaskStackFree(HalTask task) {
+    return 0;
+}
+
+void halNotify(HalTask task) {
+    TaskSlot& slot = taskSlots[task];
+    {
+        std::lock_guard<std::mutex> guard(slot.mutex);
+        slot.notified = true;
+    }
+    slot.wake.notify_one();
+}
+
+void halNotifyFromIsr(HalTask task) {
+    halNotify(task);
+}
+
+void halWait(HalTask self, uint32_t timeoutMs) {
+    TaskSlot& slot = taskSlots[self];
+    std::unique_lock<std::mutex> guard(slot.mutex);
+    int64_t timeoutAt = halMicros() + (int64_t)timeoutMs * 1000;
+    for (;;) {
+        if (slot.notified) {
+            slot.notified = false;
+            return;
+        }
+        int64_t now = halMicros();
+        if (slot.wakeAtUs <= now) {
+            slot.wakeAtUs = HAL_NEVER; // One-shot
+            return;
+        }
+        if (timeoutAt <= now) {
+            return;
+        }
+        int64_t until = slot.wakeAtUs < timeoutAt ? slot.wakeAtUs : timeoutAt;
+        slot.wake.wait_for(guard, std::chrono::microseconds(until - now));
+    }
+}
+
+void halWakeAt(HalTask task, int64_t deadlineUs) {
+    TaskSlot& slot = taskSlots[task];
+    {
+        std::lock_guard<std::mutex> guard(slot.mutex);
+        slot.wakeAtUs = deadlineUs;
+    }
+    slot.wake.notify_one(); // Let a waiting task pick up the new deadline
+}
+
+int halCoreId() {
+    return sched_getcpu();
+}
+
+void halInputsBegin(void (*onChange)(uint8_t index)) {
+    inputChangeHandler = onChange;
+}
+
+uint8_t halReadInputs() {
+    return inputLevels.load();
+}
+
+void simSetInput(uint8_t index, bool active) {
+    uint8_t bit = 1 << index;
+    uint8_t previous = active ? inputLevels.fetch_or(bit) : inputLevels.fetch_and(~bit);
+    if (((previous & bit) != 0) != active && inputChangeHandler != nullptr) {
+        inputChangeHandler(index);
+    }
+}
+
+namespace {
+std::atomic<uint32_t> samplerGeneration(0); // Bumped to retire the running sampler thread
+}
+
+// The sampler is a thread; its ticks jitter with the scheduler, which the capture
+// treats like late interrupts
+bool halSamplerStart(uint32_t periodUs, void (*onSample)()) {
+    uint32_t generation = ++samplerGeneration;
+    std::thread([periodUs, onSample, generation]() {
+        auto next = std::chrono::steady_clock::now();
+        while (samplerGeneration.load() == generation) {
+            next += std::chrono::microseconds(periodUs);
+            std::this_thread::sleep_until(next);
+            if (samplerGeneration.load() == generation) {
+                onSample();
+            }
+        }
+    }).detach();
+    return true;
+}
+
+void halSamplerStop() {
+    ++samplerGeneration;
+}
+
+// Nothing to save on the host: the policy runs, the machine stays awake
+bool halPowerSet(HalPowerState state) {
+    return false;
+}
+
+// No PSRAM distinction on the host
+void* halAlloc(size_t size, HalMemory memory) {
+    return malloc(size);
+}
+
+I2cBus& halRelayBus() {
+    return simRelayBus();
+}
+
+void halConsoleWrite(const char* data, size_t length) {
+    fwrite(data, 1, length, stdout);
+}
+
+void hostConsoleEnableStdin(bool enabled) {
+    consoleStdin = enabled;
+}
+
+bool halConsoleReadLine(char* line, size_t capacity) {
+    static char pending[HAL_CONSOLE_LINE_MAX];
+    static size_t length = 0;
+    if (!consoleStdin) {
+        return false;
+    }
+
+    pollfd fd = {STDIN_FILENO, POLLIN, 0};
+    while (poll(&fd, 1, 0) > 0 && (fd.revents & POLLIN)) {
+        char c;
+        if (read(STDIN_FILENO, &c, 1) != 1) {
+            consoleStdin = false; // EOF
+            return false;
+        }
+        if (c == '\n') {
+            size_t copied = length < capacity - 1 ? length : capacity - 1;
+            memcpy(line, pending, copied);
+            line[copied] = '\0';
+            length = 0;
+            return true;
+        }
+        if (length < sizeof(pending)) {
+            pending[length++] = c;
+        }
+    }
+    return false;
+}
+
+// The host build has no provisioning trigger; stdin lines are handled at any time
+bool halProvisioningRequested() {
+    return false;
+}
+
+ConfigFlash& halConfigFlash() {
+    return configFlash;
+}
+
+void halLegacyConfigLoad(void* data, size_t size) {
+    memcpy(data, eeprom, size < EEPROM_SIZE ? size : EEPROM_SIZE);
+}
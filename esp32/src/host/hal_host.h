@@ -0,0 +1,15 @@
+// Host (Linux) HAL extras: simulated inputs and console capture
+//
+// The HAL itself is declared in ../hal.h; these hooks let the host entry point drive
+// the simulated hardware the way the field would.
+
+#pragma once
+
+#include "../hal.h"
+
+// Set simulated input index active (pulled low) or inactive and raise its "interrupt"
+// from the calling thread, like an edge on the real pin
+void simSetInput(uint8_t index, bool active);
+
+// Lines typed on stdin are fed to halConsoleReadLine(); off when stdin is not a TTY
+void hostConsoleEnableStdin(bool enabled);
@@ -0,0 +1,830 @@
+// Host (Linux) entry point: the firmware logic against simulated hardware
+//
+//   relay_host [options]             Start a local WebSocket stand-in server, connect the
+//                                    firmware to it and run the latency/throughput benchmark
+//   relay_host --server HOST:PORT[,HOST:PORT...] [--ca FILE]
+//                                    Connect to a real backend (server.js listens on 40000)
+//                                    and run until killed; serial config lines come from stdin.
+//                                    Further endpoints are the backups (hot standby, failover).
+//                                    With --ca the links are wss, pinned to the PEM in FILE.
+//
+// Options: --protocol json|bin1  wire protocol the stand-in selects in register_ack
+//          --commands N          relay_control round trips to time (default 1000)
+//          --edges N             simulated input edges to time (default 200)
+//          --drops N             server-side disconnects to time the reconnect of (default 5)
+//          --mac AA:BB:CC:DD:EE:FF
+//          --no-bus-timing       do not spend simulated I2C wire time
+//          --lan-token T         run the LAN server (see hal.h) with client token T
+//          --lan-port N          port for it on 127.0.0.1 (default 8081; the device uses 81)
+//          --tls                 stand-in over wss with a fresh self-signed certificate the
+//                                firmware pins; also times full vs resumed TLS handshakes.
+//                                Those are the host OpenSSL link's: on the ESP32,
+//                                WiFiClientSecure does a full handshake on every connect.
+//          --handshakes N        handshakes of each kind to time (default 50)
+//
+// The firmware runs exactly as on the board: the same I/O, network and log tasks (as
+// threads), the same TCA9554 driver over SimTca9554Bus and the same edge path fed by
+// simSetInput(). The benchmark exits non-zero if an ack is missing or the simulated
+// output register does not end up where the commands put it.
+
+#include "../hal.h"
+#include "../link_health.h"
+#include "../relay_app.h"
+#include "../relay_log.h"
+#include "../relay_protocol.h"
+#include "hal_host.h"
+#include "sim_tca9554.h"
+#include "ws_link.h"
+#include <ArduinoJson.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+const uint32_t LINK_RETRY_BASE_MS = 250; // Same policy as the device link (main.cpp)
+const uint32_t LINK_RETRY_CAP_MS = 30000;
+const uint32_t LINK_PING_INTERVAL_MS = 1000;
+const uint32_t LINK_PONG_TIMEOUT_MS = 3000;
+const int HOST_CONNECT_TIMEOUT_MS = 2000;
+const int BENCH_REPLY_TIMEOUT_MS = 2000;
+const int BENCH_PIPELINE_WINDOW = 8; // Outstanding commands; below the firmware's 16-entry queue
+
+const int HOST_LAN_PORT = 8081; // HAL_LAN_PORT needs root here
+
+// Upstream links: failover.active() carries the protocol, the other one is the hot standby
+struct UpstreamLink {
+    WsSocket socket;
+    ReconnectBackoff backoff{LINK_RETRY_BASE_MS, LINK_RETRY_CAP_MS};
+    LinkHeartbeat heartbeat{LINK_PING_INTERVAL_MS, LINK_PONG_TIMEOUT_MS};
+    uint32_t nextConnectMs = 0;
+    uint32_t connectMs = 0;      // Of the last successful connect (blocking: TCP, TLS, upgrade)
+    int32_t connectHeapBytes = 0; // OpenSSL heap it kept (session and buffers)
+};
+
+UpstreamLink upstreamLinks[UPSTREAM_LINKS];
+UpstreamFailover failover;
+WsTlsClient endpointTls[UpstreamFailover::MAX_ENDPOINTS]; // Pin and session per endpoint
+bool upstreamTls = false;     // config.server_tls when the endpoints were loaded
+bool upstreamStarted = false; // Endpoints loaded from config
+WsListener lanListener;
+WsSocket lanClients[HAL_LAN_CLIENTS];
+HalLinks lanOpen = 0;          // Clients appOnLinkConnected() was called for
+std::atomic<bool> lanEnabled(false);
+bool lanListening = false;
+int lanPort = HOST_LAN_PORT;
+std::atomic<bool> networkEnabled(false);
+bool linkEverUp = false;
+int64_t linkDownSinceUs = 0;
+uint32_t linkReconnects = 0;
+uint32_t linkLastOutageMs = 0;
+char macAddressStr[18] = "02:00:00:00:00:01"; // Locally administered
+char ipAddressStr[16] = "127.0.0.1";
+bool tlsHeapTracked = false;
+
+struct Options {
+    const char* server = nullptr;
+    bool binary = false;
+    int commands = 1000;
+    int edges = 200;
+    int drops = 5;
+    bool busTiming = true;
+    const char* lanToken = nullptr;
+    const char* caFile = nullptr;
+    bool tls = false;
+    int handshakes = 50;
+};
+
+} // namespace
+
+// ---- Upstream and LAN links (HAL) ----
+
+void halNetworkBegin() {
+    networkEnabled = true;
+}
+
+// Link dropped or a connection attempt failed
+static void linkDown(uint8_t slot) {
+    UpstreamLink& link = upstreamLinks[slot];
+    bool wasActive = slot == failover.active() && failover.up(slot);
+    int8_t endpoint = failover.endpoint(slot);
+    if (failover.disconnected(slot, halMillis())) {
+        LOG_W("Endpoint %d lost, standby on endpoint %d took over", endpoint, failover.endpoint(failover.active()));
+        appOnLinkConnected(HAL_LINK_UPSTREAM);
+    } else if (wasActive) {
+        linkDownSinceUs = halMicros();
+        appOnLinkDisconnected(HAL_LINK_UPSTREAM);
+    }
+    failover.retarget(slot, halMillis());
+    link.nextConnectMs = halMillis() + link.backoff.nextDelayMs(halRandom());
+}
+
+static void linkUp(uint8_t slot) {
+    UpstreamLink& link = upstreamLinks[slot];
+    int64_t now = halMicros();
+    link.backoff.reset();
+    link.heartbeat.reset(now);
+    if (!failover.connected(slot, halMillis())) {
+        LOG_I("Standby link up on endpoint %d", failover.endpoint(slot));
+        return;
+    }
+    if (linkEverUp) {
+        linkReconnects++;
+        linkLastOutageMs = (uint32_t)((now - linkDownSinceUs) / 1000);
+        LOG_I("Link restored after %u ms (reconnect #%u)", linkLastOutageMs, linkReconnects);
+    }
+    linkEverUp = true;
+    appOnLinkConnected(HAL_LINK_UPSTREAM);
+}
+
+// Standby first, so the active link's drop is not taken for a failover
+static void stopUpstream() {
+    uint8_t order[UPSTREAM_LINKS] = {failover.standby(), failover.active()};
+    for (uint8_t slot : order) {
+        upstreamLinks[slot].socket.close();
+        if (failover.up(slot)) {
+            linkDown(slot);
+        }
+    }
+    upstreamStarted = false;
+}
+
+static void serviceUpstream(uint8_t slot) {
+    UpstreamLink& link = upstreamLinks[slot];
+    if (failover.endpoint(slot) < 0) {
+        return;
+    }
+
+    if (!link.socket.isOpen()) {
+        if (failover.up(slot)) {
+            linkDown(slot);
+        }
+        if ((int32_t)(halMillis() - link.nextConnectMs) < 0) {
+            return;
+        }
+        const char* host;
+        int port;
+        appUpstreamEndpoint((uint8_t)failover.endpoint(slot), host, port);
+        // The backend keeps a hot standby out of its live relays (see the device's upstreamUrl())
+        char path[64];
+        snprintf(path, sizeof(path), "/elevator?id=%s&role=%s", macAddressStr,
+                 slot == failover.active() ? "active" : "standby");
+        WsTlsClient& tls = endpointTls[failover.endpoint(slot)];
+        int64_t start = halMicros();
+        size_t heapBefore = wsTlsHeap().liveBytes;
+        if (!link.socket.connect(host, port, path, HOST_CONNECT_TIMEOUT_MS, upstreamTls ? &tls : nullptr)) {
+            linkDown(slot);
+            return;
+        }
+        link.connectMs = (uint32_t)((halMicros() - start) / 1000);
+        link.connectHeapBytes = (int32_t)(wsTlsHeap().liveBytes - heapBefore);
+        linkUp(slot);
+        return;
+    }
+
+    // Only the active link's frames reach the app
+    WsMessage message;
+    while (link.socket.receive(message, 0)) {
+        if (message.opcode == WS_OP_TEXT) {
+            if (slot == failover.active()) {
+                appOnLinkText(HAL_LINK_UPSTREAM, message.payload.data(), message.payload.size());
+            }
+        } else if (message.opcode == WS_OP_BINARY) {
+            if (slot == failover.active()) {
+                appOnLinkBinary(HAL_LINK_UPSTREAM, message.payload.data(), message.payload.size());
+            }
+        } else if (link.heartbeat.pongReceived(message.payload.data(), message.payload.size(), halMicros())) {
+            failover.measured(slot, link.heartbeat.lastRttUs());
+        }
+    }
+
+    int64_t now = halMicros();
+    uint8_t ping[LINK_PING_PAYLOAD_SIZE];
+    if (link.socket.isOpen() && link.heartbeat.pingDue(now, ping)) {
+        link.socket.sendPing(ping, sizeof(ping));
+    }
+    if (link.socket.isOpen() && link.heartbeat.timedOut(now)) {
+        LOG_W("No pong for %u ms, dropping half-open link to endpoint %d", LINK_PONG_TIMEOUT_MS, failover.endpoint(slot));
+        link.socket.close();
+    }
+    if (!link.socket.isOpen()) {
+        linkDown(slot);
+    }
+}
+
+// Accept, read and drop LAN clients; the stand-in for the device's WebSocketsServer
+static void serviceLanServer() {
+    if (!lanEnabled) {
+        halLinkClose(lanOpen);
+    } else if (!lanListening) {
+        lanListening = lanListener.listen(lanPort);
+        if (lanListening) {
+            LOG_I("LAN server listening on 127.0.0.1:%d", lanPort);
+        } else {
+            LOG_E("LAN server cannot listen on port %d", lanPort);
+            lanEnabled = false;
+        }
+    } else {
+        for (;;) {
+            int slot = 0;
+            while (slot < HAL_LAN_CLIENTS && lanClients[slot].isOpen()) {
+                slot++;
+            }
+            WsSocket refused;
+            WsSocket& socket = slot < HAL_LAN_CLIENTS ? lanClients[slot] : refused;
+            if (!lanListener.accept(socket, 0)) {
+                break;
+            }
+            if (&socket == &refused) {
+                LOG_W("LAN server full, connection refused");
+                continue;
+            }
+            lanOpen |= halLanLink(slot);
+            appOnLinkConnected(halLanLink(slot));
+        }
+    }
+
+    for (uint8_t i = 0; i < HAL_LAN_CLIENTS; i++) {
+        HalLinks link = halLanLink(i);
+        WsMessage message;
+        while ((lanOpen & link) && lanClients[i].receive(message, 0)) {
+            if (message.opcode == WS_OP_TEXT) {
+                appOnLinkText(link, message.payload.data(), message.payload.size());
+            } else if (message.opcode == WS_OP_BINARY) {
+                appOnLinkBinary(link, message.payload.data(), message.payload.size());
+            }
+        }
+        if ((lanOpen & link) && !lanClients[i].isOpen()) {
+            lanOpen &= ~link;
+            appOnLinkDisconnected(link);
+        }
+    }
+}
+
+void halNetworkLoop() {
+    if (!networkEnabled) {
+        return;
+    }
+    serviceLanServer();
+
+    if (!upstreamStarted) {
+        failover.configure(appUpstreamEndpointCount(), halMillis());
+        // New config: sessions from before are dropped along with the old pin
+        const char* ca = appUpstreamCa();
+        upstreamTls = ca != nullptr;
+        bool pinned = true;
+        for (WsTlsClient& tls : endpointTls) {
+            pinned &= tls.configure(ca);
+        }
+        if (upstreamTls && !pinned) {
+            LOG_E("server_ca does not parse, wss links cannot connect");
+        }
+        for (uint8_t slot = 0; slot < UPSTREAM_LINKS; slot++) {
+            upstreamLinks[slot].backoff.reset();
+            upstreamLinks[slot].nextConnectMs = halMillis();
+            failover.retarget(slot, halMillis());
+        }
+        upstreamStarted = true;
+    }
+    for (uint8_t slot = 0; slot < UPSTREAM_LINKS; slot++) {
+        serviceUpstream(slot);
+    }
+
+    uint32_t nowMs = halMillis();
+    if (failover.switchDue(nowMs)) {
+        LOG_I("Standby endpoint %d is faster, switching over", failover.endpoint(failover.active()));
+        char frame[96];
+        size_t length = appStandbyRegistration(frame, sizeof(frame));
+        if (length > 0) {
+            upstreamLinks[failover.standby()].socket.sendText(frame, length); // The demoted link
+        }
+        appOnLinkConnected(HAL_LINK_UPSTREAM);
+    }
+    if (failover.reviewStandby(nowMs)) {
+        uint8_t standby = failover.standby();
+        LOG_I("Moving the standby link off endpoint %d", failover.endpoint(standby));
+        upstreamLinks[standby].socket.close(); // Redialed by serviceUpstream()
+    }
+}
+
+// Endpoints are reloaded from the changed config on the next halNetworkLoop()
+void halNetworkRestart() {
+    stopUpstream();
+}
+
+// The host links are polled each pass; a frame waits at most one NET_POLL_MS poll
+void halNetworkWait(uint32_t timeoutMs) {
+    halWait(HAL_TASK_NET, timeoutMs);
+}
+
+static_assert(WS_MAX_HEADER == HAL_LINK_HEADROOM, "frame headroom must fit a WebSocket header");
+
+void halLanServe(bool enabled) {
+    lanEnabled = enabled;
+}
+
+// The disconnect is reported by the next serviceLanServer()
+void halLinkClose(HalLinks links) {
+    for (uint8_t i = 0; i < HAL_LAN_CLIENTS; i++) {
+        if (links & halLanLink(i)) {
+            lanClients[i].close();
+        }
+    }
+}
+
+// Server frames are sent unmasked, so the upstream link masking in place goes last
+bool halLinkSendFrame(uint8_t* frame, size_t length, bool binary, HalLinks links) {
+    uint8_t opcode = binary ? WS_OP_BINARY : WS_OP_TEXT;
+    bool sent = true;
+    for (uint8_t i = 0; i < HAL_LAN_CLIENTS; i++) {
+        if (links & lanOpen & halLanLink(i)) {
+            sent &= lanClients[i].sendInPlace(opcode, frame, length);
+        }
+    }
+    if (links & HAL_LINK_UPSTREAM) {
+        sent &= upstreamLinks[failover.active()].socket.sendInPlace(opcode, frame, length);
+    }
+    return sent;
+}
+
+const char* halMacAddress() {
+    return macAddressStr;
+}
+
+const char* halIpAddress() {
+    return ipAddressStr;
+}
+
+HalLinkStats halLinkStats() {
+    const UpstreamLink& link = upstreamLinks[failover.active()];
+    return {link.heartbeat.lastRttUs(), link.heartbeat.avgRttUs(), linkReconnects, linkLastOutageMs,
+            failover.endpoint(failover.active()), failover.switches(), link.socket.isTls(), link.connectMs, link.connectHeapBytes, 0, 0};
+}
+
+// ---- Stand-in server benchmark ----
+
+namespace {
+
+enum DeviceMessageKind {
+    DEVICE_MSG_OTHER,
+    DEVICE_MSG_REGISTER,
+    DEVICE_MSG_RELAY_ACK,
+    DEVICE_MSG_INPUT_CHANGED
+};
+
+struct DeviceMessage {
+    DeviceMessageKind kind;
+    int index;          // Relay or input
+    bool success;
+    uint32_t latencyUs; // As reported by the device
+    bool traced;        // Relay acks for traced commands
+    RelayTrace trace;
+};
+
+// Wait for the next data frame from the device and classify it
+bool receiveDeviceMessage(WsSocket& device, DeviceMessage& out, int timeoutMs) {
+    WsMessage message;
+    int64_t deadline = halMicros() + (int64_t)timeoutMs * 1000;
+    while (!device.receive(message, 1)) {
+        if (!device.isOpen() || halMicros() > deadline) {
+            return false;
+        }
+    }
+
+    out = DeviceMessage{DEVICE_MSG_OTHER, -1, false, 0, false, {}};
+    if (message.opcode == WS_OP_BINARY) {
+        const uint8_t* p = message.payload.data() + RELAY_PROTO_HEADER_SIZE;
+        switch (relayProtoFrameType(message.payload.data(), message.payload.size())) {
+        case RELAY_MSG_RELAY_ACK:
+            out.kind = DEVICE_MSG_RELAY_ACK;
+            out.index = p[0];
+            out.success = (p[1] & RELAY_ACK_SUCCESS) != 0;
+            out.latencyUs = relayProtoGetU32(p + 4);
+            break;
+        case RELAY_MSG_RELAY_ACK_TRACE:
+            out.kind = DEVICE_MSG_RELAY_ACK;
+            out.index = p[0];
+            out.success = (p[1] & RELAY_ACK_SUCCESS) != 0;
+            out.traced = true;
+            out.trace.id = relayProtoGetU32(p + 4);
+            out.trace.rx_us = relayProtoGetU32(p + 8);
+            out.trace.parse_us = out.trace.rx_us + relayProtoGetU32(p + 12);
+            out.trace.io_us = out.trace.rx_us + relayProtoGetU32(p + 16);
+            out.trace.i2c_us = out.trace.rx_us + relayProtoGetU32(p + 20);
+            out.trace.ack_us = out.trace.rx_us + relayProtoGetU32(p + 24);
+            out.latencyUs = (uint32_t)(out.trace.i2c_us - out.trace.parse_us);
+            break;
+        case RELAY_MSG_INPUT_CHANGED:
+            out.kind = DEVICE_MSG_INPUT_CHANGED;
+            out.index = p[0];
+            out.latencyUs = relayProtoGetU32(p + 12);
+            break;
+        }
+        return true;
+    }
+
+    StaticJsonDocument<512> doc;
+    if (deserializeJson(doc, message.payload.data(), message.payload.size())) {
+        return true;
+    }
+    const char* type = doc["type"] | "";
+    if (strcmp(type, "register") == 0) {
+        out.kind = DEVICE_MSG_REGISTER;
+    } else if (strcmp(type, "relay_control_ack") == 0) {
+        out.kind = DEVICE_MSG_RELAY_ACK;
+        out.index = doc["relay"] | -1;
+        out.success = doc["success"] | false;
+        out.latencyUs = doc["latency_us"] | 0;
+        out.traced = doc.containsKey("trace");
+        out.trace.id = doc["trace"] | (uint32_t)0;
+        out.trace.rx_us = doc["t_us"]["rx"] | (int64_t)0;
+        out.trace.parse_us = doc["t_us"]["parse"] | (int64_t)0;
+        out.trace.io_us = doc["t_us"]["io"] | (int64_t)0;
+        out.trace.i2c_us = doc["t_us"]["i2c"] | (int64_t)0;
+        out.trace.ack_us = doc["t_us"]["ack"] | (int64_t)0;
+    } else if (strcmp(type, "input_changed") == 0) {
+        out.kind = DEVICE_MSG_INPUT_CHANGED;
+        out.index = doc["inputIndex"] | -1;
+        out.latencyUs = doc["latency_us"] | 0;
+    }
+    return true;
+}
+
+bool waitFor(WsSocket& device, DeviceMessageKind kind, int index, DeviceMessage& out) {
+    int64_t deadline = halMicros() + (int64_t)BENCH_REPLY_TIMEOUT_MS * 1000;
+    while (halMicros() < deadline) {
+        if (receiveDeviceMessage(device, out, BENCH_REPLY_TIMEOUT_MS) && out.kind == kind &&
+            (index < 0 || out.index == index)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// trace 0 sends an untraced command
+bool sendRelayControl(WsSocket& device, bool binary, uint8_t relay, bool state, uint32_t trace = 0) {
+    if (binary) {
+        uint8_t frame[RELAY_PROTO_MAX_FRAME];
+        size_t length = trace ? encodeTracedRelayControlFrame(frame, sizeof(frame), relay, state, trace)
+                              : encodeRelayControlFrame(frame, sizeof(frame), relay, state);
+        return device.sendBinary(frame, length);
+    }
+    char message[96];
+    int length = trace ? snprintf(message, sizeof(message), "{\"type\":\"relay_control\",\"relay\":%u,\"state\":%s,\"trace\":%u}",
+                                  relay, state ? "true" : "false", trace)
+                       : snprintf(message, sizeof(message), "{\"type\":\"relay_control\",\"relay\":%u,\"state\":%s}",
+                                  relay, state ? "true" : "false");
+    return device.sendText(message, length);
+}
+
+void printLatencies(const char* label, std::vector<int64_t>& samples, const char* unit = "us") {
+    if (samples.empty()) {
+        printf("%-28s no samples\n", label);
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&](double p) { return samples[(size_t)(p * (samples.size() - 1))]; };
+    printf("%-28s n=%-6zu p50=%-6lld p90=%-6lld p99=%-6lld max=%-6lld %s\n", label, samples.size(),
+           (long long)percentile(0.50), (long long)percentile(0.90), (long long)percentile(0.99),
+           (long long)samples.back(), unit);
+}
+
+int runBenchmark(WsListener& listener, const Options& options) {
+    WsSocket device;
+    if (!listener.accept(device, 10000)) {
+        fprintf(stderr, "stand-in: firmware did not connect\n");
+        return 1;
+    }
+    DeviceMessage reply;
+    if (!waitFor(device, DEVICE_MSG_REGISTER, -1, reply)) {
+        fprintf(stderr, "stand-in: no register message\n");
+        return 1;
+    }
+    char registerAck[64];
+    int length = snprintf(registerAck, sizeof(registerAck), "{\"type\":\"register_ack\",\"protocol\":\"%s\"}",
+                          options.binary ? "bin1" : "json");
+    device.sendText(registerAck, length);
+    halDelayMs(100); // Let the ack land before the first binary command
+
+    // Closed loop: one traced command in flight, stand-in send -> ack received
+    std::vector<int64_t> roundTrips;
+    std::vector<int64_t> deviceLatencies;
+    std::vector<int64_t> stageParse, stageQueue, stageI2c, stageAck, stageWire;
+    uint8_t expectedRelays = 0;
+    int failures = 0;
+    for (int i = 0; i < options.commands; i++) {
+        uint8_t relay = i % 8;
+        bool state = (expectedRelays & (1 << relay)) == 0;
+        int64_t sentUs = halMicros();
+        uint32_t trace = i + 1;
+        sendRelayControl(device, options.binary, relay, state, trace);
+        if (!waitFor(device, DEVICE_MSG_RELAY_ACK, relay, reply) || !reply.success ||
+            !reply.traced || reply.trace.id != trace) {
+            failures++;
+            continue;
+        }
+        int64_t roundTrip = halMicros() - sentUs;
+        const RelayTrace& t = reply.trace;
+        roundTrips.push_back(roundTrip);
+        deviceLatencies.push_back(reply.latencyUs);
+        stageParse.push_back(t.parse_us - t.rx_us);
+        stageQueue.push_back(t.io_us - t.parse_us);
+        stageI2c.push_back(t.i2c_us - t.io_us);
+        stageAck.push_back(t.ack_us - t.i2c_us);
+        stageWire.push_back(roundTrip - (t.ack_us - t.rx_us)); // Both socket hops + stand-in
+        expectedRelays ^= 1 << relay;
+    }
+
+    // Pipelined: keep BENCH_PIPELINE_WINDOW commands in flight
+    int pipelined = options.commands;
+    int sent = 0;
+    int acked = 0;
+    int64_t startUs = halMicros();
+    while (acked < pipelined) {
+        while (sent < pipelined && sent - acked < BENCH_PIPELINE_WINDOW) {
+            uint8_t relay = sent % 8;
+            sendRelayControl(device, options.binary, relay, (sent / 8) % 2 == 0);
+            sent++;
+        }
+        if (!waitFor(device, DEVICE_MSG_RELAY_ACK, -1, reply)) {
+            failures += pipelined - acked;
+            break;
+        }
+        if (!reply.success) {
+            failures++;
+        }
+        acked++;
+    }
+    double elapsedS = (halMicros() - startUs) / 1e6;
+    // The last pass of 8 decides the final state
+    int lastPass = (pipelined - 1) / 8;
+    for (int relay = 0; relay < 8; relay++) {
+        int lastIndex = lastPass * 8 + relay < pipelined ? lastPass * 8 + relay : (lastPass - 1) * 8 + relay;
+        if (lastIndex >= 0) {
+            bool on = (lastIndex / 8) % 2 == 0;
+            expectedRelays = on ? (expectedRelays | (1 << relay)) : (expectedRelays & ~(1 << relay));
+        }
+    }
+
+    // Input edges: simulated pin change -> input_changed at the stand-in
+    std::vector<int64_t> edgeLatencies;
+    uint8_t inputLevels = 0;
+    for (int i = 0; i < options.edges; i++) {
+        uint8_t index = i % 8;
+        inputLevels ^= 1 << index;
+        int64_t changedUs = halMicros();
+        simSetInput(index, (inputLevels >> index) & 1);
+        if (waitFor(device, DEVICE_MSG_INPUT_CHANGED, index, reply)) {
+            edgeLatencies.push_back(halMicros() - changedUs);
+        } else {
+            failures++;
+        }
+        halDelayMs(1); // 8 inputs x 1 ms keeps each pin outside the 5 ms debounce window
+    }
+
+    // Reconnect: stand-in drops the socket -> device registered again
+    std::vector<int64_t> recoveries;
+    int resumedReconnects = 0;
+    for (int i = 0; i < options.drops; i++) {
+        int64_t droppedUs = halMicros();
+        device.close();
+        if (!listener.accept(device, 10000) || !waitFor(device, DEVICE_MSG_REGISTER, -1, reply)) {
+            fprintf(stderr, "stand-in: firmware did not reconnect\n");
+            return 1;
+        }
+        recoveries.push_back(halMicros() - droppedUs);
+        resumedReconnects += device.tlsResumed();
+        device.sendText(registerAck, length);
+        halDelayMs(100);
+    }
+
+    halDelayMs(50); // Deferred read-back
+    uint8_t actualRelays = simRelayBus().outputs();
+    SimTca9554Counters bus = simRelayBus().counters();
+
+    printf("\n=== Host benchmark (%s protocol, simulated I2C %s) ===\n", options.binary ? "bin1" : "json",
+           options.busTiming ? "timed" : "untimed");
+    printLatencies("relay_control round trip", roundTrips);
+    printLatencies("device enqueue -> I2C done", deviceLatencies);
+    printLatencies("  stage parse", stageParse);
+    printLatencies("  stage queue", stageQueue);
+    printLatencies("  stage i2c", stageI2c);
+    printLatencies("  stage ack", stageAck);
+    printLatencies("  outside the device", stageWire);
+    printLatencies("input edge -> stand-in", edgeLatencies);
+    printLatencies("drop -> registered again", recoveries);
+    if (options.tls) {
+        printf("%-28s %d of %d reconnects resumed the TLS session\n", "", resumedReconnects, options.drops);
+    }
+    printf("%-28s %d commands in %.3f s = %.0f commands/s\n", "pipelined throughput", acked, elapsedS,
+           elapsedS > 0 ? acked / elapsedS : 0.0);
+    printf("%-28s writes=%u reads=%u injected_failures=%u recoveries=%u\n", "simulated TCA9554", bus.writes, bus.reads,
+           bus.nacks, bus.recoveries);
+    printf("%-28s expected 0x%02X, output register 0x%02X\n", "final relay state", expectedRelays, actualRelays);
+    printf("%-28s %d\n", "failures", failures);
+
+    return failures == 0 && actualRelays == expectedRelays ? 0 : 1;
+}
+
+// Connect (TCP, TLS, upgrade) to a wss stand-in in a thread of its own: first with a
+// full handshake each time, then resuming the session from the previous connect. Heap
+// is OpenSSL's in this thread, so the stand-in's side of the handshake is not counted.
+int runTlsHandshakeBenchmark(const Options& options) {
+    WsTlsServer server;
+    WsListener listener;
+    WsTlsClient client;
+    if (!server.generate() || !listener.listen(0, &server) || !client.configure(server.certificatePem().c_str())) {
+        fprintf(stderr, "stand-in: cannot set up the TLS handshake benchmark\n");
+        return 1;
+    }
+    int connections = options.handshakes * 2;
+    std::thread standIn([&] {
+        for (int i = 0; i < connections; i++) {
+            WsSocket socket;
+            listener.accept(socket, 2000);
+        }
+    });
+
+    std::vector<int64_t> times[2], peaks[2], kept[2], allocated[2];
+    int failures = 0;
+    int unexpected = 0; // Full handshakes that resumed or resumptions that did not
+    for (int i = 0; i < connections; i++) {
+        int resume = i >= options.handshakes;
+        if (!resume) {
+            client.forgetSession();
+        }
+        WsSocket socket;
+        wsTlsResetPeak();
+        WsTlsHeap before = wsTlsHeap();
+        int64_t startUs = halMicros();
+        if (!socket.connect("127.0.0.1", listener.port(), "/elevator", BENCH_REPLY_TIMEOUT_MS, &client)) {
+            failures++;
+            continue;
+        }
+        times[resume].push_back(halMicros() - startUs);
+        WsTlsHeap after = wsTlsHeap();
+        peaks[resume].push_back((int64_t)(after.peakBytes - before.liveBytes));
+        kept[resume].push_back((int64_t)after.liveBytes - (int64_t)before.liveBytes);
+        allocated[resume].push_back((int64_t)(after.allocatedBytes - before.allocatedBytes));
+        unexpected += socket.tlsResumed() != (resume != 0);
+    }
+    standIn.join();
+
+    printf("\n=== TLS handshake benchmark (P-256, %zu byte records, client side) ===\n", WS_TLS_MAX_FRAGMENT);
+    const char* kinds[2] = {"full", "resumed"};
+    for (int kind = 0; kind < 2; kind++) {
+        char label[40];
+        snprintf(label, sizeof(label), "%s: connect+upgrade", kinds[kind]);
+        printLatencies(label, times[kind]);
+        if (tlsHeapTracked) {
+            snprintf(label, sizeof(label), "%s: heap peak", kinds[kind]);
+            printLatencies(label, peaks[kind], "B");
+            snprintf(label, sizeof(label), "%s: heap held open", kinds[kind]);
+            printLatencies(label, kept[kind], "B");
+            snprintf(label, sizeof(label), "%s: heap allocated", kinds[kind]);
+            printLatencies(label, allocated[kind], "B");
+        }
+    }
+    if (!tlsHeapTracked) {
+        printf("%-28s not tracked (OpenSSL was in use before main)\n", "heap");
+    }
+    printf("%-28s %d failed, %d resumed wrongly\n", "handshakes", failures, unexpected);
+    return failures == 0 && unexpected == 0 ? 0 : 1;
+}
+
+bool parseOptions(int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (strcmp(arg, "--server") == 0 && value) {
+            options.server = value;
+            i++;
+        } else if (strcmp(arg, "--protocol") == 0 && value) {
+            options.binary = strcmp(value, "bin1") == 0;
+            i++;
+        } else if (strcmp(arg, "--commands") == 0 && value) {
+            options.commands = atoi(value);
+            i++;
+        } else if (strcmp(arg, "--edges") == 0 && value) {
+            options.edges = atoi(value);
+            i++;
+        } else if (strcmp(arg, "--drops") == 0 && value) {
+            options.drops = atoi(value);
+            i++;
+        } else if (strcmp(arg, "--mac") == 0 && value) {
+            snprintf(macAddressStr, sizeof(macAddressStr), "%s", value);
+            i++;
+        } else if (strcmp(arg, "--no-bus-timing") == 0) {
+            options.busTiming = false;
+        } else if (strcmp(arg, "--lan-token") == 0 && value) {
+            options.lanToken = value;
+            i++;
+        } else if (strcmp(arg, "--lan-port") == 0 && value) {
+            lanPort = atoi(value);
+            i++;
+        } else if (strcmp(arg, "--ca") == 0 && value) {
+            options.caFile = value;
+            i++;
+        } else if (strcmp(arg, "--tls") == 0) {
+            options.tls = true;
+        } else if (strcmp(arg, "--handshakes") == 0 && value) {
+            options.handshakes = atoi(value);
+            i++;
+        } else {
+            fprintf(stderr, "usage: %s [--server HOST:PORT[,...] [--ca FILE]] [--protocol json|bin1] [--commands N] "
+                            "[--edges N] [--drops N] [--mac MAC] [--no-bus-timing] [--lan-token T] [--lan-port N] "
+                            "[--tls] [--handshakes N]\n", argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    tlsHeapTracked = wsTlsTrackHeap(); // Before anything touches OpenSSL
+    if (!parseOptions(argc, argv, options)) {
+        return 2;
+    }
+
+    halBegin();
+    simRelayBus().setTiming(options.busTiming);
+
+    // Embedded configuration, as if programmed at build time
+    snprintf(config.device_id, sizeof(config.device_id), "%s", macAddressStr);
+    snprintf(config.device_name, sizeof(config.device_name), "Host Relay Simulator");
+    snprintf(config.wifi_ssid, sizeof(config.wifi_ssid), "host");
+    if (options.lanToken != nullptr) {
+        snprintf(config.lan_token, sizeof(config.lan_token), "%s", options.lanToken);
+    }
+
+    WsTlsServer standInTls;
+    WsListener listener;
+    if (options.server != nullptr) {
+        // HOST:PORT[,HOST:PORT...]: server_host, then the backups
+        const char* endpoint = options.server;
+        for (uint8_t i = 0; i <= UPSTREAM_BACKUPS && *endpoint != '\0'; i++) {
+            const char* end = strchr(endpoint, ',');
+            size_t length = end ? (size_t)(end - endpoint) : strlen(endpoint);
+            const char* colon = (const char*)memrchr(endpoint, ':', length);
+            size_t hostLength = colon ? (size_t)(colon - endpoint) : length;
+            int port = colon ? atoi(colon + 1) : 40000;
+            if (i == 0) {
+                snprintf(config.server_host, sizeof(config.server_host), "%.*s", (int)hostLength, endpoint);
+                config.server_port = port;
+            } else {
+                snprintf(config.backup_hosts[i - 1], sizeof(config.backup_hosts[i - 1]), "%.*s", (int)hostLength, endpoint);
+                config.backup_ports[i - 1] = (uint16_t)port;
+            }
+            endpoint = end ? end + 1 : endpoint + length;
+        }
+        if (options.caFile != nullptr) {
+            FILE* file = fopen(options.caFile, "r");
+            char pem[SERVER_CA_CHUNKS * (SERVER_CA_CHUNK - 1) + 1];
+            size_t length = file != nullptr ? fread(pem, 1, sizeof(pem) - 1, file) : 0;
+            pem[length] = '\0';
+            if (file != nullptr) {
+                fclose(file);
+            }
+            if (!configSetServerCa(config, pem) || length == 0) {
+                fprintf(stderr, "%s: not a PEM certificate of at most %zu bytes\n", options.caFile, sizeof(pem) - 1);
+                return 2;
+            }
+            config.server_tls = true;
+        }
+        hostConsoleEnableStdin(isatty(STDIN_FILENO));
+    } else {
+        if ((options.tls && !standInTls.generate()) || !listener.listen(0, options.tls ? &standInTls : nullptr)) {
+            fprintf(stderr, "stand-in: cannot listen on localhost\n");
+            return 1;
+        }
+        snprintf(config.server_host, sizeof(config.server_host), "127.0.0.1");
+        config.server_port = listener.port();
+        if (options.tls) {
+            configSetServerCa(config, standInTls.certificatePem().c_str()); // Pin the stand-in
+            config.server_tls = true;
+        }
+    }
+
+    appSetup();
+
+    if (options.server != nullptr) {
+        for (;;) {
+            halDelayMs(1000);
+        }
+    }
+
+    int result = runBenchmark(listener, options);
+    if (options.tls && runTlsHandshakeBenchmark(options) != 0) {
+        result = 1;
+    }
+    fflush(stdout);
+    _exit(result); // Firmware tasks never return
+}
@@ -0,0 +1,195 @@
+#include "sim_tca9554.h"
+#include "../board_profile.h"
+#include <string.h>
+
+bool SimTca9554Bus::addDevice(uint8_t address, uint8_t channels) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (deviceCount_ == MAX_DEVICES) {
+        return false;
+    }
+    Device& device = devices_[deviceCount_++];
+    device.address = address;
+    device.wide = channels == 16;
+    // Power-on values: outputs high, every pin an input, no inversion
+    static const uint8_t TCA9554_RESET[8] = {0x00, 0xFF, 0x00, 0xFF};
+    static const uint8_t TCA9555_RESET[8] = {0x00, 0x00, 0xFF, 0xFF, 0x00, 0x00, 0xFF, 0xFF};
+    memcpy(device.registers, device.wide ? TCA9555_RESET : TCA9554_RESET, sizeof(device.registers));
+    return true;
+}
+
+void SimTca9554Bus::begin(uint32_t clockHz, uint16_t timeoutMs) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    clockHz_ = clockHz;
+}
+
+void SimTca9554Bus::setClock(uint32_t clockHz) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    clockHz_ = clockHz;
+}
+
+uint8_t SimTca9554Bus::write(uint8_t address, const uint8_t* data, size_t length) {
+    std::unique_lock<std::mutex> guard(mutex_);
+    uint8_t fault = injectedFault();
+    if (fault != 0) {
+        return fault;
+    }
+    Device* target = device(address);
+    if (target == nullptr) {
+        uint32_t clockHz = clockHz_;
+        guard.unlock();
+        spendBusTime(0, clockHz);
+        return 2;
+    }
+    // The first byte selects the register, the following ones are written to it (a
+    // TCA9555 alternates within the register pair; the TCA9554 keeps the last byte)
+    if (length >= 2) {
+        for (size_t i = 1; i < length; i++) {
+            uint8_t index = registerIndex(*target, data[0], i - 1);
+            if (index >= (target->wide ? 2 : 1)) { // Input registers are read-only
+                target->registers[index] = data[i];
+            }
+        }
+        counters_.writes++;
+    }
+    uint32_t clockHz = clockHz_;
+    guard.unlock();
+    spendBusTime(length, clockHz);
+    return 0;
+}
+
+uint8_t SimTca9554Bus::readRegisters(uint8_t address, uint8_t reg, uint8_t* data, size_t length) {
+    std::unique_lock<std::mutex> guard(mutex_);
+    uint8_t fault = injectedFault();
+    if (fault != 0) {
+        return fault;
+    }
+    Device* source = device(address);
+    if (source == nullptr) {
+        uint32_t clockHz = clockHz_;
+        guard.unlock();
+        spendBusTime(0, clockHz);
+        return 2;
+    }
+    for (size_t i = 0; i < length; i++) {
+        uint8_t index = registerIndex(*source, reg, i);
+        data[i] = index < (source->wide ? 2 : 1) ? inputValue(*source, index) : source->registers[index];
+    }
+    counters_.reads++;
+    uint32_t clockHz = clockHz_;
+    guard.unlock();
+    spendBusTime(2 + length, clockHz); // Address + register, repeated start + address, data
+    return 0;
+}
+
+bool SimTca9554Bus::recover() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stuck_ = false;
+    counters_.recoveries++;
+    return true;
+}
+
+void SimTca9554Bus::injectFailures(uint32_t count, uint8_t error) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    pendingFailures_ = count;
+    failureError_ = error;
+}
+
+void SimTca9554Bus::setStuck(bool stuck) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stuck_ = stuck;
+}
+
+void SimTca9554Bus::corruptOutputs(uint8_t value) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    devices_[0].registers[devices_[0].wide ? 2 : 1] = value;
+}
+
+uint8_t SimTca9554Bus::outputs() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return devices_[0].registers[devices_[0].wide ? 2 : 1];
+}
+
+uint16_t SimTca9554Bus::outputs(uint8_t address) const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (uint8_t i = 0; i < deviceCount_; i++) {
+        const Device& device = devices_[i];
+        if (device.address == address) {
+            return device.wide ? (uint16_t)(device.registers[2] | (device.registers[3] << 8)) : device.registers[1];
+        }
+    }
+    return 0;
+}
+
+SimTca9554Counters SimTca9554Bus::counters() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return counters_;
+}
+
+// Called with mutex_ held
+SimTca9554Bus::Device* SimTca9554Bus::device(uint8_t address) {
+    for (uint8_t i = 0; i < deviceCount_; i++) {
+        if (devices_[i].address == address) {
+            return &devices_[i];
+        }
+    }
+    return nullptr;
+}
+
+// Register hit by byte step of a transfer that started at reg
+uint8_t SimTca9554Bus::registerIndex(const Device& device, uint8_t reg, size_t step) {
+    if (!device.wide) {
+        return reg & 0x03;
+    }
+    uint8_t index = reg & 0x07;
+    return (uint8_t)((index & ~1) | ((index + step) & 1));
+}
+
+// Pins configured as outputs read back the driven level
+uint8_t SimTca9554Bus::inputValue(const Device& device, uint8_t port) {
+    const uint8_t* r = device.registers;
+    if (!device.wide) {
+        return (uint8_t)((r[1] & ~r[3]) | (r[0] & r[3]));
+    }
+    return (uint8_t)((r[2 + port] & ~r[6 + port]) | (r[port] & r[6 + port]));
+}
+
+// Called with mutex_ held
+uint8_t SimTca9554Bus::injectedFault() {
+    if (stuck_) {
+        counters_.nacks++;
+        return 5;
+    }
+    if (pendingFailures_ > 0) {
+        pendingFailures_--;
+        counters_.nacks++;
+        return failureError_;
+    }
+    return 0;
+}
+
+// START + address byte + payload bytes + STOP, 9 clocks per byte
+void SimTca9554Bus::spendBusTime(size_t bytes, uint32_t clockHz) const {
+    if (!timing_) {
+        return;
+    }
+    int64_t durationUs = (int64_t)(bytes + 1) * 9 * 1000000 / clockHz + 2;
+    int64_t until = halMicros() + durationUs;
+    while (halMicros() < until) {
+    }
+}
+
+static SimTca9554Bus* fitBoardBus() {
+    if (BOARD.expanderCount == 0) {
+        return new SimTca9554Bus();
+    }
+    SimTca9554Bus* bus = new SimTca9554Bus(BOARD.expanders[0].address, expanderChannels(BOARD.expanders[0].type));
+    for (uint8_t i = 1; i < BOARD.expanderCount; i++) {
+        bus->addDevice(BOARD.expanders[i].address, expanderChannels(BOARD.expanders[i].type));
+    }
+    return bus;
+}
+
+SimTca9554Bus& simRelayBus() {
+    static SimTca9554Bus* bus = fitBoardBus();
+    return *bus;
+}
@@ -0,0 +1,77 @@
+// Simulated I2C bus with TCA9554 / TCA9555 expanders on it (host build)
+//
+// Models the expander registers (four on a TCA9554, four pairs on a TCA9555, where the
+// register pointer steps through a pair on multi-byte transfers) and the bus timing (9
+// clocks per byte plus start/stop at the configured clock), so driver latencies measured
+// on the host are in the same range as on the board. One TCA9554 at 0x20 is fitted by
+// default; addDevice() populates larger boards. simRelayBus() is fitted with the board
+// profile's expanders (board_profile.h), or the default one if the profile finds them. Faults can be injected to exercise the
+// driver's retry, recovery and read-back paths.
+
+#pragma once
+
+#include "../hal.h"
+#include <atomic>
+#include <mutex>
+
+struct SimTca9554Counters {
+    uint32_t writes;
+    uint32_t reads;
+    uint32_t nacks;      // Injected failures
+    uint32_t recoveries;
+};
+
+class SimTca9554Bus : public I2cBus {
+public:
+    static const uint8_t MAX_DEVICES = 8;
+
+    explicit SimTca9554Bus(uint8_t address = 0x20, uint8_t channels = 8) { addDevice(address, channels); }
+
+    // Fit another expander: 8 channels = TCA9554, 16 = TCA9555
+    bool addDevice(uint8_t address, uint8_t channels);
+
+    void begin(uint32_t clockHz, uint16_t timeoutMs) override;
+    void setClock(uint32_t clockHz) override;
+    uint8_t write(uint8_t address, const uint8_t* data, size_t length) override;
+    uint8_t readRegisters(uint8_t address, uint8_t reg, uint8_t* data, size_t length) override;
+    bool recover() override;
+
+    // Fail the next count transactions with error (2 = address NACK, 5 = timeout)
+    void injectFailures(uint32_t count, uint8_t error);
+    // Hold SDA low until the next recover()
+    void setStuck(bool stuck);
+    // Overwrite the first expander's output register behind the driver's back (brown-out)
+    void corruptOutputs(uint8_t value);
+    // Spend the real wire time of each transaction (on by default)
+    void setTiming(bool enabled) { timing_ = enabled; }
+
+    // Output register of the first expander, or of the one at address (both ports)
+    uint8_t outputs() const;
+    uint16_t outputs(uint8_t address) const;
+    SimTca9554Counters counters() const;
+
+private:
+    struct Device {
+        uint8_t address;
+        bool wide;              // TCA9555
+        uint8_t registers[8];   // TCA9554 uses the first four
+    };
+
+    Device* device(uint8_t address);
+    static uint8_t registerIndex(const Device& device, uint8_t reg, size_t step);
+    static uint8_t inputValue(const Device& device, uint8_t port);
+    uint8_t injectedFault();
+    void spendBusTime(size_t bytes, uint32_t clockHz) const;
+
+    Device devices_[MAX_DEVICES] = {};
+    uint8_t deviceCount_ = 0;
+    uint32_t clockHz_ = 100000;
+    std::atomic<bool> timing_{true};
+    bool stuck_ = false;
+    uint32_t pendingFailures_ = 0;
+    uint8_t failureError_ = 2;
+    SimTca9554Counters counters_ = {};
+    mutable std::mutex mutex_;
+};
+
+SimTca9554Bus& simRelayBus();
@@ -0,0 +1,723 @@
+#include "ws_link.h"
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+const char* WS_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+const size_t WS_MAX_HANDSHAKE = 2048;
+const int WS_HANDSHAKE_TIMEOUT_MS = 1000; // Upgrade request after a non-blocking accept
+
+// SHA-1, only for Sec-WebSocket-Accept
+void sha1(const uint8_t* data, size_t length, uint8_t digest[20]) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    size_t paddedLength = ((length + 8) / 64 + 1) * 64;
+    std::vector<uint8_t> message(paddedLength, 0);
+    memcpy(message.data(), data, length);
+    message[length] = 0x80;
+    uint64_t bits = (uint64_t)length * 8;
+    for (int i = 0; i < 8; i++) {
+        message[paddedLength - 1 - i] = (uint8_t)(bits >> (8 * i));
+    }
+
+    for (size_t chunk = 0; chunk < paddedLength; chunk += 64) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            const uint8_t* p = &message[chunk + i * 4];
+            w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+        }
+        for (int i = 16; i < 80; i++) {
+            uint32_t v = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = (v << 1) | (v >> 31);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t temp = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = temp;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for (int i = 0; i < 5; i++) {
+        digest[i * 4] = h[i] >> 24;
+        digest[i * 4 + 1] = h[i] >> 16;
+        digest[i * 4 + 2] = h[i] >> 8;
+        digest[i * 4 + 3] = h[i];
+    }
+}
+
+void base64(const uint8_t* data, size_t length, char* out) {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t o = 0;
+    for (size_t i = 0; i < length; i += 3) {
+        uint32_t v = (uint32_t)data[i] << 16;
+        if (i + 1 < length) v |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < length) v |= data[i + 2];
+        out[o++] = table[(v >> 18) & 63];
+        out[o++] = table[(v >> 12) & 63];
+        out[o++] = i + 1 < length ? table[(v >> 6) & 63] : '=';
+        out[o++] = i + 2 < length ? table[v & 63] : '=';
+    }
+    out[o] = '\0';
+}
+
+void acceptKey(const char* key, char* out) {
+    char input[128];
+    snprintf(input, sizeof(input), "%s%s", key, WS_GUID);
+    uint8_t digest[20];
+    sha1((const uint8_t*)input, strlen(input), digest);
+    base64(digest, sizeof(digest), out);
+}
+
+void setNoDelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Value of header name (case-insensitive), copied into out
+bool headerValue(const char* headers, const char* name, char* out, size_t capacity) {
+    size_t nameLength = strlen(name);
+    for (const char* line = strstr(headers, "\r\n"); line != nullptr; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, name, nameLength) == 0 && line[nameLength] == ':') {
+            const char* value = line + nameLength + 1;
+            while (*value == ' ') value++;
+            const char* end = strstr(value, "\r\n");
+            size_t length = end ? (size_t)(end - value) : strlen(value);
+            if (length >= capacity) {
+                return false;
+            }
+            memcpy(out, value, length);
+            out[length] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+// Bounds the blocking TLS handshake; 0 clears it again
+void setSocketTimeout(int fd, int timeoutMs) {
+    timeval timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// OpenSSL writes with plain send(), so a peer that vanished would raise SIGPIPE
+void tlsInit() {
+    static bool done = false;
+    if (!done) {
+        signal(SIGPIPE, SIG_IGN);
+        done = true;
+    }
+}
+
+// Settings both sides share. Without auto-retry a read that only consumed a session
+// ticket returns instead of blocking for application data.
+ssl_ctx_st* newTlsContext(const SSL_METHOD* method) {
+    tlsInit();
+    SSL_CTX* ctx = SSL_CTX_new(method);
+    if (ctx != nullptr) {
+        SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+        SSL_CTX_clear_mode(ctx, SSL_MODE_AUTO_RETRY);
+        SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS); // Idle links hold no record buffers
+    }
+    return ctx;
+}
+
+thread_local WsTlsHeap tlsHeap = {};
+const size_t HEAP_PREFIX = 16; // Keeps the caller's block 16-byte aligned
+
+void* countedMalloc(size_t size, const char*, int) {
+    uint8_t* block = (uint8_t*)malloc(size + HEAP_PREFIX);
+    if (block == nullptr) {
+        return nullptr;
+    }
+    memcpy(block, &size, sizeof(size));
+    WsTlsHeap& heap = tlsHeap;
+    heap.liveBytes += size;
+    heap.allocatedBytes += size;
+    heap.allocations++;
+    if (heap.liveBytes > heap.peakBytes) {
+        heap.peakBytes = heap.liveBytes;
+    }
+    return block + HEAP_PREFIX;
+}
+
+void countedFree(void* pointer, const char*, int) {
+    if (pointer == nullptr) {
+        return;
+    }
+    uint8_t* block = (uint8_t*)pointer - HEAP_PREFIX;
+    size_t size;
+    memcpy(&size, block, sizeof(size));
+    // Freed on another thread than allocated: that thread's count may dip below zero
+    WsTlsHeap& heap = tlsHeap;
+    heap.liveBytes = heap.liveBytes > size ? heap.liveBytes - size : 0;
+    free(block);
+}
+
+void* countedRealloc(void* pointer, size_t size, const char* file, int line) {
+    if (pointer == nullptr) {
+        return countedMalloc(size, file, line);
+    }
+    if (size == 0) {
+        countedFree(pointer, file, line);
+        return nullptr;
+    }
+    void* moved = countedMalloc(size, file, line);
+    if (moved != nullptr) {
+        size_t old;
+        memcpy(&old, (uint8_t*)pointer - HEAP_PREFIX, sizeof(old));
+        memcpy(moved, pointer, old < size ? old : size);
+        countedFree(pointer, file, line);
+    }
+    return moved;
+}
+
+} // namespace
+
+bool wsTlsTrackHeap() {
+    return CRYPTO_set_mem_functions(countedMalloc, countedRealloc, countedFree) == 1;
+}
+
+WsTlsHeap wsTlsHeap() {
+    return tlsHeap;
+}
+
+void wsTlsResetPeak() {
+    tlsHeap.peakBytes = tlsHeap.liveBytes;
+}
+
+WsTlsClient::~WsTlsClient() {
+    forgetSession();
+    SSL_CTX_free(ctx_);
+}
+
+bool WsTlsClient::configure(const char* caPem) {
+    forgetSession();
+    SSL_CTX_free(ctx_);
+    ctx_ = nullptr;
+    if (caPem == nullptr || caPem[0] == '\0') {
+        return false;
+    }
+    SSL_CTX* ctx = newTlsContext(TLS_client_method());
+    if (ctx == nullptr) {
+        return false;
+    }
+    X509_STORE* store = SSL_CTX_get_cert_store(ctx);
+    BIO* pem = BIO_new_mem_buf(caPem, -1);
+    int pinned = 0;
+    while (X509* certificate = PEM_read_bio_X509(pem, nullptr, nullptr, nullptr)) {
+        pinned += X509_STORE_add_cert(store, certificate);
+        X509_free(certificate);
+    }
+    BIO_free(pem);
+    ERR_clear_error(); // The read loop ends on "no start line"
+    if (pinned == 0) {
+        SSL_CTX_free(ctx);
+        return false;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+    SSL_CTX_set_tlsext_max_fragment_length(ctx, TLSEXT_max_fragment_length_4096);
+    // Sessions are kept here, per endpoint, not in OpenSSL's internal cache
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, storeSession);
+    ctx_ = ctx;
+    return true;
+}
+
+void WsTlsClient::forgetSession() {
+    SSL_SESSION_free(session_);
+    session_ = nullptr;
+}
+
+// New session ticket (TLS 1.3 sends it after the handshake, read along with the upgrade
+// response); the latest one wins
+int WsTlsClient::storeSession(ssl_st* ssl, ssl_session_st* session) {
+    WsTlsClient* self = (WsTlsClient*)SSL_get_app_data(ssl);
+    if (self == nullptr) {
+        return 0;
+    }
+    SSL_SESSION_free(self->session_);
+    self->session_ = session;
+    return 1; // We own the reference now
+}
+
+WsTlsServer::~WsTlsServer() {
+    SSL_CTX_free(ctx_);
+}
+
+bool WsTlsServer::generate() {
+    EVP_PKEY* key = EVP_EC_gen("P-256");
+    X509* certificate = X509_new();
+    bool ok = key != nullptr && certificate != nullptr;
+    if (ok) {
+        X509_set_version(certificate, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(certificate), (long)time(nullptr));
+        X509_gmtime_adj(X509_getm_notBefore(certificate), -3600);
+        X509_gmtime_adj(X509_getm_notAfter(certificate), 24 * 3600);
+        X509_NAME* name = X509_get_subject_name(certificate);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"relay stand-in", -1, -1, 0);
+        X509_set_issuer_name(certificate, name);
+        X509_set_pubkey(certificate, key);
+        X509V3_CTX extensions;
+        X509V3_set_ctx_nodb(&extensions);
+        X509V3_set_ctx(&extensions, certificate, certificate, nullptr, nullptr, 0);
+        X509_EXTENSION* altNames =
+            X509V3_EXT_conf_nid(nullptr, &extensions, NID_subject_alt_name, "IP:127.0.0.1,DNS:localhost");
+        ok = altNames != nullptr && X509_add_ext(certificate, altNames, -1) == 1 &&
+             X509_sign(certificate, key, EVP_sha256()) > 0;
+        X509_EXTENSION_free(altNames);
+    }
+
+    SSL_CTX* ctx = ok ? newTlsContext(TLS_server_method()) : nullptr;
+    ok = ctx != nullptr && SSL_CTX_use_certificate(ctx, certificate) == 1 && SSL_CTX_use_PrivateKey(ctx, key) == 1;
+    if (ok) {
+        SSL_CTX_set_num_tickets(ctx, 1); // The client keeps one anyway
+        BIO* pem = BIO_new(BIO_s_mem());
+        PEM_write_bio_X509(pem, certificate);
+        char* data;
+        long length = BIO_get_mem_data(pem, &data);
+        certificatePem_.assign(data, length);
+        BIO_free(pem);
+        SSL_CTX_free(ctx_);
+        ctx_ = ctx;
+    } else {
+        SSL_CTX_free(ctx);
+    }
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    return ok;
+}
+
+bool WsSocket::connect(const char* host, int port, const char* path, int timeoutMs, WsTlsClient* tls) {
+    close();
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char portString[8];
+    snprintf(portString, sizeof(portString), "%d", port);
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(host, portString, &hints, &addresses) != 0) {
+        return false;
+    }
+    int fd = -1;
+    for (addrinfo* a = addresses; a != nullptr && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && ::connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        return false;
+    }
+    setNoDelay(fd);
+    fd_ = fd;
+    maskOutgoing_ = true;
+    rx_.clear();
+    if (tls != nullptr && (!tls->configured() || !startTls(tls->ctx_, tls, host, timeoutMs))) {
+        close();
+        return false;
+    }
+
+    uint8_t nonce[16];
+    for (uint8_t& b : nonce) {
+        b = (uint8_t)rand();
+    }
+    char key[32];
+    base64(nonce, sizeof(nonce), key);
+    char request[512];
+    int length = snprintf(request, sizeof(request),
+                          "GET %s HTTP/1.1\r\nHost: %s:%d\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                          "Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n\r\n",
+                          path, host, port, key);
+    char response[WS_MAX_HANDSHAKE];
+    char accept[64];
+    char expected[64];
+    acceptKey(key, expected);
+    if (!writeAll((const uint8_t*)request, length) || !readHeaders(response, sizeof(response), timeoutMs) ||
+        strncmp(response, "HTTP/1.1 101", 12) != 0 ||
+        !headerValue(response, "Sec-WebSocket-Accept", accept, sizeof(accept)) || strcmp(accept, expected) != 0) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+// TLS over the connected fd_; client is null on the server side. The client resumes the
+// endpoint's last session if it has one and checks the certificate against host.
+bool WsSocket::startTls(ssl_ctx_st* ctx, WsTlsClient* client, const char* host, int timeoutMs) {
+    ssl_ = SSL_new(ctx);
+    if (ssl_ == nullptr || SSL_set_fd(ssl_, fd_) != 1) {
+        return false;
+    }
+    if (client != nullptr) {
+        SSL_set_app_data(ssl_, client);
+        in6_addr address;
+        bool literal = inet_pton(AF_INET, host, &address) == 1 || inet_pton(AF_INET6, host, &address) == 1;
+        if (literal) {
+            X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl_), host);
+        } else {
+            SSL_set_tlsext_host_name(ssl_, host);
+            SSL_set1_host(ssl_, host);
+        }
+        if (client->session_ != nullptr) {
+            SSL_set_session(ssl_, client->session_);
+        }
+    }
+    setSocketTimeout(fd_, timeoutMs);
+    bool ok = (client != nullptr ? SSL_connect(ssl_) : SSL_accept(ssl_)) == 1;
+    setSocketTimeout(fd_, 0);
+    if (!ok) {
+        if (client != nullptr) {
+            client->forgetSession(); // Possibly what the server refused
+        }
+        ERR_clear_error();
+        return false;
+    }
+    tlsResumed_ = SSL_session_reused(ssl_) == 1;
+    return true;
+}
+
+bool WsSocket::writeAll(const uint8_t* data, size_t length) {
+    if (ssl_ != nullptr) {
+        // Blocking socket without partial writes: all of it or an error
+        return length == 0 || SSL_write(ssl_, data, (int)length) == (int)length;
+    }
+    while (length > 0) {
+        ssize_t sent = ::send(fd_, data, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+int WsSocket::readSome(uint8_t* buffer, size_t capacity) {
+    if (ssl_ == nullptr) {
+        ssize_t received = recv(fd_, buffer, capacity, 0);
+        return received > 0 ? (int)received : -1;
+    }
+    int received = SSL_read(ssl_, buffer, (int)capacity);
+    if (received > 0) {
+        return received;
+    }
+    int error = SSL_get_error(ssl_, received);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+        return 0; // A record without application data, e.g. a session ticket
+    }
+    ERR_clear_error();
+    return -1;
+}
+
+// Decrypted bytes already buffered count as readable; poll() cannot see them
+bool WsSocket::waitReadable(int timeoutMs) {
+    if (ssl_ != nullptr && SSL_pending(ssl_) > 0) {
+        return true;
+    }
+    pollfd p = {fd_, POLLIN, 0};
+    return poll(&p, 1, timeoutMs) > 0;
+}
+
+// Read an HTTP header block (up to the blank line) into buffer
+bool WsSocket::readHeaders(char* buffer, size_t capacity, int timeoutMs) {
+    size_t length = 0;
+    while (length < capacity - 1) {
+        if (!waitReadable(timeoutMs)) {
+            return false;
+        }
+        // Byte at a time so nothing after the headers (an early frame) is consumed
+        int received = readSome((uint8_t*)buffer + length, 1);
+        if (received < 0) {
+            return false;
+        }
+        if (received == 0) {
+            continue;
+        }
+        length++;
+        buffer[length] = '\0';
+        if (length >= 4 && memcmp(buffer + length - 4, "\r\n\r\n", 4) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Header with the payload length and, on the client side, a fresh masking key (also
+// returned in mask)
+size_t WsSocket::buildHeader(uint8_t* header, uint8_t opcode, size_t length, uint8_t* mask) {
+    size_t headerLength = 0;
+    header[headerLength++] = 0x80 | opcode; // FIN
+    uint8_t maskBit = maskOutgoing_ ? 0x80 : 0;
+    if (length < 126) {
+        header[headerLength++] = maskBit | (uint8_t)length;
+    } else if (length <= 0xFFFF) {
+        header[headerLength++] = maskBit | 126;
+        header[headerLength++] = length >> 8;
+        header[headerLength++] = length;
+    } else {
+        header[headerLength++] = maskBit | 127;
+        for (int i = 7; i >= 0; i--) {
+            header[headerLength++] = (uint8_t)((uint64_t)length >> (8 * i));
+        }
+    }
+    if (maskOutgoing_) {
+        for (uint8_t i = 0; i < 4; i++) {
+            mask[i] = (uint8_t)rand();
+            header[headerLength++] = mask[i];
+        }
+    }
+    return headerLength;
+}
+
+bool WsSocket::send(uint8_t opcode, const void* data, size_t length) {
+    if (fd_ < 0) {
+        return false;
+    }
+    uint8_t header[WS_MAX_HEADER];
+    uint8_t mask[4];
+    size_t headerLength = buildHeader(header, opcode, length, mask);
+
+    std::vector<uint8_t> frame(header, header + headerLength);
+    const uint8_t* payload = (const uint8_t*)data;
+    if (maskOutgoing_) {
+        for (size_t i = 0; i < length; i++) {
+            frame.push_back(payload[i] ^ mask[i & 3]);
+        }
+    } else {
+        frame.insert(frame.end(), payload, payload + length);
+    }
+
+    if (!writeAll(frame.data(), frame.size())) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool WsSocket::sendInPlace(uint8_t opcode, uint8_t* frame, size_t length) {
+    if (fd_ < 0) {
+        return false;
+    }
+    uint8_t header[WS_MAX_HEADER];
+    uint8_t mask[4];
+    size_t headerLength = buildHeader(header, opcode, length, mask);
+
+    uint8_t* payload = frame + WS_MAX_HEADER;
+    if (maskOutgoing_) {
+        for (size_t i = 0; i < length; i++) {
+            payload[i] ^= mask[i & 3];
+        }
+    }
+    uint8_t* start = payload - headerLength;
+    memcpy(start, header, headerLength);
+
+    if (!writeAll(start, headerLength + length)) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool WsSocket::receive(WsMessage& message, int timeoutMs) {
+    while (fd_ >= 0) {
+        if (parseFrame(message)) {
+            switch (message.opcode) {
+            case WS_OP_TEXT:
+            case WS_OP_BINARY:
+            case WS_OP_PONG:
+                return true;
+            case WS_OP_PING:
+                send(WS_OP_PONG, message.payload.data(), message.payload.size());
+                continue;
+            case WS_OP_CLOSE:
+                send(WS_OP_CLOSE, nullptr, 0);
+                close();
+                return false;
+            default:
+                continue;
+            }
+        }
+
+        if (!waitReadable(timeoutMs)) {
+            return false;
+        }
+        uint8_t buffer[4096];
+        int received = readSome(buffer, sizeof(buffer));
+        if (received < 0) {
+            close();
+            return false;
+        }
+        rx_.insert(rx_.end(), buffer, buffer + received);
+        timeoutMs = 0; // Only wait once; the caller polls again
+    }
+    return false;
+}
+
+// Take one complete frame off the front of rx_
+bool WsSocket::parseFrame(WsMessage& message) {
+    if (rx_.size() < 2) {
+        return false;
+    }
+    size_t offset = 2;
+    uint64_t length = rx_[1] & 0x7F;
+    bool masked = (rx_[1] & 0x80) != 0;
+    if (length == 126) {
+        if (rx_.size() < 4) return false;
+        length = (uint64_t)rx_[2] << 8 | rx_[3];
+        offset = 4;
+    } else if (length == 127) {
+        if (rx_.size() < 10) return false;
+        length = 0;
+        for (int i = 0; i < 8; i++) {
+            length = length << 8 | rx_[2 + i];
+        }
+        offset = 10;
+    }
+    size_t maskOffset = offset;
+    if (masked) {
+        offset += 4;
+    }
+    if (rx_.size() < offset + length) {
+        return false;
+    }
+
+    message.opcode = rx_[0] & 0x0F;
+    message.payload.assign(rx_.begin() + offset, rx_.begin() + offset + length);
+    if (masked) {
+        for (size_t i = 0; i < length; i++) {
+            message.payload[i] ^= rx_[maskOffset + (i & 3)];
+        }
+    }
+    rx_.erase(rx_.begin(), rx_.begin() + offset + length);
+    return true;
+}
+
+void WsSocket::close() {
+    if (ssl_ != nullptr) {
+        SSL_shutdown(ssl_); // close_notify, without waiting for the peer's
+        SSL_free(ssl_);
+        ssl_ = nullptr;
+        ERR_clear_error();
+    }
+    tlsResumed_ = false;
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    rx_.clear();
+}
+
+WsListener::~WsListener() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+bool WsListener::listen(int port, WsTlsServer* tls) {
+    tls_ = tls != nullptr ? tls->ctx_ : nullptr;
+    fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd_ < 0) {
+        return false;
+    }
+    int one = 1;
+    setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (bind(fd_, (sockaddr*)&address, sizeof(address)) != 0 || ::listen(fd_, 8) != 0) {
+        return false;
+    }
+    socklen_t addressLength = sizeof(address);
+    getsockname(fd_, (sockaddr*)&address, &addressLength);
+    port_ = ntohs(address.sin_port);
+    return true;
+}
+
+bool WsListener::accept(WsSocket& socket, int timeoutMs, char* path, size_t pathCapacity) {
+    pollfd p = {fd_, POLLIN, 0};
+    if (poll(&p, 1, timeoutMs) <= 0) {
+        return false;
+    }
+    int fd = ::accept(fd_, nullptr, nullptr);
+    if (fd < 0) {
+        return false;
+    }
+    setNoDelay(fd);
+    socket.close();
+    socket.fd_ = fd;
+    socket.maskOutgoing_ = false;
+
+    int handshakeTimeoutMs = timeoutMs > 0 ? timeoutMs : WS_HANDSHAKE_TIMEOUT_MS;
+    char request[WS_MAX_HANDSHAKE];
+    char key[64];
+    if ((tls_ != nullptr && !socket.startTls(tls_, nullptr, nullptr, handshakeTimeoutMs)) ||
+        !socket.readHeaders(request, sizeof(request), handshakeTimeoutMs) || strncmp(request, "GET ", 4) != 0 ||
+        !headerValue(request, "Sec-WebSocket-Key", key, sizeof(key))) {
+        socket.close();
+        return false;
+    }
+    if (path != nullptr && pathCapacity > 0) {
+        const char* start = request + 4;
+        const char* end = strchr(start, ' ');
+        size_t length = end ? (size_t)(end - start) : 0;
+        length = length < pathCapacity - 1 ? length : pathCapacity - 1;
+        memcpy(path, start, length);
+        path[length] = '\0';
+    }
+
+    char accept[64];
+    acceptKey(key, accept);
+    char response[256];
+    int length = snprintf(response, sizeof(response),
+                          "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                          "Sec-WebSocket-Accept: %s\r\n\r\n",
+                          accept);
+    if (!socket.writeAll((const uint8_t*)response, length)) {
+        socket.close();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,158 @@
+// Minimal RFC 6455 WebSocket over POSIX TCP (host build)
+//
+// Just enough for the firmware's upstream link and the local stand-in server:
+// unfragmented text/binary frames, ping/pong, close. Both ends set TCP_NODELAY so
+// small command/ack frames are not held back by Nagle.
+//
+// wss goes through OpenSSL (WsTlsClient / WsTlsServer). The client pins the server's
+// CA, keeps the last session ticket per endpoint so a reconnect resumes instead of
+// repeating the certificate exchange, and asks for WS_TLS_MAX_FRAGMENT records. The
+// resumption is the host link's own; the ESP32 has no hook for it (see main.cpp).
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+struct ssl_st;
+struct ssl_ctx_st;
+struct ssl_session_st;
+
+enum WsOpcode : uint8_t {
+    WS_OP_TEXT = 0x1,
+    WS_OP_BINARY = 0x2,
+    WS_OP_CLOSE = 0x8,
+    WS_OP_PING = 0x9,
+    WS_OP_PONG = 0xA
+};
+
+struct WsMessage {
+    uint8_t opcode;
+    std::vector<uint8_t> payload;
+};
+
+const size_t WS_MAX_HEADER = 14;
+
+// Largest TLS record the client accepts (max_fragment_length extension): the receive
+// buffer shrinks from 16 KB to 4 KB, and relay frames are far smaller than that
+const size_t WS_TLS_MAX_FRAGMENT = 4096;
+
+// Client side TLS for one endpoint: trusts only the pinned CA (or the server's own
+// self-signed certificate) and remembers the last session the server issued a ticket for.
+// One per endpoint - a session is only good for the server that issued it.
+class WsTlsClient {
+public:
+    WsTlsClient() {}
+    ~WsTlsClient();
+    WsTlsClient(const WsTlsClient&) = delete;
+    WsTlsClient& operator=(const WsTlsClient&) = delete;
+
+    // Pin the certificates in caPem; false (not configured) if none parses. Drops the session.
+    bool configure(const char* caPem);
+    bool configured() const { return ctx_ != nullptr; }
+    bool hasSession() const { return session_ != nullptr; }
+    void forgetSession(); // The next connect does a full handshake
+
+private:
+    friend class WsSocket;
+    static int storeSession(ssl_st* ssl, ssl_session_st* session);
+
+    ssl_ctx_st* ctx_ = nullptr;
+    ssl_session_st* session_ = nullptr;
+};
+
+// Server side TLS for the stand-in: a fresh self-signed P-256 certificate for 127.0.0.1
+// and localhost, issuing one session ticket per handshake
+class WsTlsServer {
+public:
+    WsTlsServer() {}
+    ~WsTlsServer();
+    WsTlsServer(const WsTlsServer&) = delete;
+    WsTlsServer& operator=(const WsTlsServer&) = delete;
+
+    bool generate();
+    const std::string& certificatePem() const { return certificatePem_; } // What clients pin
+
+private:
+    friend class WsListener;
+    ssl_ctx_st* ctx_ = nullptr;
+    std::string certificatePem_;
+};
+
+// OpenSSL heap use of the calling thread, for the handshake benchmark. wsTlsTrackHeap()
+// must run before anything else touches OpenSSL; false if it came too late.
+struct WsTlsHeap {
+    size_t liveBytes;      // Allocated and not yet freed
+    size_t peakBytes;      // Highest liveBytes since wsTlsResetPeak()
+    size_t allocatedBytes; // Total ever allocated
+    uint32_t allocations;
+};
+bool wsTlsTrackHeap();
+WsTlsHeap wsTlsHeap();
+void wsTlsResetPeak();
+
+class WsSocket {
+public:
+    WsSocket() {}
+    ~WsSocket() { close(); }
+    WsSocket(const WsSocket&) = delete;
+    WsSocket& operator=(const WsSocket&) = delete;
+
+    // Client side: TCP connect, TLS handshake when tls is given, and HTTP upgrade
+    // (blocking, timeoutMs for each handshake)
+    bool connect(const char* host, int port, const char* path, int timeoutMs, WsTlsClient* tls = nullptr);
+
+    bool send(uint8_t opcode, const void* data, size_t length);
+    bool sendText(const char* data, size_t length) { return send(WS_OP_TEXT, data, length); }
+    bool sendBinary(const uint8_t* data, size_t length) { return send(WS_OP_BINARY, data, length); }
+    bool sendPing(const uint8_t* data, size_t length) { return send(WS_OP_PING, data, length); }
+    // frame: WS_MAX_HEADER reserved bytes, then length payload bytes; sent with one
+    // write and masked in place, no copy (the device's zero-allocation send path)
+    bool sendInPlace(uint8_t opcode, uint8_t* frame, size_t length);
+
+    // Wait up to timeoutMs for a complete data frame or a pong. Pings are answered here;
+    // a close frame or a dropped connection closes the socket.
+    bool receive(WsMessage& message, int timeoutMs);
+
+    bool isOpen() const { return fd_ >= 0; }
+    int fd() const { return fd_; } // For polling many sockets at once; drain with receive(.., 0)
+    bool isTls() const { return ssl_ != nullptr; }
+    bool tlsResumed() const { return tlsResumed_; } // The last TLS handshake resumed a session
+    void close();
+
+private:
+    size_t buildHeader(uint8_t* header, uint8_t opcode, size_t length, uint8_t* mask);
+
+    friend class WsListener;
+
+    bool startTls(ssl_ctx_st* ctx, WsTlsClient* client, const char* host, int timeoutMs);
+    bool writeAll(const uint8_t* data, size_t length);
+    int readSome(uint8_t* buffer, size_t capacity); // > 0 bytes, 0 nothing yet, < 0 closed
+    bool waitReadable(int timeoutMs);
+    bool readHeaders(char* buffer, size_t capacity, int timeoutMs);
+    bool parseFrame(WsMessage& message);
+
+    int fd_ = -1;
+    ssl_st* ssl_ = nullptr;
+    bool tlsResumed_ = false;
+    bool maskOutgoing_ = false; // Clients mask, servers do not
+    std::vector<uint8_t> rx_;
+};
+
+// Server side: accepts connections on 127.0.0.1 and completes the upgrade
+class WsListener {
+public:
+    ~WsListener();
+    bool listen(int port, WsTlsServer* tls = nullptr); // 0 picks a free port; tls makes it wss
+    int port() const { return port_; }
+    // path receives the request target (e.g. "/elevator?id=...") if non-null. timeoutMs
+    // 0 polls for a pending connection; its upgrade request may still take a moment.
+    bool accept(WsSocket& socket, int timeoutMs, char* path = nullptr, size_t pathCapacity = 0);
+
+private:
+    int fd_ = -1;
+    int port_ = 0;
+    ssl_ctx_st* tls_ = nullptr;
+};
@@ -0,0 +1,180 @@
+// High-rate input capture - run-length compressed ring of input samples
+//
+// A hardware timer samples all eight inputs (one port-register read, halReadInputs())
+// at 1-10 kHz, so pulses far shorter than the debounce and reporting paths can see -
+// floor-passing pulses, door-zone contacts - are recorded. Consecutive equal samples
+// collapse into one run word: bits 0-7 the input levels, bits 8-31 the number of
+// samples (a longer stretch continues in a new run with the same levels).
+//
+// In ring mode the oldest runs are overwritten and the capture keeps the latest
+// history until stopped; in fill mode it stops once the buffer is full. Either mode
+// also stops after sampleLimit samples (0 = none). Timer ticks the interrupt could not
+// take in time (flash writes disable it for tens of milliseconds) are filled with the
+// last levels and counted as gap samples, so sample n is always at start + n * period.
+//
+// sample() runs in the timer interrupt; start() and stop() come from the task that owns
+// the sampler (the I/O task). The runs are read only while the capture is not running.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include "hal.h"
+
+const uint32_t INPUT_CAPTURE_MIN_HZ = 1000;
+const uint32_t INPUT_CAPTURE_MAX_HZ = 10000;
+const uint32_t INPUT_CAPTURE_MAX_RUN = 0xFFFFFF; // Samples in one run word
+
+enum InputCaptureState : uint8_t {
+    CAPTURE_IDLE,     // Nothing recorded since boot
+    CAPTURE_RUNNING,
+    CAPTURE_DONE      // Stopped (by request, limit or full buffer); runs can be read
+};
+
+inline uint8_t captureRunLevels(uint32_t run) { return (uint8_t)run; }
+inline uint32_t captureRunLength(uint32_t run) { return run >> 8; }
+
+class InputCapture {
+public:
+    InputCapture() : runs_(nullptr), capacity_(0) { clear(); }
+
+    // Buffer for the runs; attach once before the first start()
+    void attach(uint32_t* runs, uint32_t capacity) {
+        runs_ = runs;
+        capacity_ = capacity;
+    }
+    bool attached() const { return runs_ != nullptr; }
+
+    void start(uint32_t periodUs, uint32_t sampleLimit, bool stopWhenFull, int64_t nowUs, uint8_t levels) {
+        lock_.lock();
+        clear();
+        periodUs_ = periodUs;
+        sampleLimit_ = sampleLimit;
+        stopWhenFull_ = stopWhenFull;
+        startUs_ = nowUs;
+        openLevels_ = levels;
+        openLength_ = 1;
+        samples_ = 1;
+        state_.store(CAPTURE_RUNNING, std::memory_order_release);
+        lock_.unlock();
+    }
+
+    // One timer tick. True when the capture just finished on its own (limit or full
+    // buffer) and the sampler should be stopped.
+    inline bool HAL_IRAM_ATTR sample(uint8_t levels, int64_t nowUs) {
+        lock_.lock();
+        if (state_.load(std::memory_order_relaxed) != CAPTURE_RUNNING) {
+            lock_.unlock();
+            return false;
+        }
+        // Ticks missed since the last one keep the last known levels
+        uint64_t due = nowUs > startUs_ ? (uint64_t)(nowUs - startUs_) / periodUs_ : 0;
+        while (samples_ < due && append(openLevels_)) {
+            gapSamples_++;
+        }
+        bool finished = !append(levels);
+        if (!finished && sampleLimit_ != 0 && samples_ >= sampleLimit_) {
+            finished = true;
+        }
+        if (finished) {
+            finish();
+        }
+        lock_.unlock();
+        return finished;
+    }
+
+    // Close the open run; no effect unless running
+    void stop() {
+        lock_.lock();
+        if (state_.load(std::memory_order_relaxed) == CAPTURE_RUNNING) {
+            finish();
+        }
+        lock_.unlock();
+    }
+
+    InputCaptureState state() const { return (InputCaptureState)state_.load(std::memory_order_acquire); }
+
+    // Stored runs, oldest first (read only while not running)
+    uint32_t runCount() const { return count_; }
+    uint32_t run(uint32_t index) const { return runs_[(head_ + capacity_ - count_ + index) % capacity_]; }
+
+    uint32_t capacity() const { return capacity_; }
+    uint32_t periodUs() const { return periodUs_; }
+    int64_t startUs() const { return startUs_; }
+    uint64_t samples() const { return samples_; }                // Since start, including overwritten ones
+    uint64_t firstSample() const { return overwrittenSamples_; }  // Index of the first stored sample
+    uint32_t gapSamples() const { return gapSamples_; }
+
+private:
+    // Add one sample to the open run; false if the sample did not fit (fill mode, full)
+    inline bool HAL_IRAM_ATTR append(uint8_t levels) {
+        if (levels == openLevels_ && openLength_ < INPUT_CAPTURE_MAX_RUN) {
+            openLength_++;
+            samples_++;
+            return true;
+        }
+        if (!store()) {
+            return false;
+        }
+        openLevels_ = levels;
+        openLength_ = 1;
+        samples_++;
+        return true;
+    }
+
+    // Move the open run into the ring
+    inline bool HAL_IRAM_ATTR store() {
+        if (count_ == capacity_) {
+            if (stopWhenFull_) {
+                return false;
+            }
+            overwrittenSamples_ += captureRunLength(run(0));
+            count_--;
+        }
+        runs_[head_] = (openLength_ << 8) | openLevels_;
+        head_ = head_ + 1 == capacity_ ? 0 : head_ + 1;
+        count_++;
+        return true;
+    }
+
+    inline void HAL_IRAM_ATTR finish() {
+        if (openLength_ > 0 && !store()) {
+            // Full in fill mode: the open run is lost, so are its samples
+            samples_ -= openLength_;
+        }
+        openLength_ = 0;
+        state_.store(CAPTURE_DONE, std::memory_order_release);
+    }
+
+    void clear() {
+        head_ = 0;
+        count_ = 0;
+        openLevels_ = 0;
+        openLength_ = 0;
+        samples_ = 0;
+        overwrittenSamples_ = 0;
+        gapSamples_ = 0;
+        periodUs_ = 1;
+        sampleLimit_ = 0;
+        stopWhenFull_ = false;
+        startUs_ = 0;
+        state_.store(CAPTURE_IDLE, std::memory_order_release);
+    }
+
+    uint32_t* runs_;
+    uint32_t capacity_;
+    uint32_t head_;      // Next slot to write
+    uint32_t count_;     // Stored runs
+    uint8_t openLevels_;
+    uint32_t openLength_;
+    uint64_t samples_;
+    uint64_t overwrittenSamples_;
+    uint32_t gapSamples_;
+    uint32_t periodUs_;
+    uint32_t sampleLimit_;
+    bool stopWhenFull_;
+    int64_t startUs_;
+    std::atomic<uint8_t> state_;
+    HalLock lock_;
+};
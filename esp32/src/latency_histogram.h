@@ -0,0 +1,126 @@
+// Rolling latency histograms - fixed memory, no heap, O(1) record
+//
+// Values (microseconds) land in log-linear buckets: exact below 16 us, then four
+// buckets per power of two (<= 19% wide) up to ~67 s, so a percentile is reported as
+// the upper edge of its bucket. Two windows of LATENCY_WINDOW_MS are kept; the current
+// one fills while the previous one is still counted, so queries always cover the last
+// one to two windows and old outliers age out.
+//
+// Not thread safe: record and query from the same task.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+const uint32_t LATENCY_WINDOW_MS = 60000;
+
+class LatencyHistogram {
+public:
+    static const uint8_t LINEAR_BUCKETS = 16;
+    static const uint8_t SUB_BUCKETS = 4;      // Per power of two
+    static const uint8_t MAX_EXPONENT = 26;    // 2^26 us = 67 s, larger values clamp
+    static const uint8_t BUCKETS = LINEAR_BUCKETS + (MAX_EXPONENT - 4) * SUB_BUCKETS;
+
+    LatencyHistogram() { reset(0); }
+
+    void reset(uint32_t nowMs) {
+        memset(windows_, 0, sizeof(windows_));
+        current_ = 0;
+        windowStartMs_ = nowMs;
+    }
+
+    void record(uint32_t valueUs, uint32_t nowMs) {
+        rotate(nowMs);
+        Window& window = windows_[current_];
+        uint16_t& bucket = window.counts[bucketOf(valueUs)];
+        if (bucket != UINT16_MAX) {
+            bucket++;
+        }
+        window.count++;
+        if (valueUs > window.maxUs) {
+            window.maxUs = valueUs;
+        }
+    }
+
+    // Samples in the current and previous window
+    uint32_t count(uint32_t nowMs) {
+        rotate(nowMs);
+        return windows_[0].count + windows_[1].count;
+    }
+
+    uint32_t maxUs(uint32_t nowMs) {
+        rotate(nowMs);
+        return windows_[0].maxUs > windows_[1].maxUs ? windows_[0].maxUs : windows_[1].maxUs;
+    }
+
+    // Upper bucket edge at or below which `percent` of the samples fall (0 if empty)
+    uint32_t percentileUs(uint8_t percent, uint32_t nowMs) {
+        rotate(nowMs);
+        uint32_t total = 0;
+        for (uint8_t i = 0; i < BUCKETS; i++) {
+            total += windows_[0].counts[i] + windows_[1].counts[i];
+        }
+        if (total == 0) {
+            return 0;
+        }
+        uint32_t rank = (total * percent + 99) / 100;
+        uint32_t seen = 0;
+        for (uint8_t i = 0; i < BUCKETS; i++) {
+            seen += windows_[0].counts[i] + windows_[1].counts[i];
+            if (seen >= rank && seen > 0) {
+                uint32_t edge = upperEdge(i);
+                uint32_t max = maxUs(nowMs);
+                return edge < max ? edge : max;
+            }
+        }
+        return maxUs(nowMs);
+    }
+
+private:
+    struct Window {
+        uint16_t counts[BUCKETS]; // Saturating
+        uint32_t count;
+        uint32_t maxUs;
+    };
+
+    static uint8_t bucketOf(uint32_t valueUs) {
+        if (valueUs < LINEAR_BUCKETS) {
+            return (uint8_t)valueUs;
+        }
+        uint8_t exponent = 31 - __builtin_clz(valueUs);
+        if (exponent >= MAX_EXPONENT) {
+            return BUCKETS - 1;
+        }
+        uint8_t sub = (valueUs >> (exponent - 2)) & (SUB_BUCKETS - 1);
+        return LINEAR_BUCKETS + (exponent - 4) * SUB_BUCKETS + sub;
+    }
+
+    static uint32_t upperEdge(uint8_t bucket) {
+        if (bucket < LINEAR_BUCKETS) {
+            return bucket;
+        }
+        uint8_t exponent = 4 + (bucket - LINEAR_BUCKETS) / SUB_BUCKETS;
+        uint8_t sub = (bucket - LINEAR_BUCKETS) % SUB_BUCKETS;
+        return ((uint32_t)(SUB_BUCKETS + sub + 1) << (exponent - 2)) - 1;
+    }
+
+    void rotate(uint32_t nowMs) {
+        uint32_t elapsed = nowMs - windowStartMs_;
+        if (elapsed < LATENCY_WINDOW_MS) {
+            return;
+        }
+        if (elapsed >= 2 * LATENCY_WINDOW_MS) {
+            reset(nowMs); // Idle for more than a full window: everything is stale
+            return;
+        }
+        current_ ^= 1;
+        memset(&windows_[current_], 0, sizeof(Window));
+        windowStartMs_ += LATENCY_WINDOW_MS;
+    }
+
+    Window windows_[2];
+    uint8_t current_;
+    uint32_t windowStartMs_;
+};
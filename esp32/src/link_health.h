@@ -0,0 +1,307 @@
+// Upstream link health: reconnect backoff and ping/pong heartbeats
+//
+// Pure bookkeeping shared by both link implementations (main.cpp on the ESP32,
+// host/host_main.cpp on Linux); the caller does the I/O.
+//
+// ReconnectBackoff: capped exponential backoff with "equal jitter" - attempt n waits
+//   between half and all of min(cap, base * 2^n). The first retry after a blip is
+//   quick, and when a building-wide AP or server restart drops every board at once,
+//   their retries spread out instead of arriving together.
+//
+// LinkHeartbeat: a ping every intervalMs carrying the send time (halMicros, 8 bytes);
+//   the pong echoes it back, which gives the round-trip time. Pings can also be sent
+//   empty (the ESP32 WebSocket library copies non-empty control frames to the heap);
+//   the RTT then comes from the time of the last ping. If no pong arrives for
+//   timeoutMs the connection is half-open and the caller drops it.
+//
+// UpstreamFailover: the upstream endpoints in preference order (server_host, then the
+//   backups) and two link slots - the active one carries the protocol, the other is a
+//   hot standby already connected to another endpoint, with its own heartbeat, so a
+//   switch costs no TCP/WebSocket handshake. An endpoint costs its smoothed RTT, plus
+//   ERROR_COST_US per recent failure (failed connects, drops, pong timeouts; halved
+//   every ERROR_HALF_LIFE_MS), plus RANK_COST_US per place in the list.
+//   - The active link drops while the standby is up: the standby takes over at once.
+//   - Both up: the standby takes over once it has been up for SETTLE_MS and costs
+//     SWITCH_MARGIN_US less, at most once per HOLD_MS. This covers a slow or flaky
+//     active endpoint as well as moving back to a preferred one that recovered.
+//   - A link that is down dials the cheapest endpoint the other link is not on; every
+//     REVIEW_MS a connected standby is moved to a cheaper endpoint if there is one.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+class ReconnectBackoff {
+public:
+    ReconnectBackoff(uint32_t baseMs, uint32_t capMs) : baseMs_(baseMs), capMs_(capMs), attempt_(0) {}
+
+    void reset() { attempt_ = 0; }
+
+    // Delay before the next attempt; random is any uniformly distributed value
+    uint32_t nextDelayMs(uint32_t random) {
+        uint64_t ceiling = baseMs_;
+        for (uint8_t i = 0; i < attempt_ && ceiling < capMs_; i++) {
+            ceiling *= 2;
+        }
+        if (ceiling < capMs_) {
+            attempt_++; // Stop counting once capped
+        } else {
+            ceiling = capMs_;
+        }
+        uint32_t half = (uint32_t)ceiling / 2;
+        return half + random % ((uint32_t)ceiling - half + 1);
+    }
+
+    uint8_t attempts() const { return attempt_; }
+
+private:
+    uint32_t baseMs_;
+    uint32_t capMs_;
+    uint8_t attempt_;
+};
+
+const size_t LINK_PING_PAYLOAD_SIZE = 8;
+
+class LinkHeartbeat {
+public:
+    LinkHeartbeat(uint32_t intervalMs, uint32_t timeoutMs) : intervalMs_(intervalMs), timeoutMs_(timeoutMs) {
+        reset(0);
+    }
+
+    // Link (re)connected
+    void reset(int64_t nowUs) {
+        lastPingUs_ = nowUs;
+        lastPongUs_ = nowUs;
+        awaitingPong_ = false;
+    }
+
+    // True if a ping is due; fills payload (LINK_PING_PAYLOAD_SIZE bytes, unless nullptr
+    // for an empty ping) with the send time
+    bool pingDue(int64_t nowUs, uint8_t* payload) {
+        if (nowUs - lastPingUs_ < (int64_t)intervalMs_ * 1000) {
+            return false;
+        }
+        lastPingUs_ = nowUs;
+        awaitingPong_ = true;
+        if (payload != nullptr) {
+            memcpy(payload, &nowUs, sizeof(nowUs));
+        }
+        return true;
+    }
+
+    // Pong received; returns false if the payload is not one of our pings
+    bool pongReceived(const uint8_t* payload, size_t length, int64_t nowUs) {
+        int64_t sentUs;
+        if (length == 0 && awaitingPong_) {
+            sentUs = lastPingUs_; // Empty ping: at most one is outstanding
+        } else if (length == LINK_PING_PAYLOAD_SIZE) {
+            memcpy(&sentUs, payload, sizeof(sentUs));
+        } else {
+            return false;
+        }
+        if (sentUs > nowUs || nowUs - sentUs > (int64_t)timeoutMs_ * 1000) {
+            return false;
+        }
+        lastPongUs_ = nowUs;
+        awaitingPong_ = false;
+        lastRttUs_ = (uint32_t)(nowUs - sentUs);
+        // Smoothed like TCP's SRTT (gain 1/8); the first sample seeds it
+        avgRttUs_ = avgRttUs_ == 0 ? lastRttUs_ : avgRttUs_ - avgRttUs_ / 8 + lastRttUs_ / 8;
+        return true;
+    }
+
+    // No pong for timeoutMs: the peer (or a NAT/AP in between) is gone
+    bool timedOut(int64_t nowUs) const {
+        return nowUs - lastPongUs_ > (int64_t)timeoutMs_ * 1000;
+    }
+
+    uint32_t lastRttUs() const { return lastRttUs_; }
+    uint32_t avgRttUs() const { return avgRttUs_; }
+
+private:
+    uint32_t intervalMs_;
+    uint32_t timeoutMs_;
+    int64_t lastPingUs_;
+    int64_t lastPongUs_;
+    bool awaitingPong_;
+    uint32_t lastRttUs_ = 0;
+    uint32_t avgRttUs_ = 0;
+};
+
+const uint8_t UPSTREAM_LINKS = 2; // Active + hot standby
+
+class UpstreamFailover {
+public:
+    static const uint8_t MAX_ENDPOINTS = 3;
+    static const uint32_t RANK_COST_US = 50000;
+    static const uint32_t ERROR_COST_US = 250000;
+    static const uint32_t ERROR_HALF_LIFE_MS = 60000;
+    static const uint32_t SWITCH_MARGIN_US = 50000;
+    static const uint32_t SETTLE_MS = 5000;
+    static const uint32_t HOLD_MS = 30000;
+    static const uint32_t REVIEW_MS = 60000;
+
+    UpstreamFailover() : count_(0), switches_(0) { configure(1, 0); }
+
+    // (Re)start with endpoints in preference order: both links idle. Endpoint health is
+    // kept unless the number of endpoints changed.
+    void configure(uint8_t endpoints, uint32_t nowMs) {
+        endpoints = endpoints < 1 ? 1 : (endpoints > MAX_ENDPOINTS ? MAX_ENDPOINTS : endpoints);
+        if (endpoints != count_) {
+            count_ = endpoints;
+            memset(health_, 0, sizeof(health_));
+        }
+        active_ = 0;
+        lastSwitchMs_ = nowMs;
+        lastReviewMs_ = nowMs;
+        for (uint8_t i = 0; i < UPSTREAM_LINKS; i++) {
+            endpoint_[i] = -1;
+            up_[i] = false;
+            moving_[i] = false;
+            upSinceMs_[i] = nowMs;
+        }
+    }
+
+    uint8_t endpoints() const { return count_; }
+    uint8_t active() const { return active_; }
+    uint8_t standby() const { return active_ ^ 1; }
+    int8_t endpoint(uint8_t link) const { return endpoint_[link]; } // -1 = idle
+    bool up(uint8_t link) const { return up_[link]; }
+    uint32_t switches() const { return switches_; }
+
+    // Choose the endpoint a link that is down dials next; true if it changed (the
+    // caller restarts the link with the new address). With one endpoint the standby
+    // stays idle.
+    bool retarget(uint8_t link, uint32_t nowMs) {
+        int8_t best = cheapest(endpoint_[link ^ 1], nowMs);
+        bool changed = best != endpoint_[link];
+        endpoint_[link] = best;
+        return changed;
+    }
+
+    // Link connected; true if it is the active link (a standby that connects while the
+    // active link is down takes over)
+    bool connected(uint8_t link, uint32_t nowMs) {
+        up_[link] = true;
+        upSinceMs_[link] = nowMs;
+        if (link != active_ && !up_[active_]) {
+            promote(nowMs);
+        }
+        return link == active_;
+    }
+
+    // Link dropped or a connection attempt failed; true if it was the active link and
+    // the standby took over
+    bool disconnected(uint8_t link, uint32_t nowMs) {
+        bool wasUp = up_[link];
+        up_[link] = false;
+        if (moving_[link]) {
+            moving_[link] = false; // Dropped by reviewStandby(), not a failure
+        } else if (endpoint_[link] >= 0) {
+            Health& health = health_[endpoint_[link]];
+            health.errors = errorsNow(health, nowMs) + ERROR_UNIT;
+            health.failMs = nowMs;
+            health.failures++;
+            health.rttUs = 0; // Stale; measured again once it is back
+        }
+        if (link == active_ && wasUp && up_[link ^ 1]) {
+            promote(nowMs);
+            return true;
+        }
+        return false;
+    }
+
+    // Heartbeat round trip on a link; smoothed per endpoint like LinkHeartbeat
+    void measured(uint8_t link, uint32_t rttUs) {
+        if (endpoint_[link] < 0) {
+            return;
+        }
+        uint32_t& avg = health_[endpoint_[link]].rttUs;
+        avg = avg == 0 ? rttUs : avg - avg / 8 + rttUs / 8;
+    }
+
+    // Planned switch to a settled, measured and clearly cheaper standby; true if the
+    // standby just became the active link
+    bool switchDue(uint32_t nowMs) {
+        uint8_t next = standby();
+        if (!up_[active_] || !up_[next] || nowMs - upSinceMs_[next] < SETTLE_MS || nowMs - lastSwitchMs_ < HOLD_MS ||
+            health_[endpoint_[next]].rttUs == 0) {
+            return false;
+        }
+        if (costUs(endpoint_[next], nowMs) + SWITCH_MARGIN_US >= costUs(endpoint_[active_], nowMs)) {
+            return false;
+        }
+        promote(nowMs);
+        return true;
+    }
+
+    // True if the connected standby should move to a cheaper endpoint: the caller
+    // drops it, and the redial after disconnected() goes through retarget()
+    bool reviewStandby(uint32_t nowMs) {
+        uint8_t link = standby();
+        if (!up_[link] || nowMs - lastReviewMs_ < REVIEW_MS) {
+            return false;
+        }
+        lastReviewMs_ = nowMs;
+        int8_t best = cheapest(endpoint_[active_], nowMs);
+        if (best < 0 || best == endpoint_[link] ||
+            costUs(best, nowMs) + SWITCH_MARGIN_US >= costUs(endpoint_[link], nowMs)) {
+            return false;
+        }
+        moving_[link] = true;
+        return true;
+    }
+
+    uint32_t costUs(uint8_t endpoint, uint32_t nowMs) const {
+        const Health& health = health_[endpoint];
+        return endpoint * RANK_COST_US + health.rttUs + (uint32_t)((uint64_t)errorsNow(health, nowMs) * ERROR_COST_US / ERROR_UNIT);
+    }
+    uint32_t rttUs(uint8_t endpoint) const { return health_[endpoint].rttUs; }
+    uint32_t failures(uint8_t endpoint) const { return health_[endpoint].failures; }
+
+private:
+    static const uint32_t ERROR_UNIT = 256; // One failure, in the fixed-point error score
+    static const uint32_t ERROR_MAX = 16 * ERROR_UNIT;
+
+    struct Health {
+        uint32_t rttUs;    // Smoothed heartbeat round trip, 0 = never measured
+        uint32_t errors;   // Score at failMs, ERROR_UNIT per failure
+        uint32_t failMs;
+        uint32_t failures; // Since boot
+    };
+
+    static uint32_t errorsNow(const Health& health, uint32_t nowMs) {
+        uint32_t halvings = (nowMs - health.failMs) / ERROR_HALF_LIFE_MS;
+        uint32_t errors = halvings < 32 ? health.errors >> halvings : 0;
+        return errors < ERROR_MAX ? errors : ERROR_MAX;
+    }
+
+    // Cheapest endpoint other than excluded (-1 = none free); ties go to the earlier one
+    int8_t cheapest(int8_t excluded, uint32_t nowMs) const {
+        int8_t best = -1;
+        for (uint8_t i = 0; i < count_; i++) {
+            if ((int8_t)i != excluded && (best < 0 || costUs(i, nowMs) < costUs(best, nowMs))) {
+                best = (int8_t)i;
+            }
+        }
+        return best;
+    }
+
+    void promote(uint32_t nowMs) {
+        active_ ^= 1;
+        switches_++;
+        lastSwitchMs_ = nowMs;
+    }
+
+    uint8_t count_;
+    uint8_t active_;
+    uint32_t switches_;
+    uint32_t lastSwitchMs_;
+    uint32_t lastReviewMs_;
+    int8_t endpoint_[UPSTREAM_LINKS];
+    bool up_[UPSTREAM_LINKS];
+    bool moving_[UPSTREAM_LINKS];
+    uint32_t upSinceMs_[UPSTREAM_LINKS];
+    Health health_[MAX_ENDPOINTS];
+};
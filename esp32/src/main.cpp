@@ -1,762 +1,604 @@
 // Clean ESP32 Relay Controller Firmware
 // 8 I2C Relay Outputs (0-7) + 8 Direct GPIO Inputs (4-11)
 // WebSocket Reverse Proxy to skytechautomated.com:40000
+//
+// ESP32 entry point and links: WiFi station, WebSocketsClient upstream and a
+// WebSocketsServer for LAN clients. The controller logic is in relay_app.cpp, the rest of
+// the hardware layer in hal_esp32.cpp.
 
 #include <WiFi.h>
 #include <WebSocketsClient.h>
-#include <ArduinoJson.h>
-#include <Wire.h>
-#include <EEPROM.h>
-
-// EEPROM Configuration Storage
-#define EEPROM_SIZE 512
-#define CONFIG_MAGIC 0x12345678
-#define CONFIG_VERSION 1
-
-// I2C Relay Configuration
-#define I2C_SDA 42  // Fixed: SDA should be GPIO42
-#define I2C_SCL 41  // Fixed: SCL should be GPIO41
-#define RELAY_REG_INPUT 0x00    // Input Port Register
-#define RELAY_REG_OUTPUT 0x01   // Output Port Register  
-#define RELAY_REG_CONFIG 0x03   // Configuration Register
-
-// Error tracking
-bool i2cError = false;
-unsigned long lastI2CError = 0;
-const unsigned long I2C_ERROR_REPORT_INTERVAL = 30000; // Report I2C errors every 30 seconds
-
-// Global variable for I2C address (will be set during initialization)
-byte RELAY_I2C_ADDRESS = 0x20;  // Fixed: TCA9554PWR address is 0x20
-
-// Configuration Structure
-struct DeviceConfig {
-    uint32_t magic;
-    uint8_t version;
-    char device_id[32];
-    char device_name[64];
-    char wifi_ssid[32];
-    char wifi_password[64];
-    char server_host[64];
-    int server_port;
-    bool configured;
+#include <WebSocketsServer.h>
+#include <atomic>
+#include "hal.h"
+#include "link_health.h"
+#include "relay_app.h"
+#include "relay_log.h"
+
+// The libraries keep their WiFiClient protected; halNetworkWait() selects on its socket
+class UpstreamSocket : public WebSocketsClient {
+public:
+    WiFiClient* client() { return _client.tcp; }
+    // The library redials with the URL from begin(); this keeps its role query current
+    void setUrl(const char* url) { _client.cUrl = url; }
 };
 
-// Default Configuration (will be overwritten by programming)
-DeviceConfig config = {
-    CONFIG_MAGIC,
-    CONFIG_VERSION,
-    "unconfigured",
-    "Unconfigured Relay",
-    "",
-    "",
-    "skytechautomated.com",
-    40000,
-    false
+class LanServer : public WebSocketsServer {
+public:
+    explicit LanServer(uint16_t port) : WebSocketsServer(port) {}
+    WiFiClient* client(uint8_t num) { return _clients[num].tcp; }
 };
 
-// WebSocket Client (Reverse Proxy to Backend Server)
-WebSocketsClient webSocket;
-
-// State tracking
-bool inputStates[8] = {false};
-bool lastInputStates[8] = {false};
-uint8_t relayStates = 0b00000000; // All relays OFF initially
-uint8_t expectedRelayStates = 0b00000000; // Track expected vs actual states
-unsigned long lastStateReport = 0;
-const unsigned long STATE_REPORT_INTERVAL = 500; // Report every 500ms
-
-// Connection state tracking
-bool wsConnected = false;
-unsigned long lastReconnectAttempt = 0;
-const unsigned long RECONNECT_INTERVAL = 60000; // 1 minute
-
-// Input pins (GPIO 4-11)
-const int INPUT_PINS[] = {4, 5, 6, 7, 8, 9, 10, 11};
-
-// Function declarations
-void webSocketEvent(WStype_t type, uint8_t * payload, size_t length);
-void handleWebSocketMessage(uint8_t * payload, size_t length);
-void sendFullState();
-void readInputs();
-bool updateRelays();
-void loadConfiguration();
-void saveConfiguration();
+// Upstream WebSocket clients (reverse proxy to the backend): failover.active() is the
+// link, the other one the hot standby. Only the active link's frames reach the app.
+struct UpstreamLink {
+    UpstreamLink();
+    UpstreamSocket socket;
+    ReconnectBackoff backoff;
+    LinkHeartbeat heartbeat;
+    unsigned long beginAt;  // begin() with a new endpoint once due
+    bool beginPending;
+    bool tls;
+    // Connection cost, measured around loop() while the link is down: the library's TLS
+    // handshake blocks the network task for its whole duration
+    uint32_t connectStallUs;   // Longest loop() since the last attempt failed
+    uint32_t heapBeforeConnect;
+    uint32_t connectMs;        // Of the attempt that came up
+    int32_t connectHeapBytes;
+};
+
+// LAN server: serviced in the same network task pass as the upstream link, so a LAN
+// command reaches the I/O task as soon as it arrives, with no server round trip
+static_assert(WEBSOCKETS_SERVER_CLIENT_MAX <= HAL_LAN_CLIENTS, "LAN client slots must fit HalLinks");
+LanServer lanServer(HAL_LAN_PORT);
+std::atomic<bool> lanEnabled(false); // halLanServe(); lanListening follows it while WiFi is up
+bool lanListening = false;
+
+// Network identity, formatted once instead of on every message
+char macAddressStr[18] = "";
+char ipAddressStr[16] = "";
+
+// Reconnects are event driven: WiFi events (WiFi task) and WebSocket events (network
+// task) schedule the next attempt with capped exponential backoff and jitter, and a
+// ping every LINK_PING_INTERVAL_MS catches a half-open socket within LINK_PONG_TIMEOUT_MS.
+const uint32_t WIFI_RETRY_BASE_MS = 100;
+const uint32_t WIFI_RETRY_CAP_MS = 2000;    // The AP is local: an AP reboot should cost ~2 s, not a minute
+const uint32_t LINK_RETRY_BASE_MS = 250;
+const uint32_t LINK_RETRY_CAP_MS = 30000;   // Keeps a fleet from hammering a restarting server
+const uint32_t LINK_PING_INTERVAL_MS = 1000;
+const uint32_t LINK_PONG_TIMEOUT_MS = 3000;
+static_assert(UPSTREAM_BACKUPS + 1 <= UpstreamFailover::MAX_ENDPOINTS, "endpoint list must fit UpstreamFailover");
+
+// The library dials inside loop(), so a standby (re)dial stalls the whole network task:
+// up to the TCP connect timeout (WEBSOCKETS_TCP_TIMEOUT, 5 s) against an endpoint that
+// does not answer, plus the full TLS handshake for wss (connect_ms in the link stats).
+// While the active link carries traffic the standby waits, for STANDBY_DEFER_MAX_MS at most.
+const uint32_t STANDBY_QUIET_MS = 1000;      // Since the last frame on the active link
+const uint32_t STANDBY_DEFER_MAX_MS = 30000;
+
+// A wss link has no socket to select on (WiFiClientSecure keeps it, and mbedtls holds
+// decrypted records out of select()'s sight), so while one is up the network task polls
+// every TLS_POLL_MS instead. New LAN connections are accepted on the next timeout.
+const uint32_t TLS_POLL_MS = 5;
+void halWaitReadable(HalTask self, const int* fds, size_t count, uint32_t timeoutMs); // hal_esp32.cpp
+
+enum WiFiEventBits : uint8_t {
+    WIFI_EVENT_UP = 0x01,   // Got an IP
+    WIFI_EVENT_DOWN = 0x02  // Disconnected, lost the IP, or a connect attempt failed
+};
+
+// Connection state tracking (network task, except wifiEvents)
+std::atomic<uint8_t> wifiEvents(0); // WiFiEventBits set by onWiFiEvent() in the WiFi task
+bool wifiUp = false;
+bool wifiRetryPending = false;
+unsigned long wifiRetryAt = 0;
+bool wifiFastConnect = false;  // The current attempt skips the scan (cached channel/BSSID)
+bool wifiCacheStale = false;   // A fast attempt failed: scan until the next association
+bool linkEverConnected = false;
+int64_t linkDownSinceUs = 0;
+uint32_t linkReconnects = 0;
+uint32_t wifiDrops = 0;
+uint32_t linkLastOutageMs = 0;
+unsigned long activeFrameAt = 0;      // Last frame received on the active link
+bool standbyDeferring = false;        // The standby dial is waiting for a quiet active link
+unsigned long standbyDeferredAt = 0;
+ReconnectBackoff wifiBackoff(WIFI_RETRY_BASE_MS, WIFI_RETRY_CAP_MS);
+UpstreamLink::UpstreamLink()
+    : backoff(LINK_RETRY_BASE_MS, LINK_RETRY_CAP_MS), heartbeat(LINK_PING_INTERVAL_MS, LINK_PONG_TIMEOUT_MS),
+      beginAt(0), beginPending(false), tls(false), connectStallUs(0), heapBeforeConnect(0), connectMs(0),
+      connectHeapBytes(0) {}
+UpstreamLink upstreamLinks[UPSTREAM_LINKS];
+UpstreamFailover failover;
+
+void upstreamEvent(uint8_t slot, WStype_t type, uint8_t * payload, size_t length);
+void lanEvent(uint8_t client, WStype_t type, uint8_t * payload, size_t length);
+void updateLanServer();
+void onWiFiEvent(arduino_event_id_t event, arduino_event_info_t info);
+void scheduleWiFiRetry();
+void onLinkUp(uint8_t slot);
+void onLinkDown(uint8_t slot);
+void cacheNetworkIdentity();
 void connectToWiFi();
-void connectToWebSocket();
-void handleSerialConfiguration();
-void applyConfiguration(JsonObject configData);
-void sendConfigResponse(bool success, const char* message);
-void resetToDefaults();
-void initI2CRelays();
-void sendRelayControlAck(int relayIndex, bool state, bool success, const char* error);
-void sendErrorReport(const char* errorType, const char* message);
-bool verifyRelayState(int relayIndex, bool expectedState);
-void reportI2CError();
-void setRelayState(byte relayIndex, bool state);
+void startUpstream();
+void stopUpstream();
+void beginUpstream(uint8_t slot);
+void updateUpstreamRoles();
+bool standbyDialDeferred();
+void serviceUpstream(uint8_t slot);
 
 void setup() {
-  Serial.begin(115200);
-  delay(1000);
-    
-    Serial.println("=== ESP32 Relay Controller ===");
-    Serial.println("VERSION: 2024-12-19-CLEAN");
-    Serial.println("Connecting to skytechautomated.com:40000");
-    
-    // Initialize EEPROM
-    EEPROM.begin(EEPROM_SIZE);
-    
-    // Initialize WiFi first to get MAC address
+    halBegin();
+
+    // Initialize WiFi first to get MAC address. Credentials live in our own config, so
+    // the driver does not need to write them to NVS on every connect.
+    WiFi.persistent(false);
     WiFi.mode(WIFI_STA);
-    
-    // Check if we have embedded WiFi credentials first (before loading EEPROM)
-    Serial.println("Checking for embedded configuration...");
-    Serial.printf("Embedded SSID: '%s'\n", config.wifi_ssid);
-    Serial.printf("Embedded password length: %d\n", strlen(config.wifi_password));
-    
-    if (strlen(config.wifi_ssid) > 0) {
-        Serial.println("✅ Found embedded WiFi configuration!");
-        Serial.printf("WiFi SSID: %s\n", config.wifi_ssid);
-        Serial.printf("Device ID: %s\n", config.device_id);
-        Serial.printf("Device Name: %s\n", config.device_name);
-        config.configured = true;
-        // Don't load from EEPROM - use embedded config
-    } else {
-        Serial.println("⚠️  No embedded WiFi configuration found, loading from EEPROM...");
-        // Load configuration from EEPROM only if no embedded config
-        loadConfiguration();
-        
-        // Only use MAC address as device ID if no embedded config
-        if (!config.configured || strcmp(config.device_id, "unconfigured") == 0) {
-            String macAddress = WiFi.macAddress();
-            strcpy(config.device_id, macAddress.c_str());
-            strcpy(config.device_name, "ESP32 Relay Controller");
-            config.configured = true;
-            saveConfiguration();
-            Serial.printf("Using MAC address as device ID: %s\n", macAddress.c_str());
-        }
-    }
-    
-    // Initialize I2C with specific pins
-    Wire.begin(I2C_SDA, I2C_SCL);
-    Wire.setClock(100000); // Set to 100kHz for better compatibility (like working code)
-    delay(100); // Small delay for I2C to stabilize
-    
-    // Scan for I2C devices
-    Serial.println("Scanning I2C bus...");
-    for (byte address = 1; address < 127; address++) {
-        Wire.beginTransmission(address);
-        byte error = Wire.endTransmission();
-        if (error == 0) {
-            Serial.printf("I2C device found at address 0x%02X\n", address);
-        }
-    }
-    Serial.println("I2C scan complete");
-    
-    // Initialize I2C relays
-    initI2CRelays();
-    
-    // Initialize input pins
-    for (int i = 0; i < 8; i++) {
-        pinMode(INPUT_PINS[i], INPUT_PULLUP);
-    }
-    
-    // Always wait for configuration first (for programming)
-    Serial.println("Waiting for configuration...");
-    Serial.println("Send configuration via serial or wait 10 seconds to continue...");
-    
-    unsigned long startTime = millis();
-    while (millis() - startTime < 10000) {
-        handleSerialConfiguration();
-        delay(100);
-    }
-    
-    // Connect to WiFi and server if configured
-    if (config.configured && strlen(config.wifi_ssid) > 0) {
-        Serial.println("Configuration found, connecting to WiFi...");
-        Serial.printf("WiFi SSID: %s\n", config.wifi_ssid);
-        Serial.printf("Server: %s:%d\n", config.server_host, config.server_port);
-  connectToWiFi();
-  connectToWebSocket();
-    } else {
-        Serial.println("Device not configured with WiFi credentials. Cannot connect.");
-        Serial.printf("Current device_id: %s\n", config.device_id);
-        Serial.printf("Current device_name: %s\n", config.device_name);
-        Serial.println("Note: Device needs WiFi credentials to connect to server.");
-    }
+    cacheNetworkIdentity();
+
+    appSetup();
 }
 
 void loop() {
-  webSocket.loop();
-    
-    // Check WiFi and reconnect if needed
-    if (WiFi.status() != WL_CONNECTED) {
-        if (millis() - lastReconnectAttempt > RECONNECT_INTERVAL) {
-            Serial.println("WiFi disconnected. Attempting to reconnect...");
+    // All work happens in the pinned I/O and network tasks
+    vTaskDelete(nullptr);
+}
+
+void halNetworkBegin() {
+    WiFi.setAutoReconnect(false); // Retries are scheduled here, with backoff
+    WiFi.onEvent(onWiFiEvent);
+    upstreamLinks[0].socket.onEvent([](WStype_t type, uint8_t* payload, size_t length) { upstreamEvent(0, type, payload, length); });
+    upstreamLinks[1].socket.onEvent([](WStype_t type, uint8_t* payload, size_t length) { upstreamEvent(1, type, payload, length); });
+    lanServer.onEvent(lanEvent);
+    // Same ping/pong timing as the upstream link: a vanished LAN client frees its slot
+    lanServer.enableHeartbeat(LINK_PING_INTERVAL_MS, LINK_PONG_TIMEOUT_MS, 2);
+    wifiRetryPending = false; // A restart during the serial config window is superseded
+    connectToWiFi();
+}
+
+void halNetworkLoop() {
+    uint8_t events = wifiEvents.exchange(0);
+    if (events & WIFI_EVENT_DOWN) {
+        if (!wifiUp && wifiFastConnect) {
+            LOG_W("Cached AP not reachable, falling back to a full scan");
+            wifiCacheStale = true;
+        }
+        if (wifiUp) {
+            LOG_I("WiFi connection lost (status: %d)", WiFi.status());
+            wifiUp = false;
+            wifiDrops++;
+            stopUpstream(); // Reports the link down right away
+        }
+        scheduleWiFiRetry();
+    }
+    if ((events & WIFI_EVENT_UP) && WiFi.status() == WL_CONNECTED) {
+        wifiUp = true;
+        wifiRetryPending = false;
+        wifiBackoff.reset();
+        wifiCacheStale = false;
+        appOnWifiAssociated((uint8_t)WiFi.channel(), WiFi.BSSID());
+        cacheNetworkIdentity();
+        LOG_I("WiFi connected! IP: %s", ipAddressStr);
+        LOG_I("MAC Address: %s", macAddressStr);
+        LOG_I("Signal Strength: %d dBm", WiFi.RSSI());
+        startUpstream();
+    }
+    updateLanServer();
+
+    if (!wifiUp) {
+        if (wifiRetryPending && (long)(millis() - wifiRetryAt) >= 0) {
+            wifiRetryPending = false;
             connectToWiFi();
-            lastReconnectAttempt = millis();
         }
+        return;
     }
-    
-    // Check WebSocket and reconnect if needed
-    if (WiFi.status() == WL_CONNECTED && !wsConnected) {
-        if (millis() - lastReconnectAttempt > RECONNECT_INTERVAL) {
-            Serial.println("WebSocket disconnected. Attempting to reconnect...");
-            connectToWebSocket();
-            lastReconnectAttempt = millis();
-        }
+
+    for (uint8_t slot = 0; slot < UPSTREAM_LINKS; slot++) {
+        serviceUpstream(slot);
     }
-    
-    // Handle serial configuration
-    handleSerialConfiguration();
-    
-    // Read inputs and send state changes
-    readInputs();
-    
-    // Send periodic state report
-    if (wsConnected && millis() - lastStateReport > STATE_REPORT_INTERVAL) {
-        sendFullState();
-        lastStateReport = millis();
+    if (lanListening) {
+        lanServer.loop();
     }
-    
-    delay(100); // Small delay to prevent overwhelming
-}
 
-void initI2CRelays() {
-    Serial.println("Initializing TCA9554PWR I2C expander...");
-    
-    // Try multiple common TCA9554PWR addresses (but prioritize 0x20)
-    byte addresses[] = {0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F};
-    bool found = false;
-    
-    for (byte addr : addresses) {
-        Wire.beginTransmission(addr);
-        byte error = Wire.endTransmission();
-        
-        if (error == 0) {
-            Serial.printf("✅ TCA9554PWR found at address 0x%02X\n", addr);
-            
-            // Update the address for future use
-            RELAY_I2C_ADDRESS = addr;
-            
-            found = true;
-            break;
-        }
+    unsigned long now = millis();
+    if (failover.switchDue(now)) {
+        LOG_I("Standby endpoint %d is faster, switching over", failover.endpoint(failover.active()));
+        updateUpstreamRoles();
+        appOnLinkConnected(HAL_LINK_UPSTREAM); // Registers and resyncs on the new link
     }
-    
-    if (!found) {
-        Serial.println("❌ TCA9554PWR not found at any common address");
-        Serial.println("Please check I2C wiring and power supply");
+    if (failover.reviewStandby(now)) {
+        uint8_t standby = failover.standby();
+        LOG_I("Moving the standby link off endpoint %d", failover.endpoint(standby));
+        upstreamLinks[standby].socket.disconnect();
+    }
+}
+
+// The library reconnects by itself after setReconnectInterval(); onLinkDown() moves
+// that interval along the backoff, or restarts the link on another endpoint
+void serviceUpstream(uint8_t slot) {
+    UpstreamLink& link = upstreamLinks[slot];
+    if (failover.endpoint(slot) < 0) {
         return;
     }
-    
-    // Read current configuration register
-    Wire.beginTransmission(RELAY_I2C_ADDRESS);
-    Wire.write(0x03); // Configuration register
-    byte error = Wire.endTransmission();
-    
-    if (error == 0) {
-        Wire.requestFrom(RELAY_I2C_ADDRESS, 1);
-        if (Wire.available()) {
-            byte configVal = Wire.read();
-            Serial.printf("Current config register: 0x%02X\n", configVal);
+    if (link.beginPending) {
+        if ((long)(millis() - link.beginAt) < 0) {
+            return;
         }
+        link.beginPending = false;
+        beginUpstream(slot);
     }
-    
-    // Configure all pins as outputs (0 = output, 1 = input)
-    Wire.beginTransmission(RELAY_I2C_ADDRESS);
-    Wire.write(0x03); // Configuration register
-    Wire.write(0x00); // All pins as outputs
-    error = Wire.endTransmission();
-    
-    if (error != 0) {
-        Serial.printf("❌ Failed to configure pins as outputs (error: %d)\n", error);
-        return;
-    }
-    
-    Serial.println("✅ Configured all pins as outputs");
-    
-    // Set all outputs to LOW (relays OFF for active-high logic)
-    Wire.beginTransmission(RELAY_I2C_ADDRESS);
-    Wire.write(0x01); // Output register
-    Wire.write(0x00); // All outputs LOW (relays OFF)
-    error = Wire.endTransmission();
-    
-    if (error != 0) {
-        Serial.printf("❌ Failed to set initial output states (error: %d)\n", error);
+    if (failover.up(slot)) {
+        link.socket.loop();
+    } else if (slot == failover.standby() && standbyDialDeferred()) {
         return;
-    }
-    
-    Serial.println("✅ Set all outputs to LOW");
-    
-    // Read back output register to verify
-    Wire.beginTransmission(RELAY_I2C_ADDRESS);
-    Wire.write(0x01); // Output register
-    error = Wire.endTransmission();
-    
-    if (error == 0) {
-        Wire.requestFrom(RELAY_I2C_ADDRESS, 1);
-        if (Wire.available()) {
-            byte outputVal = Wire.read();
-            Serial.printf("Output register readback: 0x%02X\n", outputVal);
-            if (outputVal == 0x00) {
-                Serial.println("✅ Output register verified - all outputs are LOW");
-            } else {
-                Serial.printf("⚠️  Output register mismatch - expected 0x00, got 0x%02X\n", outputVal);
-            }
+    } else {
+        int64_t start = halMicros();
+        link.socket.loop();
+        uint32_t stallUs = (uint32_t)(halMicros() - start);
+        if (stallUs > link.connectStallUs) {
+            link.connectStallUs = stallUs;
         }
     }
-    
-    Serial.println("✅ TCA9554PWR initialized successfully - all relays OFF (active-high logic)");
-    Serial.println("EXIO pin mapping: Relay 0=EXIO1, Relay 1=EXIO2, ..., Relay 7=EXIO8");
-    Serial.println("💡 All relay LEDs should be OFF at boot - if not, check TCA9554PWR wiring/power");
-}
 
-void handleSerialConfiguration() {
-    if (Serial.available()) {
-        String configString = Serial.readStringUntil('\n');
-        configString.trim();
-        
-        if (configString.length() > 0) {
-            Serial.printf("Received configuration: %s\n", configString.c_str());
-            
-            // Parse JSON configuration
-            StaticJsonDocument<2048> configDoc;
-            DeserializationError error = deserializeJson(configDoc, configString);
-            
-            if (error) {
-                Serial.printf("JSON parsing failed: %s\n", error.c_str());
-                sendConfigResponse(false, "JSON parsing failed");
-                return;
-            }
-            
-            // Check if this is a configuration message
-            const char* msgType = configDoc["type"];
-            if (strcmp(msgType, "config") == 0) {
-                JsonObject configData = configDoc["data"];
-                if (configData) {
-                    Serial.println("Applying configuration...");
-                    applyConfiguration(configData);
-                } else {
-                    Serial.println("No configuration data found");
-                    sendConfigResponse(false, "No configuration data");
-                }
-            } else {
-                Serial.println("Unknown message type");
-                sendConfigResponse(false, "Unknown message type");
-            }
+    if (failover.up(slot)) {
+        int64_t now = halMicros();
+        // Empty ping: the library would copy a payload to the heap for every ping
+        if (link.heartbeat.pingDue(now, nullptr)) {
+            link.socket.sendPing();
+        }
+        if (link.heartbeat.timedOut(now)) {
+            LOG_W("No pong for %u ms, dropping half-open link to endpoint %d", LINK_PONG_TIMEOUT_MS, failover.endpoint(slot));
+            link.socket.disconnect();
         }
     }
 }
 
-void applyConfiguration(JsonObject configData) {
-    Serial.println("=== APPLYING CONFIGURATION ===");
-    
-    // Update device info
-    if (configData.containsKey("device_id")) {
-        strcpy(config.device_id, configData["device_id"]);
-    }
-    if (configData.containsKey("device_name")) {
-        strcpy(config.device_name, configData["device_name"]);
-    }
-    if (configData.containsKey("wifi_ssid")) {
-        strcpy(config.wifi_ssid, configData["wifi_ssid"]);
+// True while the standby should not dial: the active link is up and has frames to read or
+// the app has events to send. Gives up after STANDBY_DEFER_MAX_MS, until the next attempt ends.
+bool standbyDialDeferred() {
+    uint8_t active = failover.active();
+    WiFiClient* client = upstreamLinks[active].socket.client();
+    unsigned long now = millis();
+    bool busy = failover.up(active) && (now - activeFrameAt < STANDBY_QUIET_MS || appLinkTrafficPending() ||
+                                        (client != nullptr && client->available() > 0));
+    if (!busy) {
+        standbyDeferring = false;
+        return false;
     }
-    if (configData.containsKey("wifi_password")) {
-        strcpy(config.wifi_password, configData["wifi_password"]);
+    if (!standbyDeferring) {
+        standbyDeferring = true;
+        standbyDeferredAt = now;
     }
-    if (configData.containsKey("server_host")) {
-        strcpy(config.server_host, configData["server_host"]);
+    return now - standbyDeferredAt < STANDBY_DEFER_MAX_MS;
+}
+
+// Block in select() on the link sockets (and the task's eventfd) until one is readable,
+// the task is notified or timeoutMs passes
+void halNetworkWait(uint32_t timeoutMs) {
+    const size_t LINKS = UPSTREAM_LINKS + WEBSOCKETS_SERVER_CLIENT_MAX;
+    WiFiClient* clients[LINKS];
+    for (uint8_t slot = 0; slot < UPSTREAM_LINKS; slot++) {
+        clients[slot] = upstreamLinks[slot].socket.client();
     }
-    if (configData.containsKey("server_port")) {
-        config.server_port = configData["server_port"];
+    for (uint8_t i = 0; i < WEBSOCKETS_SERVER_CLIENT_MAX; i++) {
+        clients[UPSTREAM_LINKS + i] = lanServer.client(i);
     }
     
-    config.configured = true;
-    
-    // Save configuration
-    saveConfiguration();
-    
-    // Send success response
-    sendConfigResponse(true, "Configuration applied successfully");
-    
-    // Reconnect with new settings
-    Serial.println("Reconnecting with new configuration...");
-    connectToWiFi();
-    connectToWebSocket();
+    int fds[LINKS];
+    size_t count = 0;
+    for (WiFiClient* client : clients) {
+        if (client == nullptr || !client->connected()) {
+            continue;
+        }
+        if (client->available() > 0) {
+            return; // Already read off the socket into the client's buffer
+        }
+        int fd = client->fd();
+        if (fd < 0) {
+            timeoutMs = timeoutMs < TLS_POLL_MS ? timeoutMs : TLS_POLL_MS;
+        } else {
+            fds[count++] = fd;
+        }
+    }
+    halWaitReadable(HAL_TASK_NET, fds, count, timeoutMs);
 }
 
-void sendConfigResponse(bool success, const char* message) {
-    StaticJsonDocument<256> response;
-    response["type"] = "config_response";
-    response["success"] = success;
-    response["message"] = message;
-    
-    String responseString;
-    serializeJson(response, responseString);
-    Serial.println(responseString);
+// Reconnect with new settings (the WebSocket follows once WiFi is back up). The
+// disconnect event reschedules the retry with jitter.
+void halNetworkRestart() {
+    stopUpstream();
+    WiFi.disconnect();
+    wifiUp = false;
+    wifiBackoff.reset();
+    wifiRetryPending = true;
+    wifiRetryAt = millis() + WIFI_RETRY_BASE_MS;
 }
 
-void loadConfiguration() {
-    EEPROM.get(0, config);
-    
-    if (config.magic != CONFIG_MAGIC || config.version != CONFIG_VERSION) {
-        Serial.println("Invalid configuration, using defaults");
-        resetToDefaults();
+void halLanServe(bool enabled) {
+    lanEnabled.store(enabled);
+}
+
+// Listen while enabled and WiFi is up; closing disconnects every LAN client
+void updateLanServer() {
+    bool listen = lanEnabled.load() && wifiUp;
+    if (listen == lanListening) {
         return;
     }
-    
-    Serial.printf("Loaded configuration for %s (%s)\n", config.device_id, config.device_name);
+    lanListening = listen;
+    if (listen) {
+        lanServer.begin();
+        LOG_I("LAN server listening on %s:%u", ipAddressStr, HAL_LAN_PORT);
+    } else {
+        lanServer.close();
+        LOG_I("LAN server closed");
+    }
 }
 
-void saveConfiguration() {
-    EEPROM.put(0, config);
-    EEPROM.commit();
-    Serial.println("Configuration saved to EEPROM");
+void halLinkClose(HalLinks links) {
+    for (uint8_t i = 0; i < HAL_LAN_CLIENTS; i++) {
+        if (links & halLanLink(i)) {
+            lanServer.disconnect(i);
+        }
+    }
 }
 
-void resetToDefaults() {
-    config.magic = CONFIG_MAGIC;
-    config.version = CONFIG_VERSION;
-    strcpy(config.device_id, "unconfigured");
-    strcpy(config.device_name, "Unconfigured Relay");
-    strcpy(config.wifi_ssid, "");
-    strcpy(config.wifi_password, "");
-    strcpy(config.server_host, "skytechautomated.com");
-    config.server_port = 40000;
-    config.configured = false;
-    
-    saveConfiguration();
+// headerToPayload: the library writes the header into our headroom and masks in place.
+// Without it, every frame under 1400 bytes is copied into a malloc'd buffer. Server
+// frames are not masked, so the payload stays intact for the upstream send at the end.
+bool halLinkSendFrame(uint8_t* frame, size_t length, bool binary, HalLinks links) {
+    bool sent = true;
+    for (uint8_t i = 0; i < HAL_LAN_CLIENTS; i++) {
+        if (links & halLanLink(i)) {
+            sent &= binary ? lanServer.sendBIN(i, frame, length, true) : lanServer.sendTXT(i, frame, length, true);
+        }
+    }
+    if (links & HAL_LINK_UPSTREAM) {
+        WebSocketsClient& upstream = upstreamLinks[failover.active()].socket;
+        sent &= binary ? upstream.sendBIN(frame, length, true) : upstream.sendTXT(frame, length, true);
+    }
+    return sent;
 }
 
-void connectToWiFi() {
-    if (strlen(config.wifi_ssid) == 0) {
-        Serial.println("No WiFi SSID configured");
-        return;
-    }
-    
-    Serial.printf("Connecting to WiFi: %s\n", config.wifi_ssid);
-    Serial.printf("WiFi password length: %d\n", strlen(config.wifi_password));
-    WiFi.begin(config.wifi_ssid, config.wifi_password);
-    
-  int attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-    delay(500);
-    Serial.print(".");
-    attempts++;
-  }
-    
-  if (WiFi.status() == WL_CONNECTED) {
-        Serial.println();
-        Serial.printf("WiFi connected! IP: %s\n", WiFi.localIP().toString().c_str());
-        Serial.printf("MAC Address: %s\n", WiFi.macAddress().c_str());
-        Serial.printf("Signal Strength: %d dBm\n", WiFi.RSSI());
-  } else {
-        Serial.println();
-        Serial.println("WiFi connection failed");
-        Serial.printf("WiFi status: %d\n", WiFi.status());
-  }
+const char* halMacAddress() {
+    return macAddressStr;
 }
 
-void connectToWebSocket() {
-    if (WiFi.status() != WL_CONNECTED) {
-        Serial.println("Cannot connect WebSocket - WiFi not connected");
-        return;
-    }
-    Serial.println("Connecting to WebSocket server...");
-    // Use configured server settings or defaults
-    const char* host = (strlen(config.server_host) > 0) ? config.server_host : "skytechautomated.com";
-    int port = (config.server_port > 0) ? config.server_port : 40000;
-    // Create URL with MAC address as ID parameter
-    String url = "/elevator?id=";
-    url += WiFi.macAddress();
-    Serial.printf("Connecting to %s:%d%s\n", host, port, url.c_str());
-    webSocket.begin(host, port, url.c_str());
-  webSocket.onEvent(webSocketEvent);
-  webSocket.setReconnectInterval(5000);
+const char* halIpAddress() {
+    return ipAddressStr;
 }
 
-void readInputs() {
-    for (int i = 0; i < 8; i++) {
-        bool currentState = digitalRead(INPUT_PINS[i]) == LOW; // Active low
-        inputStates[i] = currentState;
-        lastInputStates[i] = currentState;
-    }
+HalLinkStats halLinkStats() {
+    const UpstreamLink& link = upstreamLinks[failover.active()];
+    return {link.heartbeat.lastRttUs(), link.heartbeat.avgRttUs(), linkReconnects, linkLastOutageMs,
+            failover.endpoint(failover.active()), failover.switches(), link.tls, link.connectMs,
+            link.connectHeapBytes, (int8_t)(wifiUp ? WiFi.RSSI() : 0), wifiDrops};
 }
 
-bool updateRelays() {
-    // Map relay 0-7 to EXIO 1-8 (no bit shifting needed, direct mapping)
-    // Relay 0 = EXIO1, Relay 1 = EXIO2, etc.
-    uint8_t exioStates = relayStates;
-    
-    Serial.printf("Setting EXIO states: 0x%02X (binary: ", exioStates);
-    for (int i = 7; i >= 0; i--) {
-        Serial.print((exioStates >> i) & 1);
-    }
-    Serial.println(")");
-    
-    Wire.beginTransmission(RELAY_I2C_ADDRESS);
-    Wire.write(RELAY_REG_OUTPUT);
-    Wire.write(exioStates); // Direct value - HIGH = relay ON (like working code)
-    byte error = Wire.endTransmission();
-    
-    if (error == 0) {
-        i2cError = false; // Clear error flag on successful communication
-        
-        // Read back the output register to verify
-        Wire.beginTransmission(RELAY_I2C_ADDRESS);
-        Wire.write(RELAY_REG_OUTPUT);
-        error = Wire.endTransmission();
-        
-        if (error == 0) {
-            Wire.requestFrom(RELAY_I2C_ADDRESS, 1);
-            if (Wire.available()) {
-                uint8_t readback = Wire.read();
-                Serial.printf("EXIO output register readback: 0x%02X\n", readback);
-            }
-        }
-        
-        return true;
-    } else {
-        Serial.printf("❌ I2C Error setting relay states: %d\n", error);
-        reportI2CError();
-        return false;
+// WiFi task: just record the event and wake the network task
+void onWiFiEvent(arduino_event_id_t event, arduino_event_info_t info) {
+    switch (event) {
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+        wifiEvents.fetch_or(WIFI_EVENT_UP);
+        break;
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+    case ARDUINO_EVENT_WIFI_STA_LOST_IP:
+        wifiEvents.fetch_or(WIFI_EVENT_DOWN);
+        break;
+    default:
+        return;
     }
+    halNotify(HAL_TASK_NET);
 }
 
-void webSocketEvent(WStype_t type, uint8_t * payload, size_t length) {
-    switch (type) {
-    case WStype_DISCONNECTED:
-        Serial.println("WebSocket disconnected");
-      wsConnected = false;
-      break;
-    case WStype_CONNECTED:
-        Serial.println("WebSocket connected");
-      wsConnected = true;
-        // Send registration message with MAC and IP (matching test relay connection)
-      {
-        StaticJsonDocument<256> regDoc;
-            regDoc["type"] = "register";
-        regDoc["device_id"] = config.device_id;
-        regDoc["device_name"] = config.device_name;
-            regDoc["mac"] = WiFi.macAddress();
-            regDoc["ip"] = WiFi.localIP().toString();
-            String regMessage;
-            serializeJson(regDoc, regMessage);
-            webSocket.sendTXT(regMessage);
-            Serial.printf("Sent registration: MAC=%s, IP=%s\n", WiFi.macAddress().c_str(), WiFi.localIP().toString().c_str());
-            Serial.printf("Device ID: %s, Device Name: %s\n", config.device_id, config.device_name);
-            // Send full state immediately after registration
-            sendFullState();
-      }
-      break;
-    case WStype_TEXT:
-        Serial.printf("Received message: %s\n", payload);
-        handleWebSocketMessage(payload, length);
-      break;
-    case WStype_ERROR:
-        Serial.println("WebSocket error");
-      wsConnected = false;
-      break;
-  }
+void scheduleWiFiRetry() {
+    uint32_t delayMs = wifiBackoff.nextDelayMs(halRandom());
+    wifiRetryPending = true;
+    wifiRetryAt = millis() + delayMs;
+    LOG_D("WiFi retry in %u ms", delayMs);
 }
 
-void handleWebSocketMessage(uint8_t * payload, size_t length) {
-    StaticJsonDocument<512> doc;
-    DeserializationError error = deserializeJson(doc, payload, length);
-    
-    if (error) {
-        Serial.printf("JSON parsing failed: %s\n", error.c_str());
-        sendErrorReport("JSON_PARSE_ERROR", "Failed to parse incoming message");
+void connectToWiFi() {
+    if (strlen(config.wifi_ssid) == 0) {
+        LOG_I("No WiFi SSID configured");
         return;
     }
-    
-    const char* msgType = doc["type"];
-    
-    if (strcmp(msgType, "relay_control") == 0) {
-        int relayIndex = doc["relay"];
-        bool state = doc["state"];
-        
-        if (relayIndex >= 0 && relayIndex < 8) {
-            // Map relay 0-7 to EXIO 1-8 (direct mapping)
-            int exioPin = relayIndex + 1;
-            
-            Serial.printf("🎛️  Relay control command: Relay %d (EXIO %d) -> %s\n", 
-                        relayIndex, exioPin, state ? "ON" : "OFF");
-            
-            // Store expected state for verification
-            if (state) {
-                expectedRelayStates |= (1 << relayIndex);
-            } else {
-                expectedRelayStates &= ~(1 << relayIndex);
-            }
-            
-            // Update relay state (keep internal mapping as 0-7 for state tracking)
-            if (state) {
-                relayStates |= (1 << relayIndex);
-            } else {
-                relayStates &= ~(1 << relayIndex);
-            }
-            
-            Serial.printf("Updated relay states: 0x%02X (expected: 0x%02X)\n", 
-                        relayStates, expectedRelayStates);
-            
-            // Attempt to update relays via I2C
-            bool i2cSuccess = updateRelays();
-            
-            if (i2cSuccess) {
-                Serial.printf("✅ Relay %d (EXIO %d) set to %s successfully\n", 
-                            relayIndex, exioPin, state ? "ON" : "OFF");
-                
-                // Verify state was applied correctly
-                bool stateVerified = verifyRelayState(relayIndex, state);
-                
-                // Send acknowledgment
-                sendRelayControlAck(relayIndex, state, true, nullptr);
-                
-                // Send state verification
-                if (wsConnected) {
-                    StaticJsonDocument<256> verifyDoc;
-                    verifyDoc["type"] = "relay_state_verified";
-                    verifyDoc["relay"] = relayIndex;
-                    verifyDoc["exio_pin"] = exioPin;
-                    verifyDoc["expected_state"] = state;
-                    verifyDoc["actual_state"] = stateVerified;
-                    
-                    String verifyMessage;
-                    serializeJson(verifyDoc, verifyMessage);
-                    webSocket.sendTXT(verifyMessage);
-                }
-                
-                // Send full state immediately after relay change
-                if (wsConnected) {
-                    sendFullState();
-                }
-            } else {
-                Serial.printf("❌ Failed to set relay %d (EXIO %d) to %s (I2C error)\n", 
-                            relayIndex, exioPin, state ? "ON" : "OFF");
-                
-                // Send error acknowledgment
-                sendRelayControlAck(relayIndex, state, false, "I2C communication failed");
-                
-                // Revert state change on failure
-                relayStates = expectedRelayStates;
-            }
-        } else {
-            Serial.printf("❌ Invalid relay index: %d\n", relayIndex);
-            sendRelayControlAck(relayIndex, state, false, "Invalid relay index");
-        }
-    } else if (strcmp(msgType, "config") == 0) {
-        applyConfiguration(doc["data"]);
+
+    LOG_I("Connecting to WiFi: %s", config.wifi_ssid);
+    LOG_I("WiFi password length: %u", (unsigned)strlen(config.wifi_password));
+    // Non-blocking: onWiFiEvent() reports the outcome and halNetworkLoop() opens the
+    // WebSocket once the station gets an IP. With the AP from the last association the
+    // driver skips the all-channel scan (~1-2 s).
+    wifiFastConnect = config.wifi_channel != 0 && !wifiCacheStale;
+    if (wifiFastConnect) {
+        WiFi.begin(config.wifi_ssid, config.wifi_password, config.wifi_channel, config.wifi_bssid);
     } else {
-        Serial.printf("Unknown message type: %s\n", msgType);
-        sendErrorReport("UNKNOWN_MESSAGE_TYPE", "Received unknown message type");
+        WiFi.begin(config.wifi_ssid, config.wifi_password);
     }
 }
 
-void sendFullState() {
-    // Send complete state of all inputs and relays
-    StaticJsonDocument<512> stateDoc;
-    stateDoc["type"] = "state";
-  stateDoc["device_id"] = config.device_id;
-    stateDoc["mac"] = WiFi.macAddress();
-    stateDoc["ip"] = WiFi.localIP().toString();
-    
-    JsonArray inputs = stateDoc.createNestedArray("inputs");
-    for (int i = 0; i < 8; i++) {
-        inputs.add(inputStates[i]);
+// WiFi up: both links dial the endpoints picked by the failover policy
+void startUpstream() {
+    if (WiFi.status() != WL_CONNECTED) {
+        LOG_I("Cannot connect WebSocket - WiFi not connected");
+        return;
     }
-    
-    JsonArray relays = stateDoc.createNestedArray("relays");
-    for (int i = 0; i < 8; i++) {
-        relays.add((relayStates >> i) & 1);
+    failover.configure(appUpstreamEndpointCount(), millis());
+    for (uint8_t slot = 0; slot < UPSTREAM_LINKS; slot++) {
+        upstreamLinks[slot].backoff.reset();
+        upstreamLinks[slot].beginPending = false;
+        if (failover.retarget(slot, millis()) && failover.endpoint(slot) >= 0) {
+            beginUpstream(slot);
+        }
     }
-    
-    String stateMessage;
-    serializeJson(stateDoc, stateMessage);
-    webSocket.sendTXT(stateMessage);
-    
-    Serial.println("Sent full state update");
 }
 
-void sendRelayControlAck(int relayIndex, bool state, bool success, const char* error) {
-    StaticJsonDocument<256> ackDoc;
-    ackDoc["type"] = "relay_control_ack";
-    ackDoc["relay"] = relayIndex;
-    ackDoc["state"] = state;
-    ackDoc["success"] = success;
-    if (error) {
-        ackDoc["error"] = error;
-    }
-    
-    String ackMessage;
-    serializeJson(ackDoc, ackMessage);
-    webSocket.sendTXT(ackMessage);
+// Standby first, so the active link's disconnect is not taken for a failover
+void stopUpstream() {
+    upstreamLinks[failover.standby()].socket.disconnect();
+    upstreamLinks[failover.active()].socket.disconnect();
 }
 
-void sendErrorReport(const char* errorType, const char* message) {
-    StaticJsonDocument<256> errorDoc;
-    errorDoc["type"] = "error_report";
-    errorDoc["error_type"] = errorType;
-    errorDoc["message"] = message;
-    
-    String errorMessage;
-    serializeJson(errorDoc, errorMessage);
-    webSocket.sendTXT(errorMessage);
+// MAC address as ID parameter, and the link's role: the backend keeps a hot standby out
+// of its live relays until the device registers it as the active link
+void upstreamUrl(uint8_t slot, char* url, size_t size) {
+    snprintf(url, size, "/elevator?id=%s&role=%s", macAddressStr, slot == failover.active() ? "active" : "standby");
 }
 
-bool verifyRelayState(int relayIndex, bool expectedState) {
-    return ((relayStates >> relayIndex) & 1) == expectedState;
+// After a switch: redials carry the new roles, and a demoted link that is still up
+// re-registers as the standby (the new active link registers through the app)
+void updateUpstreamRoles() {
+    char url[64];
+    for (uint8_t slot = 0; slot < UPSTREAM_LINKS; slot++) {
+        upstreamUrl(slot, url, sizeof(url));
+        upstreamLinks[slot].socket.setUrl(url);
+    }
+    uint8_t standby = failover.standby();
+    char frame[96];
+    if (failover.up(standby) && appStandbyRegistration(frame, sizeof(frame)) > 0) {
+        upstreamLinks[standby].socket.sendTXT(frame);
+    }
 }
 
-void reportI2CError() {
-    if (millis() - lastI2CError > I2C_ERROR_REPORT_INTERVAL) {
-        i2cError = true;
-        lastI2CError = millis();
-        sendErrorReport("I2C_ERROR", "I2C communication error");
+void beginUpstream(uint8_t slot) {
+    UpstreamLink& link = upstreamLinks[slot];
+    const char* host;
+    int port;
+    appUpstreamEndpoint((uint8_t)failover.endpoint(slot), host, port);
+    char url[64];
+    upstreamUrl(slot, url, sizeof(url));
+    // wss trusts only the pinned CA. WiFiClientSecure has no session resumption hook, so
+    // every connect is a full handshake; the hot standby keeps one ready instead.
+    const char* ca = appUpstreamCa();
+    link.tls = ca != nullptr;
+    LOG_I("Connecting %s link to %s://%s:%d%s", slot == failover.active() ? "upstream" : "standby",
+          link.tls ? "wss" : "ws", host, port, url);
+    if (link.tls) {
+        link.socket.beginSslWithCA(host, port, url, ca);
+    } else {
+        link.socket.begin(host, port, url);
     }
+    link.socket.setReconnectInterval(link.backoff.nextDelayMs(halRandom()));
+    link.connectStallUs = 0;
+    link.heapBeforeConnect = halHeapStats().freeBytes;
 }
 
-void setRelayState(byte relayIndex, bool state) {
-    if (relayIndex >= 8) {
-        Serial.printf("❌ Invalid relay index: %d (must be 0-7)\n", relayIndex);
+void onLinkUp(uint8_t slot) {
+    UpstreamLink& link = upstreamLinks[slot];
+    int64_t now = halMicros();
+    standbyDeferring = false;
+    link.backoff.reset();
+    link.heartbeat.reset(now);
+    link.connectMs = link.connectStallUs / 1000;
+    link.connectHeapBytes = (int32_t)(link.heapBeforeConnect - halHeapStats().freeBytes);
+    if (link.tls) {
+        LOG_I("TLS link up on endpoint %d: %u ms network task stall, %d bytes heap", failover.endpoint(slot),
+              link.connectMs, link.connectHeapBytes);
+    }
+    uint8_t active = failover.active();
+    if (!failover.connected(slot, millis())) {
+        LOG_I("Standby link up on endpoint %d", failover.endpoint(slot));
         return;
     }
-    
-    // Read current output register
-    Wire.beginTransmission(RELAY_I2C_ADDRESS);
-    Wire.write(0x01); // Output register
-    byte error = Wire.endTransmission();
-    
-    if (error != 0) {
-        Serial.printf("❌ Failed to read output register (error: %d)\n", error);
-        return;
+    if (failover.active() != active) {
+        updateUpstreamRoles(); // Dialed as the standby, took over from the link that is down
     }
-    
-    Wire.requestFrom(RELAY_I2C_ADDRESS, 1);
-    if (!Wire.available()) {
-        Serial.println("❌ No data received from I2C device");
-        return;
+    if (linkEverConnected) {
+        linkReconnects++;
+        linkLastOutageMs = (uint32_t)((now - linkDownSinceUs) / 1000);
+        LOG_I("Link restored after %u ms (reconnect #%u)", linkLastOutageMs, linkReconnects);
     }
-    
-    byte currentOutputs = Wire.read();
-    
-    // Set the specific bit (HIGH = relay ON, LOW = relay OFF)
-    if (state) {
-        currentOutputs |= (1 << relayIndex);  // Set bit HIGH (relay ON)
+    linkEverConnected = true;
+    appOnLinkConnected(HAL_LINK_UPSTREAM);
+}
+
+// Also called for every failed connection attempt; each one moves the backoff along
+void onLinkDown(uint8_t slot) {
+    UpstreamLink& link = upstreamLinks[slot];
+    bool wasActive = slot == failover.active() && failover.up(slot);
+    int8_t endpoint = failover.endpoint(slot);
+    standbyDeferring = false;
+    if (failover.disconnected(slot, millis())) {
+        LOG_W("Endpoint %d lost, standby on endpoint %d took over", endpoint, failover.endpoint(failover.active()));
+        updateUpstreamRoles();
+        appOnLinkConnected(HAL_LINK_UPSTREAM); // Registers and resyncs on the standby
+    } else if (wasActive) {
+        linkDownSinceUs = halMicros();
+        appOnLinkDisconnected(HAL_LINK_UPSTREAM);
+    }
+
+    link.connectStallUs = 0;
+    link.heapBeforeConnect = halHeapStats().freeBytes;
+    uint32_t delayMs = link.backoff.nextDelayMs(halRandom());
+    if (failover.retarget(slot, millis())) {
+        // Another endpoint: begin() would connect right away, so wait out the delay first
+        link.beginPending = failover.endpoint(slot) >= 0;
+        link.beginAt = millis() + delayMs;
     } else {
-        currentOutputs &= ~(1 << relayIndex); // Clear bit LOW (relay OFF)
+        link.socket.setReconnectInterval(delayMs);
     }
-    
-    // Write back to output register
-    Wire.beginTransmission(RELAY_I2C_ADDRESS);
-    Wire.write(0x01); // Output register
-    Wire.write(currentOutputs);
-    error = Wire.endTransmission();
-    
-    if (error != 0) {
-        Serial.printf("❌ Failed to set relay %d to %s (error: %d)\n", relayIndex, state ? "ON" : "OFF", error);
-        return;
+    LOG_D("WebSocket retry in %u ms (endpoint %d)", delayMs, failover.endpoint(slot));
+}
+
+void upstreamEvent(uint8_t slot, WStype_t type, uint8_t * payload, size_t length) {
+    UpstreamLink& link = upstreamLinks[slot];
+    switch (type) {
+    case WStype_DISCONNECTED:
+        onLinkDown(slot);
+        break;
+    case WStype_CONNECTED:
+        onLinkUp(slot);
+        break;
+    case WStype_TEXT:
+        if (slot == failover.active()) {
+            activeFrameAt = millis();
+            appOnLinkText(HAL_LINK_UPSTREAM, payload, length);
+        }
+        break;
+    case WStype_BIN:
+        if (slot == failover.active()) {
+            activeFrameAt = millis();
+            appOnLinkBinary(HAL_LINK_UPSTREAM, payload, length);
+        }
+        break;
+    case WStype_PONG:
+        if (link.heartbeat.pongReceived(payload, length, halMicros())) {
+            failover.measured(slot, link.heartbeat.lastRttUs());
+        }
+        break;
+    case WStype_ERROR:
+        LOG_I("WebSocket error");
+        onLinkDown(slot);
+        break;
+    default:
+        break;
     }
-    
-    Serial.printf("✅ Relay %d set to %s (EXIO%d)\n", relayIndex, state ? "ON" : "OFF", relayIndex + 1);
-} 
\ No newline at end of file
+}
+
+void lanEvent(uint8_t client, WStype_t type, uint8_t * payload, size_t length) {
+    HalLinks link = halLanLink(client);
+    switch (type) {
+    case WStype_CONNECTED:
+        appOnLinkConnected(link);
+        break;
+    case WStype_DISCONNECTED:
+        appOnLinkDisconnected(link);
+        break;
+    case WStype_TEXT:
+        appOnLinkText(link, payload, length);
+        break;
+    case WStype_BIN:
+        appOnLinkBinary(link, payload, length);
+        break;
+    default:
+        break;
+    }
+}
+
+void cacheNetworkIdentity() {
+    uint8_t mac[6];
+    WiFi.macAddress(mac);
+    snprintf(macAddressStr, sizeof(macAddressStr), "%02X:%02X:%02X:%02X:%02X:%02X",
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+
+    IPAddress ip = WiFi.localIP();
+    snprintf(ipAddressStr, sizeof(ipAddressStr), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+}
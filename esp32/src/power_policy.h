@@ -0,0 +1,83 @@
+// Low-power idle: when the board may light-sleep
+//
+// With power_save on, the board sits in HAL_POWER_IDLE (automatic light sleep, WiFi
+// modem sleep at the AP's DTIM) and switches to HAL_POWER_ACTIVE for holdMs after any
+// activity: a frame on a link, an input edge, or I/O work that needs the clock running
+// (a sequence or workflow step coming up, an input capture). Only the frame that ends
+// an idle stretch waits for the AP's next DTIM beacon; everything inside the hold - the
+// rest of a ride's commands, their acks and read-backs - runs as with power_save off.
+//
+// Pure bookkeeping: the network task feeds it and applies state() with halPowerSet().
+// Wakes are counted per source, and the time spent idle gives the share of time the
+// board could sleep (the drop in average current follows from it).
+
+#pragma once
+
+#include <stdint.h>
+#include "hal.h"
+
+enum PowerWake : uint8_t {
+    POWER_WAKE_FRAME,   // Message from the server or a LAN client
+    POWER_WAKE_INPUT,   // Input edge
+    POWER_WAKE_LOCAL,   // Timed I/O work (sequence, workflow, capture)
+    POWER_WAKE_SOURCES
+};
+
+class PowerPolicy {
+public:
+    explicit PowerPolicy(uint32_t holdMs)
+        : holdUs_((int64_t)holdMs * 1000), enabled_(false), state_(HAL_POWER_ACTIVE), activeUntilUs_(0),
+          sinceUs_(0), idleUs_(0), wakes_{0} {}
+
+    // power_save on or off; off keeps the board active. True if the state changed.
+    bool enable(bool enabled, int64_t nowUs) {
+        enabled_ = enabled;
+        activeUntilUs_ = nowUs + holdUs_;
+        return enabled ? false : enter(HAL_POWER_ACTIVE, nowUs);
+    }
+
+    // Keep the board active for the hold. True if this woke it from idle.
+    bool activity(PowerWake source, int64_t nowUs) {
+        activeUntilUs_ = nowUs + holdUs_;
+        if (state_ != HAL_POWER_IDLE) {
+            return false;
+        }
+        wakes_[source]++;
+        return enter(HAL_POWER_ACTIVE, nowUs);
+    }
+
+    // Idle once the hold ran out. True if the state changed.
+    bool update(int64_t nowUs) {
+        return enabled_ && state_ == HAL_POWER_ACTIVE && nowUs >= activeUntilUs_ && enter(HAL_POWER_IDLE, nowUs);
+    }
+
+    HalPowerState state() const { return state_; }
+    bool enabled() const { return enabled_; }
+    uint32_t wakes(PowerWake source) const { return wakes_[source]; }
+
+    // Time spent idle since boot, including the current stretch
+    uint64_t idleMs(int64_t nowUs) const {
+        return (idleUs_ + (state_ == HAL_POWER_IDLE ? nowUs - sinceUs_ : 0)) / 1000;
+    }
+
+private:
+    bool enter(HalPowerState state, int64_t nowUs) {
+        if (state == state_) {
+            return false;
+        }
+        if (state_ == HAL_POWER_IDLE) {
+            idleUs_ += nowUs - sinceUs_;
+        }
+        state_ = state;
+        sinceUs_ = nowUs;
+        return true;
+    }
+
+    int64_t holdUs_;
+    bool enabled_;
+    HalPowerState state_;
+    int64_t activeUntilUs_;
+    int64_t sinceUs_;   // Entered state_
+    int64_t idleUs_;    // Idle stretches that ended
+    uint32_t wakes_[POWER_WAKE_SOURCES];
+};
@@ -0,0 +1,3199 @@
+// Relay controller logic: command handling, relay/input I/O, sequencing, state
+// reporting and configuration. Hardware and network access goes through hal.h, so this
+// file builds unchanged for the ESP32 and for the Linux host build.
+
+#include "relay_app.h"
+#include <ArduinoJson.h>
+#include <string.h>
+#include <stddef.h>
+#include <atomic>
+#include "hal.h"
+#include "ring_buffer.h"
+#include "relay_protocol.h"
+#include "relay_sequencer.h"
+#include "relay_workflow.h"
+#include "relay_banks.h"
+#include "relay_log.h"
+#include "latency_histogram.h"
+#include "config_store.h"
+#include "command_window.h"
+#include "input_capture.h"
+#include "power_policy.h"
+#include "task_profile.h"
+#include "board_profile.h"
+
+// Configuration Storage (magic/version describe the legacy EEPROM blob, see importLegacyConfiguration)
+#define CONFIG_MAGIC 0x12345678
+#define CONFIG_VERSION 2   // v2 appends the fast-boot cache to the v1 layout
+#define CONFIG_VERSION_V1 1
+#ifndef RELAY_CONFIG_WINDOW_MS
+#define RELAY_CONFIG_WINDOW_MS 10000 // Serial programming window, when requested at boot
+#endif
+const unsigned long CONFIG_WINDOW_MS = RELAY_CONFIG_WINDOW_MS;
+const size_t CONFIG_LINE_MAX = HAL_CONSOLE_LINE_MAX; // Longest serial configuration line
+
+// Error tracking
+bool i2cError = false;
+unsigned long lastI2CError = 0;
+const unsigned long I2C_ERROR_REPORT_INTERVAL = 30000; // Report I2C errors every 30 seconds
+
+// Relay expanders, one bank each (shadow output registers, retries, 400 -> 100 kHz
+// fallback). Bank 0 is the board's own TCA9554PWR; larger boards add TCA9554/TCA9555
+// expanders on the same bus, discovered at boot or listed with "relay_banks".
+RelayBanks relayBanks(halRelayBus());
+const bool I2C_VERIFY_READBACK = true; // Deferred read-back of the output register after writes
+const uint8_t EXPANDER_BASE_ADDRESS = 0x20;     // TCA9554 / TCA9555: 0x20-0x27
+const uint8_t EXPANDER_ALT_BASE_ADDRESS = 0x38; // TCA9554A: 0x38-0x3F
+const uint8_t EXPANDER_ADDRESS_COUNT = 8;
+
+// Default Configuration (will be overwritten by programming)
+DeviceConfig config = {
+    CONFIG_MAGIC,
+    CONFIG_VERSION,
+    "unconfigured",
+    "Unconfigured Relay",
+    "",
+    "",
+    "skytechautomated.com",
+    40000,
+    false,
+    0,
+    0,
+    {0},
+    {0},
+    0,
+    "",
+    {"", ""},
+    {0, 0},
+    false,
+    {""},
+    false
+};
+
+// Bounded copy into a fixed-size configuration string; false (field untouched) if the
+// value is missing or does not fit
+template <size_t N>
+static bool setConfigString(char (&field)[N], const char* value) {
+    if (value == nullptr) {
+        return false;
+    }
+    size_t length = strnlen(value, N);
+    if (length >= N) {
+        return false;
+    }
+    memcpy(field, value, length + 1);
+    return true;
+}
+
+// Journaled configuration store: one record per field, keys never reused
+const ConfigField CONFIG_FIELDS[] = {
+    {1, offsetof(DeviceConfig, device_id), sizeof(DeviceConfig::device_id), true},
+    {2, offsetof(DeviceConfig, device_name), sizeof(DeviceConfig::device_name), true},
+    {3, offsetof(DeviceConfig, wifi_ssid), sizeof(DeviceConfig::wifi_ssid), true},
+    {4, offsetof(DeviceConfig, wifi_password), sizeof(DeviceConfig::wifi_password), true},
+    {5, offsetof(DeviceConfig, server_host), sizeof(DeviceConfig::server_host), true},
+    {6, offsetof(DeviceConfig, server_port), sizeof(DeviceConfig::server_port), false},
+    {7, offsetof(DeviceConfig, configured), sizeof(DeviceConfig::configured), false},
+    {8, offsetof(DeviceConfig, expander_address), sizeof(DeviceConfig::expander_address), false},
+    {9, offsetof(DeviceConfig, wifi_channel), sizeof(DeviceConfig::wifi_channel), false},
+    {10, offsetof(DeviceConfig, wifi_bssid), sizeof(DeviceConfig::wifi_bssid), false},
+    {11, offsetof(DeviceConfig, bank_addresses), sizeof(DeviceConfig::bank_addresses), false},
+    {12, offsetof(DeviceConfig, expander_wide), sizeof(DeviceConfig::expander_wide), false},
+    {13, offsetof(DeviceConfig, lan_token), sizeof(DeviceConfig::lan_token), true},
+    {14, offsetof(DeviceConfig, backup_hosts[0]), sizeof(DeviceConfig::backup_hosts[0]), true},
+    {15, offsetof(DeviceConfig, backup_hosts[1]), sizeof(DeviceConfig::backup_hosts[1]), true},
+    {16, offsetof(DeviceConfig, backup_ports), sizeof(DeviceConfig::backup_ports), false},
+    {17, offsetof(DeviceConfig, server_tls), sizeof(DeviceConfig::server_tls), false},
+    {18, offsetof(DeviceConfig, server_ca[0]), SERVER_CA_CHUNK, true},
+    {19, offsetof(DeviceConfig, server_ca[1]), SERVER_CA_CHUNK, true},
+    {20, offsetof(DeviceConfig, server_ca[2]), SERVER_CA_CHUNK, true},
+    {21, offsetof(DeviceConfig, server_ca[3]), SERVER_CA_CHUNK, true},
+    {22, offsetof(DeviceConfig, server_ca[4]), SERVER_CA_CHUNK, true},
+    {23, offsetof(DeviceConfig, server_ca[5]), SERVER_CA_CHUNK, true},
+    {24, offsetof(DeviceConfig, server_ca[6]), SERVER_CA_CHUNK, true},
+    {25, offsetof(DeviceConfig, server_ca[7]), SERVER_CA_CHUNK, true},
+    {26, offsetof(DeviceConfig, power_save), sizeof(DeviceConfig::power_save), false},
+    {27, offsetof(DeviceConfig, stats_interval), sizeof(DeviceConfig::stats_interval), false},
+};
+static_assert(SERVER_CA_CHUNKS == 8, "one config key per server_ca chunk");
+ConfigStore configStore(halConfigFlash(), CONFIG_FIELDS, sizeof(CONFIG_FIELDS) / sizeof(CONFIG_FIELDS[0]));
+static_assert(sizeof(DeviceConfig) <= CONFIG_STORE_IMAGE_MAX, "DeviceConfig must fit the config store image");
+
+// Commits run on their own low-priority task: saveConfiguration() only snapshots the
+// config. Flash writes stall code running from flash on both cores, so a commit also
+// waits for CONFIG_COMMIT_QUIET_MS without relay activity (at most CONFIG_COMMIT_MAX_DEFER_MS).
+const uint8_t CONFIG_TASK_PRIORITY = 1;
+const int CONFIG_TASK_CORE = 0;
+const uint32_t CONFIG_TASK_STACK_SIZE = 4096;
+const unsigned long CONFIG_COMMIT_QUIET_MS = 100;
+const unsigned long CONFIG_COMMIT_MAX_DEFER_MS = 2000;
+const unsigned long CONFIG_RETRY_MS = 5000;   // After a failed commit
+// Snapshots are double-buffered: saveConfiguration() (network task) copies the config
+// into the image the config task is not committing from, outside configLock - a
+// critical section on the ESP32, far too long for a 2 KB copy with the input and
+// capture interrupts waiting. Only the image indices change under the lock.
+HalLock configLock;
+DeviceConfig configImages[2];
+uint8_t configPendingImage = 0;                // Newest snapshot, if configCommitPending (configLock)
+int8_t configCommitImage = -1;                 // Being committed, -1 if none (configLock)
+bool configCommitPending = false;              // (configLock)
+bool configImageWriting = false;               // saveConfiguration() is filling an image (configLock)
+std::atomic<uint32_t> lastActuationMs(0);      // halMillis() of the last relay write (I/O task)
+
+// Fast boot: a configured board with known expanders (from its board profile, or cached)
+// and a cached AP goes online without the I2C scan, the WiFi channel scan or the
+// provisioning window
+bool fastBoot = false;           // Expanders and AP were known at this boot
+uint32_t bootRegisteredMs = 0;   // halMillis() at the first register after boot
+
+// State tracking (owned by the I/O task; the network task reads the published snapshots)
+bool inputStates[8] = {false};
+RelayMask relayStates = 0;         // All relays OFF initially; bit i = channel i across all banks
+RelayMask expectedRelayStates = 0; // Track expected vs actual states
+std::atomic<RelayMask> publishedRelayStates(0);
+std::atomic<uint8_t> publishedInputStates(0);
+// Change-driven state reporting: a compact state_delta (bitmasks + sequence number) is
+// sent whenever relays or inputs change, and a full state keyframe only every
+// STATE_KEYFRAME_INTERVAL so the backend can detect gaps and resync.
+unsigned long lastStateReport = 0;
+const unsigned long STATE_KEYFRAME_INTERVAL = 30000; // Full state keyframe / heartbeat every 30s
+uint32_t stateSeq = 0;           // Incremented for every state_delta
+RelayMask reportedRelayStates = 0; // Last relay mask sent to the links
+uint8_t reportedInputStates = 0; // Last input mask sent to the links
+
+// Low-power idle (power_save, see power_policy.h), network task. The hold covers the rest
+// of a ride: commands a few seconds apart, their acks and the read-backs.
+const uint32_t POWER_ACTIVE_HOLD_MS = 15000;
+PowerPolicy powerPolicy(POWER_ACTIVE_HOLD_MS);
+bool powerLightSleep = false;             // The last halPowerSet() could enable light sleep
+std::atomic<bool> ioTimersPending(false); // I/O task: a sequence or workflow deadline is armed
+
+// Runtime profile (stats, see task_profile.h): loop timing of the I/O and network tasks
+// and the deepest each queue got, as its consumer saw it. The CPU share covers the time
+// since the previous stats message. Pushed upstream every stats_interval seconds if set.
+const uint16_t STATS_INTERVAL_MIN_S = 10;
+const uint16_t STATS_INTERVAL_MAX_S = 3600;
+TaskProfile ioProfile;
+TaskProfile netProfile;
+std::atomic<uint8_t> commandQueuePeak(0); // I/O task
+std::atomic<uint8_t> edgeQueuePeak(0);    // I/O task
+uint8_t eventQueuePeak = 0;               // Network task
+uint32_t lastStatsPushMs = 0;
+int64_t statsSinceUs = 0;
+uint64_t statsSinceBusyUs[2] = {0, 0};    // I/O, network
+
+// Connection state tracking
+bool wsConnected = false;
+bool binaryProtocol = false; // Set once the backend accepts the binary protocol in register_ack
+
+// LAN server clients (network task). A client has LAN_AUTH_TIMEOUT_MS to send
+// {"type": "auth", "token": <lan_token>}; until then it gets nothing but the answer.
+// Authenticated clients speak the same JSON protocol as the upstream link and share one
+// relay state with it: state changes, input edges and sequence/workflow progress go to
+// every link, answers only to the link that asked.
+const uint32_t LAN_AUTH_TIMEOUT_MS = 2000;
+HalLinks lanConnected = 0;
+HalLinks lanAuthenticated = 0;
+uint32_t lanConnectedMs[HAL_LAN_CLIENTS];
+
+// Where sendJson()/sendBinaryFrame() go: LINKS_BROADCAST, or the sender of the message
+// being answered (set with LinkTarget)
+const HalLinks LINKS_BROADCAST = 0;
+HalLinks linkTarget = LINKS_BROADCAST;
+
+class LinkTarget {
+public:
+    explicit LinkTarget(HalLinks links) : saved_(linkTarget) { linkTarget = links; }
+    ~LinkTarget() { linkTarget = saved_; }
+
+private:
+    HalLinks saved_;
+};
+
+
+// Input edge capture: GPIO interrupts -> debounce -> lock-free ring -> I/O task
+const int64_t INPUT_DEBOUNCE_US = 5000; // Ignore contact bounce for 5ms after an accepted edge
+
+struct InputEdge {
+    uint8_t index;
+    bool state;
+    int64_t timestamp_us; // halMicros() time of the accepted edge
+};
+
+SpscRing<InputEdge, 64> inputEdgeQueue;
+HAL_DRAM_ATTR HalLock inputLock;
+HAL_DRAM_ATTR bool edgeLevels[8] = {false};     // Last accepted (debounced) level per input
+HAL_DRAM_ATTR int64_t edgeTimes[8] = {0};       // Time of last accepted edge per input
+HAL_DRAM_ATTR volatile uint8_t settlePendingMask = 0; // Inputs that bounced inside the debounce window
+
+// Task layout: the I/O task owns the TCA9554 and the inputs on the APP core, the network
+// task owns WiFi and the WebSocket on the PRO core (next to the WiFi stack). They only
+// talk through the bounded lock-free queues below, so a stalled socket or a WiFi
+// reconnect can never delay relay actuation.
+const int IO_TASK_CORE = 1;
+const int NET_TASK_CORE = 0;
+const uint8_t IO_TASK_PRIORITY = 10;
+const uint8_t NET_TASK_PRIORITY = 3;
+const uint32_t IO_TASK_STACK_SIZE = 4096;
+const uint32_t NET_TASK_STACK_SIZE = 8192;
+const uint8_t LOG_TASK_PRIORITY = 1;     // Below everything that does real work
+const int LOG_TASK_CORE = 0;
+const uint8_t LOG_STREAM_BATCH = 8;      // Records per upstream "log" message
+const unsigned long IO_IDLE_MS = 100;     // Max I/O task sleep when nothing wakes it
+const unsigned long NET_POLL_MS = 5;      // halNetworkLoop() cadence when idle
+const unsigned long NET_IDLE_POLL_MS = 100; // ... in HAL_POWER_IDLE (frames and I/O events wake it at once)
+
+// Network task -> I/O task. Every command is applied as a set/clear mask pair; the I/O
+// task merges all commands waiting in the queue into one write per expander, and
+// relay_control simply carries one bit.
+enum RelayCommandType : uint8_t {
+    RELAY_CMD_SINGLE,          // relay_control: one channel, acked per relay
+    RELAY_CMD_MASK,            // relay_mask: several channels switched together, one ack
+    RELAY_CMD_SEQUENCE_CANCEL, // Stop sequence sequenceId and release its relays
+    RELAY_CMD_WORKFLOW_CANCEL, // Stop workflow sequenceId and release its relays
+    RELAY_CMD_LINK_DOWN        // Upstream socket dropped
+};
+
+struct RelayCommand {
+    RelayCommandType type;
+    uint8_t relay;       // RELAY_CMD_SINGLE only
+    bool state;          // RELAY_CMD_SINGLE only
+    RelayMask setMask;
+    RelayMask clearMask;
+    int64_t enqueued_us;
+    uint16_t sequenceId;  // RELAY_CMD_SEQUENCE_CANCEL/RELAY_CMD_WORKFLOW_CANCEL only
+    bool traced;          // RELAY_CMD_SINGLE: answer with the stage timestamps
+    RelayTrace trace;     // RELAY_CMD_SINGLE: stamped for every command (latency_stats)
+    uint32_t commandId;   // Set when it came as a "command": answered with command_response
+    HalLinks link;        // Sender, for the ack
+};
+
+// I/O task -> network task
+enum IoEventType : uint8_t {
+    IO_EVENT_INPUT_EDGE,
+    IO_EVENT_RELAY_ACK,
+    IO_EVENT_MASK_ACK,
+    IO_EVENT_SEQUENCE_STATUS,
+    IO_EVENT_WORKFLOW_STATUS,
+    IO_EVENT_I2C_ERROR,
+    IO_EVENT_CAPTURE_DONE    // Input capture stopped; success false if the sampler did not start
+};
+
+struct IoEvent {
+    IoEventType type;
+    uint8_t index;        // Input or relay index, or steps run for sequence status
+    bool state;
+    bool success;
+    bool verified;
+    RelayMask setMask;    // Mask acks only
+    RelayMask clearMask;
+    RelayMask relays;     // Relay outputs after the command
+    uint16_t sequenceId;  // Sequence status only
+    RelaySequenceStatus sequenceStatus;
+    RelayError error;
+    int64_t timestamp_us; // Edge time, or I2C write completion time for acks
+    uint32_t latency_us;  // Command enqueue -> I2C write done (acks), sequence run time (status)
+    bool traced;          // Relay acks only
+    RelayTrace trace;
+    uint32_t commandId;   // Relay and mask acks: answer with command_response if set
+    HalLinks link;        // Relay and mask acks: sender of the command
+    WorkflowReport workflow; // Workflow status only
+};
+
+// High-rate input capture (input_capture.h). The network task configures it and
+// uploads the runs; the I/O task runs the sampler, so its interrupt lands on the APP
+// core, away from WiFi. The run buffer is allocated on the first capture and kept.
+const uint32_t CAPTURE_EXTERNAL_RUNS = 65536; // 256 KB of PSRAM
+const uint32_t CAPTURE_INTERNAL_RUNS = 4096;  // 16 KB of SRAM on boards without PSRAM
+const uint32_t CAPTURE_DEFAULT_HZ = 5000;
+const uint16_t CAPTURE_CHUNK_RUNS = 128;      // Runs per input_capture_chunk
+
+enum CaptureAction : uint8_t {
+    CAPTURE_ACTION_START,
+    CAPTURE_ACTION_STOP
+};
+
+struct CaptureRequest {
+    CaptureAction action;
+    uint32_t periodUs;
+    uint32_t sampleLimit;  // 0 = until stopped (or full in fill mode)
+    bool stopWhenFull;
+};
+
+InputCapture inputCapture;
+SpscRing<CaptureRequest, 4> captureRequestQueue; // Network task -> I/O task
+bool samplerRunning = false;        // I/O task
+bool captureExternal = false;       // Run buffer in PSRAM
+uint32_t captureId = 0;             // Numbers the captures since boot (network task)
+bool captureActive = false;         // Started and not reported stopped yet (network task)
+bool captureUploadPending = false;  // Upload as soon as the capture stops
+bool captureUploading = false;
+uint32_t captureUploadNext = 0;     // Next run to send
+
+SpscRing<RelayCommand, 16> relayCommandQueue;
+const uint8_t RELAY_COMMAND_BATCH = 16;  // Commands merged into one write (the whole queue)
+SpscRing<RelaySequenceSpec, 4> relaySequenceQueue;
+SpscRing<WorkflowSpec, 2> workflowQueue;
+SpscRing<IoEvent, 64> ioEventQueue;
+
+// relay_control latency per stage (network task). Every command is timed, traced or
+// not; latency_stats returns the percentiles.
+enum LatencyStage : uint8_t {
+    STAGE_PARSE,  // Frame receipt -> parsed and queued
+    STAGE_QUEUE,  // Queued -> picked up by the I/O task
+    STAGE_I2C,    // I2C write
+    STAGE_ACK,    // I2C done -> ack handed to the socket
+    STAGE_TOTAL,  // Frame receipt -> ack
+    STAGE_COUNT
+};
+const char* const LATENCY_STAGE_NAMES[STAGE_COUNT] = {"parse", "queue", "i2c", "ack", "total"};
+LatencyHistogram stageLatency[STAGE_COUNT];
+int64_t linkFrameRxUs = 0; // halMicros() when the frame being handled arrived (network task)
+
+// Outbound messages: every message type is serialized into its own fixed buffer, with
+// headroom for the WebSocket header (hal.h), so nothing on the message path allocates.
+// All sends happen on the network task. Sized for the largest message of each type.
+LinkTxBuffer<RELAY_PROTO_MAX_FRAME> binaryTx; // Every binary frame
+LinkTxBuffer<512> registerTx;
+LinkTxBuffer<1024> stateTx;     // Keyframes
+LinkTxBuffer<192> deltaTx;
+LinkTxBuffer<160> inputTx;
+LinkTxBuffer<320> relayAckTx;
+LinkTxBuffer<320> maskAckTx;
+LinkTxBuffer<160> sequenceTx;
+LinkTxBuffer<224> workflowTx;
+LinkTxBuffer<160> errorTx;      // error_report, relay_verification_failed
+LinkTxBuffer<640> statsTx;      // i2c_stats, latency_stats, heap_stats
+LinkTxBuffer<1280> profileTx;   // stats
+LinkTxBuffer<1536> logTx;
+LinkTxBuffer<320> commandTx;    // command_response
+LinkTxBuffer<384> captureStatusTx;
+LinkTxBuffer<896> captureTx;    // input_capture_chunk: CAPTURE_CHUNK_RUNS runs in base64
+uint32_t txOverflows = 0;       // Messages dropped because they did not fit their buffer
+
+// Open links linkTarget resolves to: a broadcast reaches the upstream link and the
+// authenticated LAN clients
+HalLinks targetLinks() {
+    HalLinks open = (wsConnected ? HAL_LINK_UPSTREAM : 0) | lanConnected;
+    if (linkTarget == LINKS_BROADCAST) {
+        return open & ~(lanConnected & ~lanAuthenticated);
+    }
+    return linkTarget & open;
+}
+
+// bin1 is negotiated on the upstream link only. True if links includes it with bin1;
+// it is then taken out of links, which keeps the links that need the JSON form.
+bool takeBinaryUpstream(HalLinks& links) {
+    if (!binaryProtocol || !(links & HAL_LINK_UPSTREAM)) {
+        return false;
+    }
+    links &= ~HAL_LINK_UPSTREAM;
+    return true;
+}
+
+// An oversized message is dropped and counted rather than sent truncated. Does not log:
+// streamLogs() sends through here.
+template <typename TDocument, size_t N>
+bool sendJson(const TDocument& doc, LinkTxBuffer<N>& tx) {
+    HalLinks links = targetLinks();
+    if (!links) {
+        return false;
+    }
+    size_t length = serializeJson(doc, tx.text(), N);
+    if (length >= N) {
+        txOverflows++;
+        return false;
+    }
+    return halLinkSendFrame(tx.frame, length, false, links);
+}
+
+// Binary frames only go to the upstream link
+template <size_t N>
+bool sendBinaryFrame(LinkTxBuffer<N>& tx, size_t length) {
+    return length > 0 && halLinkSendFrame(tx.frame, length, true, HAL_LINK_UPSTREAM);
+}
+
+// "command" messages (network task): retransmits are answered from here, stale ids
+// rejected. Every link numbers its commands on its own.
+CommandWindow commandWindows[1 + HAL_LAN_CLIENTS];
+
+// Window of the link being answered (the upstream link's for broadcasts)
+CommandWindow& senderWindow() {
+    for (uint8_t i = 0; i < HAL_LAN_CLIENTS; i++) {
+        if (linkTarget == halLanLink(i)) {
+            return commandWindows[1 + i];
+        }
+    }
+    return commandWindows[0];
+}
+
+// Pulses and sequences run on the I/O task; a one-shot wake-up (halWakeAt) armed for the
+// next step deadline wakes it, so pulse widths do not depend on the network round trip
+RelaySequencer relaySequencer;
+
+// Elevator workflows (relay_workflow.h) run on the I/O task as well, from the debounced
+// inputs. The network task keeps the latest status of the last few, and repeats it after
+// a reconnect so the backend learns how a ride went on while the link was down.
+RelayWorkflows relayWorkflows;
+const uint8_t WORKFLOW_RECENT = 4;
+WorkflowReport recentWorkflows[WORKFLOW_RECENT];
+uint8_t recentWorkflowCount = 0;
+uint8_t recentWorkflowNext = 0;   // Slot to reuse for a new id
+
+// Function declarations
+void handleWebSocketMessage(const uint8_t * payload, size_t length);
+void handleBinaryMessage(const uint8_t * payload, size_t length);
+void queueRelayCommand(int relayIndex, bool state, bool traced = false, uint32_t traceId = 0, uint32_t commandId = 0);
+void queueRelayMask(RelayMask setMask, RelayMask clearMask, uint32_t commandId = 0);
+int parseChannel(JsonObjectConst message);
+bool parseRelayMasks(JsonObjectConst message, RelayMask& setMask, RelayMask& clearMask);
+template <typename TTarget>
+void putRelayMask(TTarget& target, const char* field, const char* banksField, RelayMask mask);
+void handleCommand(JsonObject message);
+void finishCommand(uint32_t commandId, RelayError error, RelayMask relays, uint32_t latencyUs);
+void sendCommandResponse(uint32_t commandId, RelayError error, RelayMask relays, uint32_t latencyUs, bool duplicate);
+void queueRelayPulse(int relayIndex, uint32_t durationMs, uint16_t id, bool abortOnDisconnect);
+void queueRelaySequence(RelaySequenceSpec& spec);
+void queueSequenceCancel(uint16_t id);
+bool parseRelaySequence(JsonObject message, RelaySequenceSpec& spec);
+bool parseWorkflow(JsonObjectConst message, WorkflowSpec& spec);
+void queueWorkflow(const WorkflowSpec& spec);
+void queueWorkflowCancel(uint16_t id);
+void rejectWorkflow(uint16_t id, RelayError error);
+void rememberWorkflowStatus(const WorkflowReport& report);
+void sendWorkflowStatus(const WorkflowReport& report, bool replay);
+void sendRegistration();
+void sendFullState();
+void sendStateJson(RelayMask relayMask, uint8_t inputMask);
+void sendStateDelta();
+void reportStateChanges();
+void initInputs();
+void settleInputs();
+void drainInputEdges();
+void sendInputChanged(const IoEvent& event);
+void ioTask();
+void netTask();
+void processRelayCommands();
+bool applyRelayMasks(RelayMask setMask, RelayMask clearMask);
+void serviceSequences();
+void forwardSequenceResults();
+void serviceWorkflows();
+bool postIoEvent(const IoEvent& event);
+void drainIoEvents();
+void servicePower();
+void notePowerActivity(PowerWake source);
+void applyPowerState();
+bool updateRelays();
+void loadConfiguration();
+void importLegacyConfiguration();
+void loadFastBootCache();
+void saveConfiguration();
+void configTask();
+void handleSerialConfiguration();
+void applyConfiguration(JsonObjectConst configData);
+void sendConfigResponse(bool success, const char* message);
+bool parseRelayBankConfig(JsonArrayConst banks, DeviceConfig& updated);
+bool parseBackupServers(JsonArrayConst servers, DeviceConfig& updated);
+void resetToDefaults();
+bool initI2CRelays();
+uint8_t discoverExpanders(uint8_t* addresses);
+void sendRelayControlAck(int relayIndex, bool state, RelayError error, bool verified, uint32_t latencyUs,
+                         RelayTrace* trace = nullptr);
+void recordCommandLatency(const RelayTrace& trace);
+void sendLatencyStats(bool reset);
+void sendHeapStats();
+void sendStats(bool reset);
+void notePeak(std::atomic<uint8_t>& peak, size_t depth);
+void sendRelayMaskAck(RelayMask setMask, RelayMask clearMask, RelayMask relays, RelayError error, uint32_t latencyUs);
+void rejectRelayMask(RelayMask setMask, RelayMask clearMask, RelayError error, uint32_t commandId);
+void sendSequenceStatus(uint16_t id, RelaySequenceStatus status, RelayError error, uint8_t steps, uint32_t elapsedUs);
+void sendErrorReport(RelayError error);
+bool verifyRelayState(int relayIndex, bool expectedState);
+void reportI2CError(RelayError error = RELAY_ERR_I2C);
+void sendI2CStats();
+void streamLogs();
+void publishStates();
+void onCaptureSample();
+void serviceInputCapture();
+void handleInputCapture(JsonObjectConst message);
+void sendCaptureStatus(const char* state, const char* error = nullptr);
+void serviceCaptureUpload();
+bool authenticateLanClient(HalLinks link, const char* msgType, const char* token);
+void serviceLanClients();
+
+void appSetup() {
+    logBegin(LOG_TASK_PRIORITY, LOG_TASK_CORE);
+    
+    LOG_I("=== ESP32 Relay Controller ===");
+    LOG_I("VERSION: 2024-12-19-CLEAN");
+    LOG_I("Connecting to skytechautomated.com:40000");
+    
+    // Check if we have embedded WiFi credentials first (before loading the stored config)
+    LOG_I("Checking for embedded configuration...");
+    LOG_I("Embedded SSID: '%s'", config.wifi_ssid);
+    LOG_I("Embedded password length: %u", (unsigned)strlen(config.wifi_password));
+    
+    if (strlen(config.wifi_ssid) > 0) {
+        LOG_I("✅ Found embedded WiFi configuration!");
+        LOG_I("WiFi SSID: %s", config.wifi_ssid);
+        LOG_I("Device ID: %s", config.device_id);
+        LOG_I("Device Name: %s", config.device_name);
+        config.configured = true;
+        // Don't load the stored config - use embedded config, but keep what the last boot learned
+        loadFastBootCache();
+    } else {
+        LOG_W("⚠️  No embedded WiFi configuration found, loading from flash...");
+        // Load the stored configuration only if no embedded config
+        loadConfiguration();
+        
+        // Only use MAC address as device ID if no embedded config
+        if (!config.configured || strcmp(config.device_id, "unconfigured") == 0) {
+            setConfigString(config.device_id, halMacAddress());
+            setConfigString(config.device_name, "ESP32 Relay Controller");
+            config.configured = true;
+            saveConfiguration();
+            LOG_I("Using MAC address as device ID: %s", config.device_id);
+        }
+    }
+    
+    // Flash commits from here on happen in the background
+    halStartTask(HAL_TASK_CONFIG, "config", configTask, CONFIG_TASK_STACK_SIZE, CONFIG_TASK_PRIORITY, CONFIG_TASK_CORE);
+    
+    // Initialize I2C with specific pins (400kHz, the driver falls back to 100kHz on a marginal bus)
+    relayBanks.beginBus();
+    relayBanks.setVerify(I2C_VERIFY_READBACK);
+    
+    // Initialize I2C relays (profile or cached banks first; the bus is only scanned if that fails)
+    bool expanderCached = BOARD.expanderCount > 0 || config.expander_address != 0;
+    bool banksFromCache = initI2CRelays();
+    fastBoot = expanderCached && banksFromCache && config.wifi_channel != 0;
+    
+    // Initialize input pins and edge interrupts
+    initInputs();
+    
+    // Relays and inputs go live before the configuration window so a board that is
+    // waiting for programming still actuates commands as soon as it is online
+    halStartTask(HAL_TASK_IO, "relay_io", ioTask, IO_TASK_STACK_SIZE, IO_TASK_PRIORITY, IO_TASK_CORE);
+    
+    // Wait for configuration only when asked to; the network task accepts serial
+    // configuration at any time anyway
+    if (halProvisioningRequested() && CONFIG_WINDOW_MS > 0) {
+        LOG_I("Provisioning requested, waiting for configuration...");
+        LOG_I("Send configuration via serial or wait %lu seconds to continue...", CONFIG_WINDOW_MS / 1000);
+        
+        uint32_t startTime = halMillis();
+        while (halMillis() - startTime < CONFIG_WINDOW_MS) {
+            handleSerialConfiguration();
+            halDelayMs(100);
+        }
+    }
+    
+    // Connect to WiFi and server if configured
+    if (config.configured && strlen(config.wifi_ssid) > 0) {
+        LOG_I("Configuration found, connecting to WiFi...");
+        LOG_I("WiFi SSID: %s", config.wifi_ssid);
+        LOG_I("Server: %s:%d", config.server_host, config.server_port);
+        halLanServe(config.lan_token[0] != '\0'); // LAN server only with a client token
+        halNetworkBegin(); // Non-blocking; the network task opens the WebSocket once WiFi is up
+    } else {
+        LOG_I("Device not configured with WiFi credentials. Cannot connect.");
+        LOG_I("Current device_id: %s", config.device_id);
+        LOG_I("Current device_name: %s", config.device_name);
+        LOG_I("Note: Device needs WiFi credentials to connect to server.");
+    }
+    
+    halStartTask(HAL_TASK_NET, "network", netTask, NET_TASK_STACK_SIZE, NET_TASK_PRIORITY, NET_TASK_CORE);
+}
+
+// Real-time I/O task: the only code that touches the TCA9554 and the input state
+void ioTask() {
+    LOG_I("✅ I/O task running on core %d", halCoreId());
+    publishStates();
+    int64_t deadline = HAL_NEVER;
+    ioProfile.begin();
+    
+    for (;;) {
+        // Sleep until an input edge, a relay command or a sequence/workflow deadline wakes us.
+        // While an input is settling or a read-back is pending, only wait that long.
+        uint32_t waitMs = IO_IDLE_MS;
+        if (settlePendingMask) {
+            waitMs = INPUT_DEBOUNCE_US / 1000 + 1;
+        } else if (relayBanks.verifyPending()) {
+            waitMs = TCA9554_VERIFY_DELAY_US / 1000 + 1;
+        }
+        ioProfile.end();
+        halWait(HAL_TASK_IO, waitMs);
+        int64_t wokeUs = ioProfile.begin();
+        if (deadline != HAL_NEVER && wokeUs >= deadline) {
+            ioProfile.late(deadline, wokeUs);
+        }
+        
+        processRelayCommands();
+        serviceSequences();
+        settleInputs();
+        drainInputEdges();
+        serviceWorkflows(); // After the edges, so transitions see this pass's inputs
+        serviceInputCapture();
+        
+        deadline = relaySequencer.nextDeadline();
+        if (relayWorkflows.nextDeadline() < deadline) {
+            deadline = relayWorkflows.nextDeadline();
+        }
+        halWakeAt(HAL_TASK_IO, deadline);
+        ioTimersPending.store(deadline != HAL_NEVER); // Light sleep would delay the step by its wake-up
+        
+        // Deferred read-back, after the latency-critical work
+        if (!relayBanks.service(halMicros())) {
+            LOG_W("⚠️  Relay output read-back mismatch or failed, output register restored");
+            reportI2CError(RELAY_ERR_VERIFY_MISMATCH);
+        }
+    }
+}
+
+// Network task: WiFi, WebSocket, serial configuration and state reporting
+void netTask() {
+    LOG_I("✅ Network task running on core %d", halCoreId());
+    applyPowerState();
+    netProfile.begin();
+    
+    for (;;) {
+        // Service the link, track WiFi transitions and reconnect if needed. Only a dial
+        // blocks, and the hot standby's waits for a quiet active link (main.cpp).
+        halNetworkLoop();
+        
+        // Handle serial configuration
+        handleSerialConfiguration();
+        
+        // Forward input edges and relay acks posted by the I/O task
+        drainIoEvents();
+        
+        // Report relay/input changes as deltas, with a slow full-state keyframe
+        if (wsConnected || lanAuthenticated) {
+            reportStateChanges();
+            if (halMillis() - lastStateReport > STATE_KEYFRAME_INTERVAL) {
+                sendFullState();
+            }
+        }
+        if (wsConnected) {
+            LinkTarget upstream(HAL_LINK_UPSTREAM);
+            streamLogs();
+            serviceCaptureUpload();
+            if (config.stats_interval > 0 && halMillis() - lastStatsPushMs >= config.stats_interval * 1000UL) {
+                lastStatsPushMs = halMillis();
+                sendStats(false);
+            }
+        }
+        serviceLanClients();
+        servicePower();
+        
+        // Woken early when a frame arrives or the I/O task posts an event
+        netProfile.end();
+        halNetworkWait(powerPolicy.state() == HAL_POWER_IDLE ? NET_IDLE_POLL_MS : NET_POLL_MS);
+        netProfile.begin();
+    }
+}
+
+// Follow power_save and go idle once the activity hold runs out. Timed I/O work and an
+// input capture (the sampler timer stops in light sleep) keep the board active.
+void servicePower() {
+    int64_t now = halMicros();
+    bool changed = false;
+    if (powerPolicy.enabled() != config.power_save) {
+        LOG_I("Power save %s", config.power_save ? "on" : "off");
+        changed |= powerPolicy.enable(config.power_save, now);
+    }
+    if (ioTimersPending.load() || captureActive) {
+        changed |= powerPolicy.activity(POWER_WAKE_LOCAL, now);
+    }
+    changed |= powerPolicy.update(now);
+    if (changed) {
+        applyPowerState();
+    }
+}
+
+// A frame or an input edge: back to full speed right away if idle
+void notePowerActivity(PowerWake source) {
+    if (powerPolicy.activity(source, halMicros())) {
+        applyPowerState();
+    }
+}
+
+void applyPowerState() {
+    powerLightSleep = halPowerSet(powerPolicy.state());
+    LOG_D("Power %s", powerPolicy.state() == HAL_POWER_IDLE ? "idle" : "active");
+}
+
+// Apply queued relay commands (I/O task). Everything waiting in the queue is merged in
+// queue order - a later command wins on the channels both touch - and written at once,
+// so a burst costs one I2C write per expander instead of one per command.
+void processRelayCommands() {
+    RelayCommand batch[RELAY_COMMAND_BATCH];
+    uint8_t count = 0;
+    RelayMask setMask = 0;
+    RelayMask clearMask = 0;
+    int64_t startUs = halMicros();
+    
+    RelayCommand command;
+    notePeak(commandQueuePeak, relayCommandQueue.size());
+    while (count < RELAY_COMMAND_BATCH && relayCommandQueue.pop(command)) {
+        RelayMask commandSet = command.setMask;
+        RelayMask commandClear = command.clearMask;
+        if (command.type == RELAY_CMD_SEQUENCE_CANCEL || command.type == RELAY_CMD_WORKFLOW_CANCEL ||
+            command.type == RELAY_CMD_LINK_DOWN) {
+            // Release whatever the stopped sequences and workflows still hold; their
+            // status is reported by serviceSequences() and serviceWorkflows()
+            RelayActuation release;
+            if (command.type == RELAY_CMD_SEQUENCE_CANCEL) {
+                release = relaySequencer.cancel(command.sequenceId, startUs);
+            } else if (command.type == RELAY_CMD_WORKFLOW_CANCEL) {
+                release = relayWorkflows.cancel(command.sequenceId, startUs);
+            } else {
+                release = relaySequencer.linkDown(startUs);
+                // Workflows take their link_down transitions in serviceWorkflows()
+                relayWorkflows.linkDown(publishedInputStates.load(), startUs);
+            }
+            commandSet = 0;
+            commandClear = release.clearMask;
+        } else {
+            batch[count++] = command;
+        }
+        setMask = (setMask & ~commandClear) | commandSet;
+        clearMask = (clearMask & ~commandSet) | commandClear;
+    }
+    if (!setMask && !clearMask && count == 0) {
+        return;
+    }
+    
+    // Attempt to update relays via I2C
+    bool i2cSuccess = applyRelayMasks(setMask, clearMask);
+    int64_t doneUs = halMicros();
+    
+    for (uint8_t i = 0; i < count; i++) {
+        const RelayCommand& command = batch[i];
+        IoEvent ack = {};
+        ack.type = command.type == RELAY_CMD_MASK ? IO_EVENT_MASK_ACK : IO_EVENT_RELAY_ACK;
+        ack.index = command.relay;
+        ack.state = command.state;
+        ack.setMask = command.setMask;
+        ack.clearMask = command.clearMask;
+        ack.success = i2cSuccess;
+        ack.timestamp_us = doneUs;
+        ack.latency_us = (uint32_t)(doneUs - command.enqueued_us);
+        ack.traced = command.traced;
+        ack.trace = command.trace;
+        ack.trace.io_us = startUs;
+        ack.trace.i2c_us = doneUs;
+        ack.commandId = command.commandId;
+        ack.link = command.link;
+        
+        if (i2cSuccess && command.type == RELAY_CMD_SINGLE) {
+            ack.verified = verifyRelayState(command.relay, command.state);
+        }
+        ack.relays = relayStates;
+        
+        postIoEvent(ack);
+    }
+}
+
+// Apply a set/clear mask pair with one output-register write per expander that changes
+// (I/O task). The channels of an expander change together, so there is never an
+// intermediate combination on its outputs. If a write fails, the state falls back to
+// what the expanders really hold.
+bool applyRelayMasks(RelayMask setMask, RelayMask clearMask) {
+    relayStates = (relayStates & ~clearMask) | setMask;
+    expectedRelayStates = relayStates;
+    
+    bool i2cSuccess = updateRelays();
+    lastActuationMs.store(halMillis(), std::memory_order_relaxed);
+    if (!i2cSuccess) {
+        relayStates = relayBanks.outputs();
+        expectedRelayStates = relayStates;
+    }
+    
+    publishStates();
+    return i2cSuccess;
+}
+
+// Start queued sequences and run every step that is due (I/O task)
+void serviceSequences() {
+    int64_t now = halMicros();
+    RelayMask releaseMask = 0;
+    
+    // Results are forwarded after every start(): a burst of specs each replacing the
+    // running sequences would otherwise overflow the sequencer's result buffer
+    forwardSequenceResults(); // Cancels and link-down aborts from processRelayCommands()
+    RelaySequenceSpec spec;
+    while (relaySequenceQueue.pop(spec)) {
+        releaseMask |= relaySequencer.start(spec, now).clearMask;
+        forwardSequenceResults();
+    }
+    
+    // Due steps of all running sequences (and relays released by replaced ones) go
+    // out in one write
+    RelayActuation actuation = relaySequencer.service(now);
+    RelayMask setMask = actuation.setMask;
+    RelayMask clearMask = (actuation.clearMask | releaseMask) & ~setMask;
+    bool i2cSuccess = true;
+    if (setMask || clearMask) {
+        i2cSuccess = applyRelayMasks(setMask, clearMask);
+    }
+    
+    RelayActuation release = relaySequencer.commit(i2cSuccess, halMicros());
+    if (release.clearMask) {
+        applyRelayMasks(0, release.clearMask); // Best effort after a failed write
+    }
+    forwardSequenceResults();
+}
+
+// Finished, started and rejected sequences -> sequence_status (I/O task)
+void forwardSequenceResults() {
+    RelaySequenceResult result;
+    while (relaySequencer.popResult(result)) {
+        IoEvent event = {};
+        event.type = IO_EVENT_SEQUENCE_STATUS;
+        event.sequenceId = result.id;
+        event.sequenceStatus = result.status;
+        event.error = result.error;
+        event.index = result.steps;
+        event.latency_us = result.elapsed_us;
+        event.timestamp_us = halMicros();
+        postIoEvent(event);
+    }
+}
+
+// Start queued workflows, follow the input conditions and timeouts that hold and report
+// the transitions (I/O task)
+void serviceWorkflows() {
+    static WorkflowSpec spec; // Too large for the I/O task stack
+    int64_t now = halMicros();
+    uint8_t inputs = publishedInputStates.load();
+    RelayMask releaseMask = 0;
+    
+    while (workflowQueue.pop(spec)) {
+        releaseMask |= relayWorkflows.start(spec, inputs, now).clearMask;
+    }
+    
+    RelayActuation actuation = relayWorkflows.service(inputs, now);
+    RelayMask setMask = actuation.setMask;
+    RelayMask clearMask = (actuation.clearMask | releaseMask) & ~setMask;
+    bool i2cSuccess = true;
+    if (setMask || clearMask) {
+        i2cSuccess = applyRelayMasks(setMask, clearMask);
+    }
+    
+    RelayActuation release = relayWorkflows.commit(i2cSuccess, halMicros());
+    if (release.clearMask) {
+        applyRelayMasks(0, release.clearMask); // Best effort after a failed write
+    }
+    
+    WorkflowReport report;
+    while (relayWorkflows.popReport(report)) {
+        IoEvent event = {};
+        event.type = IO_EVENT_WORKFLOW_STATUS;
+        event.workflow = report;
+        event.timestamp_us = halMicros();
+        postIoEvent(event);
+    }
+}
+
+void publishStates() {
+    uint8_t inputMask = 0;
+    for (int i = 0; i < 8; i++) {
+        if (inputStates[i]) {
+            inputMask |= (1 << i);
+        }
+    }
+    publishedInputStates.store(inputMask);
+    publishedRelayStates.store(relayStates);
+}
+
+// Queue an event for the network task (I/O task only)
+bool postIoEvent(const IoEvent& event) {
+    bool queued = ioEventQueue.push(event);
+    halNotify(HAL_TASK_NET);
+    return queued;
+}
+
+// Send events posted by the I/O task upstream (network task)
+void drainIoEvents() {
+    IoEvent event;
+    if (ioEventQueue.size() > eventQueuePeak) {
+        eventQueuePeak = (uint8_t)ioEventQueue.size();
+    }
+    while (ioEventQueue.pop(event)) {
+        switch (event.type) {
+        case IO_EVENT_INPUT_EDGE:
+            notePowerActivity(POWER_WAKE_INPUT);
+            sendInputChanged(event);
+            break;
+        case IO_EVENT_RELAY_ACK:
+            if (event.success) {
+                LOG_D("✅ Relay %d (EXIO %d) set to %s in %u us",
+                            event.index, event.index + 1, event.state ? "ON" : "OFF", event.latency_us);
+                {
+                    LinkTarget sender(event.link);
+                    
+                    // Send acknowledgment
+                    if (event.commandId) {
+                        finishCommand(event.commandId, RELAY_ERR_NONE, event.relays, event.latency_us);
+                    } else {
+                        sendRelayControlAck(event.index, event.state, RELAY_ERR_NONE, event.verified, event.latency_us,
+                                            event.traced ? &event.trace : nullptr);
+                    }
+                    
+                    // Send state verification (binary acks carry it in their flags)
+                    HalLinks jsonLinks = targetLinks();
+                    takeBinaryUpstream(jsonLinks);
+                    if (jsonLinks) {
+                        LinkTarget json(jsonLinks);
+                        StaticJsonDocument<256> verifyDoc;
+                        verifyDoc["type"] = "relay_state_verified";
+                        verifyDoc["relay"] = event.index;
+                        verifyDoc["exio_pin"] = event.index + 1;
+                        verifyDoc["expected_state"] = event.state;
+                        verifyDoc["actual_state"] = event.verified;
+                        
+                        sendJson(verifyDoc, errorTx);
+                    }
+                }
+                if (!event.traced) {
+                    event.trace.ack_us = halMicros();
+                }
+                recordCommandLatency(event.trace);
+                
+                // Report the change right away instead of waiting for the next loop pass
+                reportStateChanges();
+            } else {
+                LOG_E("❌ Failed to set relay %d (EXIO %d) to %s (I2C error)",
+                            event.index, event.index + 1, event.state ? "ON" : "OFF");
+                
+                // Send error acknowledgment
+                LinkTarget sender(event.link);
+                if (event.commandId) {
+                    finishCommand(event.commandId, RELAY_ERR_I2C, event.relays, event.latency_us);
+                } else {
+                    sendRelayControlAck(event.index, event.state, RELAY_ERR_I2C, false, event.latency_us,
+                                        event.traced ? &event.trace : nullptr);
+                }
+            }
+            break;
+        case IO_EVENT_MASK_ACK:
+            if (event.success) {
+                LOG_D("✅ Relay mask set 0x%llX clear 0x%llX -> 0x%llX in %u us",
+                            (unsigned long long)event.setMask, (unsigned long long)event.clearMask,
+                            (unsigned long long)event.relays, event.latency_us);
+            } else {
+                LOG_E("❌ Failed to apply relay mask set 0x%llX clear 0x%llX (I2C error)",
+                            (unsigned long long)event.setMask, (unsigned long long)event.clearMask);
+            }
+            
+            // One ack for the whole mask; the state change follows as a single delta
+            {
+                LinkTarget sender(event.link);
+                if (event.commandId) {
+                    finishCommand(event.commandId, event.success ? RELAY_ERR_NONE : RELAY_ERR_I2C, event.relays, event.latency_us);
+                } else {
+                    sendRelayMaskAck(event.setMask, event.clearMask, event.relays,
+                                     event.success ? RELAY_ERR_NONE : RELAY_ERR_I2C, event.latency_us);
+                }
+            }
+            if (event.success) {
+                reportStateChanges();
+            }
+            break;
+        case IO_EVENT_SEQUENCE_STATUS:
+            LOG_D("Sequence %u %s after %u steps (%u us)", event.sequenceId,
+                        relaySequenceStatusName(event.sequenceStatus), event.index, event.latency_us);
+            sendSequenceStatus(event.sequenceId, event.sequenceStatus, event.error, event.index, event.latency_us);
+            reportStateChanges();
+            break;
+        case IO_EVENT_WORKFLOW_STATUS:
+            LOG_D("Workflow %u %s in state %u (%u us)", event.workflow.id,
+                  workflowStatusName(event.workflow.status), event.workflow.state, event.workflow.elapsed_us);
+            rememberWorkflowStatus(event.workflow);
+            sendWorkflowStatus(event.workflow, false);
+            reportStateChanges();
+            break;
+        case IO_EVENT_I2C_ERROR:
+            sendErrorReport(event.error);
+            break;
+        case IO_EVENT_CAPTURE_DONE:
+            captureActive = false;
+            LOG_I("Input capture %u stopped: %llu samples in %u runs", captureId,
+                  (unsigned long long)inputCapture.samples(), inputCapture.runCount());
+            if (wsConnected) {
+                LinkTarget upstream(HAL_LINK_UPSTREAM);
+                sendCaptureStatus("done", event.success ? nullptr : "Sampler timer unavailable");
+            }
+            if (captureUploadPending && event.success) {
+                captureUploadPending = false;
+                captureUploading = true;
+                captureUploadNext = 0;
+            }
+            break;
+        }
+    }
+}
+
+// Find the expanders: every responder at 0x20-0x27 (TCA9554/TCA9555) in address order,
+// or failing that the first at 0x38-0x3F (TCA9554A). Returns how many were found.
+uint8_t discoverExpanders(uint8_t* addresses) {
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < EXPANDER_ADDRESS_COUNT && count < RELAY_MAX_BANKS; i++) {
+        if (relayBanks.probe(EXPANDER_BASE_ADDRESS + i)) {
+            addresses[count++] = EXPANDER_BASE_ADDRESS + i;
+        }
+    }
+    for (uint8_t i = 0; i < EXPANDER_ADDRESS_COUNT && count == 0; i++) {
+        if (relayBanks.probe(EXPANDER_ALT_BASE_ADDRESS + i)) {
+            addresses[count++] = EXPANDER_ALT_BASE_ADDRESS + i;
+        }
+    }
+    return count;
+}
+
+// Set up the relay banks. True if they are exactly the ones cached by a previous boot, or
+// fixed by the board profile.
+bool initI2CRelays() {
+    LOG_I("Initializing TCA9554PWR I2C expanders...");
+    
+    // Soldered on: nothing to probe, scan or cache
+    if (BOARD.expanderCount > 0) {
+        for (uint8_t i = 0; i < BOARD.expanderCount; i++) {
+            const BoardExpander& expander = BOARD.expanders[i];
+            if (!relayBanks.addBank(expander.address, expanderChannels(expander.type))) {
+                LOG_E("❌ Failed to configure expander 0x%02X outputs (error: %d)", expander.address, relayBanks.lastError());
+            }
+        }
+        LOG_I("✅ %u relay channel(s) on the %s expanders at %u Hz - all relays OFF (active-high logic)",
+              relayBanks.channels(), BOARD.name, relayBanks.stats().clockHz);
+        return true;
+    }
+    
+    uint8_t addresses[RELAY_MAX_BANKS];
+    uint8_t count = 0;
+    bool cached = false;
+    
+    // Fast path: every expander found on a previous boot answers
+    if (config.expander_address != 0) {
+        addresses[count++] = config.expander_address;
+        for (uint8_t i = 0; i < RELAY_MAX_BANKS - 1 && config.bank_addresses[i] != 0; i++) {
+            addresses[count++] = config.bank_addresses[i];
+        }
+        cached = true;
+        for (uint8_t i = 0; i < count && cached; i++) {
+            cached = relayBanks.probe(addresses[i]);
+        }
+        if (cached) {
+            LOG_I("✅ %u expander(s) at cached addresses (first 0x%02X)", count, addresses[0]);
+        } else {
+            LOG_W("⚠️  Cached expander 0x%02X (of %u) not answering, scanning", config.expander_address, count);
+            count = 0;
+        }
+    }
+    
+    if (!cached) {
+        // Scan for I2C devices (diagnostics for a first boot or a hardware change)
+        halDelayMs(100); // Small delay for I2C to stabilize
+        LOG_I("Scanning I2C bus...");
+        for (uint8_t address = 1; address < 127; address++) {
+            if (relayBanks.probe(address)) {
+                LOG_I("I2C device found at address 0x%02X", address);
+            }
+        }
+        LOG_I("I2C scan complete");
+        
+        count = discoverExpanders(addresses);
+        
+        // A long or weakly pulled-up bus may only work at 100kHz
+        if (count == 0) {
+            relayBanks.beginBus(false);
+            count = discoverExpanders(addresses);
+            if (count > 0) {
+                LOG_I("Expanders only answer at 100kHz");
+            }
+        }
+    }
+    
+    if (count == 0) {
+        // Keep the channel numbering of a single-expander board so commands still get
+        // a (failing) write and an error report
+        LOG_E("❌ TCA9554PWR not found at any common address");
+        LOG_I("Please check I2C wiring and power supply");
+        relayBanks.addBank(EXPANDER_BASE_ADDRESS, 8);
+        return false;
+    }
+    
+    // Drive all outputs LOW (relays OFF for active-high logic), then make every pin an
+    // output. The expander type cannot be probed without touching its registers, so
+    // 16-channel TCA9555 banks come from the configuration.
+    for (uint8_t i = 0; i < count; i++) {
+        uint8_t address = addresses[i];
+        bool wide = address >= EXPANDER_BASE_ADDRESS && address < EXPANDER_BASE_ADDRESS + EXPANDER_ADDRESS_COUNT &&
+                    (config.expander_wide & (1 << (address - EXPANDER_BASE_ADDRESS)));
+        uint8_t channels = wide ? TCA9555_CHANNELS : 8;
+        if (relayBanks.addBank(address, channels)) {
+            LOG_I("✅ Bank %u: %s at 0x%02X, relays %u-%u", i, wide ? "TCA9555" : "TCA9554", address,
+                  relayBanks.bank(i).offset, relayBanks.bank(i).offset + channels - 1);
+        } else {
+            LOG_E("❌ Failed to configure expander 0x%02X outputs (error: %d)", address, relayBanks.lastError());
+        }
+    }
+    
+    LOG_I("✅ Configured all pins as outputs, all outputs LOW");
+    
+    // Next boot skips the scan
+    bool changed = config.expander_address != addresses[0];
+    for (uint8_t i = 0; i < RELAY_MAX_BANKS - 1; i++) {
+        uint8_t address = i + 1 < count ? addresses[i + 1] : 0;
+        changed |= config.bank_addresses[i] != address;
+    }
+    if (changed) {
+        config.expander_address = addresses[0];
+        for (uint8_t i = 0; i < RELAY_MAX_BANKS - 1; i++) {
+            config.bank_addresses[i] = i + 1 < count ? addresses[i + 1] : 0;
+        }
+        saveConfiguration();
+    }
+    
+    LOG_I("✅ %u relay channel(s) on %u expander(s) at %u Hz - all relays OFF (active-high logic)",
+          relayBanks.channels(), relayBanks.count(), relayBanks.stats().clockHz);
+    LOG_I("EXIO pin mapping: Relay 0=EXIO1 of bank 0, ..., the next bank continues the numbering");
+    LOG_I("💡 All relay LEDs should be OFF at boot - if not, check TCA9554PWR wiring/power");
+    return cached;
+}
+
+void handleSerialConfiguration() {
+    static char configString[CONFIG_LINE_MAX]; // Setup task, then the network task only
+    if (!halConsoleReadLine(configString, sizeof(configString))) {
+        return;
+    }
+    size_t length = strlen(configString);
+    while (length > 0 && (configString[length - 1] == '\r' || configString[length - 1] == ' ')) {
+        configString[--length] = '\0';
+    }
+    
+    if (length > 0) {
+        // The payload carries the WiFi password, so only its size is logged
+        LOG_D("Received configuration (%u bytes)", (unsigned)length);
+        
+        // Parse JSON configuration
+        StaticJsonDocument<2048> configDoc;
+        DeserializationError error = deserializeJson(configDoc, configString, length);
+        
+        if (error) {
+            LOG_I("JSON parsing failed: %s", error.c_str());
+            sendConfigResponse(false, "JSON parsing failed");
+            return;
+        }
+        
+        // Check if this is a configuration message
+        const char* msgType = configDoc["type"] | "";
+        if (strcmp(msgType, "config") == 0) {
+            JsonObjectConst configData = configDoc["data"];
+            if (configData) {
+                LOG_I("Applying configuration...");
+                applyConfiguration(configData);
+            } else {
+                LOG_I("No configuration data found");
+                sendConfigResponse(false, "No configuration data");
+            }
+        } else {
+            LOG_I("Unknown message type");
+            sendConfigResponse(false, "Unknown message type");
+        }
+    }
+}
+
+void applyConfiguration(JsonObjectConst configData) {
+    LOG_I("=== APPLYING CONFIGURATION ===");
+    
+    // Validate every field first, so a rejected push leaves the configuration untouched.
+    // Static: too big for the stack with the CA, and only one task configures at a time.
+    static DeviceConfig updated;
+    updated = config;
+    const char* rejected = nullptr;
+    if (configData.containsKey("device_id") && !setConfigString(updated.device_id, configData["device_id"].as<const char*>())) {
+        rejected = "Invalid device_id";
+    }
+    if (configData.containsKey("device_name") && !setConfigString(updated.device_name, configData["device_name"].as<const char*>())) {
+        rejected = "Invalid device_name";
+    }
+    if (configData.containsKey("wifi_ssid") && !setConfigString(updated.wifi_ssid, configData["wifi_ssid"].as<const char*>())) {
+        rejected = "Invalid wifi_ssid";
+    }
+    if (configData.containsKey("wifi_password") && !setConfigString(updated.wifi_password, configData["wifi_password"].as<const char*>())) {
+        rejected = "Invalid wifi_password";
+    }
+    if (configData.containsKey("server_host") && !setConfigString(updated.server_host, configData["server_host"].as<const char*>())) {
+        rejected = "Invalid server_host";
+    }
+    if (configData.containsKey("server_port")) {
+        long port = configData["server_port"] | 0L;
+        if (port <= 0 || port > 65535) {
+            rejected = "Invalid server_port";
+        }
+        updated.server_port = (int)port;
+    }
+    // Token LAN clients authenticate with; "" turns the LAN server off
+    if (configData.containsKey("lan_token") && !setConfigString(updated.lan_token, configData["lan_token"].as<const char*>())) {
+        rejected = "Invalid lan_token";
+    }
+    // "relay_banks": [{"address": 32, "channels": 16}, {"address": 33}] - the expanders in
+    // channel order. Applied at the next boot; the type of an expander cannot be probed
+    // without disturbing it, so this is how 16-channel TCA9555 banks are declared.
+    JsonArrayConst relayBankList = configData["relay_banks"];
+    if (!relayBankList.isNull() && BOARD.expanderCount > 0) {
+        rejected = "relay_banks is fixed by the board profile";
+    } else if (!relayBankList.isNull() && !parseRelayBankConfig(relayBankList, updated)) {
+        rejected = "Invalid relay_banks";
+    }
+    // "backup_servers": [{"host": "edge.local", "port": 40000}] - tried after server_host,
+    // in order, and kept warm as the hot standby; [] removes them
+    JsonArrayConst backupList = configData["backup_servers"];
+    if (!backupList.isNull() && !parseBackupServers(backupList, updated)) {
+        rejected = "Invalid backup_servers";
+    }
+    // "server_tls": true with "server_ca": "-----BEGIN CERTIFICATE-----..." - wss to every
+    // endpoint, trusting only that CA (or the server's self-signed certificate)
+    if (configData.containsKey("server_ca") && !configSetServerCa(updated, configData["server_ca"].as<const char*>())) {
+        rejected = "Invalid server_ca";
+    }
+    if (configData.containsKey("server_tls")) {
+        if (!configData["server_tls"].is<bool>()) {
+            rejected = "Invalid server_tls";
+        }
+        updated.server_tls = configData["server_tls"].as<bool>();
+    }
+    if (rejected == nullptr && updated.server_tls && updated.server_ca[0][0] == '\0') {
+        rejected = "server_tls needs server_ca";
+    }
+    // "power_save": true - light sleep and WiFi modem sleep while nothing happens
+    if (configData.containsKey("power_save")) {
+        if (!configData["power_save"].is<bool>()) {
+            rejected = "Invalid power_save";
+        }
+        updated.power_save = configData["power_save"].as<bool>();
+    }
+    // "stats_interval": seconds between stats pushed upstream, 0 = only when asked
+    if (configData.containsKey("stats_interval")) {
+        long interval = configData["stats_interval"] | -1L;
+        if (interval != 0 && (interval < STATS_INTERVAL_MIN_S || interval > STATS_INTERVAL_MAX_S)) {
+            rejected = "Invalid stats_interval";
+        }
+        updated.stats_interval = (uint16_t)interval;
+    }
+    if (rejected != nullptr) {
+        LOG_W("Configuration rejected: %s", rejected);
+        sendConfigResponse(false, rejected);
+        return;
+    }
+    
+    if (strcmp(updated.wifi_ssid, config.wifi_ssid) != 0) {
+        updated.wifi_channel = 0; // Cached AP belongs to the old network
+    }
+    updated.configured = true;
+    config = updated;
+    
+    // Save configuration
+    saveConfiguration();
+    
+    // Send success response
+    sendConfigResponse(true, "Configuration applied successfully");
+    
+    // Reconnect with new settings (the WebSocket follows once WiFi is back up)
+    LOG_I("Reconnecting with new configuration...");
+    halLanServe(config.lan_token[0] != '\0');
+    halNetworkRestart();
+}
+
+bool parseRelayBankConfig(JsonArrayConst banks, DeviceConfig& updated) {
+    if (banks.size() == 0 || banks.size() > RELAY_MAX_BANKS) {
+        return false;
+    }
+    uint8_t addresses[RELAY_MAX_BANKS] = {0};
+    uint8_t wide = 0;
+    uint16_t channels = 0;
+    uint8_t count = 0;
+    for (JsonObjectConst bank : banks) {
+        int address = bank["address"] | 0;
+        int bankChannels = bank["channels"] | 8;
+        bool primary = address >= EXPANDER_BASE_ADDRESS && address < EXPANDER_BASE_ADDRESS + EXPANDER_ADDRESS_COUNT;
+        bool alternate = address >= EXPANDER_ALT_BASE_ADDRESS && address < EXPANDER_ALT_BASE_ADDRESS + EXPANDER_ADDRESS_COUNT;
+        // TCA9555 only exists at 0x20-0x27
+        if (!(primary || alternate) || (bankChannels != 8 && bankChannels != TCA9555_CHANNELS) ||
+            (bankChannels == TCA9555_CHANNELS && !primary)) {
+            return false;
+        }
+        for (uint8_t i = 0; i < count; i++) {
+            if (addresses[i] == address) {
+                return false;
+            }
+        }
+        if (bankChannels == TCA9555_CHANNELS) {
+            wide |= 1 << (address - EXPANDER_BASE_ADDRESS);
+        }
+        channels += bankChannels;
+        addresses[count++] = (uint8_t)address;
+    }
+    if (channels > RELAY_MAX_CHANNELS) {
+        return false;
+    }
+    updated.expander_address = addresses[0];
+    memcpy(updated.bank_addresses, addresses + 1, sizeof(updated.bank_addresses));
+    updated.expander_wide = wide;
+    return true;
+}
+
+bool parseBackupServers(JsonArrayConst servers, DeviceConfig& updated) {
+    if (servers.size() > UPSTREAM_BACKUPS) {
+        return false;
+    }
+    memset(updated.backup_hosts, 0, sizeof(updated.backup_hosts));
+    memset(updated.backup_ports, 0, sizeof(updated.backup_ports));
+    uint8_t count = 0;
+    for (JsonObjectConst server : servers) {
+        const char* host = server["host"] | "";
+        long port = server["port"] | 40000L;
+        if (host[0] == '\0' || port <= 0 || port > 65535 || !setConfigString(updated.backup_hosts[count], host)) {
+            return false;
+        }
+        updated.backup_ports[count++] = (uint16_t)port;
+    }
+    return true;
+}
+
+bool configSetServerCa(DeviceConfig& target, const char* pem) {
+    const size_t chunkLength = SERVER_CA_CHUNK - 1;
+    if (pem == nullptr) {
+        return false;
+    }
+    size_t length = strlen(pem);
+    if (length > SERVER_CA_CHUNKS * chunkLength || (length > 0 && strncmp(pem, "-----BEGIN CERTIFICATE-----", 27) != 0)) {
+        return false;
+    }
+    memset(target.server_ca, 0, sizeof(target.server_ca));
+    for (uint8_t i = 0; i < SERVER_CA_CHUNKS && length > 0; i++) {
+        size_t copied = length < chunkLength ? length : chunkLength;
+        memcpy(target.server_ca[i], pem, copied);
+        pem += copied;
+        length -= copied;
+    }
+    return true;
+}
+
+const char* appUpstreamCa() {
+    static char pem[SERVER_CA_CHUNKS * (SERVER_CA_CHUNK - 1) + 1];
+    if (!config.server_tls) {
+        return nullptr;
+    }
+    size_t length = 0;
+    for (uint8_t i = 0; i < SERVER_CA_CHUNKS && config.server_ca[i][0] != '\0'; i++) {
+        size_t chunk = strnlen(config.server_ca[i], SERVER_CA_CHUNK - 1);
+        memcpy(pem + length, config.server_ca[i], chunk);
+        length += chunk;
+    }
+    pem[length] = '\0';
+    return pem;
+}
+
+// Tells the backend to keep the link out of its live relays: the device drops whatever
+// arrives on the standby until it registers the link as the active one again
+size_t appStandbyRegistration(char* buffer, size_t size) {
+    StaticJsonDocument<128> doc;
+    doc["type"] = "register";
+    doc["mac"] = halMacAddress();
+    doc["role"] = "standby";
+    size_t length = serializeJson(doc, buffer, size);
+    return length < size ? length : 0;
+}
+
+bool appLinkTrafficPending() {
+    return ioEventQueue.size() > 0;
+}
+
+uint8_t appUpstreamEndpointCount() {
+    uint8_t count = 1;
+    while (count <= UPSTREAM_BACKUPS && config.backup_hosts[count - 1][0] != '\0') {
+        count++;
+    }
+    return count;
+}
+
+void appUpstreamEndpoint(uint8_t index, const char*& host, int& port) {
+    if (index == 0 || index > UPSTREAM_BACKUPS) {
+        host = config.server_host[0] != '\0' ? config.server_host : "skytechautomated.com";
+        port = config.server_port > 0 ? config.server_port : 40000;
+        return;
+    }
+    host = config.backup_hosts[index - 1];
+    port = config.backup_ports[index - 1] != 0 ? config.backup_ports[index - 1] : 40000;
+}
+
+void sendConfigResponse(bool success, const char* message) {
+    StaticJsonDocument<256> response;
+    response["type"] = "config_response";
+    response["success"] = success;
+    response["message"] = message;
+    
+    // One write, so log lines from the log task cannot interleave with the response
+    char responseString[200];
+    size_t length = serializeJson(response, responseString, sizeof(responseString) - 1);
+    responseString[length++] = '\n';
+    halConsoleWrite(responseString, length);
+}
+
+void loadConfiguration() {
+    if (!configStore.load(&config, sizeof(config))) {
+        importLegacyConfiguration();
+        return;
+    }
+    
+    // Keys keep their meaning across schemas so far; a future schema bump converts here
+    // and the next commit rewrites the journal
+    if (configStore.loadedSchema() != CONFIG_STORE_SCHEMA) {
+        LOG_I("Migrating configuration schema %u -> %u", configStore.loadedSchema(), CONFIG_STORE_SCHEMA);
+        saveConfiguration();
+    }
+    
+    const ConfigStoreStats& stats = configStore.stats();
+    LOG_I("Loaded configuration for %s (%s), journal %u bytes in sector %u",
+          config.device_id, config.device_name, (unsigned)stats.usedBytes, stats.sector);
+}
+
+// No journal yet: take over the blob that firmware before the config store wrote to
+// EEPROM, once, and write it to the store
+void importLegacyConfiguration() {
+    DeviceConfig legacy = config;
+    halLegacyConfigLoad(&legacy, sizeof(legacy));
+    
+    // v1 is a prefix of v2: keep it and start with an empty fast-boot cache
+    if (legacy.magic == CONFIG_MAGIC && legacy.version == CONFIG_VERSION_V1) {
+        size_t cacheOffset = offsetof(DeviceConfig, expander_address);
+        memset((uint8_t*)&legacy + cacheOffset, 0, sizeof(legacy) - cacheOffset);
+        legacy.version = CONFIG_VERSION;
+    }
+    // The EEPROM layout ends before the relay bank fields
+    size_t banksOffset = offsetof(DeviceConfig, bank_addresses);
+    memset((uint8_t*)&legacy + banksOffset, 0, sizeof(legacy) - banksOffset);
+    
+    if (legacy.magic != CONFIG_MAGIC || legacy.version != CONFIG_VERSION) {
+        LOG_I("Invalid configuration, using defaults");
+        resetToDefaults();
+        return;
+    }
+    
+    // Never trust string termination in an old blob
+    legacy.device_id[sizeof(legacy.device_id) - 1] = '\0';
+    legacy.device_name[sizeof(legacy.device_name) - 1] = '\0';
+    legacy.wifi_ssid[sizeof(legacy.wifi_ssid) - 1] = '\0';
+    legacy.wifi_password[sizeof(legacy.wifi_password) - 1] = '\0';
+    legacy.server_host[sizeof(legacy.server_host) - 1] = '\0';
+    legacy.lan_token[0] = '\0';
+    config = legacy;
+    LOG_I("Imported configuration for %s (%s) from EEPROM", config.device_id, config.device_name);
+    saveConfiguration();
+}
+
+// Embedded configuration: only take the fast-boot cache from the store, and only if it
+// was learned on the same network
+void loadFastBootCache() {
+    DeviceConfig stored = config;
+    if (!configStore.load(&stored, sizeof(stored))) {
+        return;
+    }
+    config.expander_address = stored.expander_address;
+    memcpy(config.bank_addresses, stored.bank_addresses, sizeof(config.bank_addresses));
+    config.expander_wide = stored.expander_wide;
+    // Pushed later, never embedded
+    memcpy(config.lan_token, stored.lan_token, sizeof(config.lan_token));
+    memcpy(config.backup_hosts, stored.backup_hosts, sizeof(config.backup_hosts));
+    memcpy(config.backup_ports, stored.backup_ports, sizeof(config.backup_ports));
+    config.server_tls = stored.server_tls;
+    memcpy(config.server_ca, stored.server_ca, sizeof(config.server_ca));
+    config.power_save = stored.power_save;
+    config.stats_interval = stored.stats_interval;
+    if (strcmp(stored.wifi_ssid, config.wifi_ssid) == 0) {
+        config.wifi_channel = stored.wifi_channel;
+        memcpy(config.wifi_bssid, stored.wifi_bssid, sizeof(config.wifi_bssid));
+    }
+}
+
+// Snapshot the configuration for the config task; never waits for flash. One caller at
+// a time (setup, then the network task).
+void saveConfiguration() {
+    configLock.lock();
+    uint8_t image = configCommitImage == 0 ? 1 : 0; // May be an older pending snapshot: superseded
+    configImageWriting = true;
+    configLock.unlock();
+    
+    configImages[image] = config;
+    
+    configLock.lock();
+    configPendingImage = image;
+    configCommitPending = true;
+    configImageWriting = false;
+    configLock.unlock();
+    halNotify(HAL_TASK_CONFIG);
+}
+
+// Background flash commits: only the fields that changed are appended to the journal
+void configTask() {
+    for (;;) {
+        configLock.lock();
+        bool pending = configCommitPending && !configImageWriting; // Notified again once written
+        configLock.unlock();
+        
+        if (pending) {
+            // Let a burst of relay activity finish first
+            uint32_t deferStart = halMillis();
+            while (halMillis() - lastActuationMs.load(std::memory_order_relaxed) < CONFIG_COMMIT_QUIET_MS &&
+                   halMillis() - deferStart < CONFIG_COMMIT_MAX_DEFER_MS) {
+                halDelayMs(CONFIG_COMMIT_QUIET_MS);
+            }
+            
+            configLock.lock();
+            if (configImageWriting) {
+                configLock.unlock();
+                halWait(HAL_TASK_CONFIG, CONFIG_RETRY_MS);
+                continue;
+            }
+            uint8_t image = configPendingImage;
+            configCommitImage = (int8_t)image;
+            configCommitPending = false;
+            configLock.unlock();
+            
+            int64_t startUs = halMicros();
+            uint32_t compactions = configStore.stats().compactions;
+            bool committed = configStore.commit(&configImages[image]);
+            
+            configLock.lock();
+            configCommitImage = -1;
+            if (!committed && !configCommitPending && !configImageWriting) {
+                configPendingImage = image; // Unless a newer snapshot is already waiting
+                configCommitPending = true;
+            }
+            configLock.unlock();
+            
+            if (committed) {
+                const ConfigStoreStats& stats = configStore.stats();
+                LOG_I("Configuration saved in %lu us (journal %u bytes in sector %u%s)",
+                      (unsigned long)(halMicros() - startUs), (unsigned)stats.usedBytes, stats.sector,
+                      stats.compactions != compactions ? ", compacted" : "");
+            } else {
+                LOG_E("❌ Configuration commit failed, retrying in %lu ms", CONFIG_RETRY_MS);
+                halWait(HAL_TASK_CONFIG, CONFIG_RETRY_MS);
+                continue;
+            }
+        }
+        
+        halWait(HAL_TASK_CONFIG, CONFIG_RETRY_MS);
+    }
+}
+
+void resetToDefaults() {
+    config.magic = CONFIG_MAGIC;
+    config.version = CONFIG_VERSION;
+    setConfigString(config.device_id, "unconfigured");
+    setConfigString(config.device_name, "Unconfigured Relay");
+    setConfigString(config.wifi_ssid, "");
+    setConfigString(config.wifi_password, "");
+    setConfigString(config.server_host, "skytechautomated.com");
+    config.server_port = 40000;
+    config.configured = false;
+    config.expander_address = 0;
+    memset(config.bank_addresses, 0, sizeof(config.bank_addresses));
+    config.expander_wide = 0;
+    setConfigString(config.lan_token, "");
+    memset(config.backup_hosts, 0, sizeof(config.backup_hosts));
+    memset(config.backup_ports, 0, sizeof(config.backup_ports));
+    config.server_tls = false;
+    memset(config.server_ca, 0, sizeof(config.server_ca));
+    config.power_save = false;
+    config.stats_interval = 0;
+    config.wifi_channel = 0;
+    memset(config.wifi_bssid, 0, sizeof(config.wifi_bssid));
+    
+    saveConfiguration();
+}
+
+// Accept an input edge if the pin level differs from the last accepted level and the
+// debounce window has elapsed. Bounces inside the window only mark the pin so that
+// settleInputs() re-checks it once the window closes. If the edge queue is full the
+// accepted level is left alone and the pin is marked the same way, so the edge is re-read
+// after the I/O task drains the queue instead of being lost (the queue counts the drop).
+// Must be called with inputLock held.
+static inline bool HAL_IRAM_ATTR qualifyInputEdge(uint8_t index, int64_t now) {
+    bool state = (halReadInputs() >> index) & 1;
+    if (state == edgeLevels[index]) {
+        return false;
+    }
+    if (now - edgeTimes[index] < INPUT_DEBOUNCE_US) {
+        settlePendingMask |= (1 << index);
+        return false;
+    }
+    InputEdge edge = {index, state, now};
+    if (!inputEdgeQueue.push(edge)) {
+        settlePendingMask |= (1 << index);
+        return false;
+    }
+    edgeLevels[index] = state;
+    edgeTimes[index] = now;
+    return true;
+}
+
+void HAL_IRAM_ATTR onInputInterrupt(uint8_t index) {
+    int64_t now = halMicros();
+    
+    inputLock.lock();
+    bool queued = qualifyInputEdge(index, now);
+    inputLock.unlock();
+    
+    if (queued) {
+        halNotifyFromIsr(HAL_TASK_IO);
+    }
+}
+
+void initInputs() {
+    int64_t now = halMicros();
+    halInputsBegin(onInputInterrupt);
+    uint8_t levels = halReadInputs();
+    for (int i = 0; i < 8; i++) {
+        bool currentState = (levels >> i) & 1;
+        inputStates[i] = currentState;
+        edgeLevels[i] = currentState;
+        edgeTimes[i] = now;
+    }
+    LOG_I("✅ Input edge interrupts armed on 8 pins (debounce %lld us)", (long long)INPUT_DEBOUNCE_US);
+}
+
+void settleInputs() {
+    if (!settlePendingMask) {
+        return;
+    }
+    
+    bool queued = false;
+    int64_t now = halMicros();
+    inputLock.lock();
+    for (uint8_t i = 0; i < 8; i++) {
+        if ((settlePendingMask & (1 << i)) && now - edgeTimes[i] >= INPUT_DEBOUNCE_US) {
+            settlePendingMask &= ~(1 << i);
+            queued |= qualifyInputEdge(i, now);
+        }
+    }
+    inputLock.unlock();
+    
+    if (queued) {
+        halNotify(HAL_TASK_IO);
+    }
+}
+
+void drainInputEdges() {
+    InputEdge edge;
+    notePeak(edgeQueuePeak, inputEdgeQueue.size());
+    while (inputEdgeQueue.pop(edge)) {
+        inputStates[edge.index] = edge.state;
+        publishStates();
+        
+        IoEvent event = {};
+        event.type = IO_EVENT_INPUT_EDGE;
+        event.index = edge.index;
+        event.state = edge.state;
+        event.timestamp_us = edge.timestamp_us;
+        postIoEvent(event);
+    }
+}
+
+// Sampler tick (interrupt context): one port-register read for all inputs
+void HAL_IRAM_ATTR onCaptureSample() {
+    if (inputCapture.sample(halReadInputs(), halMicros())) {
+        halNotifyFromIsr(HAL_TASK_IO);
+    }
+}
+
+// Start/stop requests from the network task, and the sampler shutdown once a capture
+// ends on its own (I/O task)
+void serviceInputCapture() {
+    CaptureRequest request;
+    while (captureRequestQueue.pop(request)) {
+        if (request.action == CAPTURE_ACTION_START) {
+            inputCapture.start(request.periodUs, request.sampleLimit, request.stopWhenFull, halMicros(), halReadInputs());
+            samplerRunning = halSamplerStart(request.periodUs, onCaptureSample);
+            if (!samplerRunning) {
+                inputCapture.stop();
+                IoEvent event = {};
+                event.type = IO_EVENT_CAPTURE_DONE;
+                event.success = false;
+                postIoEvent(event);
+            }
+        } else {
+            inputCapture.stop();
+        }
+    }
+    
+    if (samplerRunning && inputCapture.state() != CAPTURE_RUNNING) {
+        halSamplerStop();
+        samplerRunning = false;
+        IoEvent event = {};
+        event.type = IO_EVENT_CAPTURE_DONE;
+        event.success = true;
+        postIoEvent(event);
+    }
+}
+
+// input_capture: {"action": "start", "rate_hz": 5000, "duration_ms": 2000, "mode": "ring",
+// "upload": true}, {"action": "stop"}, {"action": "upload"} (stops a running capture
+// first) or {"action": "status"}. mode "ring" keeps the latest history until stopped,
+// "fill" stops when the buffer is full.
+void handleInputCapture(JsonObjectConst message) {
+    const char* action = message["action"] | "status";
+    
+    if (strcmp(action, "start") == 0) {
+        uint32_t rateHz = message["rate_hz"] | CAPTURE_DEFAULT_HZ;
+        if (rateHz < INPUT_CAPTURE_MIN_HZ || rateHz > INPUT_CAPTURE_MAX_HZ) {
+            sendCaptureStatus(nullptr, "rate_hz out of range");
+            return;
+        }
+        if (captureActive || captureUploading) {
+            sendCaptureStatus(nullptr, "Capture busy");
+            return;
+        }
+        if (!inputCapture.attached()) {
+            void* runs = halAlloc(CAPTURE_EXTERNAL_RUNS * sizeof(uint32_t), HAL_MEMORY_EXTERNAL);
+            captureExternal = runs != nullptr;
+            if (runs != nullptr) {
+                inputCapture.attach((uint32_t*)runs, CAPTURE_EXTERNAL_RUNS);
+            } else if ((runs = halAlloc(CAPTURE_INTERNAL_RUNS * sizeof(uint32_t), HAL_MEMORY_INTERNAL)) != nullptr) {
+                inputCapture.attach((uint32_t*)runs, CAPTURE_INTERNAL_RUNS);
+            } else {
+                sendCaptureStatus(nullptr, "No memory for capture");
+                return;
+            }
+            LOG_I("Input capture buffer: %u runs in %s", inputCapture.capacity(), captureExternal ? "PSRAM" : "SRAM");
+        }
+        
+        uint64_t sampleLimit = (uint64_t)(message["duration_ms"] | (uint32_t)0) * rateHz / 1000;
+        CaptureRequest request = {CAPTURE_ACTION_START, 1000000 / rateHz,
+                                  sampleLimit > UINT32_MAX ? UINT32_MAX : (uint32_t)sampleLimit,
+                                  strcmp(message["mode"] | "ring", "fill") == 0};
+        if (!captureRequestQueue.push(request)) {
+            sendCaptureStatus(nullptr, "Capture busy");
+            return;
+        }
+        captureId++;
+        captureActive = true;
+        captureUploadPending = message["upload"] | false;
+        halNotify(HAL_TASK_IO);
+        LOG_I("Input capture %u started at %u Hz", captureId, rateHz);
+        sendCaptureStatus("running");
+    } else if (strcmp(action, "stop") == 0 || strcmp(action, "upload") == 0) {
+        bool upload = strcmp(action, "upload") == 0;
+        if (captureActive) {
+            // The upload starts when the I/O task reports the capture stopped
+            captureUploadPending |= upload;
+            CaptureRequest request = {CAPTURE_ACTION_STOP, 0, 0, false};
+            captureRequestQueue.push(request);
+            halNotify(HAL_TASK_IO);
+        } else if (!upload) {
+            sendCaptureStatus(nullptr);
+        } else if (inputCapture.state() == CAPTURE_DONE) {
+            sendCaptureStatus("done");
+            captureUploading = true;
+            captureUploadNext = 0;
+        } else {
+            sendCaptureStatus(nullptr, "No capture recorded");
+        }
+    } else {
+        sendCaptureStatus(nullptr);
+    }
+}
+
+// state: what was just requested, or nullptr for the capture's own state. The timing
+// fields describe the runs an upload sends: run i starts at sample first_sample plus the
+// lengths of runs 0..i-1, and sample n was taken at start_us + n * period_us (device clock).
+void sendCaptureStatus(const char* state, const char* error) {
+    static const char* const STATE_NAMES[] = {"idle", "running", "done"};
+    
+    StaticJsonDocument<384> statusDoc;
+    statusDoc["type"] = "input_capture_status";
+    statusDoc["capture"] = captureId;
+    statusDoc["state"] = state ? state : STATE_NAMES[inputCapture.state()];
+    statusDoc["success"] = error == nullptr;
+    if (error != nullptr) {
+        statusDoc["error"] = error;
+    }
+    if (inputCapture.state() == CAPTURE_DONE) {
+        statusDoc["period_us"] = inputCapture.periodUs();
+        statusDoc["start_us"] = inputCapture.startUs();
+        statusDoc["samples"] = inputCapture.samples();
+        statusDoc["first_sample"] = inputCapture.firstSample();
+        statusDoc["gap_samples"] = inputCapture.gapSamples();
+        statusDoc["runs"] = inputCapture.runCount();
+        statusDoc["chunks"] = (inputCapture.runCount() + CAPTURE_CHUNK_RUNS - 1) / CAPTURE_CHUNK_RUNS;
+    }
+    statusDoc["capacity"] = inputCapture.capacity();
+    statusDoc["memory"] = captureExternal ? "psram" : "sram";
+    
+    sendJson(statusDoc, captureStatusTx);
+}
+
+static size_t base64Encode(const uint8_t* data, size_t length, char* out) {
+    static const char ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t written = 0;
+    for (size_t i = 0; i < length; i += 3) {
+        uint32_t group = (uint32_t)data[i] << 16;
+        if (i + 1 < length) group |= (uint32_t)data[i + 1] << 8;
+        if (i + 2 < length) group |= data[i + 2];
+        out[written++] = ALPHABET[(group >> 18) & 0x3F];
+        out[written++] = ALPHABET[(group >> 12) & 0x3F];
+        out[written++] = i + 1 < length ? ALPHABET[(group >> 6) & 0x3F] : '=';
+        out[written++] = i + 2 < length ? ALPHABET[group & 0x3F] : '=';
+    }
+    out[written] = '\0';
+    return written;
+}
+
+// One input_capture_chunk per network task pass, so an upload of a full PSRAM buffer
+// never holds up state reports or commands. "runs" is base64 of the run words, 4 bytes
+// little endian each (input_capture.h).
+void serviceCaptureUpload() {
+    if (!captureUploading) {
+        return;
+    }
+    uint32_t total = inputCapture.runCount();
+    uint32_t count = total - captureUploadNext < CAPTURE_CHUNK_RUNS ? total - captureUploadNext : CAPTURE_CHUNK_RUNS;
+    
+    uint8_t bytes[CAPTURE_CHUNK_RUNS * 4];
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t run = inputCapture.run(captureUploadNext + i);
+        bytes[i * 4] = (uint8_t)run;
+        bytes[i * 4 + 1] = (uint8_t)(run >> 8);
+        bytes[i * 4 + 2] = (uint8_t)(run >> 16);
+        bytes[i * 4 + 3] = (uint8_t)(run >> 24);
+    }
+    char encoded[(CAPTURE_CHUNK_RUNS * 4 + 2) / 3 * 4 + 1];
+    base64Encode(bytes, count * 4, encoded);
+    
+    StaticJsonDocument<256> chunkDoc;
+    chunkDoc["type"] = "input_capture_chunk";
+    chunkDoc["capture"] = captureId;
+    chunkDoc["chunk"] = captureUploadNext / CAPTURE_CHUNK_RUNS;
+    chunkDoc["chunks"] = (total + CAPTURE_CHUNK_RUNS - 1) / CAPTURE_CHUNK_RUNS;
+    chunkDoc["runs"] = (const char*)encoded;
+    if (!sendJson(chunkDoc, captureTx)) {
+        return; // Retried on the next pass
+    }
+    
+    captureUploadNext += count;
+    if (captureUploadNext >= total) {
+        captureUploading = false;
+        LOG_I("Input capture %u uploaded (%u runs)", captureId, total);
+    } else {
+        halNotify(HAL_TASK_NET); // Next chunk without waiting for the poll interval
+    }
+}
+
+// Write relayStates to the expander output registers, one I2C transaction per bank that changed
+// (the acks are logged by the network task, off the actuation path)
+bool updateRelays() {
+    // Relay n is bit n of relayStates: the bank holding it drives EXIO(n - offset + 1)
+    // Direct value - HIGH = relay ON (like working code)
+    if (relayBanks.write(relayStates)) {
+        i2cError = false; // Clear error flag on successful communication
+        return true;
+    } else {
+        LOG_E("❌ I2C Error setting relay states: %d", relayBanks.lastError());
+        reportI2CError();
+        return false;
+    }
+}
+
+void appOnLinkConnected(HalLinks link) {
+    if (link != HAL_LINK_UPSTREAM) {
+        uint8_t client = 0;
+        while ((HalLinks)halLanLink(client) != link) {
+            client++;
+        }
+        LOG_I("LAN client %u connected", client);
+        lanConnected |= link;
+        lanConnectedMs[client] = halMillis();
+        return;
+    }
+    
+    if (wsConnected) {
+        // Moved to the hot standby (UpstreamFailover): another backend, so negotiate and
+        // resync as after a reconnect. Relays and running sequences carry on.
+        LOG_I("Upstream switched to endpoint %d", halLinkStats().endpoint);
+        binaryProtocol = false;
+        captureUploading = false;
+    } else {
+        LOG_I("WebSocket connected");
+    }
+    wsConnected = true;
+    
+    // Boot -> first registration (from app start; the ROM bootloader adds ~0.3 s)
+    if (bootRegisteredMs == 0) {
+        bootRegisteredMs = halMillis();
+        LOG_I("Registered %lu ms after boot (%s)", (unsigned long)bootRegisteredMs, fastBoot ? "fast boot" : "full scan");
+    }
+    LinkTarget upstream(HAL_LINK_UPSTREAM);
+    sendRegistration();
+    LOG_I("Sent registration: MAC=%s, IP=%s", halMacAddress(), halIpAddress());
+    LOG_I("Device ID: %s, Device Name: %s", config.device_id, config.device_name);
+    // Send full state immediately after registration
+    sendFullState();
+    for (uint8_t i = 0; i < recentWorkflowCount; i++) {
+        sendWorkflowStatus(recentWorkflows[i], true);
+    }
+}
+
+// register: device identity, relay layout and link history (upstream link, and LAN
+// clients once authenticated)
+void sendRegistration() {
+    StaticJsonDocument<768> regDoc;
+    regDoc["type"] = "register";
+    regDoc["device_id"] = config.device_id;
+    regDoc["device_name"] = config.device_name;
+    regDoc["mac"] = halMacAddress();
+    regDoc["ip"] = halIpAddress();
+    regDoc["report_mode"] = "delta";
+    regDoc["board"] = BOARD.name;
+    if (linkTarget == HAL_LINK_UPSTREAM) {
+        regDoc["role"] = "active"; // Promotes a hot-standby link (appStandbyRegistration())
+    }
+    // Binary frames carry 8 relay bits, so only a single 8-channel bank can offer them
+    if (linkTarget == HAL_LINK_UPSTREAM && relayBanks.count() == 1 && relayBanks.channels() <= RELAY_PROTO_CHANNELS) {
+        regDoc["bin_version"] = RELAY_PROTO_VERSION; // Offer the binary protocol
+    }
+    regDoc["relays"] = relayBanks.channels();
+    JsonArray bankChannels = regDoc.createNestedArray("bank_channels");
+    for (uint8_t i = 0; i < relayBanks.count(); i++) {
+        bankChannels.add(relayBanks.bank(i).channels);
+    }
+    HalLinkStats linkStats = halLinkStats();
+    regDoc["reconnects"] = linkStats.reconnects;
+    regDoc["last_outage_ms"] = linkStats.lastOutageMs;
+    regDoc["endpoint"] = linkStats.endpoint;
+    regDoc["switches"] = linkStats.switches;
+    regDoc["tls"] = linkStats.tls;
+    regDoc["connect_ms"] = linkStats.connectMs;
+    regDoc["power_save"] = config.power_save;
+    regDoc["stats_interval"] = config.stats_interval;
+    regDoc["boot_ms"] = bootRegisteredMs;
+    regDoc["fast_boot"] = fastBoot;
+    regDoc["last_command_id"] = senderWindow().lastId(); // Command ids continue above this
+    sendJson(regDoc, registerTx);
+}
+
+void appOnWifiAssociated(uint8_t channel, const uint8_t* bssid) {
+    if (channel == 0 || bssid == nullptr) {
+        return;
+    }
+    if (config.wifi_channel == channel && memcmp(config.wifi_bssid, bssid, sizeof(config.wifi_bssid)) == 0) {
+        return;
+    }
+    config.wifi_channel = channel;
+    memcpy(config.wifi_bssid, bssid, sizeof(config.wifi_bssid));
+    LOG_I("Cached AP %02X:%02X:%02X:%02X:%02X:%02X on channel %u for fast boot",
+          bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5], channel);
+    saveConfiguration();
+}
+
+void appOnLinkDisconnected(HalLinks link) {
+    if (link != HAL_LINK_UPSTREAM) {
+        if (lanConnected & link) {
+            LOG_I("LAN client disconnected");
+        }
+        lanConnected &= ~link;
+        lanAuthenticated &= ~link;
+        return;
+    }
+    
+    LOG_I("WebSocket disconnected");
+    if (wsConnected) {
+        // Sequences marked abort-on-disconnect release their relays; the rest complete
+        RelayCommand linkDown = {RELAY_CMD_LINK_DOWN, 0, false, 0, 0, halMicros()};
+        if (relayCommandQueue.push(linkDown)) {
+            halNotify(HAL_TASK_IO);
+        }
+    }
+    wsConnected = false;
+    binaryProtocol = false; // Renegotiated on every connection
+    captureUploading = false; // The runs stay; the backend asks for the upload again
+}
+
+// Answers go back to the link the message came from
+void appOnLinkText(HalLinks link, const uint8_t * payload, size_t length) {
+    linkFrameRxUs = halMicros();
+    notePowerActivity(POWER_WAKE_FRAME);
+    LOG_D("Received message: %.*s", (int)length, (const char*)payload);
+    LinkTarget sender(link);
+    handleWebSocketMessage(payload, length);
+}
+
+void appOnLinkBinary(HalLinks link, const uint8_t * payload, size_t length) {
+    linkFrameRxUs = halMicros();
+    notePowerActivity(POWER_WAKE_FRAME);
+    LinkTarget sender(link);
+    if ((link & HAL_LINK_LAN) && !(lanAuthenticated & link)) {
+        authenticateLanClient(link, "", nullptr);
+        return;
+    }
+    handleBinaryMessage(payload, length);
+}
+
+// First message of a LAN client: {"type": "auth", "token": "..."} with config.lan_token.
+// Compared in constant time; anything else closes the connection.
+bool authenticateLanClient(HalLinks link, const char* msgType, const char* token) {
+    size_t expected = strlen(config.lan_token);
+    bool match = strcmp(msgType, "auth") == 0 && token != nullptr && expected > 0 && strlen(token) == expected;
+    uint8_t difference = 0;
+    for (size_t i = 0; match && i < expected; i++) {
+        difference |= (uint8_t)(token[i] ^ config.lan_token[i]);
+    }
+    if (!match || difference != 0) {
+        LOG_W("LAN client rejected: %s", strcmp(msgType, "auth") == 0 ? "wrong token" : "not authenticated");
+        sendErrorReport(RELAY_ERR_UNAUTHORIZED);
+        halLinkClose(link);
+        return false;
+    }
+    
+    LOG_I("LAN client authenticated");
+    lanAuthenticated |= link;
+    senderWindow().reset(); // A new controller numbers its commands from 1
+    sendRegistration();
+    sendFullState();
+    for (uint8_t i = 0; i < recentWorkflowCount; i++) {
+        sendWorkflowStatus(recentWorkflows[i], true);
+    }
+    return true;
+}
+
+// Close LAN clients that did not authenticate in time (network task)
+void serviceLanClients() {
+    HalLinks pending = lanConnected & ~lanAuthenticated;
+    for (uint8_t i = 0; pending && i < HAL_LAN_CLIENTS; i++) {
+        HalLinks link = halLanLink(i);
+        if ((pending & link) && halMillis() - lanConnectedMs[i] > LAN_AUTH_TIMEOUT_MS) {
+            LOG_W("LAN client %u did not authenticate within %u ms", i, LAN_AUTH_TIMEOUT_MS);
+            halLinkClose(link);
+            lanConnected &= ~link; // The disconnect event may not follow for a dead socket
+        }
+    }
+}
+
+void handleWebSocketMessage(const uint8_t * payload, size_t length) {
+    // Room for a workflow with WORKFLOW_MAX_STATES states; static (network task only) to
+    // keep it off the stack
+    static StaticJsonDocument<8192> doc;
+    DeserializationError error = deserializeJson(doc, payload, length);
+    
+    if (error) {
+        LOG_I("JSON parsing failed: %s", error.c_str());
+        sendErrorReport(RELAY_ERR_JSON_PARSE);
+        return;
+    }
+    
+    const char* msgType = doc["type"] | "";
+    
+    if (linkTarget != HAL_LINK_UPSTREAM) {
+        if (!(lanAuthenticated & linkTarget)) {
+            authenticateLanClient(linkTarget, msgType, doc["token"]);
+            return;
+        }
+        // Link settings, configuration and the upstream-only streams stay with the backend
+        if (strcmp(msgType, "register_ack") == 0 || strcmp(msgType, "config") == 0 ||
+            strcmp(msgType, "log_stream") == 0 || strcmp(msgType, "input_capture") == 0) {
+            LOG_W("%s from a LAN client refused", msgType);
+            sendErrorReport(RELAY_ERR_UNAUTHORIZED);
+            return;
+        }
+    }
+    
+    if (strcmp(msgType, "relay_control") == 0) {
+        // An optional trace id asks for the per-stage timestamps in the ack
+        queueRelayCommand(parseChannel(doc.as<JsonObjectConst>()), doc["state"], doc.containsKey("trace"), doc["trace"] | (uint32_t)0);
+    } else if (strcmp(msgType, "command") == 0) {
+        handleCommand(doc.as<JsonObject>());
+    } else if (strcmp(msgType, "relay_mask") == 0) {
+        RelayMask setMask, clearMask;
+        if (parseRelayMasks(doc.as<JsonObjectConst>(), setMask, clearMask)) {
+            queueRelayMask(setMask, clearMask);
+        } else {
+            rejectRelayMask(setMask, clearMask, RELAY_ERR_INVALID_MASK, 0);
+        }
+    } else if (strcmp(msgType, "relay_pulse") == 0) {
+        bool abortOnDisconnect = strcmp(doc["on_disconnect"] | "complete", "abort") == 0;
+        queueRelayPulse(parseChannel(doc.as<JsonObjectConst>()), doc["duration_ms"] | 0, doc["id"] | 0, abortOnDisconnect);
+    } else if (strcmp(msgType, "relay_sequence") == 0) {
+        RelaySequenceSpec spec = {};
+        if (parseRelaySequence(doc.as<JsonObject>(), spec)) {
+            queueRelaySequence(spec);
+        } else {
+            sendSequenceStatus(spec.id, RELAY_SEQ_REJECTED, RELAY_ERR_INVALID_SEQUENCE, 0, 0);
+        }
+    } else if (strcmp(msgType, "sequence_cancel") == 0) {
+        queueSequenceCancel(doc["id"] | 0);
+    } else if (strcmp(msgType, "workflow") == 0) {
+        WorkflowSpec spec = {};
+        if (parseWorkflow(doc.as<JsonObjectConst>(), spec)) {
+            queueWorkflow(spec);
+        } else {
+            rejectWorkflow(spec.id, RELAY_ERR_INVALID_WORKFLOW);
+        }
+    } else if (strcmp(msgType, "workflow_cancel") == 0) {
+        queueWorkflowCancel(doc["id"] | 0);
+    } else if (strcmp(msgType, "i2c_stats") == 0) {
+        sendI2CStats();
+    } else if (strcmp(msgType, "latency_stats") == 0) {
+        sendLatencyStats(doc["reset"] | false);
+    } else if (strcmp(msgType, "heap_stats") == 0) {
+        sendHeapStats();
+    } else if (strcmp(msgType, "stats") == 0) {
+        sendStats(doc["reset"] | false);
+    } else if (strcmp(msgType, "input_capture") == 0) {
+        handleInputCapture(doc.as<JsonObjectConst>());
+    } else if (strcmp(msgType, "log_stream") == 0) {
+        logSetStreamLevel(logLevelFromName(doc["level"] | "off"));
+        LOG_I("Log streaming level: %s", logLevelName(logStreamLevel()));
+    } else if (strcmp(msgType, "register_ack") == 0) {
+        // Backend picks the wire protocol; anything but bin1 keeps us on JSON
+        const char* protocol = doc["protocol"] | "json";
+        binaryProtocol = strcmp(protocol, "bin1") == 0;
+        LOG_I("Registration acknowledged, protocol: %s", binaryProtocol ? "bin1" : "json");
+    } else if (strcmp(msgType, "resync") == 0) {
+        // Backend detected a gap in the state_delta sequence
+        LOG_I("Resync requested, sending full state");
+        sendFullState();
+    } else if (strcmp(msgType, "config") == 0) {
+        JsonObjectConst configData = doc["data"];
+        if (configData) {
+            applyConfiguration(configData);
+        } else {
+            LOG_W("config message without data ignored");
+            sendConfigResponse(false, "No configuration data");
+        }
+    } else {
+        LOG_I("Unknown message type: %s", msgType);
+        sendErrorReport(RELAY_ERR_UNKNOWN_MESSAGE);
+    }
+}
+
+void handleBinaryMessage(const uint8_t * payload, size_t length) {
+    switch (relayProtoFrameType(payload, length)) {
+    case RELAY_MSG_RELAY_CONTROL:
+        if (length < RELAY_PROTO_HEADER_SIZE + 2) {
+            sendErrorReport(RELAY_ERR_BAD_FRAME);
+            return;
+        }
+        if (length >= RELAY_PROTO_HEADER_SIZE + 6) {
+            queueRelayCommand(payload[RELAY_PROTO_HEADER_SIZE], payload[RELAY_PROTO_HEADER_SIZE + 1] != 0, true,
+                              relayProtoGetU32(payload + RELAY_PROTO_HEADER_SIZE + 2));
+        } else {
+            queueRelayCommand(payload[RELAY_PROTO_HEADER_SIZE], payload[RELAY_PROTO_HEADER_SIZE + 1] != 0);
+        }
+        break;
+    case RELAY_MSG_RELAY_MASK:
+        if (length < RELAY_PROTO_HEADER_SIZE + 2) {
+            sendErrorReport(RELAY_ERR_BAD_FRAME);
+            return;
+        }
+        queueRelayMask((RelayMask)payload[RELAY_PROTO_HEADER_SIZE], (RelayMask)payload[RELAY_PROTO_HEADER_SIZE + 1]);
+        break;
+    case RELAY_MSG_PULSE: {
+        if (length < RELAY_PROTO_HEADER_SIZE + 8) {
+            sendErrorReport(RELAY_ERR_BAD_FRAME);
+            return;
+        }
+        const uint8_t* p = payload + RELAY_PROTO_HEADER_SIZE;
+        queueRelayPulse(p[0], relayProtoGetU32(p + 4), relayProtoGetU16(p + 2),
+                        (p[1] & RELAY_SEQ_FLAG_ABORT_ON_DISCONNECT) != 0);
+        break;
+    }
+    case RELAY_MSG_SEQUENCE: {
+        const uint8_t* p = payload + RELAY_PROTO_HEADER_SIZE;
+        if (length < RELAY_PROTO_HEADER_SIZE + 4 ||
+            length < RELAY_PROTO_HEADER_SIZE + 4 + p[3] * RELAY_PROTO_SEQ_STEP_SIZE) {
+            sendErrorReport(RELAY_ERR_BAD_FRAME);
+            return;
+        }
+        RelaySequenceSpec spec = {};
+        spec.id = relayProtoGetU16(p);
+        spec.abortOnDisconnect = (p[2] & RELAY_SEQ_FLAG_ABORT_ON_DISCONNECT) != 0;
+        if (p[3] > RELAY_SEQ_MAX_STEPS) {
+            sendSequenceStatus(spec.id, RELAY_SEQ_REJECTED, RELAY_ERR_INVALID_SEQUENCE, 0, 0);
+            return;
+        }
+        spec.stepCount = p[3];
+        for (uint8_t i = 0; i < spec.stepCount; i++) {
+            const uint8_t* step = p + 4 + i * RELAY_PROTO_SEQ_STEP_SIZE;
+            spec.steps[i].setMask = step[0];
+            spec.steps[i].clearMask = step[1];
+            spec.steps[i].holdMs = relayProtoGetU32(step + 4);
+        }
+        queueRelaySequence(spec);
+        break;
+    }
+    case RELAY_MSG_SEQUENCE_CANCEL:
+        if (length < RELAY_PROTO_HEADER_SIZE + 2) {
+            sendErrorReport(RELAY_ERR_BAD_FRAME);
+            return;
+        }
+        queueSequenceCancel(relayProtoGetU16(payload + RELAY_PROTO_HEADER_SIZE));
+        break;
+    case RELAY_MSG_RESYNC:
+        LOG_I("Resync requested, sending full state");
+        sendFullState();
+        break;
+    case 0:
+        LOG_E("❌ Malformed binary frame (%u bytes)", (unsigned)length);
+        sendErrorReport(RELAY_ERR_BAD_FRAME);
+        break;
+    default:
+        LOG_I("Unknown binary message type: 0x%02X", payload[2]);
+        sendErrorReport(RELAY_ERR_UNKNOWN_MESSAGE);
+        break;
+    }
+}
+
+// Hand a relay command to the I/O task; the ack is sent when it reports back
+void queueRelayCommand(int relayIndex, bool state, bool traced, uint32_t traceId, uint32_t commandId) {
+    int64_t parsedUs = halMicros();
+    RelayTrace trace = {traceId, linkFrameRxUs, parsedUs, parsedUs, parsedUs, 0};
+    
+    if (relayIndex < 0 || relayIndex >= relayBanks.channels()) {
+        LOG_E("❌ Invalid relay index: %d", relayIndex);
+        if (commandId) {
+            finishCommand(commandId, RELAY_ERR_INVALID_RELAY, publishedRelayStates.load(), 0);
+        } else {
+            sendRelayControlAck(relayIndex, state, RELAY_ERR_INVALID_RELAY, false, 0, traced ? &trace : nullptr);
+        }
+        return;
+    }
+    
+    LOG_D("🎛️  Relay control command: Relay %d (EXIO %d) -> %s", 
+                relayIndex, relayIndex + 1, state ? "ON" : "OFF");
+    
+    RelayMask bit = (RelayMask)1 << relayIndex;
+    RelayCommand command = {RELAY_CMD_SINGLE, (uint8_t)relayIndex, state,
+                            state ? bit : 0, state ? 0 : bit, parsedUs};
+    command.traced = traced;
+    command.trace = trace;
+    command.commandId = commandId;
+    command.link = linkTarget;
+    if (relayCommandQueue.push(command)) {
+        halNotify(HAL_TASK_IO);
+    } else {
+        LOG_E("❌ Relay command queue full, dropping relay %d command", relayIndex);
+        if (commandId) {
+            finishCommand(commandId, RELAY_ERR_QUEUE_FULL, publishedRelayStates.load(), 0);
+        } else {
+            sendRelayControlAck(relayIndex, state, RELAY_ERR_QUEUE_FULL, false, 0, traced ? &trace : nullptr);
+        }
+    }
+}
+
+// Hand a multi-relay command to the I/O task: bits in setMask turn on, bits in
+// clearMask turn off, all other relays keep their state
+void queueRelayMask(RelayMask setMask, RelayMask clearMask, uint32_t commandId) {
+    if ((setMask & clearMask) || ((setMask | clearMask) & ~relayBanks.allChannels())) {
+        rejectRelayMask(setMask, clearMask, RELAY_ERR_INVALID_MASK, commandId);
+        return;
+    }
+    
+    RelayCommand command = {RELAY_CMD_MASK, 0, false, setMask, clearMask, halMicros()};
+    command.commandId = commandId;
+    command.link = linkTarget;
+    if (relayCommandQueue.push(command)) {
+        halNotify(HAL_TASK_IO);
+    } else {
+        rejectRelayMask(setMask, clearMask, RELAY_ERR_QUEUE_FULL, commandId);
+    }
+}
+
+void rejectRelayMask(RelayMask setMask, RelayMask clearMask, RelayError error, uint32_t commandId) {
+    if (error == RELAY_ERR_QUEUE_FULL) {
+        LOG_E("❌ Relay command queue full, dropping relay mask command");
+    } else {
+        LOG_E("❌ Invalid relay mask: set 0x%llX clear 0x%llX", (unsigned long long)setMask, (unsigned long long)clearMask);
+    }
+    if (commandId) {
+        finishCommand(commandId, error, publishedRelayStates.load(), 0);
+    } else {
+        sendRelayMaskAck(setMask, clearMask, publishedRelayStates.load(), error, 0);
+    }
+}
+
+// Channel of a relay_control/relay_pulse/set_relay: "channel" or "relay" counts across
+// all banks; with "bank" it counts within that bank. -1 if invalid.
+int parseChannel(JsonObjectConst message) {
+    JsonVariantConst relay = message.containsKey("channel") ? message["channel"] : message["relay"];
+    if (!relay.is<int>()) {
+        return -1;
+    }
+    int index = relay.as<int>();
+    if (!message.containsKey("bank")) {
+        return index;
+    }
+    int bank = message["bank"] | -1;
+    if (bank < 0 || bank >= relayBanks.count() || index < 0 || index >= relayBanks.bank(bank).channels) {
+        return -1;
+    }
+    return relayBanks.bank(bank).offset + index;
+}
+
+static bool parseBits(JsonVariantConst value, RelayMask limit, RelayMask& bits) {
+    bits = 0;
+    if (value.isNull()) {
+        return true;
+    }
+    if (!value.is<uint64_t>()) {
+        return false;
+    }
+    bits = value.as<uint64_t>();
+    return (bits & ~limit) == 0;
+}
+
+// set/clear of a relay_mask, set_mask or sequence step, in one of three forms:
+// {"set": 5, "clear": 2} across all banks, {"bank": 1, "set": 5} within one bank, or
+// {"banks": [{"bank": 0, "set": 1}, {"bank": 2, "clear": 4}]} for several at once.
+bool parseRelayMasks(JsonObjectConst message, RelayMask& setMask, RelayMask& clearMask) {
+    setMask = 0;
+    clearMask = 0;
+    JsonArrayConst banks = message["banks"];
+    if (banks.isNull() && !message.containsKey("bank")) {
+        return parseBits(message["set"], relayBanks.allChannels(), setMask) &&
+               parseBits(message["clear"], relayBanks.allChannels(), clearMask);
+    }
+    
+    // A single "bank" is the message itself
+    size_t entries = banks.isNull() ? 1 : banks.size();
+    if (entries > RELAY_MAX_BANKS) {
+        return false;
+    }
+    for (size_t i = 0; i < entries; i++) {
+        JsonObjectConst entry = banks.isNull() ? message : banks[i].as<JsonObjectConst>();
+        int bank = entry["bank"] | -1;
+        if (bank < 0 || bank >= relayBanks.count()) {
+            return false;
+        }
+        RelayMask limit = relayBanks.bankMask(bank, 0xFFFF) >> relayBanks.bank(bank).offset;
+        RelayMask bankSet, bankClear;
+        if (!parseBits(entry["set"], limit, bankSet) || !parseBits(entry["clear"], limit, bankClear)) {
+            return false;
+        }
+        setMask |= relayBanks.bankMask(bank, (uint16_t)bankSet);
+        clearMask |= relayBanks.bankMask(bank, (uint16_t)bankClear);
+    }
+    return true;
+}
+
+// Bank 0 (every channel of a one-expander board) goes in field, so single-bank consumers
+// keep working; with several banks, banksField lists each bank's bits as well (a
+// JSON number cannot carry all 64 channels exactly).
+template <typename TTarget>
+void putRelayMask(TTarget& target, const char* field, const char* banksField, RelayMask mask) {
+    target[field] = relayBanks.count() > 1 ? (RelayMask)relayBanks.bankBits(mask, 0) : mask;
+    if (relayBanks.count() > 1) {
+        JsonArray banks = target.createNestedArray(banksField);
+        for (uint8_t i = 0; i < relayBanks.count(); i++) {
+            banks.add(relayBanks.bankBits(mask, i));
+        }
+    }
+}
+
+// command: {"commandId": 12, "command": "set_relay", "params": {"channel": 3, "state": true}}
+// Answered with one command_response carrying the same commandId once the command has
+// run; command_window.h covers retransmits and stale ids. Commands: set_relay (channel
+// or relay = index, state), set_mask (set, clear) and get_state.
+void handleCommand(JsonObject message) {
+    uint32_t commandId = message["commandId"] | (uint32_t)0;
+    const char* command = message["command"] | "";
+    if (commandId == 0) {
+        LOG_W("command '%s' without commandId ignored", command);
+        sendErrorReport(RELAY_ERR_INVALID_COMMAND);
+        return;
+    }
+    
+    const CommandRecord* record;
+    switch (senderWindow().check(commandId, record)) {
+    case COMMAND_IN_FLIGHT:
+        LOG_D("Command %u retransmitted while executing", commandId);
+        return;
+    case COMMAND_REPLAY:
+        LOG_D("Command %u retransmitted, replaying response", commandId);
+        sendCommandResponse(commandId, record->error, record->relays, record->latencyUs, true);
+        return;
+    case COMMAND_STALE:
+        LOG_W("Stale command %u rejected (last %u)", commandId, senderWindow().lastId());
+        sendCommandResponse(commandId, RELAY_ERR_STALE_COMMAND, publishedRelayStates.load(), 0, false);
+        return;
+    case COMMAND_NEW:
+        break;
+    }
+    senderWindow().begin(commandId);
+    
+    JsonObject params = message["params"];
+    if (strcmp(command, "set_relay") == 0) {
+        // The backend resolves function names to a channel; a name it sent unresolved is invalid here
+        queueRelayCommand(parseChannel(params), params["state"] | false, false, 0, commandId);
+    } else if (strcmp(command, "set_mask") == 0) {
+        RelayMask setMask, clearMask;
+        if (parseRelayMasks(params, setMask, clearMask)) {
+            queueRelayMask(setMask, clearMask, commandId);
+        } else {
+            finishCommand(commandId, RELAY_ERR_INVALID_MASK, publishedRelayStates.load(), 0);
+        }
+    } else if (strcmp(command, "get_state") == 0) {
+        finishCommand(commandId, RELAY_ERR_NONE, publishedRelayStates.load(), 0);
+    } else {
+        LOG_W("Unknown command: %s", command);
+        finishCommand(commandId, RELAY_ERR_UNKNOWN_COMMAND, publishedRelayStates.load(), 0);
+    }
+}
+
+// Remember the outcome for retransmits, then answer
+void finishCommand(uint32_t commandId, RelayError error, RelayMask relays, uint32_t latencyUs) {
+    senderWindow().complete(commandId, error, relays, latencyUs);
+    sendCommandResponse(commandId, error, relays, latencyUs, false);
+}
+
+void sendCommandResponse(uint32_t commandId, RelayError error, RelayMask relays, uint32_t latencyUs, bool duplicate) {
+    StaticJsonDocument<384> responseDoc;
+    responseDoc["type"] = "command_response";
+    responseDoc["commandId"] = commandId;
+    responseDoc["success"] = error == RELAY_ERR_NONE;
+    if (error == RELAY_ERR_NONE) {
+        JsonObject result = responseDoc.createNestedObject("result");
+        putRelayMask(result, "relays", "relay_banks", relays);
+        result["inputs"] = publishedInputStates.load();
+        result["latency_us"] = latencyUs; // Command receipt -> I2C write done
+    } else {
+        responseDoc["error"] = relayErrorMessage(error);
+        responseDoc["error_type"] = relayErrorType(error);
+    }
+    if (error == RELAY_ERR_STALE_COMMAND) {
+        responseDoc["last_id"] = senderWindow().lastId(); // A restarted sender continues above this
+    }
+    if (duplicate) {
+        responseDoc["duplicate"] = true;
+    }
+    sendJson(responseDoc, commandTx);
+}
+
+// Pulse one relay on for durationMs, timed on the device
+void queueRelayPulse(int relayIndex, uint32_t durationMs, uint16_t id, bool abortOnDisconnect) {
+    if (relayIndex < 0 || relayIndex >= relayBanks.channels()) {
+        LOG_E("❌ Invalid relay index for pulse: %d", relayIndex);
+        sendSequenceStatus(id, RELAY_SEQ_REJECTED, RELAY_ERR_INVALID_RELAY, 0, 0);
+        return;
+    }
+    if (durationMs == 0) {
+        sendSequenceStatus(id, RELAY_SEQ_REJECTED, RELAY_ERR_INVALID_SEQUENCE, 0, 0);
+        return;
+    }
+    
+    LOG_D("🎛️  Relay pulse: Relay %d (EXIO %d) for %u ms", relayIndex, relayIndex + 1, durationMs);
+    
+    RelaySequenceSpec spec = {};
+    spec.id = id;
+    spec.abortOnDisconnect = abortOnDisconnect;
+    spec.stepCount = 2;
+    spec.steps[0].setMask = (RelayMask)1 << relayIndex;
+    spec.steps[0].holdMs = durationMs;
+    spec.steps[1].clearMask = (RelayMask)1 << relayIndex;
+    queueRelaySequence(spec);
+}
+
+// relay_sequence: {"id": 7, "on_disconnect": "abort", "steps": [{"relay": 2, "state": true, "hold_ms": 8000},
+// {"relay": 2, "state": false}]}. Steps may use "set"/"clear" masks instead of relay/state, and
+// "bank"/"banks" like relay_mask.
+bool parseRelaySequence(JsonObject message, RelaySequenceSpec& spec) {
+    spec.id = message["id"] | 0;
+    spec.abortOnDisconnect = strcmp(message["on_disconnect"] | "complete", "abort") == 0;
+    
+    JsonArray steps = message["steps"];
+    if (steps.isNull() || steps.size() == 0 || steps.size() > RELAY_SEQ_MAX_STEPS) {
+        return false;
+    }
+    
+    for (JsonObject step : steps) {
+        RelayStep& target = spec.steps[spec.stepCount++];
+        if (step.containsKey("relay")) {
+            int relayIndex = parseChannel(step);
+            if (relayIndex < 0 || relayIndex >= relayBanks.channels()) {
+                return false;
+            }
+            if (step["state"] | false) {
+                target.setMask = (RelayMask)1 << relayIndex;
+            } else {
+                target.clearMask = (RelayMask)1 << relayIndex;
+            }
+        } else if (!parseRelayMasks(step, target.setMask, target.clearMask)) {
+            return false;
+        }
+        target.holdMs = step["hold_ms"] | 0;
+    }
+    return true;
+}
+
+void queueRelaySequence(RelaySequenceSpec& spec) {
+    RelayError error = RelaySequencer::validate(spec);
+    if (error != RELAY_ERR_NONE) {
+        LOG_E("❌ Rejected relay sequence %u: %s", spec.id, relayErrorMessage(error));
+        sendSequenceStatus(spec.id, RELAY_SEQ_REJECTED, error, 0, 0);
+        return;
+    }
+    
+    spec.enqueued_us = halMicros();
+    if (relaySequenceQueue.push(spec)) {
+        halNotify(HAL_TASK_IO);
+    } else {
+        LOG_E("❌ Relay sequence queue full, dropping sequence %u", spec.id);
+        sendSequenceStatus(spec.id, RELAY_SEQ_REJECTED, RELAY_ERR_QUEUE_FULL, 0, 0);
+    }
+}
+
+void queueSequenceCancel(uint16_t id) {
+    RelayCommand command = {RELAY_CMD_SEQUENCE_CANCEL, 0, false, 0, 0, halMicros(), id};
+    if (relayCommandQueue.push(command)) {
+        halNotify(HAL_TASK_IO);
+    } else {
+        LOG_E("❌ Relay command queue full, dropping cancel of sequence %u", id);
+    }
+}
+
+// Index of a transition target given as a state index or name; WORKFLOW_NO_STATE if none
+static uint8_t workflowTarget(JsonArrayConst states, JsonVariantConst target) {
+    if (target.is<int>()) {
+        int index = target.as<int>();
+        return index >= 0 && index < (int)states.size() ? (uint8_t)index : WORKFLOW_NO_STATE;
+    }
+    const char* name = target.as<const char*>();
+    for (size_t i = 0; name && i < states.size(); i++) {
+        const char* candidate = states[i]["name"];
+        if (candidate && strcmp(candidate, name) == 0) {
+            return (uint8_t)i;
+        }
+    }
+    return WORKFLOW_NO_STATE;
+}
+
+// workflow: a state machine run on the device, starting in the first state:
+// {"id": 3, "states": [
+//   {"name": "call", "relay": 0, "state": true, "timeout_ms": 500, "on_timeout": "wait"},
+//   {"name": "wait", "relay": 0, "state": false, "timeout_ms": 90000, "on_timeout": "fail",
+//    "on": [{"input": 2, "active": true, "goto": "door"}, {"link": "down", "goto": "fail"}]},
+//   {"name": "door", "relay": 1, "state": true, "timeout_ms": 20000, "on_timeout": "done"},
+//   {"name": "done", "relay": 1, "state": false, "end": "completed"},
+//   {"name": "fail", "clear": 3, "end": "failed"}]}
+// A state switches relays with relay/state or with set/clear masks ("bank"/"banks" like
+// relay_mask); transition targets are state names or indices.
+bool parseWorkflow(JsonObjectConst message, WorkflowSpec& spec) {
+    spec.id = message["id"] | 0;
+    
+    JsonArrayConst states = message["states"];
+    if (states.isNull() || states.size() == 0 || states.size() > WORKFLOW_MAX_STATES) {
+        return false;
+    }
+    
+    spec.stateCount = (uint8_t)states.size();
+    for (uint8_t i = 0; i < spec.stateCount; i++) {
+        JsonObjectConst source = states[i].as<JsonObjectConst>();
+        WorkflowState& state = spec.states[i];
+        if (source.containsKey("relay") || source.containsKey("channel")) {
+            int relayIndex = parseChannel(source);
+            if (relayIndex < 0 || relayIndex >= relayBanks.channels()) {
+                return false;
+            }
+            if (source["state"] | false) {
+                state.setMask = (RelayMask)1 << relayIndex;
+            } else {
+                state.clearMask = (RelayMask)1 << relayIndex;
+            }
+        } else if (!parseRelayMasks(source, state.setMask, state.clearMask)) {
+            return false;
+        }
+        
+        state.timeoutMs = source["timeout_ms"] | (uint32_t)0;
+        state.timeoutTarget = workflowTarget(states, source["on_timeout"]);
+        
+        const char* end = source["end"] | "";
+        if (strcmp(end, "completed") == 0) {
+            state.end = WORKFLOW_END_COMPLETED;
+        } else if (strcmp(end, "failed") == 0) {
+            state.end = WORKFLOW_END_FAILED;
+        } else if (end[0] != '\0') {
+            return false;
+        }
+        
+        JsonArrayConst transitions = source["on"];
+        if (transitions.size() > WORKFLOW_MAX_TRANSITIONS) {
+            return false;
+        }
+        for (JsonObjectConst on : transitions) {
+            WorkflowTransition& transition = state.transitions[state.transitionCount++];
+            if (on.containsKey("input")) {
+                transition.condition = (on["active"] | true) ? WORKFLOW_ON_INPUT_ACTIVE : WORKFLOW_ON_INPUT_INACTIVE;
+                transition.input = on["input"] | 0xFF;
+            } else if (strcmp(on["link"] | "", "down") == 0) {
+                transition.condition = WORKFLOW_ON_LINK_DOWN;
+            } else {
+                return false;
+            }
+            transition.target = workflowTarget(states, on["goto"]);
+        }
+    }
+    // Targets and input numbers are checked by RelayWorkflows::validate()
+    return true;
+}
+
+void queueWorkflow(const WorkflowSpec& spec) {
+    RelayError error = RelayWorkflows::validate(spec);
+    if (error != RELAY_ERR_NONE) {
+        LOG_E("❌ Rejected workflow %u: %s", spec.id, relayErrorMessage(error));
+        rejectWorkflow(spec.id, error);
+        return;
+    }
+    
+    if (workflowQueue.push(spec)) {
+        halNotify(HAL_TASK_IO);
+    } else {
+        LOG_E("❌ Workflow queue full, dropping workflow %u", spec.id);
+        rejectWorkflow(spec.id, RELAY_ERR_QUEUE_FULL);
+    }
+}
+
+void queueWorkflowCancel(uint16_t id) {
+    RelayCommand command = {RELAY_CMD_WORKFLOW_CANCEL, 0, false, 0, 0, halMicros(), id};
+    if (relayCommandQueue.push(command)) {
+        halNotify(HAL_TASK_IO);
+    } else {
+        LOG_E("❌ Relay command queue full, dropping cancel of workflow %u", id);
+    }
+}
+
+void rejectWorkflow(uint16_t id, RelayError error) {
+    WorkflowReport report = {};
+    report.id = id;
+    report.status = WORKFLOW_REJECTED;
+    report.error = error;
+    report.state = WORKFLOW_NO_STATE;
+    report.from = WORKFLOW_NO_STATE;
+    sendWorkflowStatus(report, false);
+}
+
+// Keep the latest status per workflow id, for the replay after a reconnect
+void rememberWorkflowStatus(const WorkflowReport& report) {
+    for (uint8_t i = 0; i < recentWorkflowCount; i++) {
+        if (recentWorkflows[i].id == report.id) {
+            recentWorkflows[i] = report;
+            return;
+        }
+    }
+    recentWorkflows[recentWorkflowNext] = report;
+    recentWorkflowNext = (recentWorkflowNext + 1) % WORKFLOW_RECENT;
+    if (recentWorkflowCount < WORKFLOW_RECENT) {
+        recentWorkflowCount++;
+    }
+}
+
+// workflow_status: started, a step (state entered, with the previous state and the
+// cause), then the outcome. replay marks a repeat sent after a reconnect.
+void sendWorkflowStatus(const WorkflowReport& report, bool replay) {
+    StaticJsonDocument<256> statusDoc;
+    statusDoc["type"] = "workflow_status";
+    statusDoc["id"] = report.id;
+    statusDoc["status"] = workflowStatusName(report.status);
+    if (report.state != WORKFLOW_NO_STATE) {
+        statusDoc["state"] = report.state;
+    }
+    if (report.status == WORKFLOW_STEP) {
+        if (report.from != WORKFLOW_NO_STATE) {
+            statusDoc["from"] = report.from;
+        }
+        statusDoc["cause"] = workflowCauseName(report.cause);
+    }
+    statusDoc["elapsed_us"] = report.elapsed_us;
+    if (report.error != RELAY_ERR_NONE) {
+        statusDoc["error"] = relayErrorMessage(report.error);
+        statusDoc["error_type"] = relayErrorType(report.error);
+    }
+    if (replay) {
+        statusDoc["replay"] = true;
+    }
+    sendJson(statusDoc, workflowTx);
+}
+
+// Full state to linkTarget. Broadcast, it is a keyframe: the new baseline for deltas.
+// Sent to one link (a new connection), any pending delta goes out to every link first,
+// so the others do not miss the change.
+void sendFullState() {
+    bool keyframe = linkTarget == LINKS_BROADCAST;
+    if (!keyframe) {
+        reportStateChanges();
+    }
+    RelayMask relayMask = publishedRelayStates.load();
+    uint8_t inputMask = publishedInputStates.load();
+    
+    HalLinks links = targetLinks();
+    if (takeBinaryUpstream(links)) {
+        size_t length = encodeStateFrame(binaryTx.payload(), binaryTx.CAPACITY, RELAY_MSG_STATE, stateSeq, (uint8_t)relayMask, inputMask);
+        sendBinaryFrame(binaryTx, length);
+    }
+    if (links) {
+        LinkTarget json(links);
+        sendStateJson(relayMask, inputMask);
+    }
+    
+    if (keyframe) {
+        reportedRelayStates = relayMask;
+        reportedInputStates = inputMask;
+        lastStateReport = halMillis();
+        LOG_D("Sent full state keyframe (seq %u)", stateSeq);
+    }
+}
+
+// Complete state of all inputs and relays as JSON
+void sendStateJson(RelayMask relayMask, uint8_t inputMask) {
+    StaticJsonDocument<1536> stateDoc; // 64 relays at most
+    stateDoc["type"] = "state";
+    stateDoc["device_id"] = config.device_id;
+    stateDoc["mac"] = halMacAddress();
+    stateDoc["ip"] = halIpAddress();
+    stateDoc["seq"] = stateSeq;
+    
+    putRelayMask(stateDoc, "relay_mask", "relay_banks", relayMask);
+    stateDoc["input_mask"] = inputMask;
+    
+    JsonArray inputs = stateDoc.createNestedArray("inputs");
+    for (int i = 0; i < 8; i++) {
+        inputs.add((bool)((inputMask >> i) & 1));
+    }
+    
+    JsonArray relays = stateDoc.createNestedArray("relays");
+    for (int i = 0; i < relayBanks.channels(); i++) {
+        relays.add((int)((relayMask >> i) & 1));
+    }
+    
+    // Upstream link health (ping/pong round trip, reconnects)
+    HalLinkStats linkStats = halLinkStats();
+    JsonObject link = stateDoc.createNestedObject("link");
+    link["rtt_us"] = linkStats.rttUs;
+    link["avg_rtt_us"] = linkStats.avgRttUs;
+    link["reconnects"] = linkStats.reconnects;
+    link["last_outage_ms"] = linkStats.lastOutageMs;
+    link["endpoint"] = linkStats.endpoint;
+    link["switches"] = linkStats.switches;
+    link["tls"] = linkStats.tls;
+    link["connect_ms"] = linkStats.connectMs;
+    link["connect_heap"] = linkStats.connectHeapBytes;
+    
+    // Heap trend for soak monitoring (see heap_stats)
+    HalHeapStats heapStats = halHeapStats();
+    JsonObject heap = stateDoc.createNestedObject("heap");
+    heap["free"] = heapStats.freeBytes;
+    heap["min_free"] = heapStats.minFreeBytes;
+    heap["largest_block"] = heapStats.largestBlock;
+    
+    // Low-power idle: the idle share of uptime drives the average current
+    int64_t now = halMicros();
+    uint64_t idleMs = powerPolicy.idleMs(now);
+    JsonObject power = stateDoc.createNestedObject("power");
+    power["save"] = config.power_save;
+    power["state"] = powerPolicy.state() == HAL_POWER_IDLE ? "idle" : "active";
+    power["light_sleep"] = powerLightSleep;
+    power["idle_ms"] = (uint32_t)idleMs;
+    power["idle_pct"] = now > 0 ? (uint32_t)(idleMs * 100000 / (uint64_t)now) : 0;
+    JsonObject wakes = power.createNestedObject("wakes");
+    wakes["frame"] = powerPolicy.wakes(POWER_WAKE_FRAME);
+    wakes["input"] = powerPolicy.wakes(POWER_WAKE_INPUT);
+    wakes["local"] = powerPolicy.wakes(POWER_WAKE_LOCAL);
+    
+    sendJson(stateDoc, stateTx);
+}
+
+// Send a state_delta to every link if relays or inputs changed since the last report
+void reportStateChanges() {
+    LinkTarget all(LINKS_BROADCAST);
+    if (publishedRelayStates.load() != reportedRelayStates ||
+        publishedInputStates.load() != reportedInputStates) {
+        sendStateDelta();
+    }
+}
+
+void sendStateDelta() {
+    RelayMask relayMask = publishedRelayStates.load();
+    uint8_t inputMask = publishedInputStates.load();
+    reportedRelayStates = relayMask;
+    reportedInputStates = inputMask;
+    uint32_t seq = ++stateSeq;
+    
+    HalLinks links = targetLinks();
+    if (takeBinaryUpstream(links)) {
+        size_t length = encodeStateFrame(binaryTx.payload(), binaryTx.CAPACITY, RELAY_MSG_STATE_DELTA, seq, (uint8_t)relayMask, inputMask);
+        sendBinaryFrame(binaryTx, length);
+    }
+    if (!links) {
+        return;
+    }
+    LinkTarget json(links);
+    
+    StaticJsonDocument<256> deltaDoc;
+    deltaDoc["type"] = "state_delta";
+    deltaDoc["seq"] = seq;
+    putRelayMask(deltaDoc, "relays", "relay_banks", relayMask);
+    deltaDoc["inputs"] = inputMask;
+    
+    sendJson(deltaDoc, deltaTx);
+}
+
+void sendInputChanged(const IoEvent& event) {
+    uint32_t latencyUs = (uint32_t)(halMicros() - event.timestamp_us);
+    
+    HalLinks links = targetLinks();
+    if (takeBinaryUpstream(links)) {
+        size_t length = encodeInputChangedFrame(binaryTx.payload(), binaryTx.CAPACITY, event.index, event.state, event.timestamp_us, latencyUs);
+        sendBinaryFrame(binaryTx, length);
+    }
+    if (!links) {
+        return;
+    }
+    LinkTarget json(links);
+    
+    StaticJsonDocument<192> edgeDoc;
+    edgeDoc["type"] = "input_changed";
+    edgeDoc["inputIndex"] = event.index;
+    edgeDoc["state"] = event.state;
+    edgeDoc["timestamp_us"] = event.timestamp_us;
+    edgeDoc["latency_us"] = latencyUs;
+    
+    sendJson(edgeDoc, inputTx);
+}
+
+// trace (traced commands only) gets its ack timestamp here and is sent along
+void sendRelayControlAck(int relayIndex, bool state, RelayError error, bool verified, uint32_t latencyUs,
+                         RelayTrace* trace) {
+    if (trace) {
+        trace->ack_us = halMicros();
+    }
+    
+    HalLinks links = targetLinks();
+    if (takeBinaryUpstream(links)) {
+        size_t length = trace ? encodeRelayAckTraceFrame(binaryTx.payload(), binaryTx.CAPACITY, (uint8_t)relayIndex, state, error, verified, *trace)
+                              : encodeRelayAckFrame(binaryTx.payload(), binaryTx.CAPACITY, (uint8_t)relayIndex, state, error, verified, latencyUs);
+        sendBinaryFrame(binaryTx, length);
+    }
+    if (!links) {
+        return;
+    }
+    LinkTarget json(links);
+    
+    StaticJsonDocument<384> ackDoc;
+    ackDoc["type"] = "relay_control_ack";
+    ackDoc["relay"] = relayIndex;
+    ackDoc["state"] = state;
+    ackDoc["success"] = error == RELAY_ERR_NONE;
+    ackDoc["latency_us"] = latencyUs; // Command receipt -> I2C write done
+    if (error != RELAY_ERR_NONE) {
+        ackDoc["error"] = relayErrorMessage(error);
+    }
+    if (trace) {
+        ackDoc["trace"] = trace->id;
+        JsonObject stamps = ackDoc.createNestedObject("t_us"); // Device clock
+        stamps["rx"] = trace->rx_us;
+        stamps["parse"] = trace->parse_us;
+        stamps["io"] = trace->io_us;
+        stamps["i2c"] = trace->i2c_us;
+        stamps["ack"] = trace->ack_us;
+    }
+    
+    sendJson(ackDoc, relayAckTx);
+}
+
+void sendRelayMaskAck(RelayMask setMask, RelayMask clearMask, RelayMask relays, RelayError error, uint32_t latencyUs) {
+    HalLinks links = targetLinks();
+    if (takeBinaryUpstream(links)) {
+        size_t length = encodeMaskAckFrame(binaryTx.payload(), binaryTx.CAPACITY, (uint8_t)setMask, (uint8_t)clearMask,
+                                           (uint8_t)relays, error, latencyUs);
+        sendBinaryFrame(binaryTx, length);
+    }
+    if (!links) {
+        return;
+    }
+    LinkTarget json(links);
+    
+    StaticJsonDocument<384> ackDoc;
+    ackDoc["type"] = "relay_mask_ack";
+    putRelayMask(ackDoc, "set", "set_banks", setMask);
+    putRelayMask(ackDoc, "clear", "clear_banks", clearMask);
+    putRelayMask(ackDoc, "relays", "relay_banks", relays);
+    ackDoc["success"] = error == RELAY_ERR_NONE;
+    ackDoc["latency_us"] = latencyUs; // Command receipt -> I2C write done
+    if (error != RELAY_ERR_NONE) {
+        ackDoc["error"] = relayErrorMessage(error);
+    }
+    
+    sendJson(ackDoc, maskAckTx);
+}
+
+void sendSequenceStatus(uint16_t id, RelaySequenceStatus status, RelayError error, uint8_t steps, uint32_t elapsedUs) {
+    HalLinks links = targetLinks();
+    if (takeBinaryUpstream(links)) {
+        size_t length = encodeSequenceStatusFrame(binaryTx.payload(), binaryTx.CAPACITY, id, status, error, steps, elapsedUs);
+        sendBinaryFrame(binaryTx, length);
+    }
+    if (!links) {
+        return;
+    }
+    LinkTarget json(links);
+    
+    StaticJsonDocument<192> statusDoc;
+    statusDoc["type"] = "sequence_status";
+    statusDoc["id"] = id;
+    statusDoc["status"] = relaySequenceStatusName(status);
+    statusDoc["steps"] = steps;
+    statusDoc["elapsed_us"] = elapsedUs;
+    if (error != RELAY_ERR_NONE) {
+        statusDoc["error"] = relayErrorMessage(error);
+    }
+    
+    sendJson(statusDoc, sequenceTx);
+}
+
+void sendErrorReport(RelayError error) {
+    HalLinks links = targetLinks();
+    if (takeBinaryUpstream(links)) {
+        size_t length = encodeErrorFrame(binaryTx.payload(), binaryTx.CAPACITY, error);
+        sendBinaryFrame(binaryTx, length);
+    }
+    if (!links) {
+        return;
+    }
+    LinkTarget json(links);
+    
+    StaticJsonDocument<256> errorDoc;
+    errorDoc["type"] = "error_report";
+    errorDoc["error_type"] = relayErrorType(error);
+    errorDoc["message"] = relayErrorMessage(error);
+    
+    sendJson(errorDoc, errorTx);
+}
+
+bool verifyRelayState(int relayIndex, bool expectedState) {
+    return ((relayStates >> relayIndex) & 1) == expectedState;
+}
+
+// Upstream error reports are rate limited; every failure is still counted in the
+// driver stats (see i2c_stats)
+void reportI2CError(RelayError error) {
+    if (halMillis() - lastI2CError > I2C_ERROR_REPORT_INTERVAL) {
+        i2cError = true;
+        lastI2CError = halMillis();
+        IoEvent event = {};
+        event.type = IO_EVENT_I2C_ERROR;
+        event.error = error;
+        postIoEvent(event);
+    }
+}
+
+void sendI2CStats() {
+    I2cStats stats = relayBanks.stats();
+    uint32_t transactions = stats.writes + stats.reads + stats.failures;
+    
+    StaticJsonDocument<768> statsDoc;
+    statsDoc["type"] = "i2c_stats";
+    JsonArray banks = statsDoc.createNestedArray("banks");
+    for (uint8_t i = 0; i < relayBanks.count(); i++) {
+        JsonObject bank = banks.createNestedObject();
+        bank["address"] = relayBanks.bank(i).address;
+        bank["channels"] = relayBanks.bank(i).channels;
+    }
+    statsDoc["clock_hz"] = stats.clockHz;
+    statsDoc["writes"] = stats.writes;
+    statsDoc["reads"] = stats.reads;
+    statsDoc["failures"] = stats.failures;
+    statsDoc["retries"] = stats.retries;
+    statsDoc["recoveries"] = stats.recoveries;
+    statsDoc["verify_mismatches"] = stats.verifyMismatches;
+    statsDoc["last_latency_us"] = stats.lastLatencyUs;
+    statsDoc["max_latency_us"] = stats.maxLatencyUs;
+    statsDoc["avg_latency_us"] = transactions ? (uint32_t)(stats.totalLatencyUs / transactions) : 0;
+    statsDoc["last_error"] = stats.lastError;
+    
+    sendJson(statsDoc, statsTx);
+}
+
+void recordCommandLatency(const RelayTrace& trace) {
+    uint32_t now = halMillis();
+    stageLatency[STAGE_PARSE].record((uint32_t)(trace.parse_us - trace.rx_us), now);
+    stageLatency[STAGE_QUEUE].record((uint32_t)(trace.io_us - trace.parse_us), now);
+    stageLatency[STAGE_I2C].record((uint32_t)(trace.i2c_us - trace.io_us), now);
+    stageLatency[STAGE_ACK].record((uint32_t)(trace.ack_us - trace.i2c_us), now);
+    stageLatency[STAGE_TOTAL].record((uint32_t)(trace.ack_us - trace.rx_us), now);
+}
+
+// Per-stage relay_control latency over the last one to two LATENCY_WINDOW_MS windows
+void sendLatencyStats(bool reset) {
+    uint32_t now = halMillis();
+    
+    StaticJsonDocument<768> statsDoc;
+    statsDoc["type"] = "latency_stats";
+    statsDoc["window_s"] = LATENCY_WINDOW_MS / 1000;
+    JsonObject stages = statsDoc.createNestedObject("stages");
+    for (uint8_t i = 0; i < STAGE_COUNT; i++) {
+        LatencyHistogram& histogram = stageLatency[i];
+        JsonObject stage = stages.createNestedObject(LATENCY_STAGE_NAMES[i]);
+        stage["n"] = histogram.count(now);
+        stage["p50"] = histogram.percentileUs(50, now);
+        stage["p90"] = histogram.percentileUs(90, now);
+        stage["p99"] = histogram.percentileUs(99, now);
+        stage["max"] = histogram.maxUs(now);
+        if (reset) {
+            histogram.reset(now);
+        }
+    }
+    JsonObject commands = statsDoc.createNestedObject("commands");
+    commands["last_id"] = senderWindow().lastId();
+    commands["duplicates"] = senderWindow().duplicates();
+    commands["stale"] = senderWindow().stale();
+    
+    sendJson(statsDoc, statsTx);
+}
+
+// Heap free / low-water mark / largest block. Nothing on the message path allocates, so
+// after start-up a soak run should show these flat.
+void sendHeapStats() {
+    HalHeapStats heap = halHeapStats();
+    
+    StaticJsonDocument<256> statsDoc;
+    statsDoc["type"] = "heap_stats";
+    statsDoc["uptime_ms"] = halMillis();
+    statsDoc["free"] = heap.freeBytes;
+    statsDoc["min_free"] = heap.minFreeBytes;
+    statsDoc["largest_block"] = heap.largestBlock;
+    statsDoc["used"] = heap.usedBytes;
+    statsDoc["tx_overflows"] = txOverflows;
+    
+    sendJson(statsDoc, statsTx);
+}
+
+// Consumer side of a queue, before draining it
+void notePeak(std::atomic<uint8_t>& peak, size_t depth) {
+    if (depth > peak.load(std::memory_order_relaxed)) {
+        peak.store((uint8_t)depth, std::memory_order_relaxed);
+    }
+}
+
+void addTiming(JsonObject task, const char* name, const TaskTimingSummary& timing) {
+    JsonObject summary = task.createNestedObject(name);
+    summary["n"] = timing.count;
+    summary["p50"] = timing.p50Us;
+    summary["p99"] = timing.p99Us;
+    summary["max"] = timing.maxUs;
+}
+
+void addQueue(JsonObject queues, const char* name, size_t depth, uint8_t peak, size_t capacity, uint32_t dropped) {
+    JsonObject queue = queues.createNestedObject(name);
+    queue["depth"] = depth;
+    queue["peak"] = peak;
+    queue["capacity"] = capacity;
+    queue["dropped"] = dropped;
+}
+
+// Runtime profile: task loop timing and CPU share, stack and heap low-water marks, queue
+// peaks and link health in one message, so a sluggish board can be told apart from a
+// bad link. reset clears the timing histograms and the queue peaks.
+void sendStats(bool reset) {
+    int64_t now = halMicros();
+    TaskProfileReport reports[2] = {ioProfile.report(), netProfile.report()};
+    const char* const names[2] = {"io", "net"};
+    const HalTask tasks[2] = {HAL_TASK_IO, HAL_TASK_NET};
+    uint64_t elapsedUs = (uint64_t)(now - statsSinceUs);
+    
+    StaticJsonDocument<1536> statsDoc;
+    statsDoc["type"] = "stats";
+    statsDoc["uptime_ms"] = halMillis();
+    statsDoc["interval_s"] = config.stats_interval;
+    JsonObject taskStats = statsDoc.createNestedObject("tasks");
+    for (uint8_t i = 0; i < 2; i++) {
+        JsonObject task = taskStats.createNestedObject(names[i]);
+        uint64_t busyUs = reports[i].busyUs - statsSinceBusyUs[i];
+        task["cpu_pct"] = elapsedUs > 0 ? (float)(busyUs * 1000 / elapsedUs) / 10 : 0.0f;
+        task["passes"] = reports[i].passes;
+        task["stack_free"] = halTaskStackFree(tasks[i]);
+        addTiming(task, "gap_us", reports[i].gap);
+        addTiming(task, "pass_us", reports[i].pass);
+        if (tasks[i] == HAL_TASK_IO) {
+            addTiming(task, "late_us", reports[i].late); // The network task has no deadlines
+        }
+        statsSinceBusyUs[i] = reports[i].busyUs;
+    }
+    taskStats.createNestedObject("log")["stack_free"] = halTaskStackFree(HAL_TASK_LOG);
+    taskStats.createNestedObject("config")["stack_free"] = halTaskStackFree(HAL_TASK_CONFIG);
+    statsSinceUs = now;
+    
+    HalHeapStats heapStats = halHeapStats();
+    JsonObject heap = statsDoc.createNestedObject("heap");
+    heap["free"] = heapStats.freeBytes;
+    heap["min_free"] = heapStats.minFreeBytes;
+    heap["largest_block"] = heapStats.largestBlock;
+    
+    // Outbound messages wait in the event queue until the network task sends them
+    JsonObject queues = statsDoc.createNestedObject("queues");
+    addQueue(queues, "commands", relayCommandQueue.size(), commandQueuePeak.load(), relayCommandQueue.capacity(),
+             relayCommandQueue.dropped());
+    addQueue(queues, "events", ioEventQueue.size(), eventQueuePeak, ioEventQueue.capacity(), ioEventQueue.dropped());
+    addQueue(queues, "edges", inputEdgeQueue.size(), edgeQueuePeak.load(), inputEdgeQueue.capacity(),
+             inputEdgeQueue.dropped());
+    statsDoc["tx_overflows"] = txOverflows;
+    
+    HalLinkStats linkStats = halLinkStats();
+    JsonObject link = statsDoc.createNestedObject("link");
+    link["rssi"] = linkStats.rssi;
+    link["wifi_drops"] = linkStats.wifiDrops;
+    link["reconnects"] = linkStats.reconnects;
+    link["switches"] = linkStats.switches;
+    link["avg_rtt_us"] = linkStats.avgRttUs;
+    
+    if (reset) {
+        ioProfile.reset();
+        netProfile.reset();
+        commandQueuePeak.store(0);
+        edgeQueuePeak.store(0);
+        eventQueuePeak = 0;
+    }
+    
+    sendJson(statsDoc, profileTx);
+}
+
+// Forward records selected by log_stream upstream in small batches (network task).
+// Must not log itself, or every batch would produce the next one.
+void streamLogs() {
+    if (logStreamLevel() == RELAY_LOG_NONE) {
+        return;
+    }
+    
+    LogRecord record;
+    for (;;) {
+        uint8_t count = 0;
+        StaticJsonDocument<1536> logDoc;
+        logDoc["type"] = "log";
+        JsonArray lines = logDoc.createNestedArray("lines");
+        while (count < LOG_STREAM_BATCH && logPopStreamed(record)) {
+            JsonObject line = lines.createNestedObject();
+            line["t"] = record.timestamp_ms;
+            line["level"] = logLevelName(record.level);
+            line["msg"] = record.text; // char* is copied into the document; record is reused
+            count++;
+        }
+        if (count == 0) {
+            return;
+        }
+        
+        sendJson(logDoc, logTx);
+        if (count < LOG_STREAM_BATCH) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,79 @@
+// Relay controller logic shared by the ESP32 firmware and the host build
+//
+// The platform entry point (main.cpp on the ESP32, host/host_main.cpp on Linux) brings
+// up the HAL, calls appSetup() once and forwards upstream and LAN link events from
+// halNetworkLoop() to the appOnLink*() callbacks. Everything else runs in the I/O and
+// network tasks that appSetup() starts.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "relay_protocol.h"
+#include "hal.h"
+
+const uint8_t UPSTREAM_BACKUPS = 2; // Fallback endpoints after server_host
+// Pinned server CA (PEM) for wss, stored in chunks: a config store record holds at most
+// 255 bytes. 8 x 249 characters fit an RSA-4096 root such as ISRG Root X1.
+const uint8_t SERVER_CA_CHUNKS = 8;
+const uint8_t SERVER_CA_CHUNK = 250;
+
+// Configuration Structure
+struct DeviceConfig {
+    uint32_t magic;
+    uint8_t version;
+    char device_id[32];
+    char device_name[64];
+    char wifi_ssid[32];
+    char wifi_password[64];
+    char server_host[64];
+    int server_port;
+    bool configured;
+    // Fast-boot cache (v2), learned at runtime; 0 = unknown, probe/scan as usual
+    uint8_t expander_address;  // Relay bank 0
+    uint8_t wifi_channel;
+    uint8_t wifi_bssid[6];
+    // Relay banks after bank 0, in channel order, 0-terminated; discovered at boot or
+    // set with "relay_banks"
+    uint8_t bank_addresses[RELAY_MAX_BANKS - 1];
+    uint8_t expander_wide;     // Bit a: the expander at 0x20 + a is a 16-channel TCA9555
+    char lan_token[33];        // LAN clients authenticate with it; empty = no LAN server
+    // Fallback upstream endpoints after server_host, in order; set with "backup_servers".
+    // The first empty host ends the list.
+    char backup_hosts[UPSTREAM_BACKUPS][64];
+    uint16_t backup_ports[UPSTREAM_BACKUPS];
+    // wss to every upstream endpoint, verified against server_ca (the chunks concatenated,
+    // the first empty one ends it); set with "server_tls" and "server_ca"
+    bool server_tls;
+    char server_ca[SERVER_CA_CHUNKS][SERVER_CA_CHUNK];
+    bool power_save;           // Light sleep and WiFi modem sleep between bursts of activity
+    uint16_t stats_interval;   // Seconds between stats messages pushed upstream; 0 = on request only
+};
+
+extern DeviceConfig config;
+
+// Split a PEM certificate over target.server_ca; "" removes it. False (target untouched)
+// if it is too long or not a certificate.
+bool configSetServerCa(DeviceConfig& target, const char* pem);
+
+void appSetup();
+
+// link: HAL_LINK_UPSTREAM or halLanLink(n)
+void appOnLinkConnected(HalLinks link);
+void appOnLinkDisconnected(HalLinks link);
+void appOnLinkText(HalLinks link, const uint8_t* payload, size_t length);
+void appOnLinkBinary(HalLinks link, const uint8_t* payload, size_t length);
+
+// Upstream endpoints in preference order: server_host/server_port, then the backups
+uint8_t appUpstreamEndpointCount();
+void appUpstreamEndpoint(uint8_t index, const char*& host, int& port);
+// PEM of the pinned CA when the upstream uses wss, nullptr for plain ws (network task)
+const char* appUpstreamCa();
+// register frame for an upstream link that just became the hot standby (network task);
+// returns its length, 0 if it does not fit
+size_t appStandbyRegistration(char* buffer, size_t size);
+// Events waiting to go out (network task); the HAL holds back a blocking standby dial meanwhile
+bool appLinkTrafficPending();
+
+// WiFi associated (network task): remember the AP so the next boot skips the scan
+void appOnWifiAssociated(uint8_t channel, const uint8_t* bssid);
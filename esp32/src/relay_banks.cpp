@@ -0,0 +1,114 @@
+#include "relay_banks.h"
+
+RelayBanks::RelayBanks(I2cBus& bus) : bus_(bus), count_(0), channels_(0), lastError_(0) {
+    for (uint8_t i = 0; i < RELAY_MAX_BANKS; i++) {
+        drivers_[i].attach(bus, clock_);
+    }
+}
+
+void RelayBanks::beginBus(bool fastClock) {
+    clock_.begin(bus_, fastClock);
+}
+
+bool RelayBanks::probe(uint8_t address) {
+    return drivers_[0].probe(address);
+}
+
+void RelayBanks::setVerify(bool enabled) {
+    for (uint8_t i = 0; i < RELAY_MAX_BANKS; i++) {
+        drivers_[i].setVerify(enabled);
+    }
+}
+
+bool RelayBanks::addBank(uint8_t address, uint8_t channels) {
+    channels = channels == TCA9555_CHANNELS ? TCA9555_CHANNELS : 8;
+    if (count_ == RELAY_MAX_BANKS || channels_ + channels > RELAY_MAX_CHANNELS) {
+        return false;
+    }
+    RelayBank& bank = banks_[count_];
+    bank.address = address;
+    bank.channels = channels;
+    bank.offset = channels_;
+    bool configured = drivers_[count_].begin(address, 0x0000, channels);
+    if (!configured) {
+        lastError_ = drivers_[count_].stats().lastError;
+    }
+    count_++;
+    channels_ += channels;
+    return configured;
+}
+
+RelayMask RelayBanks::allChannels() const {
+    return channels_ >= 64 ? ~(RelayMask)0 : ((RelayMask)1 << channels_) - 1;
+}
+
+uint16_t RelayBanks::bankBits(RelayMask mask, uint8_t bank) const {
+    const RelayBank& b = banks_[bank];
+    return (uint16_t)((mask >> b.offset) & (((RelayMask)1 << b.channels) - 1));
+}
+
+RelayMask RelayBanks::bankMask(uint8_t bank, uint16_t bits) const {
+    const RelayBank& b = banks_[bank];
+    return ((RelayMask)bits & (((RelayMask)1 << b.channels) - 1)) << b.offset;
+}
+
+bool RelayBanks::write(RelayMask outputs) {
+    bool success = true;
+    for (uint8_t i = 0; i < count_; i++) {
+        uint16_t bits = bankBits(outputs, i);
+        if (bits == drivers_[i].outputs()) {
+            continue;
+        }
+        if (!drivers_[i].writeOutputs(bits)) {
+            lastError_ = drivers_[i].stats().lastError;
+            success = false;
+        }
+    }
+    return success;
+}
+
+RelayMask RelayBanks::outputs() const {
+    RelayMask outputs = 0;
+    for (uint8_t i = 0; i < count_; i++) {
+        outputs |= bankMask(i, drivers_[i].outputs());
+    }
+    return outputs;
+}
+
+bool RelayBanks::verifyPending() const {
+    for (uint8_t i = 0; i < count_; i++) {
+        if (drivers_[i].verifyPending()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool RelayBanks::service(int64_t nowUs) {
+    bool intact = true;
+    for (uint8_t i = 0; i < count_; i++) {
+        intact &= drivers_[i].service(nowUs);
+    }
+    return intact;
+}
+
+I2cStats RelayBanks::stats() const {
+    I2cStats total = drivers_[0].stats();
+    for (uint8_t i = 1; i < count_; i++) {
+        I2cStats bank = drivers_[i].stats();
+        total.writes += bank.writes;
+        total.reads += bank.reads;
+        total.failures += bank.failures;
+        total.retries += bank.retries;
+        total.recoveries += bank.recoveries;
+        total.verifyMismatches += bank.verifyMismatches;
+        if (bank.maxLatencyUs > total.maxLatencyUs) {
+            total.maxLatencyUs = bank.maxLatencyUs;
+        }
+        total.totalLatencyUs += bank.totalLatencyUs;
+        if (bank.lastError != 0) {
+            total.lastError = bank.lastError;
+        }
+    }
+    return total;
+}
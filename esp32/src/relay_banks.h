@@ -0,0 +1,68 @@
+// Relay banks: several TCA9554 (8 channel) / TCA9555 (16 channel) expanders on one bus
+//
+// Banks are numbered in the order they were added and their channels are numbered
+// consecutively, so channel i of the whole board is bit i of a RelayMask. write() takes
+// the complete output state and sends one transaction to each expander whose slice of
+// it changed - a command batch touching several banks costs at most one I2C write per
+// expander, and banks it does not touch cost nothing.
+//
+// All calls except stats() must come from the task that owns the bus (the I/O task).
+
+#pragma once
+
+#include "hal.h"
+#include "relay_protocol.h"
+#include "tca9554.h"
+
+struct RelayBank {
+    uint8_t address;
+    uint8_t channels;  // 8 or 16
+    uint8_t offset;    // First board channel
+};
+
+class RelayBanks {
+public:
+    explicit RelayBanks(I2cBus& bus);
+
+    // (Re)start the bus: one clock for every bank, back at 400 kHz unless fastClock is
+    // false. Probing goes through the first driver.
+    void beginBus(bool fastClock = true);
+    bool probe(uint8_t address);
+    void setVerify(bool enabled);
+
+    // Configure the expander at address as the next bank, all outputs off. False if
+    // the board is full or the expander does not answer (it is still added, so the
+    // channel numbering matches the configured layout; its writes keep failing).
+    bool addBank(uint8_t address, uint8_t channels);
+
+    uint8_t count() const { return count_; }
+    uint8_t channels() const { return channels_; }
+    const RelayBank& bank(uint8_t index) const { return banks_[index]; }
+    RelayMask allChannels() const;
+
+    // Slice of mask belonging to bank, and back
+    uint16_t bankBits(RelayMask mask, uint8_t bank) const;
+    RelayMask bankMask(uint8_t bank, uint16_t bits) const;
+
+    // Drive every channel from outputs: one write per expander whose bits changed.
+    // False if any write failed; outputs() then holds what the expanders really have.
+    bool write(RelayMask outputs);
+    RelayMask outputs() const;
+
+    bool verifyPending() const;
+    // Deferred read-backs that are due; false if any bank had to be restored
+    bool service(int64_t nowUs);
+
+    // Counters of all banks added up
+    I2cStats stats() const;
+    uint8_t lastError() const { return lastError_; }
+
+private:
+    I2cBus& bus_;
+    I2cBusClock clock_;
+    Tca9554 drivers_[RELAY_MAX_BANKS];
+    RelayBank banks_[RELAY_MAX_BANKS];
+    uint8_t count_;
+    uint8_t channels_;
+    uint8_t lastError_;
+};
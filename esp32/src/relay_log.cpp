@@ -0,0 +1,111 @@
+#include "relay_log.h"
+#include "ring_buffer.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+const uint32_t LOG_TASK_STACK_SIZE = 3072;
+const unsigned long LOG_FLUSH_MS = 50; // Max delay before a record reaches Serial
+
+static MpscRing<LogRecord, 32> logRing;          // Any task -> log task
+static SpscRing<LogRecord, 16> logStreamRing;    // Log task -> network task
+static std::atomic<uint8_t> streamLevel(RELAY_LOG_NONE);
+static std::atomic<bool> logTaskStarted(false);
+
+static void logTask() {
+    char line[LOG_LINE_MAX + 24];
+    uint32_t reportedDrops = 0;
+
+    for (;;) {
+        halWait(HAL_TASK_LOG, LOG_FLUSH_MS);
+
+        LogRecord record;
+        while (logRing.pop(record)) {
+            int length = snprintf(line, sizeof(line), "%c (%lu) %s\n", logLevelLetter(record.level),
+                                  (unsigned long)record.timestamp_ms, record.text);
+            if (length >= (int)sizeof(line)) {
+                length = sizeof(line) - 1;
+                line[length - 1] = '\n';
+            }
+            halConsoleWrite(line, length);
+
+            if (record.level <= streamLevel.load(std::memory_order_relaxed)) {
+                logStreamRing.push(record);
+            }
+        }
+
+        uint32_t drops = logDropped();
+        if (drops != reportedDrops) {
+            int length = snprintf(line, sizeof(line), "W (%lu) %u log records dropped\n",
+                                  (unsigned long)halMillis(), (unsigned)(drops - reportedDrops));
+            halConsoleWrite(line, length);
+            reportedDrops = drops;
+        }
+    }
+}
+
+void logBegin(uint8_t priority, int core) {
+    if (!logTaskStarted.exchange(true)) {
+        halStartTask(HAL_TASK_LOG, "log", logTask, LOG_TASK_STACK_SIZE, priority, core);
+    }
+}
+
+void logWrite(uint8_t level, const char* format, ...) {
+    LogRecord record;
+    record.timestamp_ms = halMillis();
+    record.level = level;
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(record.text, sizeof(record.text), format, args);
+    va_end(args);
+
+    if (logRing.push(record)) {
+        halNotify(HAL_TASK_LOG);
+    }
+}
+
+void logSetStreamLevel(uint8_t level) {
+    streamLevel.store(level > RELAY_LOG_LEVEL ? RELAY_LOG_LEVEL : level, std::memory_order_relaxed);
+}
+
+uint8_t logStreamLevel() {
+    return streamLevel.load(std::memory_order_relaxed);
+}
+
+bool logPopStreamed(LogRecord& record) {
+    return logStreamRing.pop(record);
+}
+
+uint32_t logDropped() {
+    return logRing.dropped() + logStreamRing.dropped();
+}
+
+char logLevelLetter(uint8_t level) {
+    switch (level) {
+    case RELAY_LOG_ERROR: return 'E';
+    case RELAY_LOG_WARN: return 'W';
+    case RELAY_LOG_INFO: return 'I';
+    case RELAY_LOG_DEBUG: return 'D';
+    }
+    return '-';
+}
+
+const char* logLevelName(uint8_t level) {
+    switch (level) {
+    case RELAY_LOG_ERROR: return "error";
+    case RELAY_LOG_WARN: return "warn";
+    case RELAY_LOG_INFO: return "info";
+    case RELAY_LOG_DEBUG: return "debug";
+    }
+    return "off";
+}
+
+uint8_t logLevelFromName(const char* name) {
+    for (uint8_t level = RELAY_LOG_ERROR; level <= RELAY_LOG_DEBUG; level++) {
+        if (strcmp(name, logLevelName(level)) == 0) {
+            return level;
+        }
+    }
+    return RELAY_LOG_NONE;
+}
@@ -0,0 +1,73 @@
+// Ring-buffered, level-filtered logging
+//
+// LOG_E/LOG_W/LOG_I/LOG_D format into a fixed-size record and push it onto a lock-free
+// ring; a low-priority task writes the records to Serial. A log call on the relay path
+// therefore costs one vsnprintf instead of milliseconds of UART time at 115200 baud.
+// Levels above RELAY_LOG_LEVEL (set in platformio.ini build_flags) compile to nothing,
+// arguments included. Not for use from ISRs.
+//
+// Records can also be streamed upstream: logSetStreamLevel() makes the log task copy
+// records at or below that level into a second ring that the network task drains.
+
+#pragma once
+
+#include "hal.h"
+
+#define RELAY_LOG_NONE 0
+#define RELAY_LOG_ERROR 1
+#define RELAY_LOG_WARN 2
+#define RELAY_LOG_INFO 3
+#define RELAY_LOG_DEBUG 4
+
+#ifndef RELAY_LOG_LEVEL
+#define RELAY_LOG_LEVEL RELAY_LOG_INFO
+#endif
+
+const size_t LOG_LINE_MAX = 120; // Longer lines are truncated
+
+struct LogRecord {
+    uint32_t timestamp_ms;
+    uint8_t level;
+    char text[LOG_LINE_MAX];
+};
+
+// Start the drain task. Records logged earlier are kept (up to the ring size).
+void logBegin(uint8_t priority, int core);
+
+void logWrite(uint8_t level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+// Upstream streaming (RELAY_LOG_NONE = off); capped at the compiled-in level
+void logSetStreamLevel(uint8_t level);
+uint8_t logStreamLevel();
+bool logPopStreamed(LogRecord& record);
+
+// Records lost because a ring was full
+uint32_t logDropped();
+
+char logLevelLetter(uint8_t level);
+const char* logLevelName(uint8_t level);
+uint8_t logLevelFromName(const char* name); // Unknown names map to RELAY_LOG_NONE
+
+#if RELAY_LOG_LEVEL >= RELAY_LOG_ERROR
+#define LOG_E(...) logWrite(RELAY_LOG_ERROR, __VA_ARGS__)
+#else
+#define LOG_E(...) ((void)0)
+#endif
+
+#if RELAY_LOG_LEVEL >= RELAY_LOG_WARN
+#define LOG_W(...) logWrite(RELAY_LOG_WARN, __VA_ARGS__)
+#else
+#define LOG_W(...) ((void)0)
+#endif
+
+#if RELAY_LOG_LEVEL >= RELAY_LOG_INFO
+#define LOG_I(...) logWrite(RELAY_LOG_INFO, __VA_ARGS__)
+#else
+#define LOG_I(...) ((void)0)
+#endif
+
+#if RELAY_LOG_LEVEL >= RELAY_LOG_DEBUG
+#define LOG_D(...) logWrite(RELAY_LOG_DEBUG, __VA_ARGS__)
+#else
+#define LOG_D(...) ((void)0)
+#endif
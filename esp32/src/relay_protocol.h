@@ -0,0 +1,348 @@
+// Compact binary relay protocol (WebSocket BIN frames)
+//
+// Negotiated at register time: the device advertises "bin_version" in its JSON
+// register message and switches to binary once the backend answers with a
+// register_ack selecting "bin1". Old firmware / old backends never negotiate and
+// keep using JSON text frames. Inbound, the firmware always accepts both.
+//
+// Every frame starts with a 4-byte header, followed by a fixed little-endian payload:
+//
+//   0      1        2     3
+//   magic  version  type  reserved
+//
+//   RELAY_CONTROL  relay u8, state u8 [, trace u32]                             (6 or 10 bytes)
+//   RESYNC         -                                                            (4 bytes)
+//   RELAY_MASK     set u8, clear u8                                             (6 bytes)
+//   PULSE          relay u8, flags u8, id u16, duration_ms u32                  (12 bytes)
+//   SEQUENCE       id u16, flags u8, count u8,
+//                  count x (set u8, clear u8, reserved u16, hold_ms u32)        (8 + 8n bytes)
+//   SEQUENCE_CANCEL id u16                                                      (6 bytes)
+//   STATE          seq u32, relays u8, inputs u8                                (10 bytes)
+//   STATE_DELTA    seq u32, relays u8, inputs u8                                (10 bytes)
+//   RELAY_ACK      relay u8, flags u8, error u8, reserved u8, latency_us u32    (12 bytes)
+//   INPUT_CHANGED  index u8, state u8, reserved u16, timestamp_us u64,
+//                  latency_us u32                                               (20 bytes)
+//   ERROR          error u8                                                     (5 bytes)
+//   MASK_ACK       set u8, clear u8, relays u8, error u8, latency_us u32        (12 bytes)
+//   SEQUENCE_STATUS id u16, status u8, error u8, steps u8, reserved u8/u16,
+//                  elapsed_us u32                                               (16 bytes)
+//   RELAY_ACK_TRACE relay u8, flags u8, error u8, reserved u8, trace u32,
+//                  rx_us u32, then parse/io/i2c/ack offsets from rx_us u32 each (32 bytes)
+//
+// A RELAY_CONTROL carrying a trace id is answered with RELAY_ACK_TRACE instead of
+// RELAY_ACK. rx_us is the low 32 bits of the device clock at frame receipt; see
+// RelayTrace for the stages.
+//
+// PULSE/SEQUENCE flags: bit 0 = abort (release asserted relays) if the socket drops
+//
+// Relay masks on the wire are 8 bits wide, so only boards with a single 8-channel bank
+// offer the binary protocol; larger boards stay on JSON (see "relay_banks").
+//
+// backend/core/RelayBinaryProtocol.js is the host-side encoder/decoder and must be
+// kept in sync with this file.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+const uint8_t RELAY_PROTO_MAGIC = 0xA5;
+const uint8_t RELAY_PROTO_VERSION = 1;
+const size_t RELAY_PROTO_HEADER_SIZE = 4;
+const size_t RELAY_PROTO_MAX_FRAME = 32;
+const uint8_t RELAY_PROTO_CHANNELS = 8;   // Relays a binary frame can address
+
+// Relay channels across every expander bank: bit i = channel i, banks in order
+typedef uint64_t RelayMask;
+const uint8_t RELAY_MAX_CHANNELS = 64;
+const uint8_t RELAY_MAX_BANKS = 8;
+
+enum RelayMessageType : uint8_t {
+    // Server -> device
+    RELAY_MSG_RELAY_CONTROL = 0x01,
+    RELAY_MSG_RESYNC = 0x02,
+    RELAY_MSG_RELAY_MASK = 0x03,
+    RELAY_MSG_PULSE = 0x04,
+    RELAY_MSG_SEQUENCE = 0x05,
+    RELAY_MSG_SEQUENCE_CANCEL = 0x06,
+    // Device -> server
+    RELAY_MSG_STATE = 0x10,
+    RELAY_MSG_STATE_DELTA = 0x11,
+    RELAY_MSG_RELAY_ACK = 0x12,
+    RELAY_MSG_INPUT_CHANGED = 0x13,
+    RELAY_MSG_ERROR = 0x14,
+    RELAY_MSG_MASK_ACK = 0x15,
+    RELAY_MSG_SEQUENCE_STATUS = 0x16,
+    RELAY_MSG_RELAY_ACK_TRACE = 0x17
+};
+
+// RELAY_ACK flag bits
+const uint8_t RELAY_ACK_STATE = 0x01;
+const uint8_t RELAY_ACK_SUCCESS = 0x02;
+const uint8_t RELAY_ACK_VERIFIED = 0x04;
+
+// PULSE / SEQUENCE flag bits
+const uint8_t RELAY_SEQ_FLAG_ABORT_ON_DISCONNECT = 0x01;
+const size_t RELAY_PROTO_SEQ_STEP_SIZE = 8;
+
+// Per-command trace of a relay_control that carried a trace id (device clock, us)
+struct RelayTrace {
+    uint32_t id;
+    int64_t rx_us;    // Frame handed over by the WebSocket client
+    int64_t parse_us; // Parsed and queued for the I/O task
+    int64_t io_us;    // Dequeued by the I/O task, I2C write starts
+    int64_t i2c_us;   // I2C write done
+    int64_t ack_us;   // Ack handed to the socket
+};
+
+// Error codes shared by acks and error reports (and mapped to the legacy JSON strings)
+enum RelayError : uint8_t {
+    RELAY_ERR_NONE = 0,
+    RELAY_ERR_INVALID_RELAY = 1,
+    RELAY_ERR_QUEUE_FULL = 2,
+    RELAY_ERR_I2C = 3,
+    RELAY_ERR_JSON_PARSE = 4,
+    RELAY_ERR_UNKNOWN_MESSAGE = 5,
+    RELAY_ERR_BAD_FRAME = 6,
+    RELAY_ERR_INVALID_MASK = 7,
+    RELAY_ERR_INVALID_SEQUENCE = 8,
+    RELAY_ERR_VERIFY_MISMATCH = 9,
+    RELAY_ERR_STALE_COMMAND = 10,
+    RELAY_ERR_UNKNOWN_COMMAND = 11,
+    RELAY_ERR_INVALID_COMMAND = 12,
+    RELAY_ERR_INVALID_WORKFLOW = 13,
+    RELAY_ERR_UNAUTHORIZED = 14
+};
+
+// Outcome reported in SEQUENCE_STATUS / sequence_status
+enum RelaySequenceStatus : uint8_t {
+    RELAY_SEQ_STARTED = 0,
+    RELAY_SEQ_COMPLETED = 1,
+    RELAY_SEQ_ABORTED = 2,  // Cancelled or socket dropped; asserted relays released
+    RELAY_SEQ_REPLACED = 3, // A newer sequence took over its relays
+    RELAY_SEQ_REJECTED = 4,
+    RELAY_SEQ_FAILED = 5    // I2C write failed; asserted relays released (best effort)
+};
+
+inline const char* relaySequenceStatusName(RelaySequenceStatus status) {
+    switch (status) {
+    case RELAY_SEQ_STARTED: return "started";
+    case RELAY_SEQ_COMPLETED: return "completed";
+    case RELAY_SEQ_ABORTED: return "aborted";
+    case RELAY_SEQ_REPLACED: return "replaced";
+    case RELAY_SEQ_REJECTED: return "rejected";
+    case RELAY_SEQ_FAILED: return "failed";
+    }
+    return "unknown";
+}
+
+inline const char* relayErrorType(RelayError error) {
+    switch (error) {
+    case RELAY_ERR_NONE: return "NONE";
+    case RELAY_ERR_INVALID_RELAY: return "INVALID_RELAY";
+    case RELAY_ERR_QUEUE_FULL: return "QUEUE_FULL";
+    case RELAY_ERR_I2C: return "I2C_ERROR";
+    case RELAY_ERR_JSON_PARSE: return "JSON_PARSE_ERROR";
+    case RELAY_ERR_UNKNOWN_MESSAGE: return "UNKNOWN_MESSAGE_TYPE";
+    case RELAY_ERR_BAD_FRAME: return "BAD_FRAME";
+    case RELAY_ERR_INVALID_MASK: return "INVALID_MASK";
+    case RELAY_ERR_INVALID_SEQUENCE: return "INVALID_SEQUENCE";
+    case RELAY_ERR_VERIFY_MISMATCH: return "VERIFY_MISMATCH";
+    case RELAY_ERR_STALE_COMMAND: return "STALE_COMMAND";
+    case RELAY_ERR_UNKNOWN_COMMAND: return "UNKNOWN_COMMAND";
+    case RELAY_ERR_INVALID_COMMAND: return "INVALID_COMMAND";
+    case RELAY_ERR_INVALID_WORKFLOW: return "INVALID_WORKFLOW";
+    case RELAY_ERR_UNAUTHORIZED: return "UNAUTHORIZED";
+    }
+    return "UNKNOWN";
+}
+
+inline const char* relayErrorMessage(RelayError error) {
+    switch (error) {
+    case RELAY_ERR_NONE: return "OK";
+    case RELAY_ERR_INVALID_RELAY: return "Invalid relay index";
+    case RELAY_ERR_QUEUE_FULL: return "Command queue full";
+    case RELAY_ERR_I2C: return "I2C communication failed";
+    case RELAY_ERR_JSON_PARSE: return "Failed to parse incoming message";
+    case RELAY_ERR_UNKNOWN_MESSAGE: return "Received unknown message type";
+    case RELAY_ERR_BAD_FRAME: return "Malformed binary frame";
+    case RELAY_ERR_INVALID_MASK: return "Relay set and clear masks overlap";
+    case RELAY_ERR_INVALID_SEQUENCE: return "Invalid relay sequence";
+    case RELAY_ERR_VERIFY_MISMATCH: return "Relay output read-back mismatch";
+    case RELAY_ERR_STALE_COMMAND: return "Stale command id";
+    case RELAY_ERR_UNKNOWN_COMMAND: return "Unknown command";
+    case RELAY_ERR_INVALID_COMMAND: return "Missing command id or invalid parameters";
+    case RELAY_ERR_INVALID_WORKFLOW: return "Invalid workflow table";
+    case RELAY_ERR_UNAUTHORIZED: return "Not authenticated, or not allowed on this link";
+    }
+    return "Unknown error";
+}
+
+// Little-endian field helpers
+inline void relayProtoPutU16(uint8_t* out, uint16_t value) {
+    out[0] = (uint8_t)value;
+    out[1] = (uint8_t)(value >> 8);
+}
+
+inline void relayProtoPutU32(uint8_t* out, uint32_t value) {
+    relayProtoPutU16(out, (uint16_t)value);
+    relayProtoPutU16(out + 2, (uint16_t)(value >> 16));
+}
+
+inline void relayProtoPutU64(uint8_t* out, uint64_t value) {
+    relayProtoPutU32(out, (uint32_t)value);
+    relayProtoPutU32(out + 4, (uint32_t)(value >> 32));
+}
+
+inline uint16_t relayProtoGetU16(const uint8_t* in) {
+    return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+inline uint32_t relayProtoGetU32(const uint8_t* in) {
+    return (uint32_t)relayProtoGetU16(in) | ((uint32_t)relayProtoGetU16(in + 2) << 16);
+}
+
+inline uint64_t relayProtoGetU64(const uint8_t* in) {
+    return (uint64_t)relayProtoGetU32(in) | ((uint64_t)relayProtoGetU32(in + 4) << 32);
+}
+
+// Writes the header and returns a pointer to the payload, or nullptr if it does not fit
+inline uint8_t* relayProtoBegin(uint8_t* buffer, size_t capacity, RelayMessageType type, size_t payloadSize) {
+    if (capacity < RELAY_PROTO_HEADER_SIZE + payloadSize) {
+        return nullptr;
+    }
+    buffer[0] = RELAY_PROTO_MAGIC;
+    buffer[1] = RELAY_PROTO_VERSION;
+    buffer[2] = type;
+    buffer[3] = 0;
+    return buffer + RELAY_PROTO_HEADER_SIZE;
+}
+
+// Validates the header; returns the message type or 0 for a malformed frame
+inline uint8_t relayProtoFrameType(const uint8_t* frame, size_t length) {
+    if (length < RELAY_PROTO_HEADER_SIZE || frame[0] != RELAY_PROTO_MAGIC || frame[1] != RELAY_PROTO_VERSION) {
+        return 0;
+    }
+    return frame[2];
+}
+
+// Encoders return the frame length, or 0 if the buffer is too small
+
+inline size_t encodeRelayControlFrame(uint8_t* buffer, size_t capacity, uint8_t relay, bool state) {
+    uint8_t* p = relayProtoBegin(buffer, capacity, RELAY_MSG_RELAY_CONTROL, 2);
+    if (!p) return 0;
+    p[0] = relay;
+    p[1] = state ? 1 : 0;
+    return RELAY_PROTO_HEADER_SIZE + 2;
+}
+
+inline size_t encodeTracedRelayControlFrame(uint8_t* buffer, size_t capacity, uint8_t relay, bool state, uint32_t trace) {
+    uint8_t* p = relayProtoBegin(buffer, capacity, RELAY_MSG_RELAY_CONTROL, 6);
+    if (!p) return 0;
+    p[0] = relay;
+    p[1] = state ? 1 : 0;
+    relayProtoPutU32(p + 2, trace);
+    return RELAY_PROTO_HEADER_SIZE + 6;
+}
+
+inline size_t encodeResyncFrame(uint8_t* buffer, size_t capacity) {
+    return relayProtoBegin(buffer, capacity, RELAY_MSG_RESYNC, 0) ? RELAY_PROTO_HEADER_SIZE : 0;
+}
+
+inline size_t encodeRelayMaskFrame(uint8_t* buffer, size_t capacity, uint8_t setMask, uint8_t clearMask) {
+    uint8_t* p = relayProtoBegin(buffer, capacity, RELAY_MSG_RELAY_MASK, 2);
+    if (!p) return 0;
+    p[0] = setMask;
+    p[1] = clearMask;
+    return RELAY_PROTO_HEADER_SIZE + 2;
+}
+
+// type is RELAY_MSG_STATE (keyframe) or RELAY_MSG_STATE_DELTA
+inline size_t encodeStateFrame(uint8_t* buffer, size_t capacity, RelayMessageType type,
+                               uint32_t seq, uint8_t relays, uint8_t inputs) {
+    uint8_t* p = relayProtoBegin(buffer, capacity, type, 6);
+    if (!p) return 0;
+    relayProtoPutU32(p, seq);
+    p[4] = relays;
+    p[5] = inputs;
+    return RELAY_PROTO_HEADER_SIZE + 6;
+}
+
+inline size_t encodeRelayAckFrame(uint8_t* buffer, size_t capacity, uint8_t relay, bool state,
+                                  RelayError error, bool verified, uint32_t latencyUs) {
+    uint8_t* p = relayProtoBegin(buffer, capacity, RELAY_MSG_RELAY_ACK, 8);
+    if (!p) return 0;
+    p[0] = relay;
+    p[1] = (state ? RELAY_ACK_STATE : 0) |
+           (error == RELAY_ERR_NONE ? RELAY_ACK_SUCCESS : 0) |
+           (verified ? RELAY_ACK_VERIFIED : 0);
+    p[2] = error;
+    p[3] = 0;
+    relayProtoPutU32(p + 4, latencyUs);
+    return RELAY_PROTO_HEADER_SIZE + 8;
+}
+
+inline size_t encodeRelayAckTraceFrame(uint8_t* buffer, size_t capacity, uint8_t relay, bool state,
+                                       RelayError error, bool verified, const RelayTrace& trace) {
+    uint8_t* p = relayProtoBegin(buffer, capacity, RELAY_MSG_RELAY_ACK_TRACE, 28);
+    if (!p) return 0;
+    p[0] = relay;
+    p[1] = (state ? RELAY_ACK_STATE : 0) |
+           (error == RELAY_ERR_NONE ? RELAY_ACK_SUCCESS : 0) |
+           (verified ? RELAY_ACK_VERIFIED : 0);
+    p[2] = error;
+    p[3] = 0;
+    relayProtoPutU32(p + 4, trace.id);
+    relayProtoPutU32(p + 8, (uint32_t)trace.rx_us);
+    relayProtoPutU32(p + 12, (uint32_t)(trace.parse_us - trace.rx_us));
+    relayProtoPutU32(p + 16, (uint32_t)(trace.io_us - trace.rx_us));
+    relayProtoPutU32(p + 20, (uint32_t)(trace.i2c_us - trace.rx_us));
+    relayProtoPutU32(p + 24, (uint32_t)(trace.ack_us - trace.rx_us));
+    return RELAY_PROTO_HEADER_SIZE + 28;
+}
+
+inline size_t encodeInputChangedFrame(uint8_t* buffer, size_t capacity, uint8_t index, bool state,
+                                      int64_t timestampUs, uint32_t latencyUs) {
+    uint8_t* p = relayProtoBegin(buffer, capacity, RELAY_MSG_INPUT_CHANGED, 16);
+    if (!p) return 0;
+    p[0] = index;
+    p[1] = state ? 1 : 0;
+    relayProtoPutU16(p + 2, 0);
+    relayProtoPutU64(p + 4, (uint64_t)timestampUs);
+    relayProtoPutU32(p + 12, latencyUs);
+    return RELAY_PROTO_HEADER_SIZE + 16;
+}
+
+inline size_t encodeErrorFrame(uint8_t* buffer, size_t capacity, RelayError error) {
+    uint8_t* p = relayProtoBegin(buffer, capacity, RELAY_MSG_ERROR, 1);
+    if (!p) return 0;
+    p[0] = error;
+    return RELAY_PROTO_HEADER_SIZE + 1;
+}
+
+// relays is the output register value after the command (unchanged if it failed)
+inline size_t encodeMaskAckFrame(uint8_t* buffer, size_t capacity, uint8_t setMask, uint8_t clearMask,
+                                 uint8_t relays, RelayError error, uint32_t latencyUs) {
+    uint8_t* p = relayProtoBegin(buffer, capacity, RELAY_MSG_MASK_ACK, 8);
+    if (!p) return 0;
+    p[0] = setMask;
+    p[1] = clearMask;
+    p[2] = relays;
+    p[3] = error;
+    relayProtoPutU32(p + 4, latencyUs);
+    return RELAY_PROTO_HEADER_SIZE + 8;
+}
+
+inline size_t encodeSequenceStatusFrame(uint8_t* buffer, size_t capacity, uint16_t id, RelaySequenceStatus status,
+                                        RelayError error, uint8_t steps, uint32_t elapsedUs) {
+    uint8_t* p = relayProtoBegin(buffer, capacity, RELAY_MSG_SEQUENCE_STATUS, 12);
+    if (!p) return 0;
+    relayProtoPutU16(p, id);
+    p[2] = status;
+    p[3] = error;
+    p[4] = steps;
+    p[5] = 0;
+    relayProtoPutU16(p + 6, 0);
+    relayProtoPutU32(p + 8, elapsedUs);
+    return RELAY_PROTO_HEADER_SIZE + 12;
+}
@@ -0,0 +1,261 @@
+// Timed relay pulses and short multi-step sequences, executed on the device
+//
+// A sequence is a list of steps. Each step applies a set/clear mask pair and then holds
+// for hold_ms before the next one; the sequence completes when the last hold elapses.
+// A pulse is the two-step sequence {set bit, hold duration} -> {clear bit}.
+// Step deadlines are computed from the previous deadline (not from when the step was
+// actually written) so long sequences do not drift.
+//
+// RelaySequencer is pure bookkeeping - no I2C and no timers. The I/O task arms a
+// wake-up (halWakeAt) for nextDeadline(), calls service() when it fires, writes the returned
+// masks to the expander in one transaction, reports the outcome with commit() and
+// forwards the finished sequences from popResult().
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "relay_protocol.h"
+
+const uint8_t RELAY_SEQ_MAX_STEPS = 8;
+const uint8_t RELAY_SEQ_SLOTS = 4;              // Sequences running at the same time
+const uint32_t RELAY_SEQ_MAX_HOLD_MS = 600000;  // 10 minutes per step
+const int64_t RELAY_SEQ_IDLE = INT64_MAX;       // nextDeadline() when nothing is running
+
+struct RelayStep {
+    RelayMask setMask;
+    RelayMask clearMask;
+    uint32_t holdMs;
+};
+
+struct RelaySequenceSpec {
+    uint16_t id;
+    bool abortOnDisconnect; // Release asserted relays if the upstream socket drops
+    uint8_t stepCount;
+    RelayStep steps[RELAY_SEQ_MAX_STEPS];
+    int64_t enqueued_us;
+};
+
+struct RelaySequenceResult {
+    uint16_t id;
+    RelaySequenceStatus status;
+    RelayError error;
+    uint8_t steps;       // Steps applied before it finished
+    uint32_t elapsed_us; // Start -> finish
+};
+
+// Masks to write to the output register
+struct RelayActuation {
+    RelayMask setMask;
+    RelayMask clearMask;
+};
+
+class RelaySequencer {
+public:
+    // Validate a spec before queueing it
+    static RelayError validate(const RelaySequenceSpec& spec) {
+        if (spec.stepCount == 0 || spec.stepCount > RELAY_SEQ_MAX_STEPS) {
+            return RELAY_ERR_INVALID_SEQUENCE;
+        }
+        for (uint8_t i = 0; i < spec.stepCount; i++) {
+            if (spec.steps[i].setMask & spec.steps[i].clearMask) {
+                return RELAY_ERR_INVALID_MASK;
+            }
+            if (spec.steps[i].holdMs > RELAY_SEQ_MAX_HOLD_MS) {
+                return RELAY_ERR_INVALID_SEQUENCE;
+            }
+        }
+        return RELAY_ERR_NONE;
+    }
+
+    // Start a sequence; its first step is due immediately. Running sequences that
+    // share relays with it are replaced. Returns the relays to release for them.
+    RelayActuation start(const RelaySequenceSpec& spec, int64_t nowUs) {
+        RelayActuation release = {0, 0};
+        RelayMask touched = touchedMask(spec);
+
+        for (uint8_t i = 0; i < RELAY_SEQ_SLOTS; i++) {
+            Slot& slot = slots_[i];
+            if (slot.active && (slot.touched & touched)) {
+                release.clearMask |= slot.holding & ~touched;
+                finish(slot, RELAY_SEQ_REPLACED, RELAY_ERR_NONE, nowUs);
+            }
+        }
+
+        Slot* free = nullptr;
+        for (uint8_t i = 0; i < RELAY_SEQ_SLOTS && !free; i++) {
+            if (!slots_[i].active) {
+                free = &slots_[i];
+            }
+        }
+        if (!free) {
+            pushResult(spec.id, RELAY_SEQ_REJECTED, RELAY_ERR_QUEUE_FULL, 0, 0);
+            return release;
+        }
+
+        free->active = true;
+        free->stepped = false;
+        free->spec = spec;
+        free->next = 0;
+        free->touched = touched;
+        free->holding = 0;
+        free->started_us = nowUs;
+        free->due_us = nowUs;
+        pushResult(spec.id, RELAY_SEQ_STARTED, RELAY_ERR_NONE, 0, 0);
+        return release;
+    }
+
+    // Advance every step that is due at nowUs; the combined masks must be written in
+    // one transaction and the outcome passed to commit()
+    RelayActuation service(int64_t nowUs) {
+        RelayActuation actuation = {0, 0};
+        for (uint8_t i = 0; i < RELAY_SEQ_SLOTS; i++) {
+            Slot& slot = slots_[i];
+            slot.stepped = false;
+            if (!slot.active) {
+                continue;
+            }
+            // Zero-length holds collapse into the same write
+            while (slot.due_us <= nowUs && slot.next < slot.spec.stepCount) {
+                const RelayStep& step = slot.spec.steps[slot.next++];
+                actuation.setMask = (actuation.setMask & ~step.clearMask) | step.setMask;
+                actuation.clearMask = (actuation.clearMask & ~step.setMask) | step.clearMask;
+                slot.holding = (slot.holding & ~step.clearMask) | step.setMask;
+                slot.due_us += (int64_t)step.holdMs * 1000;
+                slot.stepped = true;
+            }
+            // Last hold elapsed without a new step
+            if (!slot.stepped && slot.next == slot.spec.stepCount && slot.due_us <= nowUs) {
+                finish(slot, RELAY_SEQ_COMPLETED, RELAY_ERR_NONE, nowUs);
+            }
+        }
+        return actuation;
+    }
+
+    // Outcome of writing the masks from service(). On failure the affected sequences
+    // stop and the returned masks release whatever they still hold (best effort).
+    RelayActuation commit(bool success, int64_t nowUs) {
+        RelayActuation release = {0, 0};
+        for (uint8_t i = 0; i < RELAY_SEQ_SLOTS; i++) {
+            Slot& slot = slots_[i];
+            if (!slot.active || !slot.stepped) {
+                continue;
+            }
+            slot.stepped = false;
+            if (!success) {
+                release.clearMask |= slot.holding;
+                finish(slot, RELAY_SEQ_FAILED, RELAY_ERR_I2C, nowUs);
+            } else if (slot.next == slot.spec.stepCount && slot.due_us <= nowUs) {
+                finish(slot, RELAY_SEQ_COMPLETED, RELAY_ERR_NONE, nowUs);
+            }
+        }
+        return release;
+    }
+
+    // Stop one sequence (id) and release the relays it asserted
+    RelayActuation cancel(uint16_t id, int64_t nowUs) {
+        RelayActuation release = {0, 0};
+        for (uint8_t i = 0; i < RELAY_SEQ_SLOTS; i++) {
+            Slot& slot = slots_[i];
+            if (slot.active && slot.spec.id == id) {
+                release.clearMask |= slot.holding;
+                finish(slot, RELAY_SEQ_ABORTED, RELAY_ERR_NONE, nowUs);
+            }
+        }
+        return release;
+    }
+
+    // Upstream link lost: abort the sequences that asked for it, let the rest complete
+    RelayActuation linkDown(int64_t nowUs) {
+        RelayActuation release = {0, 0};
+        for (uint8_t i = 0; i < RELAY_SEQ_SLOTS; i++) {
+            Slot& slot = slots_[i];
+            if (slot.active && slot.spec.abortOnDisconnect) {
+                release.clearMask |= slot.holding;
+                finish(slot, RELAY_SEQ_ABORTED, RELAY_ERR_NONE, nowUs);
+            }
+        }
+        return release;
+    }
+
+    // Earliest time service() has work to do, or RELAY_SEQ_IDLE
+    int64_t nextDeadline() const {
+        int64_t deadline = RELAY_SEQ_IDLE;
+        for (uint8_t i = 0; i < RELAY_SEQ_SLOTS; i++) {
+            if (slots_[i].active && slots_[i].due_us < deadline) {
+                deadline = slots_[i].due_us;
+            }
+        }
+        return deadline;
+    }
+
+    uint8_t running() const {
+        uint8_t count = 0;
+        for (uint8_t i = 0; i < RELAY_SEQ_SLOTS; i++) {
+            count += slots_[i].active ? 1 : 0;
+        }
+        return count;
+    }
+
+    bool popResult(RelaySequenceResult& result) {
+        if (resultCount_ == 0) {
+            return false;
+        }
+        result = results_[resultTail_];
+        resultTail_ = (resultTail_ + 1) % RESULT_CAPACITY;
+        resultCount_--;
+        return true;
+    }
+
+private:
+    struct Slot {
+        bool active;
+        bool stepped;     // Advanced by the last service() call
+        RelaySequenceSpec spec;
+        uint8_t next;     // Next step to apply
+        RelayMask touched;  // Every relay any step sets or clears
+        RelayMask holding;  // Relays this sequence has turned on and not yet released
+        int64_t started_us;
+        int64_t due_us;
+    };
+
+    // A start() adds at most RELAY_SEQ_SLOTS + 1 results (it replaced every running
+    // sequence, then started), and calls without a start() in between at most one per
+    // slot. Pop them before each start() and after commit(); oldest ones are dropped on
+    // overflow.
+    static const uint8_t RESULT_CAPACITY = RELAY_SEQ_SLOTS * 2 + 2;
+
+    static RelayMask touchedMask(const RelaySequenceSpec& spec) {
+        RelayMask mask = 0;
+        for (uint8_t i = 0; i < spec.stepCount; i++) {
+            mask |= spec.steps[i].setMask | spec.steps[i].clearMask;
+        }
+        return mask;
+    }
+
+    void finish(Slot& slot, RelaySequenceStatus status, RelayError error, int64_t nowUs) {
+        slot.active = false;
+        slot.stepped = false;
+        pushResult(slot.spec.id, status, error, slot.next, (uint32_t)(nowUs - slot.started_us));
+    }
+
+    void pushResult(uint16_t id, RelaySequenceStatus status, RelayError error, uint8_t steps, uint32_t elapsedUs) {
+        if (resultCount_ == RESULT_CAPACITY) {
+            // Drop the oldest rather than the newest outcome
+            resultTail_ = (resultTail_ + 1) % RESULT_CAPACITY;
+            resultCount_--;
+        }
+        RelaySequenceResult& result = results_[(resultTail_ + resultCount_) % RESULT_CAPACITY];
+        resultCount_++;
+        result.id = id;
+        result.status = status;
+        result.error = error;
+        result.steps = steps;
+        result.elapsed_us = elapsedUs;
+    }
+
+    Slot slots_[RELAY_SEQ_SLOTS] = {};
+    RelaySequenceResult results_[RESULT_CAPACITY] = {};
+    uint8_t resultTail_ = 0;
+    uint8_t resultCount_ = 0;
+};
@@ -0,0 +1,385 @@
+// Table-driven workflows (elevator rides) executed on the device
+//
+// The backend pushes a small state machine instead of driving every step over the WAN:
+// "press the call relay, wait until the car-arrived input is active, hold the door for
+// 20 s, release". Each state
+//  - applies a set/clear mask pair when it is entered,
+//  - leaves through the first transition whose condition holds: an input at a level
+//    (checked on entry and whenever the inputs change, so a car already standing at
+//    the floor counts), or the upstream link going down,
+//  - or through its timeout (timeout_ms after entry), if it has one.
+// A state marked as an end completes or fails the workflow once its masks are written.
+// Only transitions and the outcome are reported, and a ride keeps progressing (and its
+// timeouts keep releasing relays) while the link is down.
+//
+// RelayWorkflows is pure bookkeeping like RelaySequencer: the I/O task passes the
+// debounced inputs to service(), writes the returned masks in one transaction, reports
+// the outcome with commit(), arms a wake-up for nextDeadline() and forwards popReport().
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "relay_protocol.h"
+#include "relay_sequencer.h"
+
+const uint8_t WORKFLOW_MAX_STATES = 16;
+const uint8_t WORKFLOW_MAX_TRANSITIONS = 4;       // Per state, besides the timeout
+const uint8_t WORKFLOW_SLOTS = 2;                 // Workflows running at the same time
+const uint32_t WORKFLOW_MAX_TIMEOUT_MS = 3600000; // 1 hour per state
+const uint8_t WORKFLOW_NO_STATE = 0xFF;
+const int64_t WORKFLOW_IDLE = INT64_MAX;          // nextDeadline() when nothing is waiting
+
+enum WorkflowCondition : uint8_t {
+    WORKFLOW_ON_INPUT_ACTIVE,
+    WORKFLOW_ON_INPUT_INACTIVE,
+    WORKFLOW_ON_LINK_DOWN
+};
+
+struct WorkflowTransition {
+    WorkflowCondition condition;
+    uint8_t input;   // Input conditions only
+    uint8_t target;
+};
+
+enum WorkflowEnd : uint8_t {
+    WORKFLOW_END_NONE,
+    WORKFLOW_END_COMPLETED,
+    WORKFLOW_END_FAILED
+};
+
+struct WorkflowState {
+    RelayMask setMask;
+    RelayMask clearMask;
+    uint32_t timeoutMs;     // 0 = no timeout
+    uint8_t timeoutTarget;
+    WorkflowEnd end;
+    uint8_t transitionCount;
+    WorkflowTransition transitions[WORKFLOW_MAX_TRANSITIONS];
+};
+
+struct WorkflowSpec {
+    uint16_t id;
+    uint8_t stateCount;     // Starts in state 0
+    WorkflowState states[WORKFLOW_MAX_STATES];
+};
+
+enum WorkflowStatus : uint8_t {
+    WORKFLOW_STARTED,
+    WORKFLOW_STEP,       // Entered a state
+    WORKFLOW_COMPLETED,
+    WORKFLOW_FAILED,     // Reached a failing end, or an I2C write failed (relays released)
+    WORKFLOW_ABORTED,    // Cancelled; relays released
+    WORKFLOW_REPLACED,   // A newer workflow with the same id or relays took over
+    WORKFLOW_REJECTED
+};
+
+// Why a state was entered
+enum WorkflowCause : uint8_t {
+    WORKFLOW_CAUSE_START,
+    WORKFLOW_CAUSE_INPUT,
+    WORKFLOW_CAUSE_TIMEOUT,
+    WORKFLOW_CAUSE_LINK_DOWN
+};
+
+inline const char* workflowStatusName(WorkflowStatus status) {
+    switch (status) {
+    case WORKFLOW_STARTED: return "started";
+    case WORKFLOW_STEP: return "step";
+    case WORKFLOW_COMPLETED: return "completed";
+    case WORKFLOW_FAILED: return "failed";
+    case WORKFLOW_ABORTED: return "aborted";
+    case WORKFLOW_REPLACED: return "replaced";
+    case WORKFLOW_REJECTED: return "rejected";
+    }
+    return "unknown";
+}
+
+inline const char* workflowCauseName(WorkflowCause cause) {
+    switch (cause) {
+    case WORKFLOW_CAUSE_START: return "start";
+    case WORKFLOW_CAUSE_INPUT: return "input";
+    case WORKFLOW_CAUSE_TIMEOUT: return "timeout";
+    case WORKFLOW_CAUSE_LINK_DOWN: return "link_down";
+    }
+    return "unknown";
+}
+
+struct WorkflowReport {
+    uint16_t id;
+    WorkflowStatus status;
+    RelayError error;
+    uint8_t state;       // State entered (steps) or the last state
+    uint8_t from;        // Previous state, WORKFLOW_NO_STATE for the first
+    WorkflowCause cause;
+    uint32_t elapsed_us; // Since start
+};
+
+class RelayWorkflows {
+public:
+    static RelayError validate(const WorkflowSpec& spec) {
+        if (spec.stateCount == 0 || spec.stateCount > WORKFLOW_MAX_STATES) {
+            return RELAY_ERR_INVALID_WORKFLOW;
+        }
+        for (uint8_t i = 0; i < spec.stateCount; i++) {
+            const WorkflowState& state = spec.states[i];
+            if (state.setMask & state.clearMask) {
+                return RELAY_ERR_INVALID_MASK;
+            }
+            if (state.timeoutMs > WORKFLOW_MAX_TIMEOUT_MS ||
+                (state.timeoutMs > 0 && state.timeoutTarget >= spec.stateCount) ||
+                state.transitionCount > WORKFLOW_MAX_TRANSITIONS) {
+                return RELAY_ERR_INVALID_WORKFLOW;
+            }
+            for (uint8_t t = 0; t < state.transitionCount; t++) {
+                const WorkflowTransition& transition = state.transitions[t];
+                if (transition.target >= spec.stateCount ||
+                    (transition.condition != WORKFLOW_ON_LINK_DOWN && transition.input >= 8)) {
+                    return RELAY_ERR_INVALID_WORKFLOW;
+                }
+            }
+        }
+        return RELAY_ERR_NONE;
+    }
+
+    // Start a workflow in state 0. Running workflows with the same id or sharing relays
+    // with it are replaced; returns the relays to release for them.
+    RelayActuation start(const WorkflowSpec& spec, uint8_t inputs, int64_t nowUs) {
+        RelayActuation release = {0, 0};
+        RelayMask touched = touchedMask(spec);
+        for (uint8_t i = 0; i < WORKFLOW_SLOTS; i++) {
+            Slot& slot = slots_[i];
+            if (slot.active && (slot.spec.id == spec.id || (slot.touched & touched))) {
+                release.clearMask |= slot.holding & ~touched;
+                finish(slot, WORKFLOW_REPLACED, RELAY_ERR_NONE, nowUs);
+            }
+        }
+
+        Slot* free = nullptr;
+        for (uint8_t i = 0; i < WORKFLOW_SLOTS && !free; i++) {
+            if (!slots_[i].active) {
+                free = &slots_[i];
+            }
+        }
+        if (!free) {
+            pushReport(spec.id, WORKFLOW_REJECTED, RELAY_ERR_QUEUE_FULL, 0, WORKFLOW_NO_STATE, WORKFLOW_CAUSE_START, 0);
+            return release;
+        }
+
+        merge(release, free->pending); // Release of a workflow that just failed in this slot
+        free->active = true;
+        free->spec = spec;
+        free->touched = touched;
+        free->holding = 0;
+        free->state = WORKFLOW_NO_STATE;
+        free->started_us = nowUs;
+        free->pending = {0, 0};
+        pushReport(spec.id, WORKFLOW_STARTED, RELAY_ERR_NONE, 0, WORKFLOW_NO_STATE, WORKFLOW_CAUSE_START, 0);
+        enter(*free, 0, WORKFLOW_CAUSE_START, inputs, nowUs);
+        return release;
+    }
+
+    // Follow the timeouts that are due and the input conditions that hold. The combined
+    // masks must be written in one transaction and the outcome passed to commit().
+    RelayActuation service(uint8_t inputs, int64_t nowUs) {
+        RelayActuation actuation = {0, 0};
+        for (uint8_t i = 0; i < WORKFLOW_SLOTS; i++) {
+            Slot& slot = slots_[i];
+            if (slot.active && slot.spec.states[slot.state].end == WORKFLOW_END_NONE) {
+                const WorkflowState& state = slot.spec.states[slot.state];
+                uint8_t target = inputTarget(state, inputs);
+                if (target != WORKFLOW_NO_STATE) {
+                    enter(slot, target, WORKFLOW_CAUSE_INPUT, inputs, nowUs);
+                } else if (state.timeoutMs > 0 && slot.due_us <= nowUs) {
+                    enter(slot, state.timeoutTarget, WORKFLOW_CAUSE_TIMEOUT, inputs, nowUs);
+                }
+            }
+            merge(actuation, slot.pending);
+        }
+        return actuation;
+    }
+
+    // Outcome of writing the masks from service(). Workflows that reached an end finish
+    // now; on failure every workflow that had masks pending fails and the returned masks
+    // release whatever it still holds (best effort).
+    RelayActuation commit(bool success, int64_t nowUs) {
+        RelayActuation release = {0, 0};
+        for (uint8_t i = 0; i < WORKFLOW_SLOTS; i++) {
+            Slot& slot = slots_[i];
+            bool wrote = slot.pending.setMask || slot.pending.clearMask;
+            slot.pending = {0, 0};
+            if (!slot.active) {
+                continue;
+            }
+            if (wrote && !success) {
+                release.clearMask |= slot.holding;
+                finish(slot, WORKFLOW_FAILED, RELAY_ERR_I2C, nowUs);
+                continue;
+            }
+            WorkflowEnd end = slot.spec.states[slot.state].end;
+            if (end != WORKFLOW_END_NONE) {
+                finish(slot, end == WORKFLOW_END_COMPLETED ? WORKFLOW_COMPLETED : WORKFLOW_FAILED, RELAY_ERR_NONE, nowUs);
+            }
+        }
+        return release;
+    }
+
+    // Stop workflow id and release the relays it turned on
+    RelayActuation cancel(uint16_t id, int64_t nowUs) {
+        RelayActuation release = {0, 0};
+        for (uint8_t i = 0; i < WORKFLOW_SLOTS; i++) {
+            Slot& slot = slots_[i];
+            if (slot.active && slot.spec.id == id) {
+                release.clearMask |= slot.holding;
+                finish(slot, WORKFLOW_ABORTED, RELAY_ERR_NONE, nowUs);
+            }
+        }
+        return release;
+    }
+
+    // Upstream link lost: take the link_down transitions of the current states. The
+    // masks are picked up by the next service() call.
+    void linkDown(uint8_t inputs, int64_t nowUs) {
+        for (uint8_t i = 0; i < WORKFLOW_SLOTS; i++) {
+            Slot& slot = slots_[i];
+            if (!slot.active || slot.spec.states[slot.state].end != WORKFLOW_END_NONE) {
+                continue;
+            }
+            const WorkflowState& state = slot.spec.states[slot.state];
+            for (uint8_t t = 0; t < state.transitionCount; t++) {
+                if (state.transitions[t].condition == WORKFLOW_ON_LINK_DOWN) {
+                    enter(slot, state.transitions[t].target, WORKFLOW_CAUSE_LINK_DOWN, inputs, nowUs);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Earliest timeout, or WORKFLOW_IDLE (input conditions need no deadline: input edges
+    // wake the I/O task anyway)
+    int64_t nextDeadline() const {
+        int64_t deadline = WORKFLOW_IDLE;
+        for (uint8_t i = 0; i < WORKFLOW_SLOTS; i++) {
+            const Slot& slot = slots_[i];
+            if (slot.active && slot.spec.states[slot.state].timeoutMs > 0 && slot.due_us < deadline) {
+                deadline = slot.due_us;
+            }
+        }
+        return deadline;
+    }
+
+    uint8_t running() const {
+        uint8_t count = 0;
+        for (uint8_t i = 0; i < WORKFLOW_SLOTS; i++) {
+            count += slots_[i].active ? 1 : 0;
+        }
+        return count;
+    }
+
+    bool popReport(WorkflowReport& report) {
+        if (reportCount_ == 0) {
+            return false;
+        }
+        report = reports_[reportTail_];
+        reportTail_ = (reportTail_ + 1) % REPORT_CAPACITY;
+        reportCount_--;
+        return true;
+    }
+
+private:
+    struct Slot {
+        bool active;
+        WorkflowSpec spec;
+        uint8_t state;             // Current state
+        RelayMask touched;         // Every relay any state sets or clears
+        RelayMask holding;         // Relays this workflow has turned on and not released
+        RelayActuation pending;    // Masks not yet handed to the I/O task (kept past finish())
+        int64_t started_us;
+        int64_t due_us;            // Timeout of the current state
+    };
+
+    // A chain of entries in one call is bounded by the state count; reports are drained
+    // after every call
+    static const uint8_t REPORT_CAPACITY = WORKFLOW_SLOTS * (WORKFLOW_MAX_STATES + 3);
+
+    static RelayMask touchedMask(const WorkflowSpec& spec) {
+        RelayMask mask = 0;
+        for (uint8_t i = 0; i < spec.stateCount; i++) {
+            mask |= spec.states[i].setMask | spec.states[i].clearMask;
+        }
+        return mask;
+    }
+
+    static uint8_t inputTarget(const WorkflowState& state, uint8_t inputs) {
+        for (uint8_t t = 0; t < state.transitionCount; t++) {
+            const WorkflowTransition& transition = state.transitions[t];
+            bool active = (inputs >> transition.input) & 1;
+            if ((transition.condition == WORKFLOW_ON_INPUT_ACTIVE && active) ||
+                (transition.condition == WORKFLOW_ON_INPUT_INACTIVE && !active)) {
+                return transition.target;
+            }
+        }
+        return WORKFLOW_NO_STATE;
+    }
+
+    static void merge(RelayActuation& into, const RelayActuation& masks) {
+        into.setMask = (into.setMask & ~masks.clearMask) | masks.setMask;
+        into.clearMask = (into.clearMask & ~masks.setMask) | masks.clearMask;
+    }
+
+    // Enter target and follow input conditions that already hold, at most one pass over
+    // the table (a cycle of conditions that all hold fails the workflow)
+    void enter(Slot& slot, uint8_t target, WorkflowCause cause, uint8_t inputs, int64_t nowUs) {
+        for (uint8_t hops = 0; hops <= slot.spec.stateCount; hops++) {
+            uint8_t from = slot.state;
+            const WorkflowState& state = slot.spec.states[target];
+            slot.state = target;
+            merge(slot.pending, {state.setMask, state.clearMask});
+            slot.holding = (slot.holding & ~state.clearMask) | state.setMask;
+            slot.due_us = nowUs + (int64_t)state.timeoutMs * 1000;
+            pushReport(slot.spec.id, WORKFLOW_STEP, RELAY_ERR_NONE, target, from, cause,
+                       (uint32_t)(nowUs - slot.started_us));
+            if (state.end != WORKFLOW_END_NONE) {
+                return;
+            }
+            target = inputTarget(state, inputs);
+            if (target == WORKFLOW_NO_STATE) {
+                return;
+            }
+            cause = WORKFLOW_CAUSE_INPUT;
+        }
+        slot.pending.clearMask |= slot.holding;
+        slot.pending.setMask = 0;
+        slot.holding = 0;
+        finish(slot, WORKFLOW_FAILED, RELAY_ERR_INVALID_WORKFLOW, nowUs);
+    }
+
+    void finish(Slot& slot, WorkflowStatus status, RelayError error, int64_t nowUs) {
+        slot.active = false;
+        pushReport(slot.spec.id, status, error, slot.state, WORKFLOW_NO_STATE, WORKFLOW_CAUSE_START,
+                   (uint32_t)(nowUs - slot.started_us));
+    }
+
+    void pushReport(uint16_t id, WorkflowStatus status, RelayError error, uint8_t state, uint8_t from,
+                    WorkflowCause cause, uint32_t elapsedUs) {
+        if (reportCount_ == REPORT_CAPACITY) {
+            // Drop the oldest rather than the newest
+            reportTail_ = (reportTail_ + 1) % REPORT_CAPACITY;
+            reportCount_--;
+        }
+        WorkflowReport& report = reports_[(reportTail_ + reportCount_) % REPORT_CAPACITY];
+        reportCount_++;
+        report.id = id;
+        report.status = status;
+        report.error = error;
+        report.state = state;
+        report.from = from;
+        report.cause = cause;
+        report.elapsed_us = elapsedUs;
+    }
+
+    Slot slots_[WORKFLOW_SLOTS] = {};
+    WorkflowReport reports_[REPORT_CAPACITY] = {};
+    uint8_t reportTail_ = 0;
+    uint8_t reportCount_ = 0;
+};
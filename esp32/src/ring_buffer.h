@@ -0,0 +1,121 @@
+// Lock-free ring buffers - no locks, no heap, fixed capacity (a power of two)
+//
+// SpscRing: single producer / single consumer. The producer may be an ISR and the
+//           consumer a task (or vice versa).
+// MpscRing: any number of producer tasks / one consumer (bounded sequence-numbered
+//           slots). Producers never block; a full ring rejects the push.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+template <typename T, size_t N>
+class SpscRing {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "SpscRing capacity must be a power of two");
+
+public:
+    // Producer side. Inlined so it is safe to call from IRAM interrupt handlers.
+    inline __attribute__((always_inline)) bool push(const T& item) {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        if (head - tail >= N) {
+            dropped_.store(dropped_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+        slots_[head & (N - 1)] = item;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side
+    inline __attribute__((always_inline)) bool pop(T& item) {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        uint32_t head = head_.load(std::memory_order_acquire);
+        if (head == tail) {
+            return false;
+        }
+        item = slots_[tail & (N - 1)];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+    size_t size() const {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const { return N; }
+
+    // Number of pushes rejected because the ring was full
+    uint32_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    T slots_[N];
+    std::atomic<uint32_t> head_{0};
+    std::atomic<uint32_t> tail_{0};
+    std::atomic<uint32_t> dropped_{0};
+};
+
+template <typename T, size_t N>
+class MpscRing {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "MpscRing capacity must be a power of two");
+
+public:
+    MpscRing() {
+        for (uint32_t i = 0; i < N; i++) {
+            sequence_[i].store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Producer side: claim a slot, fill it, then publish it through its sequence number
+    bool push(const T& item) {
+        uint32_t pos = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            uint32_t sequence = sequence_[pos & (N - 1)].load(std::memory_order_acquire);
+            int32_t diff = (int32_t)(sequence - pos);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+        slots_[pos & (N - 1)] = item;
+        sequence_[pos & (N - 1)].store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side (one task only)
+    bool pop(T& item) {
+        uint32_t pos = tail_.load(std::memory_order_relaxed);
+        uint32_t sequence = sequence_[pos & (N - 1)].load(std::memory_order_acquire);
+        if ((int32_t)(sequence - (pos + 1)) < 0) {
+            return false;
+        }
+        item = slots_[pos & (N - 1)];
+        sequence_[pos & (N - 1)].store(pos + N, std::memory_order_release);
+        tail_.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    size_t capacity() const { return N; }
+
+    // Number of pushes rejected because the ring was full
+    uint32_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    T slots_[N];
+    std::atomic<uint32_t> sequence_[N];
+    std::atomic<uint32_t> head_{0};
+    std::atomic<uint32_t> tail_{0};
+    std::atomic<uint32_t> dropped_{0};
+};
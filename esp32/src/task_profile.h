@@ -0,0 +1,115 @@
+// Task loop profiling: how regularly a task loop runs and how much CPU it takes
+//
+// The loop calls begin() when it wakes and end() before it blocks again:
+//   gap   wake to wake - the loop's period; a stall (a blocking connect, a flash commit,
+//         a higher-priority task hogging the core) shows up in the tail
+//   pass  time spent working per wake; busy time over an interval is the CPU share
+//   late  how long after its armed deadline (halWakeAt) the task ran - the jitter a
+//         sequence or workflow step sees
+// Histograms are LatencyHistogram, so they cover the last one to two minutes.
+//
+// The owning task records and any task reads: both take the HalLock (a critical section
+// on the ESP32), for a bucket increment or a copy of one histogram - the percentile
+// scans run on the copy, outside it. The time is read inside the lock, so the histogram
+// windows never see it go backwards.
+
+#pragma once
+
+#include <stdint.h>
+#include "hal.h"
+#include "latency_histogram.h"
+
+struct TaskTimingSummary {
+    uint32_t count;
+    uint32_t p50Us;
+    uint32_t p99Us;
+    uint32_t maxUs;
+};
+
+struct TaskProfileReport {
+    uint32_t passes;    // Since boot
+    uint64_t busyUs;    // Since boot
+    TaskTimingSummary gap;
+    TaskTimingSummary pass;
+    TaskTimingSummary late;
+};
+
+class TaskProfile {
+public:
+    TaskProfile() : passes_(0), busyUs_(0), beginUs_(0) {}
+
+    // Returns the wake time
+    int64_t begin() {
+        lock_.lock();
+        int64_t nowUs = halMicros();
+        uint32_t nowMs = (uint32_t)(nowUs / 1000);
+        if (beginUs_ != 0) {
+            gap_.record((uint32_t)(nowUs - beginUs_), nowMs);
+        }
+        beginUs_ = nowUs;
+        lock_.unlock();
+        return nowUs;
+    }
+
+    void end() {
+        lock_.lock();
+        int64_t nowUs = halMicros();
+        uint32_t nowMs = (uint32_t)(nowUs / 1000);
+        passes_++;
+        busyUs_ += nowUs - beginUs_;
+        pass_.record((uint32_t)(nowUs - beginUs_), nowMs);
+        lock_.unlock();
+    }
+
+    // Woke at wakeUs (from begin()) for a deadline at deadlineUs
+    void late(int64_t deadlineUs, int64_t wakeUs) {
+        lock_.lock();
+        late_.record((uint32_t)(wakeUs - deadlineUs), (uint32_t)(halMicros() / 1000));
+        lock_.unlock();
+    }
+
+    // One histogram at a time on the caller's stack (about 450 bytes each)
+    TaskProfileReport report() {
+        TaskProfileReport report;
+        lock_.lock();
+        report.passes = passes_;
+        report.busyUs = busyUs_;
+        lock_.unlock();
+        report.gap = summarize(gap_);
+        report.pass = summarize(pass_);
+        report.late = summarize(late_);
+        return report;
+    }
+
+    // Clear the histograms; the since-boot counters keep running
+    void reset() {
+        lock_.lock();
+        uint32_t nowMs = (uint32_t)(halMicros() / 1000);
+        gap_.reset(nowMs);
+        pass_.reset(nowMs);
+        late_.reset(nowMs);
+        lock_.unlock();
+    }
+
+private:
+    TaskTimingSummary summarize(const LatencyHistogram& histogram) {
+        lock_.lock();
+        LatencyHistogram copy = histogram;
+        uint32_t nowMs = (uint32_t)(halMicros() / 1000);
+        lock_.unlock();
+        return summarizeCopy(copy, nowMs);
+    }
+
+    static TaskTimingSummary summarizeCopy(LatencyHistogram& histogram, uint32_t nowMs) {
+        return {histogram.count(nowMs), histogram.percentileUs(50, nowMs), histogram.percentileUs(99, nowMs),
+                histogram.maxUs(nowMs)};
+    }
+
+    HalLock lock_;
+    LatencyHistogram gap_;
+    LatencyHistogram pass_;
+    LatencyHistogram late_;
+    uint32_t passes_;
+    uint64_t busyUs_;
+    int64_t beginUs_;   // Last wake
+};
@@ -0,0 +1,189 @@
+#include "tca9554.h"
+
+void I2cBusClock::begin(I2cBus& bus, bool fastClock) {
+    hz_.store(fastClock ? TCA9554_FAST_CLOCK_HZ : TCA9554_SLOW_CLOCK_HZ, std::memory_order_relaxed);
+    marginalTransactions_ = 0;
+    bus.begin(hz(), TCA9554_BUS_TIMEOUT_MS);
+}
+
+void I2cBusClock::slowDown(I2cBus& bus) {
+    if (fast()) {
+        hz_.store(TCA9554_SLOW_CLOCK_HZ, std::memory_order_relaxed);
+        bus.setClock(TCA9554_SLOW_CLOCK_HZ);
+    }
+}
+
+// A bus that keeps needing retries at 400 kHz is marginal: stay at 100 kHz
+void I2cBusClock::marginal(I2cBus& bus) {
+    if (fast() && ++marginalTransactions_ >= TCA9554_FALLBACK_THRESHOLD) {
+        slowDown(bus);
+    }
+}
+
+bool Tca9554::probe(uint8_t address) {
+    return bus_->write(address, nullptr, 0) == 0;
+}
+
+bool Tca9554::begin(uint8_t address, uint16_t initialOutputs, uint8_t channels) {
+    address_ = address;
+    channels_ = channels == TCA9555_CHANNELS ? TCA9555_CHANNELS : 8;
+    shadow_ = wide() ? initialOutputs : (uint8_t)initialOutputs;
+    verifyDueUs_ = 0;
+
+    // Output register first, so the pins come up at the right level when they
+    // are switched to outputs
+    if (!writeRegister(outputRegister(), shadow_)) {
+        if (!clock_->fast()) {
+            return false;
+        }
+        // Device is there but not answering reliably at 400 kHz (the other expanders
+        // on the bus follow it down)
+        clock_->slowDown(*bus_);
+        if (!writeRegister(outputRegister(), shadow_)) {
+            return false;
+        }
+    }
+    return writeRegister(wide() ? TCA9555_REG_CONFIG : TCA9554_REG_CONFIG, 0x0000); // 0 = output
+}
+
+bool Tca9554::writeOutputs(uint16_t value) {
+    uint16_t previous = shadow_;
+    shadow_ = value;
+
+    if (!writeRegister(outputRegister(), value)) {
+        shadow_ = previous;
+        return false;
+    }
+    if (verify_) {
+        verifyDueUs_ = halMicros() + TCA9554_VERIFY_DELAY_US;
+    }
+    return true;
+}
+
+bool Tca9554::readInputs(uint16_t& value) {
+    return readRegister(wide() ? TCA9555_REG_INPUT : TCA9554_REG_INPUT, value);
+}
+
+bool Tca9554::readOutputs(uint16_t& value) {
+    return readRegister(outputRegister(), value);
+}
+
+bool Tca9554::service(int64_t nowUs) {
+    if (verifyDueUs_ == 0 || nowUs < verifyDueUs_) {
+        return true;
+    }
+    verifyDueUs_ = 0;
+
+    uint16_t actual;
+    if (!readRegister(outputRegister(), actual)) {
+        return false;
+    }
+    if (actual == shadow_) {
+        return true;
+    }
+
+    // The expander lost the value (brown-out, glitch on the bus): restore it
+    statsLock_.lock();
+    stats_.verifyMismatches++;
+    statsLock_.unlock();
+    if (writeRegister(outputRegister(), shadow_) && verify_) {
+        verifyDueUs_ = halMicros() + TCA9554_VERIFY_DELAY_US;
+    }
+    return false;
+}
+
+I2cStats Tca9554::stats() const {
+    statsLock_.lock();
+    I2cStats snapshot = stats_;
+    statsLock_.unlock();
+    snapshot.clockHz = clock_->hz();
+    return snapshot;
+}
+
+bool Tca9554::recoverBus() {
+    bool released = bus_->recover();
+
+    statsLock_.lock();
+    stats_.recoveries++;
+    statsLock_.unlock();
+    return released;
+}
+
+bool Tca9554::writeRegister(uint8_t reg, uint16_t value) {
+    int64_t startUs = halMicros();
+    for (uint8_t attempt = 1; attempt <= TCA9554_MAX_ATTEMPTS; attempt++) {
+        if (attemptWrite(reg, value)) {
+            record(true, true, attempt, startUs);
+            return true;
+        }
+        if (attempt < TCA9554_MAX_ATTEMPTS) {
+            afterFailedAttempt(attempt);
+        }
+    }
+    record(false, true, TCA9554_MAX_ATTEMPTS, startUs);
+    return false;
+}
+
+bool Tca9554::readRegister(uint8_t reg, uint16_t& value) {
+    int64_t startUs = halMicros();
+    for (uint8_t attempt = 1; attempt <= TCA9554_MAX_ATTEMPTS; attempt++) {
+        if (attemptRead(reg, value)) {
+            record(true, false, attempt, startUs);
+            return true;
+        }
+        if (attempt < TCA9554_MAX_ATTEMPTS) {
+            afterFailedAttempt(attempt);
+        }
+    }
+    record(false, false, TCA9554_MAX_ATTEMPTS, startUs);
+    return false;
+}
+
+// A TCA9555 takes port 0 then port 1 in the same transaction
+bool Tca9554::attemptWrite(uint8_t reg, uint16_t value) {
+    uint8_t data[3] = {reg, (uint8_t)value, (uint8_t)(value >> 8)};
+    lastError_ = bus_->write(address_, data, wide() ? 3 : 2);
+    return lastError_ == 0;
+}
+
+bool Tca9554::attemptRead(uint8_t reg, uint16_t& value) {
+    uint8_t data[2] = {0, 0};
+    lastError_ = bus_->readRegisters(address_, reg, data, wide() ? 2 : 1);
+    value = (uint16_t)(data[0] | (data[1] << 8));
+    return lastError_ == 0;
+}
+
+// Between attempts: a timeout or bus error means the bus is probably held, and a
+// second NACK in a row is worth a recovery too
+void Tca9554::afterFailedAttempt(uint8_t attempt) {
+    if (lastError_ >= 4 || attempt >= 2) {
+        recoverBus();
+    }
+}
+
+void Tca9554::record(bool success, bool isWrite, uint8_t attempts, int64_t startUs) {
+    uint32_t latencyUs = (uint32_t)(halMicros() - startUs);
+
+    if (!success || attempts > 1) {
+        clock_->marginal(*bus_);
+    }
+
+    statsLock_.lock();
+    if (success) {
+        if (isWrite) {
+            stats_.writes++;
+        } else {
+            stats_.reads++;
+        }
+    } else {
+        stats_.failures++;
+    }
+    stats_.retries += attempts - 1;
+    stats_.lastLatencyUs = latencyUs;
+    if (latencyUs > stats_.maxLatencyUs) {
+        stats_.maxLatencyUs = latencyUs;
+    }
+    stats_.totalLatencyUs += latencyUs;
+    stats_.lastError = success ? 0 : lastError_;
+    statsLock_.unlock();
+}
@@ -0,0 +1,136 @@
+// TCA9554 I/O expander driver with a shadow output register
+//
+// Also drives the 16-bit TCA9555 (begin() with 16 channels): same registers per port,
+// in pairs, and both output ports are written in one transaction since the register
+// pointer steps through the pair.
+//
+// Writes go straight to the output register from the shadow copy - no read-modify-write.
+// The bus starts at 400 kHz and drops to 100 kHz for good if transactions keep needing
+// retries; the clock (I2cBusClock) is one per bus, shared by the drivers of every
+// expander on it. Failed transactions are retried a bounded number of times, with an SCL-toggle
+// bus recovery in between when the bus looks hung. Read-back verification is optional
+// and deferred: the output register is re-read a little after the write, off the
+// actuation path, and rewritten from the shadow if it does not match.
+//
+// All calls except stats() must come from the task that owns the bus (the I/O task).
+
+#pragma once
+
+#include <atomic>
+#include "hal.h"
+
+const uint32_t TCA9554_FAST_CLOCK_HZ = 400000;
+const uint32_t TCA9554_SLOW_CLOCK_HZ = 100000;
+const uint8_t TCA9554_MAX_ATTEMPTS = 3;          // Per transaction, including the first
+const uint8_t TCA9554_FALLBACK_THRESHOLD = 3;    // Retried transactions before dropping to 100 kHz
+const int64_t TCA9554_VERIFY_DELAY_US = 10000;   // Write -> deferred read-back
+const uint16_t TCA9554_BUS_TIMEOUT_MS = 10;
+
+// TCA9554 registers
+const uint8_t TCA9554_REG_INPUT = 0x00;
+const uint8_t TCA9554_REG_OUTPUT = 0x01;
+const uint8_t TCA9554_REG_POLARITY = 0x02;
+const uint8_t TCA9554_REG_CONFIG = 0x03;
+
+// TCA9555 registers (port 0; port 1 follows at +1)
+const uint8_t TCA9555_REG_INPUT = 0x00;
+const uint8_t TCA9555_REG_OUTPUT = 0x02;
+const uint8_t TCA9555_REG_POLARITY = 0x04;
+const uint8_t TCA9555_REG_CONFIG = 0x06;
+const uint8_t TCA9555_CHANNELS = 16;
+
+struct I2cStats {
+    uint32_t writes;           // Completed write transactions
+    uint32_t reads;            // Completed read transactions
+    uint32_t failures;         // Transactions that failed after all attempts
+    uint32_t retries;          // Extra attempts
+    uint32_t recoveries;       // SCL-toggle bus recoveries
+    uint32_t verifyMismatches; // Deferred read-backs that did not match the shadow
+    uint32_t clockHz;          // Of the bus, shared by all expanders on it
+    uint32_t lastLatencyUs;    // Whole transaction including retries
+    uint32_t maxLatencyUs;
+    uint64_t totalLatencyUs;
+    uint8_t lastError;         // Last Wire endTransmission() error (0 = none)
+};
+
+// Clock of one I2C bus and its 400 -> 100 kHz fallback, counted over the transactions
+// of every expander on it. Owned by the bus task; hz() is safe to call from any task.
+class I2cBusClock {
+public:
+    // (Re)start the bus at 400 kHz (or 100 kHz if fastClock is false)
+    void begin(I2cBus& bus, bool fastClock);
+    // Drop to 100 kHz for good; no-op if already there
+    void slowDown(I2cBus& bus);
+    // A transaction needed retries or failed
+    void marginal(I2cBus& bus);
+
+    bool fast() const { return hz() == TCA9554_FAST_CLOCK_HZ; }
+    uint32_t hz() const { return hz_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint32_t> hz_{TCA9554_FAST_CLOCK_HZ};
+    uint8_t marginalTransactions_ = 0;
+};
+
+class Tca9554 {
+public:
+    Tca9554() {} // attach() before use
+    Tca9554(I2cBus& bus, I2cBusClock& clock) : bus_(&bus), clock_(&clock) {}
+    void attach(I2cBus& bus, I2cBusClock& clock) {
+        bus_ = &bus;
+        clock_ = &clock;
+    }
+
+    // Whether a device ACKs at address; falls back to 100 kHz if it only answers there
+    bool probe(uint8_t address);
+
+    // Configure every pin as an output and drive initialOutputs; channels is 8 for a
+    // TCA9554, 16 for a TCA9555
+    bool begin(uint8_t address, uint16_t initialOutputs, uint8_t channels = 8);
+
+    // Drive the output register(s) from value in one write transaction
+    bool writeOutputs(uint16_t value);
+
+    bool readInputs(uint16_t& value);
+    bool readOutputs(uint16_t& value);
+
+    // Last value written (or being written) to the output register
+    uint16_t outputs() const { return shadow_; }
+    uint8_t address() const { return address_; }
+    uint8_t channels() const { return channels_; }
+
+    void setVerify(bool enabled) { verify_ = enabled; }
+    bool verifyPending() const { return verifyDueUs_ != 0; }
+
+    // Run the deferred read-back once it is due. Returns false if the register did not
+    // match the shadow (it has been rewritten) or could not be read.
+    bool service(int64_t nowUs);
+
+    // Consistent copy of the counters; safe to call from any task
+    I2cStats stats() const;
+
+    // Clock SCL until a stuck device releases SDA, then issue a STOP and restart the bus
+    bool recoverBus();
+
+private:
+    bool wide() const { return channels_ == TCA9555_CHANNELS; }
+    uint8_t outputRegister() const { return wide() ? TCA9555_REG_OUTPUT : TCA9554_REG_OUTPUT; }
+    bool writeRegister(uint8_t reg, uint16_t value);
+    bool readRegister(uint8_t reg, uint16_t& value);
+    bool attemptWrite(uint8_t reg, uint16_t value);
+    bool attemptRead(uint8_t reg, uint16_t& value);
+    void afterFailedAttempt(uint8_t attempt);
+    void record(bool success, bool isWrite, uint8_t attempts, int64_t startUs);
+
+    I2cBus* bus_ = nullptr;
+    I2cBusClock* clock_ = nullptr;
+    uint8_t address_ = 0;
+    uint8_t channels_ = 8;
+    uint16_t shadow_ = 0;
+    bool verify_ = false;
+    int64_t verifyDueUs_ = 0;
+    uint8_t lastError_ = 0;
+
+    I2cStats stats_ = {};
+    HalLock statsLock_;
+};